@@ -15,8 +15,35 @@
 #   include <windows.h>
 #   include <winsock.h>
 #else
+#include <dirent.h>
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <zlib.h>
+// SHA256_* is the API of the OpenSSL 1.0.2 that comes with VixDiskLib.
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/sha.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define VIX_HAVE_URING
+#endif
+#endif
 #endif
 
 #include <algorithm>
@@ -25,6 +52,7 @@
 #include <chrono>
 #include <deque>
 #include <forward_list>
+#include <fstream>
 #include <functional>
 #include <future>
 #include <iomanip>
@@ -43,6 +71,8 @@
 #include <thread>
 #include <time.h>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #ifdef _WIN32
@@ -56,6 +86,11 @@
 #endif
 #include "vixMntapi.h"
 
+#if defined(FOR_MNTAPI) && !defined(_WIN32)
+#define FUSE_USE_VERSION 29
+#include <fuse_lowlevel.h>
+#endif
+
 using std::shared_ptr;
 
 using std::cin;
@@ -81,6 +116,158 @@ using std::vector;
 #define COMMAND_WRITEASYNCBENCH      (1 << 14)
 #define COMMAND_GET_ALLOCATED_BLOCKS (1 << 15)
 #define COMMAND_MOUNT                (1 << 16)
+#define COMMAND_BATCH                (1 << 17)
+#define COMMAND_DAEMON               (1 << 18)
+#define COMMAND_NBD                  (1 << 19)
+#define COMMAND_FUSE                 (1 << 20)
+#define COMMAND_EXPORT_RAW           (1 << 21)
+#define COMMAND_IMPORT_RAW           (1 << 22)
+#define COMMAND_EXPORT_ZIP           (1 << 23)
+#define COMMAND_EXPORT_STREAM        (1 << 24)
+#define COMMAND_EXPORT_DELTA         (1 << 25)
+#define COMMAND_APPLY_DELTA          (1 << 26)
+#define COMMAND_MERKLE               (1 << 27)
+#define COMMAND_MERKLE_DIFF          (1 << 28)
+#define COMMAND_DROP_BLOCK_MAP       (1 << 29)
+#define COMMAND_EXTENT_CHECK         (1 << 30)
+
+// Commands that write to the disks they are given
+#define COMMAND_WRITES (COMMAND_CREATE | COMMAND_FILL | COMMAND_REDO |       \
+                        COMMAND_WRITE_META | COMMAND_CLONE |                 \
+                        COMMAND_WRITEBENCH | COMMAND_WRITEASYNCBENCH |       \
+                        COMMAND_IMPORT_RAW | COMMAND_APPLY_DELTA)
+
+// Disk metadata naming the -exportdelta state a disk holds, see DeltaStamp
+#define DELTA_META_KEY "vixdelta.identity"
+
+// Default number of sectors written at a time by -fill
+#ifndef VIX_FILL_WRITE_SIZE
+#define VIX_FILL_WRITE_SIZE 2048
+#endif
+
+// Upper bounds of -filldepth and -fillthreads
+#ifndef VIX_FILL_MAX_DEPTH
+#define VIX_FILL_MAX_DEPTH 64
+#endif
+#ifndef VIX_FILL_MAX_THREADS
+#define VIX_FILL_MAX_THREADS 32
+#endif
+
+// Sectors read at a time by -dump
+#ifndef VIX_DUMP_CHUNK
+#define VIX_DUMP_CHUNK 2048
+#endif
+
+// Sectors per read and write of -exportraw with -journal
+#ifndef VIX_EXPORT_CHUNK
+#define VIX_EXPORT_CHUNK 2048
+#endif
+
+// Reads in flight during -exportraw
+#ifndef VIX_EXPORT_DEPTH
+#define VIX_EXPORT_DEPTH 4
+#endif
+
+// Largest read in sectors of -exportraw without -journal, through NBD(SSL)
+// and through the other transports
+#ifndef VIX_MAX_IO_NBD
+#define VIX_MAX_IO_NBD 4096
+#endif
+#ifndef VIX_MAX_IO
+#define VIX_MAX_IO 8192
+#endif
+
+// Reads timed by -exportraw to find the latency of a read, and the
+// bandwidth of reads
+#ifndef VIX_PLAN_PROBES
+#define VIX_PLAN_PROBES 8
+#endif
+#ifndef VIX_PLAN_BANDWIDTH_PROBES
+#define VIX_PLAN_BANDWIDTH_PROBES 3
+#endif
+
+// Data exported between -journal checkpoints, in MB or seconds
+#ifndef VIX_JOURNAL_MB
+#define VIX_JOURNAL_MB 1024
+#endif
+#ifndef VIX_JOURNAL_SECONDS
+#define VIX_JOURNAL_SECONDS 30
+#endif
+
+// Sectors per read of -importraw
+#ifndef VIX_IMPORT_CHUNK
+#define VIX_IMPORT_CHUNK 2048
+#endif
+
+// Image pieces read or written at a time by -importraw
+#ifndef VIX_IMPORT_DEPTH
+#define VIX_IMPORT_DEPTH 4
+#endif
+
+// Sectors per independently deflated chunk of -exportzip
+#ifndef VIX_ZIP_CHUNK
+#define VIX_ZIP_CHUNK 2048
+#endif
+
+// zlib compression level of -exportzip
+#ifndef VIX_ZIP_LEVEL
+#define VIX_ZIP_LEVEL 6
+#endif
+
+// Sectors per independently compressed frame of -exportstream
+#ifndef VIX_COMPRESS_CHUNK
+#define VIX_COMPRESS_CHUNK 2048
+#endif
+
+// Sectors per hashed and compared block of -exportdelta
+#ifndef VIX_DELTA_BLOCK
+#define VIX_DELTA_BLOCK 2048
+#endif
+
+// Sectors per leaf of -merkle
+#ifndef VIX_MERKLE_LEAF
+#define VIX_MERKLE_LEAF 2048
+#endif
+
+// Handles querying the allocated blocks of a remote disk at once
+#ifndef VIX_QUERY_THREADS
+#define VIX_QUERY_THREADS 4
+#endif
+
+// Upper bound of -querythreads
+#ifndef VIX_QUERY_MAX_THREADS
+#define VIX_QUERY_MAX_THREADS 16
+#endif
+
+// Chunks per VixDiskLib_QueryAllocatedBlocks call, at most
+// VIXDISKLIB_MAX_CHUNK_NUMBER
+#ifndef VIX_QUERY_CHUNKS
+#define VIX_QUERY_CHUNKS VIXDISKLIB_MAX_CHUNK_NUMBER
+#endif
+
+// Content-defined chunk sizes of -chunkmap in bytes
+#ifndef VIX_CDC_MIN
+#define VIX_CDC_MIN 65536
+#endif
+#ifndef VIX_CDC_AVG
+#define VIX_CDC_AVG 262144
+#endif
+#ifndef VIX_CDC_MAX
+#define VIX_CDC_MAX 1048576
+#endif
+
+// Submission ring entries of the io_uring behind local file I/O
+#ifndef VIX_URING_DEPTH
+#define VIX_URING_DEPTH 32
+#endif
+
+// -fillpattern values
+enum FillPattern {
+   FILL_BYTE,        // -val in every byte
+   FILL_ZERO,
+   FILL_RANDOM,
+   FILL_LBA,         // every 8 bytes of a sector hold its sector number
+};
 
 #define VIXDISKLIB_VERSION_MAJOR 6
 #define VIXDISKLIB_VERSION_MINOR 8
@@ -96,16 +283,31 @@ using std::vector;
 static const char randChars[] = "0123456789"
    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
 
+struct AppGlobals;
+
+/*
+ * Progress and cancellation of a command run as a daemon job. Progress is
+ * in sectors (percent for clone).
+ */
+struct JobControl {
+   JobControl() : cancelled(false), done(0), total(0) {}
+
+   std::atomic<bool> cancelled;
+   std::atomic<uint64> done;
+   std::atomic<uint64> total;
+};
+
 // Per-thread information for multi-threaded VixDiskLib test.
 struct ThreadData {
    std::string dstDisk;
    VixDiskLibHandle srcHandle;
    VixDiskLibHandle dstHandle;
    VixDiskLibSectorType numSectors;
+   AppGlobals *globals;
 };
 
 
-static struct {
+struct AppGlobals {
     int command;
     VixDiskLibAdapterType adapterType;
     char *transportModes;
@@ -114,6 +316,11 @@ static struct {
     char *metaKey;
     char *metaVal;
     int filler;
+    int fillPattern;
+    uint32 fillSize;
+    unsigned fillDepth;
+    unsigned fillThreads;
+    char *dumpFile;
     unsigned mbSize;
     VixDiskLibSectorType numSectors;
     VixDiskLibSectorType startSector;
@@ -143,7 +350,217 @@ static struct {
     int repair;
     uint32 logicalSectorSize;
     uint32 physicalSectorSize;
-} appGlobals;
+    bool poolStats;
+    bool startupProfile;
+    bool noUring;
+    bool directIO;
+    char *journalPath;
+    bool resume;
+    bool journalHash;
+    uint32 cacheMB;
+    char *cacheFile;
+    uint32 cacheFileMB;
+    char *batchFile;
+    unsigned numJobs;
+    char *socketPath;
+    char *nbdListen;
+    char *fuseMountPoint;
+    char *exportPath;
+    char *importPath;
+    bool zeroAll;
+    char *zipPath;
+    char *peInfoFile;
+    unsigned zipThreads;
+    char *chunkMapPath;
+    char *streamPath;
+    const char *codecSpec;
+    char *deltaPath;
+    char *applyPath;
+    char *baseManifestPath;
+    char *manifestPath;
+    char *merklePath;
+    char *merkleDiff[2];
+    unsigned hashThreads;
+    unsigned queryThreads;
+    int64 readGap;
+    char *blockMapDir;
+    JobControl *job;
+};
+
+/*
+ * Options of the command being run. Batch mode runs several commands at
+ * once, each with its own AppGlobals, so this is per thread; threads
+ * started on behalf of a command must inherit it (see GlobalsScope).
+ */
+static AppGlobals processGlobals;
+static thread_local AppGlobals *curGlobals = &processGlobals;
+
+static inline AppGlobals&
+Globals(void)
+{
+   return *curGlobals;
+}
+
+class GlobalsScope
+{
+   public:
+      explicit GlobalsScope(AppGlobals *globals) : _saved(curGlobals)
+      {
+         curGlobals = globals;
+      }
+      ~GlobalsScope()
+      {
+         curGlobals = _saved;
+      }
+   private:
+      AppGlobals *_saved;
+};
+
+// VixDiskLib_Open and VixDiskLib_Close are not thread safe.
+static std::mutex openCloseLock;
+
+// Max number of phases kept in the startup timeline
+#define STARTUP_MAX_PHASES 64
+
+/*
+ * Timeline of the startup path for -startupprofile: library loading and
+ * init, PrepareForAccess, connect and disk open up to the first I/O. Times
+ * are relative to static initialization of the process.
+ */
+class StartupTimeline
+{
+   public:
+      using Clock = std::chrono::steady_clock;
+
+      StartupTimeline()
+         : _enabled(false), _origin(Clock::now()), _firstIO(false),
+           _numSymbols(0), _symbolUsec(0)
+      {}
+
+      void enable()
+      {
+         _enabled = true;
+      }
+
+      bool enabled() const
+      {
+         return _enabled;
+      }
+
+      void add(const string& name, Clock::time_point start,
+               Clock::time_point end)
+      {
+         std::lock_guard<std::mutex> lg(_lock);
+         if (_phases.size() < STARTUP_MAX_PHASES) {
+            _phases.push_back({name, start, end});
+         }
+      }
+
+      // Marks the first sector transferred by any command.
+      void firstIO()
+      {
+         if (_enabled && !_firstIO.exchange(true)) {
+            auto now = Clock::now();
+            add("first I/O", now, now);
+         }
+      }
+
+      void addSymbol(uint64 usec)
+      {
+         std::lock_guard<std::mutex> lg(_lock);
+         ++_numSymbols;
+         _symbolUsec += usec;
+      }
+
+      void print()
+      {
+         std::lock_guard<std::mutex> lg(_lock);
+         auto msec = [this] (Clock::time_point t) {
+            return std::chrono::duration_cast<std::chrono::microseconds>(
+                      t - _origin).count() / 1000.0;
+         };
+
+         cout << "Startup timeline (msec since start, duration):" << endl;
+         cout << std::fixed << std::setprecision(3);
+         for (const auto& p : _phases) {
+            cout << std::setw(10) << msec(p.start);
+            if (p.end != p.start) {
+               cout << " +" << std::setw(9) << msec(p.end) - msec(p.start);
+            } else {
+               cout << "           ";
+            }
+            cout << "  " << p.name << endl;
+         }
+         if (_numSymbols > 0) {
+            cout << "  " << _numSymbols << " VixDiskLib symbols resolved "
+                 << "on demand in " << _symbolUsec / 1000.0 << " msec"
+                 << endl;
+         }
+         cout.unsetf(std::ios_base::floatfield);
+      }
+
+   private:
+      struct Phase {
+         string name;
+         Clock::time_point start;
+         Clock::time_point end;
+      };
+
+      bool _enabled;
+      Clock::time_point _origin;
+      std::atomic<bool> _firstIO;
+      std::mutex _lock;
+      vector<Phase> _phases;
+      unsigned _numSymbols;
+      uint64 _symbolUsec;
+};
+
+static StartupTimeline startupTimeline;
+
+// Adds the lifetime of the object as a phase to the startup timeline.
+class StartupPhase
+{
+   public:
+      explicit StartupPhase(const string& name)
+      {
+         if (startupTimeline.enabled()) {
+            _name = name;
+            _start = StartupTimeline::Clock::now();
+         }
+      }
+
+      ~StartupPhase()
+      {
+         if (!_name.empty()) {
+            startupTimeline.add(_name, _start,
+                                StartupTimeline::Clock::now());
+         }
+      }
+
+   private:
+      string _name;
+      StartupTimeline::Clock::time_point _start;
+};
+
+// Progress reporting for daemon jobs; no-ops outside of a job.
+static void
+JobAddTotal(uint64 total)
+{
+   if (Globals().job != NULL) {
+      Globals().job->total += total;
+   }
+}
+
+static VixError
+JobAdvance(uint64 done)
+{
+   startupTimeline.firstIO();
+   if (Globals().job == NULL) {
+      return VIX_OK;
+   }
+   Globals().job->done += done;
+   return Globals().job->cancelled ? VIX_E_CANCELLED : VIX_OK;
+}
 
 template <typename TYPE>
 class BufferPoolInterface {
@@ -152,6 +569,10 @@ public:
    virtual ~BufferPoolInterface() {}
    virtual TYPE* getBuffer() = 0;
    virtual void returnBuffer(TYPE*) = 0;
+   // The buffers of a fixed size pool, e.g. to register them with the
+   // kernel; empty if buffers are allocated on demand.
+   virtual std::vector<TYPE*> buffers() const { return std::vector<TYPE*>(); }
+   virtual size_t bufferSize() const { return 0; }
 };
 
 class VixDisk;
@@ -159,7 +580,7 @@ class VixDisk;
 static int ParseArguments(int argc, char* argv[]);
 template<size_t SIZE, typename TYPE, typename LOCK>
 static std::unique_ptr<BufferPoolInterface<TYPE>>
-getBufferPool(const VixDisk& disk, size_t bufSize);
+getBufferPool(const VixDisk& disk, size_t bufSize, uint32 alignment = 0);
 static void DoCreate(void);
 static void DoRedo(void);
 static void DoFill(void);
@@ -173,11 +594,32 @@ static void DoInfo(void);
 static void DoTestMultiThread(void);
 static void DoClone(void);
 static int BitCount(int number);
-static void DumpBytes(const uint8 *buf, size_t n, int step);
+static void DumpBytes(const uint8 *buf, size_t n, int step, string& out);
 static void DoRWBench(bool read, bool async);
 static void DoCheckRepair(Bool repair);
 static void DoMntApi();
+#ifdef FOR_MNTAPI
+static void MntapiExit(void);
+#endif
 static void DoGetAllocatedBlocks(void);
+static void DoBatch(void);
+static void DoDaemon(void);
+static void DoNbd(void);
+static void DoFuse(void);
+static void DoExportRaw(void);
+static void DoImportRaw(void);
+static void DoExportZip(void);
+static void DoExportStream(void);
+static void DoExportDelta(void);
+static void DoApplyDelta(void);
+static void DoMerkle(void);
+static void DoMerkleDiff(void);
+static void DoDropBlockMap(void);
+static void DoExtentCheck(void);
+static void RunCommand(void);
+#ifndef _WIN32
+static bool WriteAll(int fd, const void *buf, size_t len);
+#endif
 
 
 #define THROW_ERROR(vixError) \
@@ -362,6 +804,51 @@ static VixError
                                        VixDiskLibSectorType chunkSize,
                                        VixDiskLibBlockList **blockList);
 
+static VixError
+(*VixDiskLib_FreeBlockList_Ptr)(VixDiskLibBlockList *blockList);
+
+static VixError
+(*VixDiskLib_PrepareForAccess_Ptr)(const VixDiskLibConnectParams *connectParams,
+                                   const char *identity);
+
+static VixError
+(*VixDiskLib_EndAccess_Ptr)(const VixDiskLibConnectParams *connectParams,
+                            const char *identity);
+
+static VixDiskLibConnectParams *
+(*VixDiskLib_AllocateConnectParams_Ptr)(void);
+
+static void
+(*VixDiskLib_FreeConnectParams_Ptr)(VixDiskLibConnectParams *connectParams);
+
+static VixError
+(*VixDiskLib_ReadAsync_Ptr)(VixDiskLibHandle diskHandle,
+                            VixDiskLibSectorType startSector,
+                            VixDiskLibSectorType numSectors,
+                            uint8 *readBuffer,
+                            VixDiskLibCompletionCB callback,
+                            void *cbData);
+
+static VixError
+(*VixDiskLib_WriteAsync_Ptr)(VixDiskLibHandle diskHandle,
+                             VixDiskLibSectorType startSector,
+                             VixDiskLibSectorType numSectors,
+                             const uint8 *writeBuffer,
+                             VixDiskLibCompletionCB callback,
+                             void *cbData);
+
+static VixError
+(*VixDiskLib_Wait_Ptr)(VixDiskLibHandle diskHandle);
+
+static VixError
+(*VixDiskLib_Flush_Ptr)(VixDiskLibHandle diskHandle);
+
+#ifdef _WIN32
+static HINSTANCE diskLibHandle;
+#else
+static void *diskLibHandle;
+#endif
+
 
 
 /*
@@ -407,9 +894,6 @@ LoadOneFunc(void* dlHandle, void** pFunction, const char* funcName)
 }
 #endif
 
-#define LOAD_ONE_FUNC(handle, funcName)  \
-   LoadOneFunc(handle, (void**)&(funcName##_Ptr), #funcName)
-
 #ifdef _WIN32
 #define IS_HANDLE_INVALID(handle) ((handle) == INVALID_HANDLE_VALUE)
 #else
@@ -422,13 +906,15 @@ LoadOneFunc(void* dlHandle, void** pFunction, const char* funcName)
  *
  * DynLoadDiskLib --
  *
- *      Dynamically loads VixDiskLib and bind to the functions.
+ *      Dynamically loads VixDiskLib. Functions are bound on their first
+ *      call (see LAZY_FUNC), so commands only pay for the symbols they
+ *      use.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Exits the process if the library can't be loaded.
  *
  *----------------------------------------------------------------------
  */
@@ -436,13 +922,13 @@ LoadOneFunc(void* dlHandle, void** pFunction, const char* funcName)
 static void
 DynLoadDiskLib(void)
 {
+   StartupPhase phase("load VixDiskLib shared library");
 #ifdef _WIN32
    HINSTANCE hInstLib = LoadLibrary("vixDiskLib.dll");
 #else
    void* hInstLib = dlopen("libvixDiskLib.so", RTLD_LAZY);
 #endif
 
-   // If the handle is valid, try to get the function address.
    if (IS_HANDLE_INVALID(hInstLib)) {
       cout << "Can't load vixDiskLib shared library / DLL : lasterror = " <<
 #ifdef _WIN32
@@ -454,78 +940,92 @@ DynLoadDiskLib(void)
 
       exit(EXIT_FAILURE);
    }
-   try {
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_InitEx);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Init);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Exit);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_ListTransportModes);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Cleanup);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Connect);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_ConnectEx);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Disconnect);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Create);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_CreateChild);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Open);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_GetInfo);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_FreeInfo);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_GetTransportMode);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Close);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Read);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Write);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_ReadMetadata);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_WriteMetadata);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_GetMetadataKeys);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Unlink);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Grow);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Shrink);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Defragment);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Rename);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Clone);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_GetErrorText);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_FreeErrorText);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_Attach);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_SpaceNeededForClone);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_CheckRepair);
-      LOAD_ONE_FUNC(hInstLib, VixDiskLib_QueryAllocatedBlocks);
-   } catch (const std::runtime_error& exc) {
-      cout << "Error while dynamically loading : " << exc.what() << "\n";
-      exit(EXIT_FAILURE);
-   }
+   diskLibHandle = hInstLib;
 }
 
 
-#define VixDiskLib_InitEx           (*VixDiskLib_InitEx_Ptr)
-#define VixDiskLib_Init             (*VixDiskLib_Init_Ptr)
-#define VixDiskLib_Exit             (*VixDiskLib_Exit_Ptr)
-#define VixDiskLib_ListTransportModes   (*VixDiskLib_ListTransportModes_Ptr)
-#define VixDiskLib_Cleanup          (*VixDiskLib_Cleanup_Ptr)
-#define VixDiskLib_Connect          (*VixDiskLib_Connect_Ptr)
-#define VixDiskLib_ConnectEx        (*VixDiskLib_ConnectEx_Ptr)
-#define VixDiskLib_Disconnect       (*VixDiskLib_Disconnect_Ptr)
-#define VixDiskLib_Create           (*VixDiskLib_Create_Ptr)
-#define VixDiskLib_CreateChild      (*VixDiskLib_CreateChild_Ptr)
-#define VixDiskLib_Open             (*VixDiskLib_Open_Ptr)
-#define VixDiskLib_GetInfo          (*VixDiskLib_GetInfo_Ptr)
-#define VixDiskLib_FreeInfo         (*VixDiskLib_FreeInfo_Ptr)
-#define VixDiskLib_GetTransportMode (*VixDiskLib_GetTransportMode_Ptr)
-#define VixDiskLib_Close            (*VixDiskLib_Close_Ptr)
-#define VixDiskLib_Read             (*VixDiskLib_Read_Ptr)
-#define VixDiskLib_Write            (*VixDiskLib_Write_Ptr)
-#define VixDiskLib_ReadMetadata     (*VixDiskLib_ReadMetadata_Ptr)
-#define VixDiskLib_WriteMetadata    (*VixDiskLib_WriteMetadata_Ptr)
-#define VixDiskLib_GetMetadataKeys  (*VixDiskLib_GetMetadataKeys_Ptr)
-#define VixDiskLib_Unlink           (*VixDiskLib_Unlink_Ptr)
-#define VixDiskLib_Grow             (*VixDiskLib_Grow_Ptr)
-#define VixDiskLib_Shrink           (*VixDiskLib_Shrink_Ptr)
-#define VixDiskLib_Defragment       (*VixDiskLib_Defragment_Ptr)
-#define VixDiskLib_Rename           (*VixDiskLib_Rename_Ptr)
-#define VixDiskLib_Clone            (*VixDiskLib_Clone_Ptr)
-#define VixDiskLib_GetErrorText     (*VixDiskLib_GetErrorText_Ptr)
-#define VixDiskLib_FreeErrorText    (*VixDiskLib_FreeErrorText_Ptr)
-#define VixDiskLib_Attach           (*VixDiskLib_Attach_Ptr)
-#define VixDiskLib_SpaceNeededForClone   (*VixDiskLib_SpaceNeededForClone_Ptr)
-#define VixDiskLib_CheckRepair      (*VixDiskLib_CheckRepair_Ptr)
-#define VixDiskLib_QueryAllocatedBlocks  (*VixDiskLib_QueryAllocatedBlocks_Ptr)
+/*
+ *----------------------------------------------------------------------
+ *
+ * LazyLoadFunc --
+ *
+ *      Binds the vixDiskLib function stored in *PTR on its first call.
+ *
+ * Results:
+ *      The function pointer.
+ *
+ * Side effects:
+ *      Exits the process if the function can't be loaded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+template <typename FUNC, FUNC *PTR>
+static FUNC
+LazyLoadFunc(const char *funcName)
+{
+   static std::once_flag once;
+
+   std::call_once(once, [funcName] () {
+      auto start = StartupTimeline::Clock::now();
+      try {
+         LoadOneFunc(diskLibHandle, (void**)PTR, funcName);
+      } catch (const std::runtime_error& exc) {
+         cout << "Error while dynamically loading : " << exc.what() << "\n";
+         exit(EXIT_FAILURE);
+      }
+      startupTimeline.addSymbol(
+         std::chrono::duration_cast<std::chrono::microseconds>(
+            StartupTimeline::Clock::now() - start).count());
+   });
+   return *PTR;
+}
+
+#define LAZY_FUNC(funcName) \
+   (*LazyLoadFunc<decltype(funcName##_Ptr), &funcName##_Ptr>(#funcName))
+
+
+#define VixDiskLib_InitEx           LAZY_FUNC(VixDiskLib_InitEx)
+#define VixDiskLib_Init             LAZY_FUNC(VixDiskLib_Init)
+#define VixDiskLib_Exit             LAZY_FUNC(VixDiskLib_Exit)
+#define VixDiskLib_ListTransportModes   LAZY_FUNC(VixDiskLib_ListTransportModes)
+#define VixDiskLib_Cleanup          LAZY_FUNC(VixDiskLib_Cleanup)
+#define VixDiskLib_Connect          LAZY_FUNC(VixDiskLib_Connect)
+#define VixDiskLib_ConnectEx        LAZY_FUNC(VixDiskLib_ConnectEx)
+#define VixDiskLib_Disconnect       LAZY_FUNC(VixDiskLib_Disconnect)
+#define VixDiskLib_Create           LAZY_FUNC(VixDiskLib_Create)
+#define VixDiskLib_CreateChild      LAZY_FUNC(VixDiskLib_CreateChild)
+#define VixDiskLib_Open             LAZY_FUNC(VixDiskLib_Open)
+#define VixDiskLib_GetInfo          LAZY_FUNC(VixDiskLib_GetInfo)
+#define VixDiskLib_FreeInfo         LAZY_FUNC(VixDiskLib_FreeInfo)
+#define VixDiskLib_GetTransportMode LAZY_FUNC(VixDiskLib_GetTransportMode)
+#define VixDiskLib_Close            LAZY_FUNC(VixDiskLib_Close)
+#define VixDiskLib_Read             LAZY_FUNC(VixDiskLib_Read)
+#define VixDiskLib_Write            LAZY_FUNC(VixDiskLib_Write)
+#define VixDiskLib_ReadMetadata     LAZY_FUNC(VixDiskLib_ReadMetadata)
+#define VixDiskLib_WriteMetadata    LAZY_FUNC(VixDiskLib_WriteMetadata)
+#define VixDiskLib_GetMetadataKeys  LAZY_FUNC(VixDiskLib_GetMetadataKeys)
+#define VixDiskLib_Unlink           LAZY_FUNC(VixDiskLib_Unlink)
+#define VixDiskLib_Grow             LAZY_FUNC(VixDiskLib_Grow)
+#define VixDiskLib_Shrink           LAZY_FUNC(VixDiskLib_Shrink)
+#define VixDiskLib_Defragment       LAZY_FUNC(VixDiskLib_Defragment)
+#define VixDiskLib_Rename           LAZY_FUNC(VixDiskLib_Rename)
+#define VixDiskLib_Clone            LAZY_FUNC(VixDiskLib_Clone)
+#define VixDiskLib_GetErrorText     LAZY_FUNC(VixDiskLib_GetErrorText)
+#define VixDiskLib_FreeErrorText    LAZY_FUNC(VixDiskLib_FreeErrorText)
+#define VixDiskLib_Attach           LAZY_FUNC(VixDiskLib_Attach)
+#define VixDiskLib_SpaceNeededForClone   LAZY_FUNC(VixDiskLib_SpaceNeededForClone)
+#define VixDiskLib_CheckRepair      LAZY_FUNC(VixDiskLib_CheckRepair)
+#define VixDiskLib_QueryAllocatedBlocks  LAZY_FUNC(VixDiskLib_QueryAllocatedBlocks)
+#define VixDiskLib_FreeBlockList    LAZY_FUNC(VixDiskLib_FreeBlockList)
+#define VixDiskLib_PrepareForAccess LAZY_FUNC(VixDiskLib_PrepareForAccess)
+#define VixDiskLib_EndAccess        LAZY_FUNC(VixDiskLib_EndAccess)
+#define VixDiskLib_AllocateConnectParams LAZY_FUNC(VixDiskLib_AllocateConnectParams)
+#define VixDiskLib_FreeConnectParams     LAZY_FUNC(VixDiskLib_FreeConnectParams)
+#define VixDiskLib_ReadAsync        LAZY_FUNC(VixDiskLib_ReadAsync)
+#define VixDiskLib_WriteAsync       LAZY_FUNC(VixDiskLib_WriteAsync)
+#define VixDiskLib_Wait             LAZY_FUNC(VixDiskLib_Wait)
+#define VixDiskLib_Flush            LAZY_FUNC(VixDiskLib_Flush)
 
 #endif // DYNAMIC_LOADING
 
@@ -716,623 +1216,767 @@ private:
     int _line;
 };
 
-class VixDisk
+// Size in sectors of the blocks kept by -cache
+#ifndef VIX_BLOCK_CACHE_BLOCK
+#define VIX_BLOCK_CACHE_BLOCK 128
+#endif
+
+// Number of independently locked parts of the -cache block cache
+#ifndef VIX_BLOCK_CACHE_SHARDS
+#define VIX_BLOCK_CACHE_SHARDS 16
+#endif
+
+// Default size in MBytes of the -cachefile persistent block cache
+#ifndef VIX_BLOCK_CACHE_FILE_MB
+#define VIX_BLOCK_CACHE_FILE_MB 1024
+#endif
+
+/*
+ * Persistent block cache in a local file, kept across runs (-cachefile).
+ * The file is a header and slot index, which are mmap'ed, followed by one
+ * VIX_BLOCK_CACHE_BLOCK sized data area per slot. Slots are grouped into
+ * sets of BLOCK_CACHE_FILE_WAYS; a block can only live in the set its key
+ * hashes to and evicts the least recently used slot of that set, so the
+ * file never grows. A slot records the CRC of its data, and a slot is
+ * only marked valid after its data was written: a block torn by a crash
+ * fails the CRC check and is dropped instead of returned. Only disks
+ * with a SnapshotIdentity are kept in it.
+ */
+class BlockCacheFile
 {
-public:
-    typedef shared_ptr<VixDisk> Ptr;
+   public:
+      BlockCacheFile()
+         : _fd(-1), _map(NULL), _mapSize(0), _header(NULL), _slots(NULL),
+           _numSets(0), _dataOffset(0), _hits(0), _misses(0), _stores(0),
+           _evictions(0), _corrupt(0)
+      {}
 
-    VixDiskLibHandle Handle() const { return _handle; }
-    VixDisk(VixDiskLibConnection connection, const char *path, uint32 flags, int id = 0)
-       : _id(id)
-    {
-       _handle = NULL;
-       VixError vixError = VixDiskLib_Open(connection, path, flags, &_handle);
-       CHECK_AND_THROW(vixError);
-       printf("Disk[%d] \"%s\" is opened using transport mode \"%s\".\n",
-              id, path, VixDiskLib_GetTransportMode(_handle));
+      ~BlockCacheFile()
+      {
+         close();
+      }
 
-       vixError = VixDiskLib_GetInfo(_handle, &_info);
-       CHECK_AND_THROW(vixError);
-    }
+      bool open(const char *path, uint64 bytes);
+      void close();
 
-    int getId() const
-    {
-       return _id;
-    }
+      bool isOpen() const
+      {
+         return _map != NULL;
+      }
 
-    std::string getTransportMode() const
-    {
-       return VixDiskLib_GetTransportMode(_handle);
-    }
+      bool lookup(uint64 diskId, uint64 block, uint8 *buf, size_t len);
+      void store(uint64 diskId, uint64 block, const uint8 *buf, size_t len);
+      void invalidate(uint64 diskId, uint64 block);
+      void printStats(std::ostream& out);
 
-    const VixDiskLibInfo* getInfo() const
-    {
-       return _info;
-    }
+   private:
+      enum {
+         BLOCK_CACHE_FILE_VERSION = 1,
+         BLOCK_CACHE_FILE_WAYS = 8,
+         BLOCK_CACHE_FILE_LOCKS = 64,
+         BLOCK_CACHE_FILE_HEADER = 4096,
+      };
 
-    ~VixDisk()
-    {
-        if (_handle) {
-           VixDiskLib_FreeInfo(_info);
-           VixDiskLib_Close(_handle);
-           printf("Disk[%d] is closed.\n", _id);
-        }
-        _info = NULL;
-        _handle = NULL;
-    }
+      struct Header {
+         char magic[8];
+         uint32 version;
+         uint32 blockBytes;
+         uint64 numSlots;
+         uint64 clock;       // bumped on every use, orders slots for LRU
+      };
 
-private:
-    VixDiskLibHandle _handle;
-    VixDiskLibInfo *_info;
-    int _id;
-};
+      struct Slot {
+         uint64 diskId;
+         uint64 block;
+         uint64 lastUse;
+         uint32 len;         // 0 if the slot is free
+         uint32 crc;
+      };
 
-template <int V>
-using INT_TYPE = std::integral_constant<int, V>;
+      uint64 setOf(uint64 diskId, uint64 block) const
+      {
+         return (diskId ^ block * 0x9e3779b97f4a7c15ULL) % _numSets;
+      }
 
-template <typename T1, typename T2, typename N = INT_TYPE<1>>
-struct sizeT
-{
-   enum
-   {
-      value = std::conditional_t<(sizeof(T1) > sizeof(T2[N::value])),
-                                 sizeT<T1, T2, INT_TYPE<N::value+1>>,
-                                 INT_TYPE<N::value>>::value
-   };
+      Slot *find(uint64 set, uint64 diskId, uint64 block);
+
+      int _fd;
+      void *_map;
+      size_t _mapSize;
+      Header *_header;
+      Slot *_slots;
+      uint64 _numSets;
+      uint64 _dataOffset;
+      std::mutex _locks[BLOCK_CACHE_FILE_LOCKS];
+      std::atomic<uint64> _hits;
+      std::atomic<uint64> _misses;
+      std::atomic<uint64> _stores;
+      std::atomic<uint64> _evictions;
+      std::atomic<uint64> _corrupt;
 };
 
-class ThreadLock
+/*
+ * LRU cache of disk blocks in front of VixDiskLib_Read, shared by all
+ * disks the process opens. Entries are keyed by disk and block number:
+ * handles of the same disk (see DiskLocation) share entries, a write
+ * through any of them drops the blocks it touches for all, and the
+ * entries of a disk go away when its last handle is closed. Blocks are
+ * spread over
+ * VIX_BLOCK_CACHE_SHARDS shards, each with its own lock and LRU list and
+ * an equal part of the memory budget. Writes going through the cache drop
+ * the blocks they touch; a fill that raced with a write is not inserted.
+ * With -cachefile, blocks of disks opened read-only are also kept in a
+ * BlockCacheFile under the identity of the disk, so later runs opening
+ * the same disk read them locally.
+ */
+class BlockCache
 {
    public:
-      void lock()
-      {
-         _mutex.lock();
-      }
-      void unlock()
+      BlockCache()
+         : _shardBudget(0), _anonymous(0), _hits(0), _misses(0),
+           _evictions(0), _invalidations(0)
+      {}
+
+      void setBudget(uint64 bytes)
       {
-         _mutex.unlock();
+         _shardBudget = bytes / VIX_BLOCK_CACHE_SHARDS;
       }
-      bool wait()
+
+      bool openFile(const char *path, uint64 bytes)
       {
-         _cond.wait(_mutex);
-         return true;
+         return _file.open(path, bytes);
       }
-      void notify()
+
+      bool enabled() const
       {
-         _cond.notify_all();
+         return _shardBudget != 0 || _file.isOpen();
       }
+
+      void open(VixDiskLibHandle handle, VixDiskLibConnection connection,
+                const char *path, uint32 flags, const VixDiskLibInfo *info);
+
+      VixError read(const VixDisk& disk, uint64 sector, uint64 numSectors,
+                    uint8 *buf, std::mutex *ioLock = NULL);
+      VixError read(VixDiskLibHandle handle, uint64 capacity, uint64 sector,
+                    uint64 numSectors, uint8 *buf, std::mutex *ioLock = NULL);
+      VixError write(const VixDisk& disk, uint64 sector, uint64 numSectors,
+                     const uint8 *buf, std::mutex *ioLock = NULL);
+      VixError readAsync(const VixDisk& disk, uint64 sector,
+                         uint64 numSectors, uint8 *buf,
+                         VixDiskLibCompletionCB cb, void *cbData);
+      VixError readAsync(VixDiskLibHandle handle, uint64 capacity,
+                         uint64 sector, uint64 numSectors, uint8 *buf,
+                         VixDiskLibCompletionCB cb, void *cbData);
+      VixError writeAsync(const VixDisk& disk, uint64 sector,
+                          uint64 numSectors, const uint8 *buf,
+                          VixDiskLibCompletionCB cb, void *cbData);
+      void invalidate(VixDiskLibHandle handle, uint64 sector,
+                      uint64 numSectors);
+      void invalidate(VixDiskLibHandle handle);
+      void printStats(std::ostream& out = cout);
+
    private:
-      std::mutex _mutex;
-      std::condition_variable_any _cond;
-};
+      struct Key {
+         uint64 disk;
+         uint64 block;
 
-struct FakeLock
-{
-   void lock() {}
-   void unlock() {}
-   bool wait()
-   {
-      return false;
-   }
+         bool operator==(const Key& other) const
+         {
+            return disk == other.disk && block == other.block;
+         }
+      };
 
-   void notify() {}
-};
+      struct KeyHash {
+         size_t operator()(const Key& key) const
+         {
+            return std::hash<uint64>()(key.disk) ^
+                   std::hash<uint64>()(key.block) * 0x9e3779b97f4a7c15ULL;
+         }
+      };
 
+      struct Entry {
+         Key key;
+         vector<uint8> data;
+      };
 
-template <typename T>
-struct NotAlignedAlloc
-{
-   using ptr_type = std::unique_ptr<T[]>;
-   ptr_type allocBuf(size_t size);
-};
+      // A disk with open handles, shared by all of them
+      struct Disk {
+         uint64 id;                    // Key::disk of its blocks
+         std::atomic<uint64> fileId;   // its blocks' id in the file, or 0
+         std::atomic<uint64> gen;      // bumped by every invalidation
+         unsigned handles;
+      };
+      typedef std::shared_ptr<Disk> DiskPtr;
 
-template <typename T>
-typename NotAlignedAlloc<T>::ptr_type NotAlignedAlloc<T>::allocBuf(size_t size)
-{
-   return ptr_type(new T[size]);
-}
+      struct Shard {
+         Shard() : bytes(0) {}
 
-template <typename T>
-class AlignedAlloc
-{
-   public:
-      using ptr_type = std::unique_ptr<T, std::function<void(T*)>>;
-      explicit AlignedAlloc(uint32 align) : alignment(align) {}
-      ptr_type allocBuf(size_t size);
+         std::mutex lock;
+         std::list<Entry> lru;     // most recently used first
+         std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map;
+         uint64 bytes;
+      };
 
-   private:
-      uint32 alignment;
-};
+      // An async read or write going through the cache.
+      struct AsyncIO {
+         BlockCache *cache;
+         DiskPtr disk;
+         uint64 sector;       // of the request
+         uint64 numSectors;
+         uint8 *buf;
+         uint64 readSector;   // block aligned, of the transport read
+         uint64 readSectors;
+         std::unique_ptr<uint8[]> readBuf;
+         uint64 gen;
+         VixDiskLibCompletionCB cb;
+         void *cbData;
+      };
 
-template <typename T>
-typename AlignedAlloc<T>::ptr_type AlignedAlloc<T>::allocBuf(size_t size)
-{
-   auto del = [] (T* buf_p) {
-#ifdef _WIN32
-      _aligned_free(static_cast<void*>(buf_p));
-#else
-      free(buf_p);
-#endif
-   };
-   void* buf = NULL;
-   int err;
+      Shard& shardOf(const Key& key)
+      {
+         return _shards[KeyHash()(key) % VIX_BLOCK_CACHE_SHARDS];
+      }
 
-#ifdef _WIN32
-   buf = _aligned_malloc(sizeof(T) * size, alignment);
-   _get_errno(&err);
-#else
-   err = posix_memalign((void**) &buf, alignment, sizeof(T) * size);
-#endif
+      bool lookup(const Key& key, uint64 sector, uint64 numSectors,
+                  uint8 *buf);
+      void insert(const Disk& disk, const Key& key, const uint8 *data,
+                  size_t len, uint64 gen);
+      void fill(const Disk& disk, uint64 readSector, uint64 readSectors,
+                const uint8 *readBuf, uint64 gen, uint64 sector,
+                uint64 numSectors, uint8 *buf);
+      DiskPtr diskOf(VixDiskLibHandle handle);
+      void drop(uint64 id);
+      bool fileLookup(const Disk& disk, uint64 readSector,
+                      uint64 readSectors, uint8 *readBuf,
+                      vector<bool> *cached = NULL);
+      void fileStore(const Disk& disk, uint64 readSector,
+                     uint64 readSectors, const uint8 *readBuf, uint64 gen);
+      VixError readBlocks(VixDiskLibHandle handle, const Disk& disk,
+                          uint64 readSector, uint64 readSectors,
+                          uint8 *readBuf, uint64 gen, std::mutex *ioLock);
+      void invalidate(Disk& disk, uint64 sector, uint64 numSectors);
+      static void CopyOverlap(uint64 fromSector, uint64 fromSectors,
+                              const uint8 *from, uint64 sector,
+                              uint64 numSectors, uint8 *buf);
+      static void ReadDone(void *cbData, VixError result);
+      static void WriteDone(void *cbData, VixError result);
+
+      uint64 _shardBudget;
+      Shard _shards[VIX_BLOCK_CACHE_SHARDS];
+      BlockCacheFile _file;
+      std::mutex _diskLock;
+      std::map<VixDiskLibHandle, DiskPtr> _handles;
+      std::map<uint64, DiskPtr> _disks;   // by Disk::id
+      uint64 _anonymous;                  // Disk::id of unknown disks
+
+      // The top bit of a Disk::id: set on the hashes of DiskLocations,
+      // clear on the counts of _anonymous, so the two never meet.
+      static const uint64 LOCATED_ID = 1ULL << 63;
+      std::atomic<uint64> _hits;
+      std::atomic<uint64> _misses;
+      std::atomic<uint64> _evictions;
+      std::atomic<uint64> _invalidations;
+};
 
-   if (buf == nullptr) {
-      THROW_ERROR(VIX_E_OUT_OF_MEMORY);
-   }
+static BlockCache blockCache;
 
-   return ptr_type(static_cast<T*>(buf), del);
-}
 
-template <size_t SIZE, typename TYPE = char, typename LOCK = FakeLock,
-          typename ALLOC = NotAlignedAlloc<TYPE>>
-class BufferPool : public BufferPoolInterface<TYPE>,  private LOCK
+class VixDisk
 {
-   using Buffer = std::vector<typename ALLOC::ptr_type>;
-   using Pool = std::list<TYPE*>;
-   using PoolIt = int;
-   using LockGrd = std::lock_guard<LOCK>;
-
-   public:
-      explicit BufferPool(size_t bufSize)
-         : _bufSize(bufSize)
-      {
-         initPool();
-      }
+public:
+    typedef shared_ptr<VixDisk> Ptr;
 
-      BufferPool(size_t bufSize, ALLOC&& alloc)
-         : _bufSize(bufSize), _alloc(std::forward<ALLOC>(alloc))
-      {
-         initPool();
-      }
+    VixDiskLibHandle Handle() const { return _handle; }
+    VixDisk(VixDiskLibConnection connection, const char *path, uint32 flags, int id = 0)
+       : _connection(connection), _path(path), _flags(flags), _id(id)
+    {
+       _handle = NULL;
+       VixError vixError;
+       {
+          StartupPhase phase(string("VixDisk open ") + path);
+          std::lock_guard<std::mutex> lg(openCloseLock);
+          vixError = VixDiskLib_Open(connection, path, flags, &_handle);
+       }
+       CHECK_AND_THROW(vixError);
+       printf("Disk[%d] \"%s\" is opened using transport mode \"%s\".\n",
+              id, path, VixDiskLib_GetTransportMode(_handle));
 
-      BufferPool(size_t bufSize, ALLOC&& alloc, LOCK&& lock)
-         : LOCK(std::forward<LOCK>(lock)), _bufSize(bufSize),
-           _alloc(std::forward<ALLOC>(alloc))
-      {
-         initPool();
-      }
+       vixError = VixDiskLib_GetInfo(_handle, &_info);
+       CHECK_AND_THROW(vixError);
+       blockCache.open(_handle, connection, path, flags, _info);
+    }
 
-      ~BufferPool()
-      {
-         LockGrd lg(*this);
-         while (inPool.size() != SIZE) {
-            if (!LOCK::wait()) {
-               break;
-            }
-         }
-      }
+    int getId() const
+    {
+       return _id;
+    }
 
-      size_t size() const
-      {
-         return SIZE;
-      }
+    std::string getTransportMode() const
+    {
+       return VixDiskLib_GetTransportMode(_handle);
+    }
 
-      TYPE * getBuffer()
-      {
-         TYPE * buf = NULL;
-         {
-            LockGrd lg(*this);
-            while (inPool.empty()) {
-               if (!LOCK::wait()) {
-                  return buf;
-               }
-            }
-            buf = inPool.front();
-            inPool.pop_front();
-         }
-         return buf;
-      }
-      void returnBuffer(TYPE * buf)
-      {
-         PoolIt it =
-            *(reinterpret_cast<PoolIt*>(buf + _bufSize));
-         TYPE *rawBuf = (_buf.at(it)).get();
-         {
-            LockGrd lg(*this);
-            inPool.push_back(rawBuf);
-         }
-         LOCK::notify();
-      }
+    const VixDiskLibInfo* getInfo() const
+    {
+       return _info;
+    }
 
-   private:
+    VixDiskLibConnection connection() const
+    {
+       return _connection;
+    }
 
-      void initPool()
-      {
-         for (unsigned int i = 0 ; i < SIZE ; ++i) {
-            try {
-               auto buf = _alloc.allocBuf(_bufSize+sizeT<PoolIt, TYPE>::value);
-               inPool.push_front(buf.get());
-               PoolIt * it = reinterpret_cast<PoolIt*>(buf.get()+_bufSize);
-               *it = i;
-               _buf.push_back(std::move(buf));
-            } catch (...) {
-               throw;
-            }
-         }
-      }
+    const std::string& path() const
+    {
+       return _path;
+    }
 
-      Pool inPool;
-      Buffer _buf;
-      size_t _bufSize;
-      ALLOC _alloc;
-};
+    uint32 flags() const
+    {
+       return _flags;
+    }
 
-// specialization for unlimited size buffer pool
-template<typename TYPE, typename LOCK, typename ALLOC>
-class BufferPool<std::numeric_limits<size_t>::max(), TYPE, LOCK, ALLOC>
-   : public BufferPoolInterface<TYPE> {
-public:
-   using Buffer = std::map<TYPE *, typename ALLOC::ptr_type>;
+    // Opens another, read-only handle of the disk.
+    Ptr reopen() const
+    {
+       return std::make_shared<VixDisk>(_connection, _path.c_str(),
+                                        _flags | VIXDISKLIB_FLAG_OPEN_READ_ONLY,
+                                        _id);
+    }
 
-   explicit BufferPool(size_t bz) : _bufSize(bz) {}
+    ~VixDisk()
+    {
+        if (_handle) {
+           blockCache.invalidate(_handle);
+           std::lock_guard<std::mutex> lg(openCloseLock);
+           VixDiskLib_FreeInfo(_info);
+           VixDiskLib_Close(_handle);
+           printf("Disk[%d] is closed.\n", _id);
+        }
+        _info = NULL;
+        _handle = NULL;
+    }
 
-   BufferPool(size_t bz, ALLOC&& alloc)
-      : _bufSize(bz), _alloc(std::forward<ALLOC>(alloc)) {}
+private:
+    VixDiskLibHandle _handle;
+    VixDiskLibInfo *_info;
+    VixDiskLibConnection _connection;
+    std::string _path;
+    uint32 _flags;
+    int _id;
+};
 
-   ~BufferPool() {}
 
-   size_t size() { return std::numeric_limits<size_t>::max(); }
+#ifndef _WIN32
 
-   TYPE *getBuffer() {
-      TYPE *buffer;
-      auto buf = _alloc.allocBuf(_bufSize);
+static const char blockCacheFileMagic[8] = { 'V', 'D', 'L', 'B', 'C', 'A',
+                                             'C', 'H' };
 
-      buffer = buf.get();
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BlockCacheFile::open --
+ *
+ *      Opens or creates the cache file at path, sized to hold about bytes
+ *      of blocks. An existing file with another layout is emptied. The
+ *      file is locked, so only one process uses it at a time.
+ *
+ * Results:
+ *      true on success.
+ *
+ * Side effects:
+ *      Prints why the cache can't be used on failure.
+ *
+ *--------------------------------------------------------------------------
+ */
 
-      _buf[buffer] = std::move(buf);
+bool
+BlockCacheFile::open(const char *path,     // IN
+                     uint64 bytes)         // IN
+{
+   const uint32 blockBytes = VIX_BLOCK_CACHE_BLOCK * VIXDISKLIB_SECTOR_SIZE;
+   uint64 numSlots = bytes / blockBytes / BLOCK_CACHE_FILE_WAYS *
+                     BLOCK_CACHE_FILE_WAYS;
 
-      return buffer;
+   if (numSlots == 0) {
+      cout << "Cache file " << path << " is too small." << endl;
+      return false;
    }
 
-   void returnBuffer(TYPE *buf) {
-      if (!_buf.erase(buf)) {
-         assert(0);
-      }
+   _fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+   if (_fd < 0) {
+      cout << "Can't open cache file " << path << ": " << strerror(errno)
+           << endl;
+      return false;
+   }
+   if (flock(_fd, LOCK_EX | LOCK_NB) != 0) {
+      cout << "Cache file " << path << " is in use by another process."
+           << endl;
+      close();
+      return false;
    }
 
-private:
-   size_t _bufSize;
-   Buffer _buf;
-   ALLOC _alloc;
-};
-
-#ifndef VIX_AIO_BUFPOOL_SIZE
-#define VIX_AIO_BUFPOOL_SIZE 256
-#endif
+   _mapSize = BLOCK_CACHE_FILE_HEADER +
+              (numSlots * sizeof(Slot) + BLOCK_CACHE_FILE_HEADER - 1) /
+              BLOCK_CACHE_FILE_HEADER * BLOCK_CACHE_FILE_HEADER;
+   _dataOffset = _mapSize;
+   uint64 fileSize = _dataOffset + numSlots * blockBytes;
+
+   struct stat st;
+   if (fstat(_fd, &st) != 0 ||
+       ((uint64)st.st_size != fileSize &&
+        (ftruncate(_fd, 0) != 0 || ftruncate(_fd, fileSize) != 0))) {
+      cout << "Can't size cache file " << path << ": " << strerror(errno)
+           << endl;
+      close();
+      return false;
+   }
 
-template <typename Pool>
-class AioCBData
-{
-   public:
-      AioCBData(typename Pool::type * b, Pool& pool)
-         : buf(b), aioBufPool(pool)
-      {}
+   _map = mmap(NULL, _mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+   if (_map == MAP_FAILED) {
+      _map = NULL;
+      cout << "Can't map cache file " << path << ": " << strerror(errno)
+           << endl;
+      close();
+      return false;
+   }
+   _header = (Header *)_map;
+   _slots = (Slot *)((uint8 *)_map + BLOCK_CACHE_FILE_HEADER);
+   _numSets = numSlots / BLOCK_CACHE_FILE_WAYS;
+
+   if (memcmp(_header->magic, blockCacheFileMagic, sizeof _header->magic) ||
+       _header->version != BLOCK_CACHE_FILE_VERSION ||
+       _header->blockBytes != blockBytes || _header->numSlots != numSlots) {
+      // The magic goes last, so a crash here empties the file again.
+      memset(_header->magic, 0, sizeof _header->magic);
+      memset(_slots, 0, numSlots * sizeof(Slot));
+      _header->version = BLOCK_CACHE_FILE_VERSION;
+      _header->blockBytes = blockBytes;
+      _header->numSlots = numSlots;
+      _header->clock = 0;
+      msync(_map, _mapSize, MS_SYNC);
+      memcpy(_header->magic, blockCacheFileMagic, sizeof _header->magic);
+   }
+   return true;
+}
 
-      void returnBuffer()
-      {
-         aioBufPool.returnBuffer(buf);
-      }
-   private:
-      typename Pool::type * buf;
-      Pool& aioBufPool;
-};
 
-template <typename CB>
-static void AioCB(void * cbData, VixError err)
+void
+BlockCacheFile::close()
 {
-   CB* pCB = static_cast<CB*>(cbData);
-   if (pCB == NULL) return;
-
-   pCB->returnBuffer();
-   delete pCB;
-
-#ifdef AIO_PERF_DEBUG
-   static int count = 0;
-   if (++count % 20 == 0)
-   {
-      cout << ".";
-      cout.flush();
+   if (_map != NULL) {
+      munmap(_map, _mapSize);
+      _map = NULL;
+   }
+   if (_fd >= 0) {
+      ::close(_fd);
+      _fd = -1;
    }
-#endif
 }
 
-class TaskExecutor
+
+// Finds the valid slot of a block in its set; called with the set locked.
+BlockCacheFile::Slot *
+BlockCacheFile::find(uint64 set, uint64 diskId, uint64 block)
 {
-   public:
-      template <typename T>
-      TaskExecutor(size_t parallel_size, T task)
-      {
-         m_threads.reserve(parallel_size);
-         for (size_t i = 0 ; i < parallel_size ; ++i) {
-            m_threads.emplace_back(task);
-         }
-      }
+   Slot *slot = &_slots[set * BLOCK_CACHE_FILE_WAYS];
 
-      ~TaskExecutor()
-      {
-         for (auto& t : m_threads) {
-            t.join();
-         }
+   for (int i = 0; i < BLOCK_CACHE_FILE_WAYS; i++, slot++) {
+      if (slot->len != 0 && slot->diskId == diskId && slot->block == block) {
+         return slot;
       }
+   }
+   return NULL;
+}
 
-   private:
-      std::vector<std::thread> m_threads;
-};
 
-class DiskIOPipeline
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BlockCacheFile::lookup --
+ *
+ *      Reads a cached block of len bytes into buf.
+ *
+ * Results:
+ *      true if the block was cached and its CRC matched.
+ *
+ * Side effects:
+ *      Frees the slot of a block that fails the CRC check.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+bool
+BlockCacheFile::lookup(uint64 diskId,     // IN
+                       uint64 block,      // IN
+                       uint8 *buf,        // OUT
+                       size_t len)        // IN
 {
-      using LockGrd = std::lock_guard<ThreadLock>;
-   public:
-      explicit DiskIOPipeline(size_t work_size)
-         : _exit(false), _taskExec(1, [this] () {openCloseDisk();})
-      {
-      }
+   uint64 set = setOf(diskId, block);
+   std::lock_guard<std::mutex> lg(_locks[set % BLOCK_CACHE_FILE_LOCKS]);
 
-      ~DiskIOPipeline()
-      {
-         _exit = true;
-         _diskInfosLock.notify();
-         // wait for _taskExec exit
-      }
+   Slot *slot = find(set, diskId, block);
+   if (slot == NULL || slot->len != len) {
+      ++_misses;
+      return false;
+   }
+   off_t off = _dataOffset + (slot - _slots) * _header->blockBytes;
+   if (pread(_fd, buf, len, off) != (ssize_t)len ||
+       crc32(0, buf, len) != slot->crc) {
+      slot->len = 0;
+      ++_corrupt;
+      ++_misses;
+      return false;
+   }
+   slot->lastUse = __atomic_add_fetch(&_header->clock, 1, __ATOMIC_RELAXED);
+   ++_hits;
+   return true;
+}
 
-      void read(VixDiskLibConnection connection,
-                const char *path, uint32 flags, int id, bool async)
-      {
-         {
-            LockGrd lock(_diskInfosLock);
-            DiskInfo di = {connection, path, flags, id, true, async};
-            _diskInfos.push_back(di);
-         }
-         _diskInfosLock.notify();
-      }
 
-      void write(VixDiskLibConnection connection,
-                 const char *path, uint32 flags, int id, bool async)
-      {
-         {
-            LockGrd lock(_diskInfosLock);
-            DiskInfo di = {connection, path, flags, id, false, async};
-            _diskInfos.push_back(di);
+// Writes a block into a free or the least recently used slot of its set.
+void
+BlockCacheFile::store(uint64 diskId, uint64 block, const uint8 *buf,
+                      size_t len)
+{
+   uint64 set = setOf(diskId, block);
+   std::lock_guard<std::mutex> lg(_locks[set % BLOCK_CACHE_FILE_LOCKS]);
+
+   Slot *slot = find(set, diskId, block);
+   if (slot == NULL) {
+      slot = &_slots[set * BLOCK_CACHE_FILE_WAYS];
+      for (int i = 1; i < BLOCK_CACHE_FILE_WAYS && slot->len != 0; i++) {
+         Slot *other = &_slots[set * BLOCK_CACHE_FILE_WAYS + i];
+         if (other->len == 0 || other->lastUse < slot->lastUse) {
+            slot = other;
          }
-         _diskInfosLock.notify();
       }
-
-   private:
-      struct DiskInfo {
-         VixDiskLibConnection _conn;
-         const char *         _path;
-         uint32               _flags;
-         int                  _id;
-         bool                 _read;
-         bool                 _async;
-      };
-
-      void openDisks(std::deque<DiskInfo>& diskInfos)
-      {
-         for (const auto& diskInfo : diskInfos) {
-            try {
-               DiskIO(diskInfo._conn, diskInfo._path,
-                      diskInfo._flags, diskInfo._id,
-                      [this, async = diskInfo._async, read = diskInfo._read]
-                      (auto disk) {
-                         (async) ? aio(disk, read) : io(disk, read);
-                      });
-            } catch (...) {
-               // in case any error just skip that disk and continue the next
-            }
-         }
+      if (slot->len != 0) {
+         ++_evictions;
       }
+   }
 
-      void closeDisks();
+   slot->len = 0;
+   off_t off = _dataOffset + (slot - _slots) * _header->blockBytes;
+   if (pwrite(_fd, buf, len, off) != (ssize_t)len) {
+      return;
+   }
+   slot->diskId = diskId;
+   slot->block = block;
+   slot->crc = crc32(0, buf, len);
+   slot->lastUse = __atomic_add_fetch(&_header->clock, 1, __ATOMIC_RELAXED);
+   slot->len = len;
+   ++_stores;
+}
 
-      template <typename IOFunc>
-      void DiskIO(VixDiskLibConnection connection,
-                    const char *path, uint32 flags, int id, IOFunc ioFunc)
-      {
-         auto disk = std::make_shared<VixDisk>(connection, path, flags, id);
-         auto fut = std::async(
-#ifdef _DEBUG
-                               std::launch::deferred,
-#else
-                               std::launch::async,
-#endif
-                               [disk, ioFunc] () -> VixDisk::Ptr {
-                                 ioFunc(disk);
-                                 return disk;
-                               });
-         _diskIOs.push_front(std::move(fut));
-      }
 
-      void io(VixDisk::Ptr disk, bool read);
-      void doIO(BufferPoolInterface<uint8>& bufPool,
-                VixDisk::Ptr disk, bool read, size_t bufSize);
-      void aio(VixDisk::Ptr disk, bool read);
-      void doAIO(BufferPoolInterface<uint8>& bufPool,
-                 VixDisk::Ptr disk, bool read, size_t bufSize);
+void
+BlockCacheFile::invalidate(uint64 diskId, uint64 block)
+{
+   uint64 set = setOf(diskId, block);
+   std::lock_guard<std::mutex> lg(_locks[set % BLOCK_CACHE_FILE_LOCKS]);
 
-      void
-      openCloseDisk()
-      {
-         while (true) {
-            decltype(_diskInfos) diskInfos;
-            {
-               LockGrd lock(_diskInfosLock);
-               while (_diskInfos.empty() && _diskIOs.empty()) {
-                  if (_exit) {
-                     return;
-                  }
-                  _diskInfosLock.wait();
-               }
-               _diskInfos.swap(diskInfos);
-            }
-            openDisks(diskInfos);
-            closeDisks();
-         }
-      }
+   Slot *slot = find(set, diskId, block);
+   if (slot != NULL) {
+      slot->len = 0;
+   }
+}
 
-      std::deque<DiskInfo> _diskInfos;
-      std::forward_list<std::future<VixDisk::Ptr>> _diskIOs;
-      ThreadLock _diskInfosLock;
-      std::atomic<bool> _exit;
-      TaskExecutor _taskExec; // must keep as last member
-};
 
 void
-DiskIOPipeline::closeDisks()
+BlockCacheFile::printStats(std::ostream& out)
 {
-   // In order not to block on the first future,
-   // check each future
-   for (auto &fut : _diskIOs) {
-      if (fut.valid() && fut.wait_for(std::chrono::milliseconds(100)) ==
-#ifdef _DEBUG
-         std::future_status::deferred
-#else
-         std::future_status::ready
-#endif
-         ) {
-         try {
-            auto disk = fut.get();
-            disk.reset(); // release/close the disk
-         } catch (...) {
-            // continue for the next disk IO
-         }
-      }
+   uint64 used = 0;
+
+   for (uint64 i = 0; i < _header->numSlots; i++) {
+      used += _slots[i].len != 0;
    }
-   _diskIOs.remove_if([] (const auto& fut) {return !fut.valid();});
+   out << "Cache file: " << _hits << " hits, " << _misses << " misses, "
+       << _stores << " stores, " << _evictions << " evictions, "
+       << _corrupt << " corrupt" << endl;
+   out << "Cache file: " << used << " of " << _header->numSlots
+       << " blocks used" << endl;
 }
 
-void DiskIOPipeline::io(VixDisk::Ptr disk, bool read)
-{
-   size_t bufSize;
-   if (appGlobals.bufSize == 0) {
-      appGlobals.bufSize = DEFAULT_BUFSIZE;
-   }
-   bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
+#else
 
-   auto bufPool =
-      getBufferPool<std::numeric_limits<size_t>::max(), uint8, FakeLock>(
-         *disk, bufSize);
-   doIO(*bufPool, disk, read, bufSize);
+bool
+BlockCacheFile::open(const char *path, uint64 bytes)
+{
+   cout << "-cachefile is not supported on Windows." << endl;
+   return false;
 }
 
-void DiskIOPipeline::doIO(BufferPoolInterface<uint8>& bufPool,
-                          VixDisk::Ptr disk, bool read, size_t bufSize)
-{
-   const VixDiskLibInfo *info;
-   uint32 maxOps, i;
-   uint32 bufUpdate;
-   auto buf = bufPool.getBuffer();
+void BlockCacheFile::close() {}
 
-   info = disk->getInfo();
+bool
+BlockCacheFile::lookup(uint64 diskId, uint64 block, uint8 *buf, size_t len)
+{
+   return false;
+}
 
-   maxOps = info->capacity / appGlobals.bufSize;
+void
+BlockCacheFile::store(uint64 diskId, uint64 block, const uint8 *buf,
+                      size_t len)
+{
+}
 
-   std::ostringstream prefix;
-   prefix << "Disk[" << disk->getId() << "] - ";
-   std::cout << prefix.str() <<  "Processing "
-             << maxOps << " buffers of " << bufSize << " bytes." << std::endl;
+void BlockCacheFile::invalidate(uint64 diskId, uint64 block) {}
 
-   if (!read) {
-      InitBuffer((uint32*)buf, bufSize / sizeof(uint32));
-   }
+void BlockCacheFile::printStats(std::ostream& out) {}
 
-   auto total = std::chrono::system_clock::now();
-   decltype(total) end, start;
+#endif // _WIN32
 
-   start = total;
-   bufUpdate = 0;
-   for (i = 0; i < maxOps; i++) {
-      VixError vixError;
 
-      if (read) {
-         vixError = VixDiskLib_Read(disk->Handle(),
-               i * appGlobals.bufSize,
-               appGlobals.bufSize, buf);
-      } else {
-         vixError = VixDiskLib_Write(disk->Handle(),
-               i * appGlobals.bufSize,
-               appGlobals.bufSize, buf);
-      }
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BlockCache::CopyOverlap --
+ *
+ *      Copies the sectors that [fromSector, fromSector + fromSectors) and
+ *      [sector, sector + numSectors) have in common from 'from' to buf.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
 
-      CHECK_AND_THROW(vixError);
+void
+BlockCache::CopyOverlap(uint64 fromSector,     // IN
+                        uint64 fromSectors,    // IN
+                        const uint8 *from,     // IN
+                        uint64 sector,         // IN
+                        uint64 numSectors,     // IN
+                        uint8 *buf)            // OUT
+{
+   uint64 start = std::max(fromSector, sector);
+   uint64 end = std::min(fromSector + fromSectors, sector + numSectors);
 
-      bufUpdate += appGlobals.bufSize;
-      if (bufUpdate >= BUFS_PER_STAT) {
-         end = std::chrono::system_clock::now();
-         PrintStat(read, start, end, bufUpdate,
-                   VIXDISKLIB_SECTOR_SIZE, prefix.str());
-         start = end;
-         bufUpdate = 0;
-      }
+   if (start < end) {
+      memcpy(buf + (start - sector) * VIXDISKLIB_SECTOR_SIZE,
+             from + (start - fromSector) * VIXDISKLIB_SECTOR_SIZE,
+             (end - start) * VIXDISKLIB_SECTOR_SIZE);
    }
-   end = std::chrono::system_clock::now();
-   PrintStat(read, total, end, appGlobals.bufSize * maxOps,
-             VIXDISKLIB_SECTOR_SIZE, prefix.str());
-   bufPool.returnBuffer(buf);
 }
 
-void DiskIOPipeline::aio(VixDisk::Ptr disk, bool read)
+
+// Copies the part of a cached block within the request to buf.
+bool
+BlockCache::lookup(const Key& key, uint64 sector, uint64 numSectors,
+                   uint8 *buf)
 {
-   size_t bufSize = appGlobals.bufSize * VIXDISKLIB_SECTOR_SIZE;
-   auto bufPool = getBufferPool<VIX_AIO_BUFPOOL_SIZE, uint8, ThreadLock>
-                     (*disk, bufSize);
-   doAIO(*bufPool, disk, read, bufSize);
+   Shard& shard = shardOf(key);
+   std::lock_guard<std::mutex> lg(shard.lock);
+
+   auto it = shard.map.find(key);
+   if (it == shard.map.end()) {
+      return false;
+   }
+   shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+   const vector<uint8>& data = it->second->data;
+   CopyOverlap(key.block * VIX_BLOCK_CACHE_BLOCK,
+               data.size() / VIXDISKLIB_SECTOR_SIZE, data.data(),
+               sector, numSectors, buf);
+   return true;
 }
 
-void DiskIOPipeline::doAIO(BufferPoolInterface<uint8>& bufPool,
-                           VixDisk::Ptr disk, bool read, size_t bufSize)
+
+// Adds a block read while the invalidation generation of disk was gen.
+void
+BlockCache::insert(const Disk& disk, const Key& key, const uint8 *data,
+                   size_t len, uint64 gen)
 {
-   const VixDiskLibInfo *info = disk->getInfo();
-   uint32 maxOps = info->capacity / appGlobals.bufSize;
+   Shard& shard = shardOf(key);
+   std::lock_guard<std::mutex> lg(shard.lock);
 
-   std::ostringstream prefix;
-   prefix << "Disk[" << disk->getId() << "] - ";
-   std::cout << prefix.str() <<  "Processing "
-             << maxOps << " buffers of " << bufSize << " bytes." << std::endl;
+   if (disk.gen != gen || shard.map.count(key) != 0 || len > _shardBudget) {
+      return;
+   }
+   shard.lru.push_front(Entry{key, vector<uint8>(data, data + len)});
+   shard.map[key] = shard.lru.begin();
+   shard.bytes += len;
+   while (shard.bytes > _shardBudget) {
+      Entry& victim = shard.lru.back();
+      shard.bytes -= victim.data.size();
+      shard.map.erase(victim.key);
+      shard.lru.pop_back();
+      ++_evictions;
+   }
+}
 
-   auto start = std::chrono::system_clock::now();
-   decltype(start) end;
-   for (uint32 i = 0; i < maxOps; i++) {
-      VixError vixError;
 
-      auto buf = bufPool.getBuffer();
-      AioCBData<BufferPoolInterface<uint8>> *
-         cbd = new AioCBData<BufferPoolInterface<uint8>>(buf, bufPool);
-      if (read) {
-         vixError = VixDiskLib_ReadAsync(disk->Handle(),
-               i * appGlobals.bufSize, appGlobals.bufSize, buf,
-               AioCB<AioCBData<BufferPoolInterface<uint8>> >, cbd);
-      } else {
-         InitBuffer((uint32*)buf, bufSize / sizeof(uint32));
-         vixError = VixDiskLib_WriteAsync(disk->Handle(),
-               i * appGlobals.bufSize, appGlobals.bufSize, buf,
-               AioCB<AioCBData<BufferPoolInterface<uint8>> >, cbd);
+// Caches the blocks of a block aligned read and copies the request out.
+void
+BlockCache::fill(const Disk& disk, uint64 readSector, uint64 readSectors,
+                 const uint8 *readBuf, uint64 gen, uint64 sector,
+                 uint64 numSectors, uint8 *buf)
+{
+   for (uint64 s = 0; s < readSectors; s += VIX_BLOCK_CACHE_BLOCK) {
+      uint64 n = std::min<uint64>(VIX_BLOCK_CACHE_BLOCK, readSectors - s);
+      insert(disk, Key{disk.id, (readSector + s) / VIX_BLOCK_CACHE_BLOCK},
+             readBuf + s * VIXDISKLIB_SECTOR_SIZE,
+             n * VIXDISKLIB_SECTOR_SIZE, gen);
+   }
+   CopyOverlap(readSector, readSectors, readBuf, sector, numSectors, buf);
+}
+
+
+/*
+ * The disk of a handle. Handles not opened through VixDisk, which the
+ * cache knows nothing about, get a disk of their own.
+ */
+BlockCache::DiskPtr
+BlockCache::diskOf(VixDiskLibHandle handle)
+{
+   std::lock_guard<std::mutex> lg(_diskLock);
+   DiskPtr& disk = _handles[handle];
+
+   if (!disk) {
+      disk = std::make_shared<Disk>();
+      disk->id = ++_anonymous & ~LOCATED_ID;
+      disk->fileId = 0;
+      disk->gen = 0;
+      disk->handles = 1;
+   }
+   return disk;
+}
+
+
+// Drops all cached blocks of a disk.
+void
+BlockCache::drop(uint64 id)
+{
+   for (auto& shard : _shards) {
+      std::lock_guard<std::mutex> lg(shard.lock);
+      for (auto it = shard.lru.begin(); it != shard.lru.end(); ) {
+         if (it->key.disk == id) {
+            shard.bytes -= it->data.size();
+            shard.map.erase(it->key);
+            it = shard.lru.erase(it);
+         } else {
+            ++it;
+         }
       }
    }
-   cout << prefix.str() << "sent all data requests!" << endl;
-   VixDiskLib_Wait(disk->Handle());
-   end = std::chrono::system_clock::now();
-   PrintStat(read, start, end, appGlobals.bufSize * maxOps,
-             VIXDISKLIB_SECTOR_SIZE, prefix.str());
 }
 
+
 /*
  *--------------------------------------------------------------------------
  *
- * PrintUsage --
+ * BlockCache::fileLookup --
  *
- *      Displays the usage message.
+ *      Looks up the blocks of a block aligned range in the cache file,
+ *      reading the ones found into readBuf. Which ones were found is
+ *      returned in cached if given, else the lookup stops at the first
+ *      block not found.
  *
  * Results:
- *      1.
+ *      true if all blocks were found.
  *
  * Side effects:
  *      None.
@@ -1340,90 +1984,62 @@ void DiskIOPipeline::doAIO(BufferPoolInterface<uint8>& bufPool,
  *--------------------------------------------------------------------------
  */
 
-static int
-PrintUsage(void)
+bool
+BlockCache::fileLookup(const Disk& disk,             // IN
+                       uint64 readSector,            // IN
+                       uint64 readSectors,           // IN
+                       uint8 *readBuf,               // OUT
+                       vector<bool> *cached)         // OUT: optional
 {
-    printf("Usage: vixdisklibsample.exe command [options] diskPath\n\n");
-
-    printf("List of commands (all commands are mutually exclusive):\n");
-    printf(" -create : creates a sparse virtual disk with capacity "
-           "specified by -cap\n");
-    printf(" -redo parentPath : creates a redo log 'diskPath' "
-           "for base disk 'parentPath'\n");
-    printf(" -info : displays information for specified virtual disk\n");
-    printf(" -dump : dumps the contents of specified range of sectors "
-           "in hexadecimal\n");
-    printf(" -mount : mount the virtual disk specified\n");
-    printf(" -fill : fills specified range of sectors with byte value "
-           "specified by -val\n");
-    printf(" -wmeta key value : writes (key,value) entry into disk's metadata table\n");
-    printf(" -rmeta key : displays the value of the specified metada entry\n");
-    printf(" -meta : dumps all entries of the disk's metadata\n");
-    printf(" -clone sourcePath : clone source vmdk possibly to a remote site\n");
-    printf(" -compress type: specify the compression type for nbd transport mode\n");
-    printf(" -readbench blocksize: Does a read benchmark on a disk using the \n");
-    printf("specified I/O block size (in sectors).\n");
-    printf(" -writebench blocksize: Does a write benchmark on a disk using the\n");
-    printf("specified I/O block size (in sectors). WARNING: This will\n");
-    printf("overwrite the contents of the disk specified.\n");
-    printf(" -readasyncbench blocksize: Does an async read benchmark on a disk using the \n");
-    printf("specified I/O block size (in sectors).\n");
-    printf(" -writeasyncbench blocksize: Does an async write benchmark on a disk using the\n");
-    printf("specified I/O block size (in sectors). WARNING: This will\n");
-    printf("overwrite the contents of the disk specified.\n");
-    printf(" -getallocatedblocks : gets allocated block list on a disk using the \n");
-    printf("specified I/O block size (in sectors).\n");
-    printf(" -check repair: Check a sparse disk for internal consistency, "
-           "where repair is a boolean value to indicate if a repair operation "
-           "should be attempted.\n\n");
+   bool all = true;
+
+   for (uint64 s = 0; s < readSectors; s += VIX_BLOCK_CACHE_BLOCK) {
+      uint64 n = std::min<uint64>(VIX_BLOCK_CACHE_BLOCK, readSectors - s);
+      bool found = disk.fileId != 0 &&
+                   _file.lookup(disk.fileId,
+                                (readSector + s) / VIX_BLOCK_CACHE_BLOCK,
+                                readBuf + s * VIXDISKLIB_SECTOR_SIZE,
+                                n * VIXDISKLIB_SECTOR_SIZE);
+      all = all && found;
+      if (cached != NULL) {
+         cached->push_back(found);
+      } else if (!found) {
+         break;
+      }
+   }
+   return all;
+}
 
-    printf("options:\n");
-    printf(" -adapter [ide|scsi] : bus adapter type for 'create' option "
-           "(default='scsi')\n");
-    printf(" -start n : start sector for 'dump/fill' options (default=0)\n");
-    printf(" -count n : number of sectors for 'dump/fill' options (default=1)\n");
-    printf(" -val byte : byte value to fill with for 'write' option (default=255)\n");
-    printf(" -cap megabytes : capacity in MB for -create option (default=100)\n");
-    printf(" -single : open file as single disk link (default=open entire chain)\n");
-    printf(" -multithread n: start n threads and copy the file to n new files\n");
-    printf(" -host hostname : hostname/IP address of VC/vSphere host (Mandatory)\n");
-    printf(" -user userid : user name on host (Mandatory) \n");
-    printf(" -password password : password on host. (Mandatory)\n");
-    printf(" -cookie cookie : cookie from existing authenticated session on host. (Optional)\n");
-    printf(" -port port : port to use to connect to VC/ESXi host (default = 443) \n");
-    printf(" -nfchostport port : port to use to establish NFC connection to ESXi host (default = 902) \n");
-    printf(" -vm moref=id : id is the managed object reference of the VM \n");
-    printf(" -fcdid id : id is the uuid of the vStorage Object \n");
-    printf(" -ds ds : ds is the managed object reference of the Datastore \n");
-    printf(" -fcdssid ssid : id is the uuid of the snapshot of the vStorage Object \n");
-    printf(" -libdir dir : Folder location of the VDDK installation. "
-           "On Windows, the bin folder holds the plugin.  On Linux, it is "
-           "the lib64 directory\n");
-    printf(" -initex configfile : Specify path and filename of config file \n");
-    printf(" -ssmoref moref : Managed object reference of VM snapshot \n");
-    printf(" -mode mode : Mode string to pass into VixDiskLib_ConnectEx. "
-           "Valid modes are: nbd, nbdssl, san, hotadd \n");
-    printf(" -thumb string : Provides a SSL thumbprint string for validation. "
-           "Format: xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx\n");
-    printf(" -chunksize n : number of sectors as a chunk to query allocated "
-           "blocks\n");
-    printf(" -lssize n : number of logical sector size for -create and -clone option (default = 0) \n");
-    printf(" -pssize n : number of physical sector size for -create and -clone option (default = 0) \n");
-    printf(" -unbuffered: use VIXDISKLIB_FLAG_OPEN_UNBUFFERED flag \n");
 
-    return 1;
+// Stores the blocks of a block aligned read in the cache file.
+void
+BlockCache::fileStore(const Disk& disk, uint64 readSector,
+                      uint64 readSectors, const uint8 *readBuf, uint64 gen)
+{
+   if (disk.fileId == 0) {
+      return;
+   }
+   for (uint64 s = 0; s < readSectors && disk.gen == gen;
+        s += VIX_BLOCK_CACHE_BLOCK) {
+      uint64 n = std::min<uint64>(VIX_BLOCK_CACHE_BLOCK, readSectors - s);
+      _file.store(disk.fileId, (readSector + s) / VIX_BLOCK_CACHE_BLOCK,
+                  readBuf + s * VIXDISKLIB_SECTOR_SIZE,
+                  n * VIXDISKLIB_SECTOR_SIZE);
+   }
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * main --
+ * BlockCache::readBlocks --
  *
- *      Main routine of the program.
+ *      Reads a block aligned range of disk into readBuf. Blocks in the
+ *      cache file are read from it; each run of the others is read with
+ *      one VixDiskLib_Read, under ioLock if given, and stored in the file.
  *
  * Results:
- *      None.
+ *      VixError.
  *
  * Side effects:
  *      None.
@@ -1431,185 +2047,159 @@ PrintUsage(void)
  *--------------------------------------------------------------------------
  */
 
-int
-main(int argc, char* argv[])
+VixError
+BlockCache::readBlocks(VixDiskLibHandle handle,   // IN
+                       const Disk& disk,          // IN
+                       uint64 readSector,         // IN
+                       uint64 readSectors,        // IN
+                       uint8 *readBuf,            // OUT
+                       uint64 gen,                // IN
+                       std::mutex *ioLock)        // IN: optional
 {
-    int retval;
-    bool bVixInit(false);
+   vector<bool> cached;
+   uint64 numBlocks = (readSectors + VIX_BLOCK_CACHE_BLOCK - 1) /
+                      VIX_BLOCK_CACHE_BLOCK;
 
-    memset(&appGlobals, 0, sizeof appGlobals);
-    appGlobals.command = 0;
-    appGlobals.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
-    appGlobals.startSector = 0;
-    appGlobals.numSectors = 1;
-    appGlobals.mbSize = 100;
-    appGlobals.filler = 0xff;
-    appGlobals.openFlags = 0;
-    appGlobals.numThreads = 1;
-    appGlobals.success = TRUE;
-    appGlobals.isRemote = FALSE;
-    appGlobals.cookie = NULL;
-    appGlobals.chunkSize = VIXDISKLIB_MIN_CHUNK_SIZE;
+   if (disk.fileId != 0) {
+      fileLookup(disk, readSector, readSectors, readBuf, &cached);
+   } else {
+      cached.resize(numBlocks, false);
+   }
 
-    retval = ParseArguments(argc, argv);
-    if (retval) {
-        return retval;
-    }
+   for (uint64 i = 0; i < numBlocks; ) {
+      if (cached[i]) {
+         i++;
+         continue;
+      }
+      uint64 j = i + 1;
+      while (j < numBlocks && !cached[j]) {
+         j++;
+      }
+      uint64 s = i * VIX_BLOCK_CACHE_BLOCK;
+      uint64 n = std::min(j * VIX_BLOCK_CACHE_BLOCK, readSectors) - s;
+      VixError vixError;
+      {
+         std::unique_lock<std::mutex> lk;
+         if (ioLock != NULL) {
+            lk = std::unique_lock<std::mutex>(*ioLock);
+         }
+         vixError = VixDiskLib_Read(handle, readSector + s, n,
+                                    readBuf + s * VIXDISKLIB_SECTOR_SIZE);
+      }
+      if (VIX_FAILED(vixError)) {
+         return vixError;
+      }
+      fileStore(disk, readSector + s, n,
+                readBuf + s * VIXDISKLIB_SECTOR_SIZE, gen);
+      i = j;
+   }
+   return VIX_OK;
+}
 
-#ifdef DYNAMIC_LOADING
-    DynLoadDiskLib();
-#endif
 
-    // Initialize random generator
-    struct timeval time;
-    gettimeofday(&time, NULL);
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BlockCache::read --
+ *
+ *      Reads sectors of disk, from the cache where possible. Runs of
+ *      missing blocks are read whole with readBlocks and cached.
+ *
+ * Results:
+ *      VixError.
+ *
+ * Side effects:
+ *      May evict other blocks.
+ *
+ *--------------------------------------------------------------------------
+ */
 
-    srand((time.tv_sec * 1000) + (time.tv_usec/1000));
+VixError
+BlockCache::read(VixDiskLibHandle handle,  // IN
+                 uint64 capacity,          // IN
+                 uint64 sector,            // IN
+                 uint64 numSectors,        // IN
+                 uint8 *buf,               // OUT
+                 std::mutex *ioLock)       // IN: optional
+{
+   if (!enabled() || numSectors == 0 || sector + numSectors > capacity) {
+      std::unique_lock<std::mutex> lk;
+      if (ioLock != NULL) {
+         lk = std::unique_lock<std::mutex>(*ioLock);
+      }
+      return VixDiskLib_Read(handle, sector, numSectors, buf);
+   }
 
-    VixDiskLibConnectParams *cnxParams = VixDiskLib_AllocateConnectParams();
-    VixError vixError;
-    try {
-       if (appGlobals.isRemote) {
-          if (appGlobals.fcdid != NULL) {
-            cnxParams->specType = VIXDISKLIB_SPEC_VSTORAGE_OBJECT;
-            cnxParams->spec.vStorageObjSpec.id = appGlobals.fcdid;
-            cnxParams->spec.vStorageObjSpec.datastoreMoRef = appGlobals.ds;
-            cnxParams->spec.vStorageObjSpec.ssId = appGlobals.fcdssid;
-          } else if (appGlobals.vmxSpec != NULL) {
-            cnxParams->specType = VIXDISKLIB_SPEC_VMX;
-            cnxParams->vmxSpec = appGlobals.vmxSpec;
-          }
-          cnxParams->serverName = appGlobals.host;
-          if (appGlobals.cookie == NULL) {
-             cnxParams->credType = VIXDISKLIB_CRED_UID;
-             cnxParams->creds.uid.password = appGlobals.password;
-             cnxParams->creds.uid.userName = appGlobals.userName;
-          } else {
-            cnxParams->credType = VIXDISKLIB_CRED_SESSIONID;
-            cnxParams->creds.sessionId.cookie = appGlobals.cookie;
-            cnxParams->creds.sessionId.userName = appGlobals.userName;
-            cnxParams->creds.sessionId.key = appGlobals.password;
-          }
-          cnxParams->thumbPrint =
-             (appGlobals.thumbPrint != NULL) ? appGlobals.thumbPrint:NULL;
-          cnxParams->port = appGlobals.port;
-          cnxParams->nfcHostPort = appGlobals.nfcHostPort;
-       }
+   DiskPtr disk = diskOf(handle);
+   uint64 first = sector / VIX_BLOCK_CACHE_BLOCK;
+   uint64 last = (sector + numSectors - 1) / VIX_BLOCK_CACHE_BLOCK;
+   uint64 block = first;
 
-       if (appGlobals.useInitEx) {
-          vixError = VixDiskLib_InitEx(VIXDISKLIB_VERSION_MAJOR,
-                                       VIXDISKLIB_VERSION_MINOR,
-                                       &LogFunc, &WarnFunc, &PanicFunc,
-                                       appGlobals.libdir,
-                                       appGlobals.cfgFile);
-       } else {
-          vixError = VixDiskLib_Init(VIXDISKLIB_VERSION_MAJOR,
-                                     VIXDISKLIB_VERSION_MINOR,
-                                     NULL, NULL, NULL, // Log, warn, panic
-                                     appGlobals.libdir);
-       }
-       CHECK_AND_THROW(vixError);
-       bVixInit = true;
+   while (block <= last) {
+      if (lookup(Key{disk->id, block}, sector, numSectors, buf)) {
+         ++_hits;
+         block++;
+         continue;
+      }
 
-#ifdef FOR_MNTAPI
-       if (appGlobals.useInitEx) {
-          vixError = VixMntapi_Init(VIXMNTAPI_MAJOR_VERSION,
-                                    VIXMNTAPI_MINOR_VERSION,
-                                    &LogFunc, &WarnFunc, &PanicFunc,
-                                    appGlobals.libdir, appGlobals.cfgFile);
-       } else {
-          vixError = VixMntapi_Init(VIXMNTAPI_MAJOR_VERSION,
-                                    VIXMNTAPI_MINOR_VERSION,
-                                    NULL, NULL, NULL,
-                                    appGlobals.libdir, NULL);
-       }
-       CHECK_AND_THROW(vixError);
-#endif
+      // Find the run of missing blocks; the block ending it is copied.
+      uint64 runStart = block++;
+      ++_misses;
+      while (block <= last &&
+             !lookup(Key{disk->id, block}, sector, numSectors, buf)) {
+         ++_misses;
+         block++;
+      }
+      if (block <= last) {
+         ++_hits;
+      }
 
-       if (appGlobals.vmxSpec != NULL || appGlobals.fcdid != NULL) {
-          vixError = VixDiskLib_PrepareForAccess(cnxParams, "Sample");
-          CHECK_AND_THROW(vixError);
-       }
-       if (appGlobals.fcdid == NULL &&
-           appGlobals.ssMoRef == NULL && appGlobals.transportModes == NULL) {
-          vixError = VixDiskLib_Connect(cnxParams,
-                                        &appGlobals.connection);
-       } else {
-          Bool ro = (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY);
-          vixError = VixDiskLib_ConnectEx(cnxParams, ro, appGlobals.ssMoRef,
-                                          appGlobals.transportModes,
-                                          &appGlobals.connection);
-       }
-       CHECK_AND_THROW(vixError);
+      uint64 readSector = runStart * VIX_BLOCK_CACHE_BLOCK;
+      uint64 readSectors = std::min(block * VIX_BLOCK_CACHE_BLOCK,
+                                    capacity) - readSector;
+      std::unique_ptr<uint8[]> readBuf(
+         new uint8[readSectors * VIXDISKLIB_SECTOR_SIZE]);
+      uint64 gen = disk->gen;
+      VixError vixError = readBlocks(handle, *disk, readSector, readSectors,
+                                     readBuf.get(), gen, ioLock);
+      if (VIX_FAILED(vixError)) {
+         return vixError;
+      }
+      fill(*disk, readSector, readSectors, readBuf.get(), gen,
+           sector, numSectors, buf);
+      block++;
+   }
+   return VIX_OK;
+}
 
-        if (appGlobals.command & COMMAND_INFO) {
-            DoInfo();
-        } else if (appGlobals.command & COMMAND_CREATE) {
-            DoCreate();
-        } else if (appGlobals.command & COMMAND_REDO) {
-            DoRedo();
-        } else if (appGlobals.command & COMMAND_FILL) {
-            DoFill();
-        } else if (appGlobals.command & COMMAND_DUMP) {
-            DoDump();
-        } else if (appGlobals.command & COMMAND_READ_META) {
-            DoReadMetadata();
-        } else if (appGlobals.command & COMMAND_WRITE_META) {
-            DoWriteMetadata();
-        } else if (appGlobals.command & COMMAND_DUMP_META) {
-            DoDumpMetadata();
-        } else if (appGlobals.command & COMMAND_MULTITHREAD) {
-            DoTestMultiThread();
-        } else if (appGlobals.command & COMMAND_CLONE) {
-            DoClone();
-        } else if (appGlobals.command & COMMAND_READBENCH) {
-            DoRWBench(true, false);
-        } else if (appGlobals.command & COMMAND_WRITEBENCH) {
-            DoRWBench(false, false);
-        } else if (appGlobals.command & COMMAND_READASYNCBENCH) {
-            DoRWBench(true, true);
-        } else if (appGlobals.command & COMMAND_WRITEASYNCBENCH) {
-            DoRWBench(false, true);
-        } else if (appGlobals.command & COMMAND_CHECKREPAIR) {
-            DoCheckRepair(appGlobals.repair);
-        } else if (appGlobals.command & COMMAND_GET_ALLOCATED_BLOCKS) {
-            DoGetAllocatedBlocks();
-        } else if (appGlobals.command & COMMAND_MOUNT) {
-           DoMntApi();
-        }
 
-        retval = 0;
-    } catch (const VixDiskLibErrWrapper& e) {
-       cout << "Error: [" << e.File() << ":" << e.Line() << "]  " <<
-               std::hex << e.ErrorCode() << " " << e.Description() << "\n";
-       retval = 1;
-    }
+VixError
+BlockCache::read(const VixDisk& disk, uint64 sector, uint64 numSectors,
+                 uint8 *buf, std::mutex *ioLock)
+{
+   return read(disk.Handle(), disk.getInfo()->capacity, sector, numSectors,
+               buf, ioLock);
+}
 
-    if (appGlobals.vmxSpec != NULL || appGlobals.fcdid != NULL) {
-       vixError = VixDiskLib_EndAccess(cnxParams, "Sample");
-    }
-    if (appGlobals.connection != NULL) {
-       VixDiskLib_Disconnect(appGlobals.connection);
-    }
-    VixDiskLib_FreeConnectParams(cnxParams);
-#ifdef FOR_MNTAPI
-    VixMntapi_Exit();
-#endif
-    if (bVixInit) {
-       VixDiskLib_Exit();
-    }
-    return retval;
+
+VixError
+BlockCache::readAsync(const VixDisk& disk, uint64 sector, uint64 numSectors,
+                      uint8 *buf, VixDiskLibCompletionCB cb, void *cbData)
+{
+   return readAsync(disk.Handle(), disk.getInfo()->capacity, sector,
+                    numSectors, buf, cb, cbData);
 }
 
+
 /*
  *--------------------------------------------------------------------------
  *
- * ParseArguments --
+ * BlockCache::write --
  *
- *      Parses the arguments passed on the command line.
+ *      Writes sectors of disk and drops the cached blocks they touch.
  *
  * Results:
- *      None.
+ *      VixError.
  *
  * Side effects:
  *      None.
@@ -1617,469 +2207,11577 @@ main(int argc, char* argv[])
  *--------------------------------------------------------------------------
  */
 
-static int
-ParseArguments(int argc, char* argv[])
+VixError
+BlockCache::write(const VixDisk& disk,      // IN
+                  uint64 sector,            // IN
+                  uint64 numSectors,        // IN
+                  const uint8 *buf,         // IN
+                  std::mutex *ioLock)       // IN: optional
 {
-    int i;
-    if (argc < 3) {
+   VixError vixError;
+   {
+      std::unique_lock<std::mutex> lk;
+      if (ioLock != NULL) {
+         lk = std::unique_lock<std::mutex>(*ioLock);
+      }
+      vixError = VixDiskLib_Write(disk.Handle(), sector, numSectors, buf);
+   }
+   invalidate(disk.Handle(), sector, numSectors);
+   return vixError;
+}
+
+
+void
+BlockCache::ReadDone(void *cbData, VixError result)
+{
+   std::unique_ptr<AsyncIO> io((AsyncIO *)cbData);
+
+   if (!VIX_FAILED(result)) {
+      io->cache->fileStore(*io->disk, io->readSector, io->readSectors,
+                           io->readBuf.get(), io->gen);
+      io->cache->fill(*io->disk, io->readSector, io->readSectors,
+                      io->readBuf.get(), io->gen, io->sector,
+                      io->numSectors, io->buf);
+   }
+   io->cb(io->cbData, result);
+}
+
+
+void
+BlockCache::WriteDone(void *cbData, VixError result)
+{
+   std::unique_ptr<AsyncIO> io((AsyncIO *)cbData);
+
+   io->cache->invalidate(*io->disk, io->sector, io->numSectors);
+   io->cb(io->cbData, result);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BlockCache::readAsync --
+ *
+ *      VixDiskLib_ReadAsync through the cache. If every block is cached
+ *      or in the cache file the request completes right away; otherwise
+ *      the whole blocks around it are read in one go and cached on
+ *      completion. The caller serializes calls on the handle, as for
+ *      VixDiskLib_ReadAsync.
+ *
+ * Results:
+ *      VIX_ASYNC if cb will be called, else the result of the read.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+VixError
+BlockCache::readAsync(VixDiskLibHandle handle,        // IN
+                      uint64 capacity,                // IN
+                      uint64 sector,                  // IN
+                      uint64 numSectors,              // IN
+                      uint8 *buf,                     // OUT
+                      VixDiskLibCompletionCB cb,      // IN
+                      void *cbData)                   // IN
+{
+   if (!enabled() || numSectors == 0 || sector + numSectors > capacity) {
+      return VixDiskLib_ReadAsync(handle, sector, numSectors, buf,
+                                  cb, cbData);
+   }
+
+   DiskPtr disk = diskOf(handle);
+   uint64 first = sector / VIX_BLOCK_CACHE_BLOCK;
+   uint64 last = (sector + numSectors - 1) / VIX_BLOCK_CACHE_BLOCK;
+   uint64 block;
+   for (block = first; block <= last; block++) {
+      if (!lookup(Key{disk->id, block}, sector, numSectors, buf)) {
+         break;
+      }
+   }
+   if (block > last) {
+      _hits += last - first + 1;
+      return VIX_OK;
+   }
+   _misses += last - first + 1;
+
+   std::unique_ptr<AsyncIO> io(new AsyncIO);
+   io->cache = this;
+   io->disk = disk;
+   io->sector = sector;
+   io->numSectors = numSectors;
+   io->buf = buf;
+   io->readSector = first * VIX_BLOCK_CACHE_BLOCK;
+   io->readSectors = std::min((last + 1) * VIX_BLOCK_CACHE_BLOCK,
+                              capacity) - io->readSector;
+   io->readBuf.reset(new uint8[io->readSectors * VIXDISKLIB_SECTOR_SIZE]);
+   io->gen = disk->gen;
+   io->cb = cb;
+   io->cbData = cbData;
+
+   if (fileLookup(*disk, io->readSector, io->readSectors,
+                  io->readBuf.get())) {
+      fill(*disk, io->readSector, io->readSectors, io->readBuf.get(),
+           io->gen, sector, numSectors, buf);
+      return VIX_OK;
+   }
+
+   AsyncIO *ioPtr = io.release();
+   VixError vixError = VixDiskLib_ReadAsync(handle, ioPtr->readSector,
+                                            ioPtr->readSectors,
+                                            ioPtr->readBuf.get(), ReadDone,
+                                            ioPtr);
+   if (vixError != VIX_ASYNC) {
+      io.reset(ioPtr);
+      if (!VIX_FAILED(vixError)) {
+         fill(*disk, io->readSector, io->readSectors, io->readBuf.get(),
+              io->gen, sector, numSectors, buf);
+      }
+   }
+   return vixError;
+}
+
+
+// VixDiskLib_WriteAsync dropping the touched blocks once it completes.
+VixError
+BlockCache::writeAsync(const VixDisk& disk, uint64 sector, uint64 numSectors,
+                       const uint8 *buf, VixDiskLibCompletionCB cb,
+                       void *cbData)
+{
+   if (!enabled()) {
+      return VixDiskLib_WriteAsync(disk.Handle(), sector, numSectors, buf,
+                                   cb, cbData);
+   }
+
+   AsyncIO *io = new AsyncIO;
+   io->cache = this;
+   io->disk = diskOf(disk.Handle());
+   io->sector = sector;
+   io->numSectors = numSectors;
+   io->cb = cb;
+   io->cbData = cbData;
+
+   VixError vixError = VixDiskLib_WriteAsync(disk.Handle(), sector,
+                                             numSectors, buf, WriteDone, io);
+   if (vixError != VIX_ASYNC) {
+      invalidate(*io->disk, sector, numSectors);
+      delete io;
+   }
+   return vixError;
+}
+
+
+// Drops the cached blocks of disk overlapping the given sectors.
+void
+BlockCache::invalidate(Disk& disk, uint64 sector, uint64 numSectors)
+{
+   if (!enabled() || numSectors == 0) {
+      return;
+   }
+   ++disk.gen;
+   uint64 last = (sector + numSectors - 1) / VIX_BLOCK_CACHE_BLOCK;
+   for (uint64 block = sector / VIX_BLOCK_CACHE_BLOCK; block <= last;
+        block++) {
+      if (disk.fileId != 0) {
+         _file.invalidate(disk.fileId, block);
+      }
+      Key key{disk.id, block};
+      Shard& shard = shardOf(key);
+      std::lock_guard<std::mutex> lg(shard.lock);
+      auto it = shard.map.find(key);
+      if (it != shard.map.end()) {
+         shard.bytes -= it->second->data.size();
+         shard.lru.erase(it->second);
+         shard.map.erase(it);
+         ++_invalidations;
+      }
+   }
+}
+
+
+void
+BlockCache::invalidate(VixDiskLibHandle handle, uint64 sector,
+                       uint64 numSectors)
+{
+   if (enabled() && numSectors != 0) {
+      invalidate(*diskOf(handle), sector, numSectors);
+   }
+}
+
+
+/*
+ * Forgets a handle; called when it's closed. The blocks of its disk are
+ * dropped with the last handle of the disk, as nothing tells the cache
+ * about changes made while the disk isn't open.
+ */
+void
+BlockCache::invalidate(VixDiskLibHandle handle)
+{
+   if (!enabled()) {
+      return;
+   }
+   DiskPtr disk;
+   {
+      std::lock_guard<std::mutex> lg(_diskLock);
+      auto it = _handles.find(handle);
+      if (it == _handles.end()) {
+         return;
+      }
+      disk = it->second;
+      _handles.erase(it);
+      if (--disk->handles != 0) {
+         return;
+      }
+      auto d = _disks.find(disk->id);
+      if (d != _disks.end() && d->second == disk) {
+         _disks.erase(d);
+      }
+   }
+   ++disk->gen;
+   drop(disk->id);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BlockCache::printStats --
+ *
+ *      Prints hit / miss / eviction counters and memory use to out.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+BlockCache::printStats(std::ostream& out)
+{
+   uint64 bytes = 0;
+   uint64 blocks = 0;
+
+   for (auto& shard : _shards) {
+      std::lock_guard<std::mutex> lg(shard.lock);
+      bytes += shard.bytes;
+      blocks += shard.lru.size();
+   }
+   out << "Block cache: " << _hits << " hits, " << _misses << " misses, "
+       << _evictions << " evictions, " << _invalidations
+       << " invalidations" << endl;
+   out << "Block cache: " << blocks << " blocks, " << bytes << " of "
+       << _shardBudget * VIX_BLOCK_CACHE_SHARDS << " bytes" << endl;
+   if (_file.isOpen()) {
+      _file.printStats(out);
+   }
+}
+
+
+// Readahead window in sectors when sequential reads are first detected
+#ifndef VIX_READAHEAD_MIN
+#define VIX_READAHEAD_MIN 64
+#endif
+
+// Max readahead window in sectors, grown to while prefetches get used
+#ifndef VIX_READAHEAD_MAX
+#define VIX_READAHEAD_MAX 4096
+#endif
+
+// Max number of readahead windows in flight
+#ifndef VIX_READAHEAD_DEPTH
+#define VIX_READAHEAD_DEPTH 4
+#endif
+
+// Reads with the same forward stride in a row before prefetching starts
+#define READAHEAD_TRIGGER 2
+
+/*
+ * Readahead for one reader of one handle. Reads that keep moving forward
+ * by the same stride are prefetched with VixDiskLib_ReadAsync (through
+ * blockCache) into buffers from a pool of VIX_READAHEAD_DEPTH buffers of
+ * VIX_READAHEAD_MAX sectors. Sequential reads are prefetched in windows
+ * of contiguous sectors, strided reads one predicted read per window.
+ * The window doubles each time a prefetch is used and halves each time
+ * one is thrown away unused, so a reader waiting on round trips ends up
+ * with enough data in flight to keep the transport busy.
+ */
+class ReadAhead
+{
+   public:
+      ReadAhead(VixDiskLibHandle handle, uint64 capacity,
+                BufferPoolInterface<uint8>& pool, std::mutex *ioLock = NULL)
+         : _handle(handle), _capacity(capacity), _pool(pool),
+           _ioLock(ioLock), _lastSector(0), _stride(0), _streak(0),
+           _next(0), _window(VIX_READAHEAD_MIN), _hits(0), _misses(0),
+           _windows(0), _wasted(0)
+      {}
+
+      ~ReadAhead()
+      {
+         while (!_inFlight.empty()) {
+            retire(false);
+         }
+      }
+
+      VixError read(uint64 sector, uint64 numSectors, uint8 *buf);
+      void printStats(std::ostream& out = cout);
+
+   private:
+      struct Window {
+         uint64 sector;
+         uint64 numSectors;
+         uint8 *buf;
+         std::atomic<bool> ready;
+         VixError vixError;
+         bool used;
+      };
+
+      void prefetch(uint64 numSectors);
+      bool wait(Window& win);
+      void retire(bool adapt);
+      static void WindowDone(void *cbData, VixError result);
+
+      VixDiskLibHandle _handle;
+      uint64 _capacity;
+      BufferPoolInterface<uint8>& _pool;
+      std::mutex *_ioLock;
+      uint64 _lastSector;
+      int64 _stride;
+      unsigned _streak;
+      uint64 _next;          // first sector not prefetched yet
+      uint64 _window;        // sectors
+      std::deque<std::unique_ptr<Window>> _inFlight;
+      uint64 _hits;
+      uint64 _misses;
+      uint64 _windows;
+      uint64 _wasted;
+};
+
+
+void
+ReadAhead::WindowDone(void *cbData, VixError result)
+{
+   Window *win = (Window *)cbData;
+
+   win->vixError = result;
+   win->ready = true;
+}
+
+
+// Waits for a window to be read; false if the read failed.
+bool
+ReadAhead::wait(Window& win)
+{
+   if (!win.ready) {
+      std::unique_lock<std::mutex> lk;
+      if (_ioLock != NULL) {
+         lk = std::unique_lock<std::mutex>(*_ioLock);
+      }
+      VixDiskLib_Wait(_handle);
+   }
+   while (!win.ready) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+   }
+   return !VIX_FAILED(win.vixError);
+}
+
+
+// Drops the oldest window; with adapt, sizes the window by whether it was used.
+void
+ReadAhead::retire(bool adapt)
+{
+   Window& win = *_inFlight.front();
+
+   wait(win);
+   if (!win.used) {
+      ++_wasted;
+   }
+   if (adapt) {
+      _window = win.used ? std::min<uint64>(_window * 2, VIX_READAHEAD_MAX)
+                         : std::max<uint64>(_window / 2, VIX_READAHEAD_MIN);
+   }
+   _pool.returnBuffer(win.buf);
+   _inFlight.pop_front();
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ReadAhead::prefetch --
+ *
+ *      Starts reading ahead of the reader, up to VIX_READAHEAD_DEPTH
+ *      windows: whole windows for sequential reads, or the next reads of
+ *      numSectors each for strided reads.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+ReadAhead::prefetch(uint64 numSectors)
+{
+   bool sequential = (uint64)_stride == numSectors;
+
+   if (numSectors > VIX_READAHEAD_MAX) {
+      return;
+   }
+   // Whole reads per window, so that no read straddles two windows.
+   uint64 windowSectors = std::max(numSectors,
+                                   _window / numSectors * numSectors);
+   // Strided readers get one read in flight per VIX_READAHEAD_MIN of window.
+   size_t depth = sequential ? VIX_READAHEAD_DEPTH :
+                  std::min<size_t>(VIX_READAHEAD_DEPTH,
+                                   _window / VIX_READAHEAD_MIN);
+
+   while (_inFlight.size() < depth && _next < _capacity) {
+      std::unique_ptr<Window> win(new Window);
+      win->sector = _next;
+      win->numSectors = std::min(sequential ? windowSectors : numSectors,
+                                 _capacity - _next);
+      win->buf = _pool.getBuffer();
+      win->ready = false;
+      win->vixError = VIX_OK;
+      win->used = false;
+      _next += sequential ? win->numSectors : _stride;
+
+      VixError vixError;
+      {
+         std::unique_lock<std::mutex> lk;
+         if (_ioLock != NULL) {
+            lk = std::unique_lock<std::mutex>(*_ioLock);
+         }
+         vixError = blockCache.readAsync(_handle, _capacity, win->sector,
+                                         win->numSectors, win->buf,
+                                         WindowDone, win.get());
+      }
+      if (vixError != VIX_ASYNC) {
+         win->vixError = vixError;
+         win->ready = true;
+      }
+      ++_windows;
+      _inFlight.push_back(std::move(win));
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ReadAhead::read --
+ *
+ *      Reads sectors like VixDiskLib_Read, from a prefetched window when
+ *      one holds them, and updates the access pattern.
+ *
+ * Results:
+ *      VixError.
+ *
+ * Side effects:
+ *      Starts, retires or drops readahead windows.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+VixError
+ReadAhead::read(uint64 sector,         // IN
+                uint64 numSectors,     // IN
+                uint8 *buf)            // OUT
+{
+   int64 stride = (int64)(sector - _lastSector);
+
+   if (stride > 0 && stride == _stride) {
+      _streak++;
+   } else {
+      // The pattern changed: nothing in flight is going to be used.
+      while (!_inFlight.empty()) {
+         retire(false);
+      }
+      _window = VIX_READAHEAD_MIN;
+      _stride = stride;
+      _streak = 0;
+      _next = sector;
+   }
+   _lastSector = sector;
+
+   // Windows the reader has moved past are done with.
+   while (!_inFlight.empty() &&
+          _inFlight.front()->sector + _inFlight.front()->numSectors <=
+          sector) {
+      retire(true);
+   }
+
+   VixError vixError = VIX_E_FAIL;
+   bool hit = false;
+   if (!_inFlight.empty() && _inFlight.front()->sector <= sector &&
+       sector + numSectors <=
+       _inFlight.front()->sector + _inFlight.front()->numSectors) {
+      Window& win = *_inFlight.front();
+      if (wait(win)) {
+         memcpy(buf,
+                win.buf + (sector - win.sector) * VIXDISKLIB_SECTOR_SIZE,
+                numSectors * VIXDISKLIB_SECTOR_SIZE);
+         win.used = true;
+         vixError = VIX_OK;
+         hit = true;
+         ++_hits;
+      }
+   }
+   if (!hit) {
+      ++_misses;
+      vixError = blockCache.read(_handle, _capacity, sector, numSectors, buf,
+                                 _ioLock);
+   }
+
+   if (_streak + 1 >= READAHEAD_TRIGGER) {
+      while (_next < sector + numSectors) {
+         _next += _stride;
+      }
+      prefetch(numSectors);
+   }
+   return vixError;
+}
+
+
+void
+ReadAhead::printStats(std::ostream& out)
+{
+   out << "Readahead: " << _hits << " hits, " << _misses << " misses, "
+       << _windows << " windows (" << _wasted << " unused), window "
+       << _window << " sectors" << endl;
+}
+
+template <int V>
+using INT_TYPE = std::integral_constant<int, V>;
+
+template <typename T1, typename T2, typename N = INT_TYPE<1>>
+struct sizeT
+{
+   enum
+   {
+      value = std::conditional_t<(sizeof(T1) > sizeof(T2[N::value])),
+                                 sizeT<T1, T2, INT_TYPE<N::value+1>>,
+                                 INT_TYPE<N::value>>::value
+   };
+};
+
+class ThreadLock
+{
+   public:
+      void lock()
+      {
+         _mutex.lock();
+      }
+      void unlock()
+      {
+         _mutex.unlock();
+      }
+      bool wait()
+      {
+         _cond.wait(_mutex);
+         return true;
+      }
+      void notify()
+      {
+         _cond.notify_all();
+      }
+   private:
+      std::mutex _mutex;
+      std::condition_variable_any _cond;
+};
+
+struct FakeLock
+{
+   void lock() {}
+   void unlock() {}
+   bool wait()
+   {
+      return false;
+   }
+
+   void notify() {}
+};
+
+
+template <typename T>
+struct NotAlignedAlloc
+{
+   using ptr_type = std::unique_ptr<T[]>;
+   ptr_type allocBuf(size_t size);
+};
+
+template <typename T>
+typename NotAlignedAlloc<T>::ptr_type NotAlignedAlloc<T>::allocBuf(size_t size)
+{
+   return ptr_type(new T[size]);
+}
+
+template <typename T>
+class AlignedAlloc
+{
+   public:
+      using ptr_type = std::unique_ptr<T, std::function<void(T*)>>;
+      explicit AlignedAlloc(uint32 align) : alignment(align) {}
+      ptr_type allocBuf(size_t size);
+
+   private:
+      uint32 alignment;
+};
+
+template <typename T>
+typename AlignedAlloc<T>::ptr_type AlignedAlloc<T>::allocBuf(size_t size)
+{
+   auto del = [] (T* buf_p) {
+#ifdef _WIN32
+      _aligned_free(static_cast<void*>(buf_p));
+#else
+      free(buf_p);
+#endif
+   };
+   void* buf = NULL;
+   int err;
+
+#ifdef _WIN32
+   buf = _aligned_malloc(sizeof(T) * size, alignment);
+   _get_errno(&err);
+#else
+   err = posix_memalign((void**) &buf, alignment, sizeof(T) * size);
+#endif
+
+   if (buf == nullptr) {
+      THROW_ERROR(VIX_E_OUT_OF_MEMORY);
+   }
+
+   return ptr_type(static_cast<T*>(buf), del);
+}
+
+template <size_t SIZE, typename TYPE = char, typename LOCK = FakeLock,
+          typename ALLOC = NotAlignedAlloc<TYPE>>
+class BufferPool : public BufferPoolInterface<TYPE>,  private LOCK
+{
+   using Buffer = std::vector<typename ALLOC::ptr_type>;
+   using Pool = std::list<TYPE*>;
+   using PoolIt = int;
+   using LockGrd = std::lock_guard<LOCK>;
+
+   public:
+      explicit BufferPool(size_t bufSize)
+         : _bufSize(bufSize)
+      {
+         initPool();
+      }
+
+      BufferPool(size_t bufSize, ALLOC&& alloc)
+         : _bufSize(bufSize), _alloc(std::forward<ALLOC>(alloc))
+      {
+         initPool();
+      }
+
+      BufferPool(size_t bufSize, ALLOC&& alloc, LOCK&& lock)
+         : LOCK(std::forward<LOCK>(lock)), _bufSize(bufSize),
+           _alloc(std::forward<ALLOC>(alloc))
+      {
+         initPool();
+      }
+
+      ~BufferPool()
+      {
+         LockGrd lg(*this);
+         while (inPool.size() != SIZE) {
+            if (!LOCK::wait()) {
+               break;
+            }
+         }
+      }
+
+      size_t size() const
+      {
+         return SIZE;
+      }
+
+      TYPE * getBuffer()
+      {
+         TYPE * buf = NULL;
+         {
+            LockGrd lg(*this);
+            while (inPool.empty()) {
+               if (!LOCK::wait()) {
+                  return buf;
+               }
+            }
+            buf = inPool.front();
+            inPool.pop_front();
+         }
+         return buf;
+      }
+      void returnBuffer(TYPE * buf)
+      {
+         PoolIt it =
+            *(reinterpret_cast<PoolIt*>(buf + _bufSize));
+         TYPE *rawBuf = (_buf.at(it)).get();
+         {
+            LockGrd lg(*this);
+            inPool.push_back(rawBuf);
+         }
+         LOCK::notify();
+      }
+
+      std::vector<TYPE*> buffers() const
+      {
+         std::vector<TYPE*> bufs;
+         for (const auto& buf : _buf) {
+            bufs.push_back(buf.get());
+         }
+         return bufs;
+      }
+
+      size_t bufferSize() const
+      {
+         return _bufSize;
+      }
+
+   private:
+
+      void initPool()
+      {
+         for (unsigned int i = 0 ; i < SIZE ; ++i) {
+            try {
+               auto buf = _alloc.allocBuf(_bufSize+sizeT<PoolIt, TYPE>::value);
+               inPool.push_front(buf.get());
+               PoolIt * it = reinterpret_cast<PoolIt*>(buf.get()+_bufSize);
+               *it = i;
+               _buf.push_back(std::move(buf));
+            } catch (...) {
+               throw;
+            }
+         }
+      }
+
+      Pool inPool;
+      Buffer _buf;
+      size_t _bufSize;
+      ALLOC _alloc;
+};
+
+// specialization for unlimited size buffer pool
+template<typename TYPE, typename LOCK, typename ALLOC>
+class BufferPool<std::numeric_limits<size_t>::max(), TYPE, LOCK, ALLOC>
+   : public BufferPoolInterface<TYPE> {
+public:
+   using Buffer = std::map<TYPE *, typename ALLOC::ptr_type>;
+
+   explicit BufferPool(size_t bz) : _bufSize(bz) {}
+
+   BufferPool(size_t bz, ALLOC&& alloc)
+      : _bufSize(bz), _alloc(std::forward<ALLOC>(alloc)) {}
+
+   ~BufferPool() {}
+
+   size_t size() { return std::numeric_limits<size_t>::max(); }
+
+   TYPE *getBuffer() {
+      TYPE *buffer;
+      auto buf = _alloc.allocBuf(_bufSize);
+
+      buffer = buf.get();
+
+      _buf[buffer] = std::move(buf);
+
+      return buffer;
+   }
+
+   void returnBuffer(TYPE *buf) {
+      if (!_buf.erase(buf)) {
+         assert(0);
+      }
+   }
+
+private:
+   size_t _bufSize;
+   Buffer _buf;
+   ALLOC _alloc;
+};
+
+#ifndef VIX_AIO_BUFPOOL_SIZE
+#define VIX_AIO_BUFPOOL_SIZE 256
+#endif
+
+template <typename Pool>
+class AioCBData
+{
+   public:
+      AioCBData(typename Pool::type * b, Pool& pool)
+         : buf(b), aioBufPool(pool)
+      {}
+
+      void returnBuffer()
+      {
+         aioBufPool.returnBuffer(buf);
+      }
+   private:
+      typename Pool::type * buf;
+      Pool& aioBufPool;
+};
+
+template <typename CB>
+static void AioCB(void * cbData, VixError err)
+{
+   CB* pCB = static_cast<CB*>(cbData);
+   if (pCB == NULL) return;
+
+   pCB->returnBuffer();
+   delete pCB;
+
+#ifdef AIO_PERF_DEBUG
+   static int count = 0;
+   if (++count % 20 == 0)
+   {
+      cout << ".";
+      cout.flush();
+   }
+#endif
+}
+
+class TaskExecutor
+{
+   public:
+      template <typename T>
+      TaskExecutor(size_t parallel_size, T task)
+      {
+         m_threads.reserve(parallel_size);
+         for (size_t i = 0 ; i < parallel_size ; ++i) {
+            m_threads.emplace_back(task);
+         }
+      }
+
+      ~TaskExecutor()
+      {
+         for (auto& t : m_threads) {
+            t.join();
+         }
+      }
+
+   private:
+      std::vector<std::thread> m_threads;
+};
+
+class DiskIOPipeline
+{
+      using LockGrd = std::lock_guard<ThreadLock>;
+   public:
+      explicit DiskIOPipeline(size_t work_size)
+         : _exit(false), _globals(curGlobals),
+           _taskExec(1, [this] () {openCloseDisk();})
+      {
+      }
+
+      ~DiskIOPipeline()
+      {
+         _exit = true;
+         _diskInfosLock.notify();
+         // wait for _taskExec exit
+      }
+
+      void read(VixDiskLibConnection connection,
+                const char *path, uint32 flags, int id, bool async)
+      {
+         {
+            LockGrd lock(_diskInfosLock);
+            DiskInfo di = {connection, path, flags, id, true, async};
+            _diskInfos.push_back(di);
+         }
+         _diskInfosLock.notify();
+      }
+
+      void write(VixDiskLibConnection connection,
+                 const char *path, uint32 flags, int id, bool async)
+      {
+         {
+            LockGrd lock(_diskInfosLock);
+            DiskInfo di = {connection, path, flags, id, false, async};
+            _diskInfos.push_back(di);
+         }
+         _diskInfosLock.notify();
+      }
+
+   private:
+      struct DiskInfo {
+         VixDiskLibConnection _conn;
+         const char *         _path;
+         uint32               _flags;
+         int                  _id;
+         bool                 _read;
+         bool                 _async;
+      };
+
+      void openDisks(std::deque<DiskInfo>& diskInfos)
+      {
+         for (const auto& diskInfo : diskInfos) {
+            try {
+               DiskIO(diskInfo._conn, diskInfo._path,
+                      diskInfo._flags, diskInfo._id,
+                      [this, async = diskInfo._async, read = diskInfo._read]
+                      (auto disk) {
+                         (async) ? aio(disk, read) : io(disk, read);
+                      });
+            } catch (...) {
+               // in case any error just skip that disk and continue the next
+            }
+         }
+      }
+
+      void closeDisks();
+
+      template <typename IOFunc>
+      void DiskIO(VixDiskLibConnection connection,
+                    const char *path, uint32 flags, int id, IOFunc ioFunc)
+      {
+         auto disk = std::make_shared<VixDisk>(connection, path, flags, id);
+         auto fut = std::async(
+#ifdef _DEBUG
+                               std::launch::deferred,
+#else
+                               std::launch::async,
+#endif
+                               [disk, ioFunc, globals = _globals] ()
+                                     -> VixDisk::Ptr {
+                                 GlobalsScope gs(globals);
+                                 ioFunc(disk);
+                                 return disk;
+                               });
+         _diskIOs.push_front(std::move(fut));
+      }
+
+      void io(VixDisk::Ptr disk, bool read);
+      void doIO(BufferPoolInterface<uint8>& bufPool,
+                VixDisk::Ptr disk, bool read, size_t bufSize);
+      void aio(VixDisk::Ptr disk, bool read);
+      void doAIO(BufferPoolInterface<uint8>& bufPool,
+                 VixDisk::Ptr disk, bool read, size_t bufSize);
+
+      void
+      openCloseDisk()
+      {
+         GlobalsScope gs(_globals);
+         while (true) {
+            decltype(_diskInfos) diskInfos;
+            {
+               LockGrd lock(_diskInfosLock);
+               while (_diskInfos.empty() && _diskIOs.empty()) {
+                  if (_exit) {
+                     return;
+                  }
+                  _diskInfosLock.wait();
+               }
+               _diskInfos.swap(diskInfos);
+            }
+            openDisks(diskInfos);
+            closeDisks();
+         }
+      }
+
+      std::deque<DiskInfo> _diskInfos;
+      std::forward_list<std::future<VixDisk::Ptr>> _diskIOs;
+      ThreadLock _diskInfosLock;
+      std::atomic<bool> _exit;
+      AppGlobals *_globals;
+      TaskExecutor _taskExec; // must keep as last member
+};
+
+void
+DiskIOPipeline::closeDisks()
+{
+   // In order not to block on the first future,
+   // check each future
+   for (auto &fut : _diskIOs) {
+      if (fut.valid() && fut.wait_for(std::chrono::milliseconds(100)) ==
+#ifdef _DEBUG
+         std::future_status::deferred
+#else
+         std::future_status::ready
+#endif
+         ) {
+         try {
+            auto disk = fut.get();
+            disk.reset(); // release/close the disk
+         } catch (...) {
+            // continue for the next disk IO
+         }
+      }
+   }
+   _diskIOs.remove_if([] (const auto& fut) {return !fut.valid();});
+}
+
+void DiskIOPipeline::io(VixDisk::Ptr disk, bool read)
+{
+   size_t bufSize;
+   if (Globals().bufSize == 0) {
+      Globals().bufSize = DEFAULT_BUFSIZE;
+   }
+   bufSize = Globals().bufSize * VIXDISKLIB_SECTOR_SIZE;
+
+   auto bufPool =
+      getBufferPool<std::numeric_limits<size_t>::max(), uint8, FakeLock>(
+         *disk, bufSize);
+   doIO(*bufPool, disk, read, bufSize);
+}
+
+void DiskIOPipeline::doIO(BufferPoolInterface<uint8>& bufPool,
+                          VixDisk::Ptr disk, bool read, size_t bufSize)
+{
+   const VixDiskLibInfo *info;
+   uint32 maxOps, i;
+   uint32 bufUpdate;
+   auto buf = bufPool.getBuffer();
+
+   info = disk->getInfo();
+
+   maxOps = info->capacity / Globals().bufSize;
+
+   std::ostringstream prefix;
+   prefix << "Disk[" << disk->getId() << "] - ";
+   std::cout << prefix.str() <<  "Processing "
+             << maxOps << " buffers of " << bufSize << " bytes." << std::endl;
+
+   if (!read) {
+      InitBuffer((uint32*)buf, bufSize / sizeof(uint32));
+   }
+
+   auto total = std::chrono::system_clock::now();
+   decltype(total) end, start;
+
+   start = total;
+   bufUpdate = 0;
+   JobAddTotal((uint64)maxOps * Globals().bufSize);
+   for (i = 0; i < maxOps; i++) {
+      VixError vixError;
+
+      if (read) {
+         vixError = blockCache.read(*disk,
+               i * Globals().bufSize,
+               Globals().bufSize, buf);
+      } else {
+         vixError = blockCache.write(*disk,
+               i * Globals().bufSize,
+               Globals().bufSize, buf);
+      }
+
+      CHECK_AND_THROW(vixError);
+      vixError = JobAdvance(Globals().bufSize);
+      CHECK_AND_THROW(vixError);
+
+      bufUpdate += Globals().bufSize;
+      if (bufUpdate >= BUFS_PER_STAT) {
+         end = std::chrono::system_clock::now();
+         PrintStat(read, start, end, bufUpdate,
+                   VIXDISKLIB_SECTOR_SIZE, prefix.str());
+         start = end;
+         bufUpdate = 0;
+      }
+   }
+   end = std::chrono::system_clock::now();
+   PrintStat(read, total, end, Globals().bufSize * maxOps,
+             VIXDISKLIB_SECTOR_SIZE, prefix.str());
+   bufPool.returnBuffer(buf);
+}
+
+void DiskIOPipeline::aio(VixDisk::Ptr disk, bool read)
+{
+   size_t bufSize = Globals().bufSize * VIXDISKLIB_SECTOR_SIZE;
+   auto bufPool = getBufferPool<VIX_AIO_BUFPOOL_SIZE, uint8, ThreadLock>
+                     (*disk, bufSize);
+   doAIO(*bufPool, disk, read, bufSize);
+}
+
+void DiskIOPipeline::doAIO(BufferPoolInterface<uint8>& bufPool,
+                           VixDisk::Ptr disk, bool read, size_t bufSize)
+{
+   const VixDiskLibInfo *info = disk->getInfo();
+   uint32 maxOps = info->capacity / Globals().bufSize;
+
+   std::ostringstream prefix;
+   prefix << "Disk[" << disk->getId() << "] - ";
+   std::cout << prefix.str() <<  "Processing "
+             << maxOps << " buffers of " << bufSize << " bytes." << std::endl;
+
+   auto start = std::chrono::system_clock::now();
+   decltype(start) end;
+   JobAddTotal((uint64)maxOps * Globals().bufSize);
+   for (uint32 i = 0; i < maxOps; i++) {
+      VixError vixError;
+
+      vixError = JobAdvance(Globals().bufSize);
+      if (VIX_FAILED(vixError)) {
+         // Drain what is in flight before the buffers go away.
+         VixDiskLib_Wait(disk->Handle());
+         THROW_ERROR(vixError);
+      }
+      auto buf = bufPool.getBuffer();
+      AioCBData<BufferPoolInterface<uint8>> *
+         cbd = new AioCBData<BufferPoolInterface<uint8>>(buf, bufPool);
+      if (read) {
+         vixError = VixDiskLib_ReadAsync(disk->Handle(),
+               i * Globals().bufSize, Globals().bufSize, buf,
+               AioCB<AioCBData<BufferPoolInterface<uint8>> >, cbd);
+      } else {
+         InitBuffer((uint32*)buf, bufSize / sizeof(uint32));
+         vixError = VixDiskLib_WriteAsync(disk->Handle(),
+               i * Globals().bufSize, Globals().bufSize, buf,
+               AioCB<AioCBData<BufferPoolInterface<uint8>> >, cbd);
+      }
+   }
+   cout << prefix.str() << "sent all data requests!" << endl;
+   VixDiskLib_Wait(disk->Handle());
+   end = std::chrono::system_clock::now();
+   PrintStat(read, start, end, Globals().bufSize * maxOps,
+             VIXDISKLIB_SECTOR_SIZE, prefix.str());
+}
+
+// Max number of idle connections kept per connection spec
+#ifndef VIX_CONNPOOL_MAX_IDLE
+#define VIX_CONNPOOL_MAX_IDLE 4
+#endif
+
+// Idle connections older than this (in seconds) are not handed out again
+#ifndef VIX_CONNPOOL_IDLE_TIMEOUT
+#define VIX_CONNPOOL_IDLE_TIMEOUT 300
+#endif
+
+// Remote connections idle for longer than this (in seconds) are probed
+#ifndef VIX_CONNPOOL_PROBE_AFTER
+#define VIX_CONNPOOL_PROBE_AFTER 30
+#endif
+
+// Everything that VixDiskLib_Connect(Ex) takes into account.
+struct ConnectSpec
+{
+   bool isRemote;
+   string host;
+   string userName;
+   string password;
+   string cookie;
+   string thumbPrint;
+   int port;
+   int nfcHostPort;
+   string vmxSpec;
+   string fcdid;
+   string fcdssid;
+   string ds;
+   string ssMoRef;
+   string transportModes;
+   bool readOnly;
+
+   static ConnectSpec FromGlobals();
+   static ConnectSpec Local();
+
+   bool NeedsAccess() const
+   {
+      return !vmxSpec.empty() || !fcdid.empty();
+   }
+
+   bool UseConnectEx() const
+   {
+      return !fcdid.empty() || !ssMoRef.empty() || !transportModes.empty();
+   }
+
+   string Key() const;
+};
+
+static string
+CStr(const char *s)
+{
+   return s == NULL ? string() : string(s);
+}
+
+static char *
+CStrOrNull(const string& s)
+{
+   return s.empty() ? NULL : const_cast<char *>(s.c_str());
+}
+
+ConnectSpec
+ConnectSpec::FromGlobals()
+{
+   ConnectSpec spec;
+   spec.isRemote = Globals().isRemote;
+   spec.host = CStr(Globals().host);
+   spec.userName = CStr(Globals().userName);
+   spec.password = CStr(Globals().password);
+   spec.cookie = CStr(Globals().cookie);
+   spec.thumbPrint = CStr(Globals().thumbPrint);
+   spec.port = Globals().port;
+   spec.nfcHostPort = Globals().nfcHostPort;
+   spec.vmxSpec = CStr(Globals().vmxSpec);
+   spec.fcdid = CStr(Globals().fcdid);
+   spec.fcdssid = CStr(Globals().fcdssid);
+   spec.ds = CStr(Globals().ds);
+   spec.ssMoRef = CStr(Globals().ssMoRef);
+   spec.transportModes = CStr(Globals().transportModes);
+   spec.readOnly = (Globals().openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY) != 0;
+   return spec;
+}
+
+ConnectSpec
+ConnectSpec::Local()
+{
+   ConnectSpec spec;
+   spec.isRemote = false;
+   spec.port = 0;
+   spec.nfcHostPort = 0;
+   spec.readOnly = false;
+   return spec;
+}
+
+string
+ConnectSpec::Key() const
+{
+   std::ostringstream key;
+   auto field = [&key] (const string& s) {
+      key << s.size() << ':' << s << '|';
+   };
+
+   if (!isRemote) {
+      key << "local|";
+   } else {
+      field(host);
+      field(userName);
+      field(password);
+      field(cookie);
+      field(thumbPrint);
+      key << port << '|' << nfcHostPort << '|';
+      field(vmxSpec);
+      field(fcdid);
+      field(fcdssid);
+      field(ds);
+   }
+   // readOnly, snapshot and transport only matter for VixDiskLib_ConnectEx
+   if (UseConnectEx()) {
+      field(ssMoRef);
+      field(transportModes);
+      key << (readOnly ? "ro" : "rw");
+   }
+   return key.str();
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * AllocConnectParams --
+ *
+ *      Builds VixDiskLib connection parameters for a connection spec. The
+ *      strings are referenced, not copied, so the spec must outlive the
+ *      returned parameters.
+ *
+ * Results:
+ *      Connection parameters, free with VixDiskLib_FreeConnectParams.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static VixDiskLibConnectParams *
+AllocConnectParams(const ConnectSpec& spec)
+{
+   VixDiskLibConnectParams *cnxParams = VixDiskLib_AllocateConnectParams();
+   if (cnxParams == NULL) {
+      THROW_ERROR(VIX_E_OUT_OF_MEMORY);
+   }
+   if (spec.isRemote) {
+      if (!spec.fcdid.empty()) {
+         cnxParams->specType = VIXDISKLIB_SPEC_VSTORAGE_OBJECT;
+         cnxParams->spec.vStorageObjSpec.id = CStrOrNull(spec.fcdid);
+         cnxParams->spec.vStorageObjSpec.datastoreMoRef = CStrOrNull(spec.ds);
+         cnxParams->spec.vStorageObjSpec.ssId = CStrOrNull(spec.fcdssid);
+      } else if (!spec.vmxSpec.empty()) {
+         cnxParams->specType = VIXDISKLIB_SPEC_VMX;
+         cnxParams->vmxSpec = CStrOrNull(spec.vmxSpec);
+      }
+      cnxParams->serverName = CStrOrNull(spec.host);
+      if (spec.cookie.empty()) {
+         cnxParams->credType = VIXDISKLIB_CRED_UID;
+         cnxParams->creds.uid.password = CStrOrNull(spec.password);
+         cnxParams->creds.uid.userName = CStrOrNull(spec.userName);
+      } else {
+         cnxParams->credType = VIXDISKLIB_CRED_SESSIONID;
+         cnxParams->creds.sessionId.cookie = CStrOrNull(spec.cookie);
+         cnxParams->creds.sessionId.userName = CStrOrNull(spec.userName);
+         cnxParams->creds.sessionId.key = CStrOrNull(spec.password);
+      }
+      cnxParams->thumbPrint = CStrOrNull(spec.thumbPrint);
+      cnxParams->port = spec.port;
+      cnxParams->nfcHostPort = spec.nfcHostPort;
+   }
+   return cnxParams;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * IsConnectionError --
+ *
+ *      Tells whether an error means the connection itself is unusable,
+ *      as opposed to an error with a particular disk or request.
+ *
+ * Results:
+ *      true if the connection should not be reused.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+IsConnectionError(VixError vixError)
+{
+   switch (vixError & 0xFFFF) {
+   case VIX_E_HOST_NOT_CONNECTED:
+   case VIX_E_VM_HOST_DISCONNECTED:
+   case VIX_E_AUTHENTICATION_FAIL:
+   case VIX_E_HOST_CONNECTION_LOST:
+   case VIX_E_INVALID_AUTHENTICATION_SESSION:
+   case VIX_E_HOST_NETWORK_CONN_REFUSED:
+   case VIX_E_HOST_TCP_CONN_LOST:
+   case VIX_E_DISK_INVALID_CONNECTION:
+   case VIX_E_CANNOT_CONNECT_TO_HOST:
+   case VIX_E_NET_HTTP_COULDNT_CONNECT:
+   case VIX_E_NET_HTTP_SSL_CONNECT_ERROR:
+      return true;
+   default:
+      return false;
+   }
+}
+
+class ConnectionPool
+{
+   using Clock = std::chrono::steady_clock;
+
+   public:
+      class Lease
+      {
+         public:
+            Lease() : _pool(NULL), _conn(NULL), _broken(false) {}
+
+            Lease(ConnectionPool *pool, const string& key,
+                  VixDiskLibConnection conn)
+               : _pool(pool), _key(key), _conn(conn), _broken(false)
+            {}
+
+            Lease(Lease&& other)
+               : _pool(other._pool), _key(std::move(other._key)),
+                 _conn(other._conn), _broken(other._broken)
+            {
+               _path = std::move(other._path);
+               other._pool = NULL;
+               other._conn = NULL;
+            }
+
+            Lease& operator=(Lease&& other)
+            {
+               if (this != &other) {
+                  release();
+                  _pool = other._pool;
+                  _key = std::move(other._key);
+                  _conn = other._conn;
+                  _broken = other._broken;
+                  _path = std::move(other._path);
+                  other._pool = NULL;
+                  other._conn = NULL;
+               }
+               return *this;
+            }
+
+            Lease(const Lease&) = delete;
+            Lease& operator=(const Lease&) = delete;
+
+            ~Lease()
+            {
+               release();
+            }
+
+            VixDiskLibConnection get() const
+            {
+               return _conn;
+            }
+
+            // Remembers a disk opened on the connection for isHealthy.
+            void opened(const string& path)
+            {
+               _path = path;
+            }
+
+            // Don't give the connection back to the pool if it failed.
+            void checkError(VixError vixError)
+            {
+               if (IsConnectionError(vixError)) {
+                  _broken = true;
+               }
+            }
+
+            void release()
+            {
+               if (_pool != NULL && _conn != NULL) {
+                  _pool->giveBack(_key, _conn, _path, _broken);
+               }
+               _pool = NULL;
+               _conn = NULL;
+            }
+
+         private:
+            ConnectionPool *_pool;
+            string _key;
+            VixDiskLibConnection _conn;
+            string _path;
+            bool _broken;
+      };
+
+      ConnectionPool()
+         : _hits(0), _misses(0), _expired(0), _unhealthy(0), _connects(0),
+           _connectTimeTotal(0), _connectTimeMax(0)
+      {}
+
+      Lease acquire(const ConnectSpec& spec);
+      void clear();
+      void printStats(std::ostream& out = cout);
+      bool specOf(VixDiskLibConnection conn, ConnectSpec& spec);
+
+   private:
+      struct Idle {
+         VixDiskLibConnection _conn;
+         Clock::time_point    _since;
+         string               _path;    // a disk opened on it, or empty
+      };
+
+      struct Slot {
+         Slot() : _params(NULL), _prepared(false) {}
+
+         ConnectSpec              _spec;
+         VixDiskLibConnectParams *_params;
+         std::atomic<bool>        _prepared;  // set under _connectLock
+         std::deque<Idle>         _idle;
+      };
+
+      bool isHealthy(const Slot& slot, const Idle& idle);
+      VixDiskLibConnection connect(Slot& slot);
+      void giveBack(const string& key, VixDiskLibConnection conn,
+                    const string& path, bool broken);
+
+      void forget(VixDiskLibConnection conn)
+      {
+         std::lock_guard<std::mutex> lg(_lock);
+         _connSpecs.erase(conn);
+      }
+
+      std::mutex _lock;
+      // VixDiskLib connect/prepare calls are serialized
+      std::mutex _connectLock;
+      std::map<string, Slot> _slots;
+      // Spec of every pooled connection, leased or idle
+      std::map<VixDiskLibConnection, const ConnectSpec *> _connSpecs;
+
+      uint64 _hits;
+      uint64 _misses;
+      uint64 _expired;
+      uint64 _unhealthy;
+      uint64 _connects;
+      uint64 _connectTimeTotal; // usec
+      uint64 _connectTimeMax;   // usec
+};
+
+static ConnectionPool connPool;
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ConnectionPool::acquire --
+ *
+ *      Hands out a connection for spec, reusing a healthy idle one when
+ *      available and connecting otherwise. The connection is exclusively
+ *      owned by the lease until it is released.
+ *
+ * Results:
+ *      A lease on the connection.
+ *
+ * Side effects:
+ *      May call VixDiskLib_PrepareForAccess and connect to the host.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+ConnectionPool::Lease
+ConnectionPool::acquire(const ConnectSpec& spec)
+{
+   string key = spec.Key();
+   VixDiskLibConnection conn = NULL;
+   Slot *slot;
+   {
+      std::lock_guard<std::mutex> lg(_lock);
+      slot = &_slots[key];
+      if (slot->_params == NULL) {
+         slot->_spec = spec;
+         slot->_params = AllocConnectParams(slot->_spec);
+      }
+   }
+
+   // The health check may talk to the host, so it runs without _lock.
+   while (conn == NULL) {
+      Idle idle;
+      {
+         std::lock_guard<std::mutex> lg(_lock);
+         if (slot->_idle.empty()) {
+            ++_misses;
+            break;
+         }
+         idle = slot->_idle.back();
+         slot->_idle.pop_back();
+      }
+      if (isHealthy(*slot, idle)) {
+         std::lock_guard<std::mutex> lg(_lock);
+         ++_hits;
+         conn = idle._conn;
+      } else {
+         forget(idle._conn);
+         VixDiskLib_Disconnect(idle._conn);
+      }
+   }
+   if (conn == NULL) {
+      conn = connect(*slot);
+   }
+   return Lease(this, key, conn);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ConnectionPool::isHealthy --
+ *
+ *      Health check for an idle connection before handing it out: it must
+ *      not have been idle for longer than VIX_CONNPOOL_IDLE_TIMEOUT (the
+ *      host session may have expired). A remote connection idle for more
+ *      than VIX_CONNPOOL_PROBE_AFTER seconds must also still be able to
+ *      open the last disk opened on it, which goes to the host; there is
+ *      no cheaper call that does. Called without _lock held; the probe
+ *      takes openCloseLock like any other open and close.
+ *
+ * Results:
+ *      true if the connection can be reused.
+ *
+ * Side effects:
+ *      Updates the expired / unhealthy counters.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+bool
+ConnectionPool::isHealthy(const Slot& slot,     // IN
+                          const Idle& idle)     // IN
+{
+   auto idleFor = Clock::now() - idle._since;
+
+   if (idleFor > std::chrono::seconds(VIX_CONNPOOL_IDLE_TIMEOUT)) {
+      std::lock_guard<std::mutex> lg(_lock);
+      ++_expired;
+      return false;
+   }
+   if (!slot._spec.isRemote || idle._path.empty() ||
+       idleFor < std::chrono::seconds(VIX_CONNPOOL_PROBE_AFTER)) {
+      return true;
+   }
+
+   VixDiskLibHandle handle = NULL;
+   VixError vixError;
+   {
+      std::lock_guard<std::mutex> lg(openCloseLock);
+      vixError = VixDiskLib_Open(idle._conn, idle._path.c_str(),
+                                 VIXDISKLIB_FLAG_OPEN_READ_ONLY, &handle);
+      if (!VIX_FAILED(vixError)) {
+         VixDiskLib_Close(handle);
+      }
+   }
+   if (VIX_FAILED(vixError) && IsConnectionError(vixError)) {
+      std::lock_guard<std::mutex> lg(_lock);
+      ++_unhealthy;
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ConnectionPool::connect --
+ *
+ *      Opens a new connection for a slot, preparing the VM / FCD for
+ *      access the first time it is connected to.
+ *
+ * Results:
+ *      The new connection.
+ *
+ * Side effects:
+ *      Throws VixDiskLibErrWrapper on failure.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+VixDiskLibConnection
+ConnectionPool::connect(Slot& slot)
+{
+   std::lock_guard<std::mutex> lg(_connectLock);
+   const ConnectSpec& spec = slot._spec;
+   VixDiskLibConnection conn = NULL;
+   VixError vixError;
+
+   auto start = Clock::now();
+   if (spec.NeedsAccess() && !slot._prepared) {
+      StartupPhase phase("VixDiskLib_PrepareForAccess");
+      vixError = VixDiskLib_PrepareForAccess(slot._params, "Sample");
+      CHECK_AND_THROW(vixError);
+      slot._prepared = true;
+   }
+   if (!spec.UseConnectEx()) {
+      StartupPhase phase("VixDiskLib_Connect");
+      vixError = VixDiskLib_Connect(slot._params, &conn);
+   } else {
+      StartupPhase phase("VixDiskLib_ConnectEx");
+      vixError = VixDiskLib_ConnectEx(slot._params, spec.readOnly,
+                                      CStrOrNull(spec.ssMoRef),
+                                      CStrOrNull(spec.transportModes),
+                                      &conn);
+   }
+   CHECK_AND_THROW(vixError);
+   uint64 usec = std::chrono::duration_cast<std::chrono::microseconds>(
+                    Clock::now() - start).count();
+
+   std::lock_guard<std::mutex> statLg(_lock);
+   _connSpecs[conn] = &slot._spec;
+   ++_connects;
+   _connectTimeTotal += usec;
+   _connectTimeMax = std::max(_connectTimeMax, usec);
+   return conn;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ConnectionPool::giveBack --
+ *
+ *      Returns a leased connection. Broken connections and connections
+ *      beyond VIX_CONNPOOL_MAX_IDLE are disconnected.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+ConnectionPool::giveBack(const string& key,             // IN
+                         VixDiskLibConnection conn,     // IN
+                         const string& path,            // IN
+                         bool broken)                   // IN
+{
+   {
+      std::lock_guard<std::mutex> lg(_lock);
+      auto it = _slots.find(key);
+      if (!broken && it != _slots.end() &&
+          it->second._idle.size() < VIX_CONNPOOL_MAX_IDLE) {
+         it->second._idle.push_back({conn, Clock::now(), path});
+         return;
+      }
+      if (broken) {
+         ++_unhealthy;
+      }
+      _connSpecs.erase(conn);
+   }
+   VixDiskLib_Disconnect(conn);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ConnectionPool::clear --
+ *
+ *      Ends access to prepared VMs / FCDs and disconnects all idle
+ *      connections. Must be called before VixDiskLib_Exit, with no
+ *      outstanding leases.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+ConnectionPool::clear()
+{
+   std::lock_guard<std::mutex> lg(_lock);
+   for (auto& kv : _slots) {
+      Slot& slot = kv.second;
+      if (slot._prepared) {
+         VixDiskLib_EndAccess(slot._params, "Sample");
+      }
+      for (const auto& idle : slot._idle) {
+         VixDiskLib_Disconnect(idle._conn);
+      }
+      VixDiskLib_FreeConnectParams(slot._params);
+   }
+   _slots.clear();
+   _connSpecs.clear();
+}
+
+
+// Looks up the spec a pooled connection was made with.
+bool
+ConnectionPool::specOf(VixDiskLibConnection conn, ConnectSpec& spec)
+{
+   std::lock_guard<std::mutex> lg(_lock);
+   auto it = _connSpecs.find(conn);
+   if (it == _connSpecs.end()) {
+      return false;
+   }
+   spec = *it->second;
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ConnectionPool::printStats --
+ *
+ *      Prints hit / miss counters and connect latency to out.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+ConnectionPool::printStats(std::ostream& out)
+{
+   std::lock_guard<std::mutex> lg(_lock);
+   uint64 avg = _connects == 0 ? 0 : _connectTimeTotal / _connects;
+   out << "Connection pool: " << _hits << " hits, " << _misses
+       << " misses, " << _expired << " expired, " << _unhealthy
+       << " unhealthy" << endl;
+   out << "Connection pool: " << _connects << " connects, avg "
+       << avg << " usec, max " << _connectTimeMax << " usec" << endl;
+}
+
+
+#ifndef _WIN32
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ExtentIdentity --
+ *
+ *      Identifies the extents of the local disk whose descriptor is the
+ *      file full: the CID lines of a descriptor file, and the path, size
+ *      and modification time of each extent file it names, as writes go
+ *      to those and leave the descriptor alone. A disk in one file, with
+ *      its descriptor embedded, has none to add.
+ *
+ * Results:
+ *      false if an extent file can't be found.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+ExtentIdentity(const string& full,               // IN
+               std::ostringstream& identity)     // IN/OUT
+{
+   static const char magic[] = "# Disk DescriptorFile";
+   std::ifstream in(full.c_str());
+   char head[sizeof magic - 1];
+   string line;
+
+   // Not a descriptor file: a sparse disk with its descriptor inside.
+   if (!in.read(head, sizeof head) || memcmp(head, magic, sizeof head) != 0) {
+      return true;
+   }
+   std::getline(in, line);
+   const string dir = full.substr(0, full.rfind('/') + 1);
+   while (std::getline(in, line)) {
+      if (line.compare(0, 4, "CID=") == 0 ||
+          line.compare(0, 10, "parentCID=") == 0) {
+         identity << line << '|';
+         continue;
+      }
+      // RW|RDONLY|NOACCESS sectors type "file" [offset]
+      size_t open = line.find('"');
+      size_t close = line.find('"', open + 1);
+      if (open == string::npos || close == string::npos ||
+          (line.compare(0, 3, "RW ") != 0 &&
+           line.compare(0, 7, "RDONLY ") != 0 &&
+           line.compare(0, 9, "NOACCESS ") != 0)) {
+         continue;
+      }
+      string file = line.substr(open + 1, close - open - 1);
+      if (file.empty() || file[0] != '/') {
+         file = dir + file;
+      }
+      struct stat st;
+      if (stat(file.c_str(), &st) != 0) {
+         return false;
+      }
+      identity << "extent|" << file.size() << ':' << file << '|'
+               << st.st_size << '|' << st.st_mtim.tv_sec << '.'
+               << st.st_mtim.tv_nsec << '|';
+   }
+   return true;
+}
+
+#endif // _WIN32
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DiskIdentity --
+ *
+ *      Identifies the data of a disk: the host, VM / FCD, snapshot and
+ *      path it was opened by, or for a local disk the full path, size and
+ *      modification time of the file and of its extent files (see
+ *      ExtentIdentity), plus its capacity. Credentials and transport are
+ *      left out: they don't change the data.
+ *
+ * Results:
+ *      false if the disk can't be identified.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+DiskIdentity(VixDiskLibConnection connection,   // IN
+             const char *path,                  // IN
+             uint64 capacity,                   // IN
+             string& result)                    // OUT
+{
+   ConnectSpec spec;
+
+   if (!connPool.specOf(connection, spec)) {
+      return false;
+   }
+
+   std::ostringstream identity;
+   auto field = [&identity] (const string& s) {
+      identity << s.size() << ':' << s << '|';
+   };
+
+   if (spec.isRemote) {
+      field(spec.host);
+      field(spec.vmxSpec);
+      field(spec.fcdid);
+      field(spec.fcdssid);
+      field(spec.ds);
+      field(spec.ssMoRef);
+      field(path);
+   } else {
+#ifndef _WIN32
+      char *full = realpath(path, NULL);
+      struct stat st;
+      if (full == NULL || stat(full, &st) != 0) {
+         free(full);
+         return false;
+      }
+      identity << "local|";
+      field(full);
+      identity << st.st_size << '|' << st.st_mtim.tv_sec << '.'
+               << st.st_mtim.tv_nsec << '|';
+      bool ok = ExtentIdentity(full, identity);
+      free(full);
+      if (!ok) {
+         return false;
+      }
+#else
+      return false;
+#endif
+   }
+   identity << capacity;
+   result = identity.str();
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * SnapshotIdentity --
+ *
+ *      The DiskIdentity of a disk whose data can't change under it, so
+ *      what's read from it may be kept across runs: a local disk, whose
+ *      identity has the modification times of its files, or a snapshot
+ *      (-ssmoref, -fcdssid). Whether only the top link is seen is part
+ *      of it.
+ *
+ * Results:
+ *      false for a live remote disk, or if the disk can't be identified.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+SnapshotIdentity(VixDiskLibConnection connection,   // IN
+                 const char *path,                  // IN
+                 uint32 flags,                      // IN
+                 uint64 capacity,                   // IN
+                 string& result)                    // OUT
+{
+   ConnectSpec spec;
+
+   if (!connPool.specOf(connection, spec) ||
+       (spec.isRemote && spec.ssMoRef.empty() && spec.fcdssid.empty()) ||
+       !DiskIdentity(connection, path, capacity, result)) {
+      return false;
+   }
+   if ((flags & VIXDISKLIB_FLAG_OPEN_SINGLE_LINK) != 0) {
+      result += "|single";
+   }
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DiskLocation --
+ *
+ *      Identifies a disk while it's open, whatever its content: the host,
+ *      VM / FCD, snapshot and path it was opened by, or for a local disk
+ *      the device and inode of the file, plus whether only its top link
+ *      is seen. Handles of the same disk get the same location.
+ *
+ * Results:
+ *      false if the disk can't be located.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+DiskLocation(VixDiskLibConnection connection,   // IN
+             const char *path,                  // IN
+             uint32 flags,                      // IN
+             string& result)                    // OUT
+{
+   ConnectSpec spec;
+
+   if (!connPool.specOf(connection, spec)) {
+      return false;
+   }
+
+   std::ostringstream location;
+   auto field = [&location] (const string& s) {
+      location << s.size() << ':' << s << '|';
+   };
+
+   if (spec.isRemote) {
+      field(spec.host);
+      field(spec.vmxSpec);
+      field(spec.fcdid);
+      field(spec.fcdssid);
+      field(spec.ds);
+      field(spec.ssMoRef);
+      field(path);
+   } else {
+#ifndef _WIN32
+      struct stat st;
+      if (stat(path, &st) != 0) {
+         return false;
+      }
+      location << "local|" << st.st_dev << ':' << st.st_ino << '|';
+#else
+      return false;
+#endif
+   }
+   location << ((flags & VIXDISKLIB_FLAG_OPEN_SINGLE_LINK) != 0);
+   result = location.str();
+   return true;
+}
+
+
+// FNV-1a, never 0
+static uint64
+IdentityHash(const string& s)
+{
+   uint64 id = 0xcbf29ce484222325ULL;
+   for (char c : s) {
+      id = (id ^ (uint8)c) * 0x100000001b3ULL;
+   }
+   return id == 0 ? 1 : id;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BlockCache::open --
+ *
+ *      Registers a newly opened disk handle: with the other handles of
+ *      its DiskLocation, and if it's read-only with the cache file under
+ *      a hash of its SnapshotIdentity. Blocks of live remote disks are
+ *      only kept in memory.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+BlockCache::open(VixDiskLibHandle handle,               // IN
+                 VixDiskLibConnection connection,       // IN
+                 const char *path,                      // IN
+                 uint32 flags,                          // IN
+                 const VixDiskLibInfo *info)            // IN
+{
+   string location;
+   string identity;
+
+   if (!enabled()) {
+      return;
+   }
+
+   bool located = DiskLocation(connection, path, flags, location);
+   uint64 fileId = 0;
+   if (_file.isOpen() && (flags & VIXDISKLIB_FLAG_OPEN_READ_ONLY) != 0 &&
+       SnapshotIdentity(connection, path, flags, info->capacity, identity)) {
+      fileId = IdentityHash(identity);
+   }
+
+   const uint64 id = located ? IdentityHash(location) | LOCATED_ID : 0;
+   std::lock_guard<std::mutex> lg(_diskLock);
+   DiskPtr& disk = located ? _disks[id] : _handles[handle];
+   if (!disk) {
+      disk = std::make_shared<Disk>();
+      disk->id = located ? id : ++_anonymous & ~LOCATED_ID;
+      disk->fileId = fileId;
+      disk->gen = 0;
+      disk->handles = 0;
+   } else if (disk->fileId != fileId) {
+      // Opened read-only and for writing at once: don't persist its blocks
+      disk->fileId = 0;
+   }
+   disk->handles++;
+   _handles[handle] = disk;
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * PrintUsage --
+ *
+ *      Displays the usage message.
+ *
+ * Results:
+ *      1.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+PrintUsage(void)
+{
+    printf("Usage: vixdisklibsample.exe command [options] diskPath\n\n");
+
+    printf("List of commands (all commands are mutually exclusive):\n");
+    printf(" -create : creates a sparse virtual disk with capacity "
+           "specified by -cap\n");
+    printf(" -redo parentPath : creates a redo log 'diskPath' "
+           "for base disk 'parentPath'\n");
+    printf(" -info : displays information for specified virtual disk\n");
+    printf(" -dump : dumps the contents of specified range of sectors "
+           "in hexadecimal\n");
+    printf(" -mount : mount the virtual disk specified\n");
+    printf(" -fill : fills specified range of sectors with byte value "
+           "specified by -val, or -fillpattern\n");
+    printf(" -wmeta key value : writes (key,value) entry into disk's metadata table\n");
+    printf(" -rmeta key : displays the value of the specified metada entry\n");
+    printf(" -meta : dumps all entries of the disk's metadata\n");
+    printf(" -clone sourcePath : clone source vmdk possibly to a remote site\n");
+    printf(" -compress type: specify the compression type for nbd transport mode\n");
+    printf(" -readbench blocksize: Does a read benchmark on a disk using the \n");
+    printf("specified I/O block size (in sectors).\n");
+    printf(" -writebench blocksize: Does a write benchmark on a disk using the\n");
+    printf("specified I/O block size (in sectors). WARNING: This will\n");
+    printf("overwrite the contents of the disk specified.\n");
+    printf(" -readasyncbench blocksize: Does an async read benchmark on a disk using the \n");
+    printf("specified I/O block size (in sectors).\n");
+    printf(" -writeasyncbench blocksize: Does an async write benchmark on a disk using the\n");
+    printf("specified I/O block size (in sectors). WARNING: This will\n");
+    printf("overwrite the contents of the disk specified.\n");
+    printf(" -getallocatedblocks : gets allocated block list on a disk using the \n");
+    printf("specified I/O block size (in sectors).\n");
+    printf(" -check repair: Check a sparse disk for internal consistency, "
+           "where repair is a boolean value to indicate if a repair operation "
+           "should be attempted.\n");
+    printf(" -batch file : run the commands listed in file ('-' for stdin), "
+           "one command line per line, after a single VixDiskLib init. "
+           "Options given before -batch are defaults for every line.\n");
+    printf(" -nbd address : export the disk read-only as an NBD server on "
+           "address, a port, host:port or Unix socket path, until "
+           "interrupted\n");
+    printf(" -nbdrw address : like -nbd, but clients may write\n");
+    printf(" -fuse mountpoint : mount the disk read-only as disk.raw and "
+           "each link of its chain as linkN.raw on mountpoint (FUSE, "
+           "vix-mntapi-sample on Linux), until unmounted\n");
+    printf(" -exportraw file : write the disk to a raw image file or "
+           "device, reading only allocated blocks and leaving unallocated "
+           "and zero ranges as holes\n");
+    printf(" -importraw file : write a raw image file, or '-' for stdin, "
+           "to the disk, skipping holes and zeros; with -create the disk "
+           "is created as large as the file first, otherwise allocated "
+           "blocks of the disk that the file doesn't write are zeroed\n");
+    printf(" -zeroall : for -importraw to a disk without allocation info, "
+           "zero everything the file doesn't write (default: fail)\n");
+    printf(" -exportzip file : write the disk as an astrolabe protected "
+           "entity zip (peinfo and data entries), or to stdout for '-'\n");
+    printf(" -exportstream file : write the raw disk as concatenated "
+           "compressed frames (see -codec), or to stdout for '-'\n");
+    printf(" -exportdelta file : write the blocks changed since the "
+           "-basemanifest export, or all nonzero blocks without one, to "
+           "file or to stdout for '-'; with -single only the blocks "
+           "allocated in the link are read, and -basemanifest must be of "
+           "its parent; the disk must be local or a snapshot (-ssmoref, "
+           "-fcdssid)\n");
+    printf(" -applydelta file : write a delta of -exportdelta, or stdin "
+           "for '-', to a copy of the disk it is relative to; the disk "
+           "must carry the " DELTA_META_KEY " metadata of that base, which "
+           "-applydelta leaves behind\n");
+    printf(" -merkle file : build a Merkle tree of the block hashes of each "
+           "disk given, in file, or file.0, file.1, ... for several\n");
+    printf(" -merklediff file1 file2 : print the byte ranges where the "
+           "disks of two -merkle trees differ; takes no disk\n");
+    printf(" -extentcheck : check the extent map operations against "
+           "bitmaps on random maps; takes no disk\n");
+    printf(" -dropblockmap : remove the block maps kept in -blockmapdir for "
+           "the disk\n");
+    printf(" -daemon socketpath : keep VixDiskLib initialized and run jobs "
+           "sent over a Unix domain socket. A client sends 'RUN <command "
+           "line>' and gets 'JOB id', 'PROGRESS id done total' and "
+           "'DONE id OK|FAILED code text|CANCELLED' back; 'CANCEL [id]', "
+           "'LIST', 'STATS' and 'SHUTDOWN' are also accepted. Options given "
+           "before -daemon are defaults for every job.\n\n");
+
+    printf("options:\n");
+    printf(" -adapter [ide|scsi] : bus adapter type for 'create' option "
+           "(default='scsi')\n");
+    printf(" -dumpfile path : with -dump, write the raw sectors to path "
+           "instead of in hex\n");
+    printf(" -start n : start sector for 'dump/fill' options (default=0)\n");
+    printf(" -count n : number of sectors for 'dump/fill' options (default=1)\n");
+    printf(" -val byte : byte value to fill with for 'write' option (default=255)\n");
+    printf(" -fillpattern byte|zero|random|lba : what -fill writes: -val, "
+           "zeros, random data or in every 8 bytes the sector number "
+           "(default=byte)\n");
+    printf(" -fillsize n : sectors per -fill write, rounded up to whole "
+           "grains (default=%d)\n", VIX_FILL_WRITE_SIZE);
+    printf(" -filldepth n : -fill writes in flight per thread, at most %d; "
+           "asynchronous if above 1 or with several threads (default=1)\n",
+           VIX_FILL_MAX_DEPTH);
+    printf(" -fillthreads n : threads filling disjoint parts of the range, "
+           "at most %d (default=1)\n", VIX_FILL_MAX_THREADS);
+    printf(" -cap megabytes : capacity in MB for -create option (default=100)\n");
+    printf(" -single : open file as single disk link (default=open entire chain)\n");
+    printf(" -multithread n: start n threads and copy the file to n new files\n");
+    printf(" -host hostname : hostname/IP address of VC/vSphere host (Mandatory)\n");
+    printf(" -user userid : user name on host (Mandatory) \n");
+    printf(" -password password : password on host. (Mandatory)\n");
+    printf(" -cookie cookie : cookie from existing authenticated session on host. (Optional)\n");
+    printf(" -port port : port to use to connect to VC/ESXi host (default = 443) \n");
+    printf(" -nfchostport port : port to use to establish NFC connection to ESXi host (default = 902) \n");
+    printf(" -vm moref=id : id is the managed object reference of the VM \n");
+    printf(" -fcdid id : id is the uuid of the vStorage Object \n");
+    printf(" -ds ds : ds is the managed object reference of the Datastore \n");
+    printf(" -fcdssid ssid : id is the uuid of the snapshot of the vStorage Object \n");
+    printf(" -libdir dir : Folder location of the VDDK installation. "
+           "On Windows, the bin folder holds the plugin.  On Linux, it is "
+           "the lib64 directory\n");
+    printf(" -initex configfile : Specify path and filename of config file \n");
+    printf(" -ssmoref moref : Managed object reference of VM snapshot \n");
+    printf(" -mode mode : Mode string to pass into VixDiskLib_ConnectEx. "
+           "Valid modes are: nbd, nbdssl, san, hotadd \n");
+    printf(" -thumb string : Provides a SSL thumbprint string for validation. "
+           "Format: xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx:xx\n");
+    printf(" -chunksize n : number of sectors as a chunk to query allocated "
+           "blocks\n");
+    printf(" -lssize n : number of logical sector size for -create and -clone option (default = 0) \n");
+    printf(" -pssize n : number of physical sector size for -create and -clone option (default = 0) \n");
+    printf(" -unbuffered: use VIXDISKLIB_FLAG_OPEN_UNBUFFERED flag \n");
+    printf(" -poolstats : print connection pool statistics on exit\n");
+    printf(" -cache mbytes : keep up to mbytes of disk blocks read in an "
+           "LRU cache shared by all disks of the process, and print its "
+           "statistics on exit\n");
+    printf(" -cachefile path : keep blocks of local disks and snapshots "
+           "opened read-only in a persistent cache file, so later runs "
+           "opening the same disk or snapshot read them locally; blocks of "
+           "live remote disks are only cached in memory\n");
+    printf(" -cachefilesize mbytes : size of the -cachefile (default %d)\n",
+           VIX_BLOCK_CACHE_FILE_MB);
+    printf(" -startupprofile : print a timeline of library load, init, "
+           "connect and disk open up to the first I/O on exit\n");
+    printf(" -peinfo file : ProtectedEntityInfo JSON for -exportzip "
+           "(default: an ivd entity named after the disk)\n");
+    printf(" -zipthreads n : compression threads of -exportzip and "
+           "-exportstream (default: one per CPU)\n");
+    printf(" -codec name[:level] : compression of -exportstream: lz4 "
+           "(levels 0-12), zstd (1-22), deflate (0-9) or none "
+           "(default: zstd:3)\n");
+    printf(" -basemanifest file : manifest of an earlier -exportdelta run "
+           "to compare block hashes with\n");
+    printf(" -manifest file : with -exportdelta, save the block hashes of "
+           "the disk for the next run\n");
+    printf(" -hashthreads n : hashing threads per disk of -merkle "
+           "(default: one per CPU)\n");
+    printf(" -querythreads n : handles querying the allocated blocks at "
+           "once, at most %d, shared by all disks of a command (default: "
+           "%d for remote disks, 1 for local ones)\n",
+           VIX_QUERY_MAX_THREADS, VIX_QUERY_THREADS);
+    printf(" -readgap sectors : with -exportraw, the only command that "
+           "plans its reads, read extents up to sectors apart together and "
+           "write only the extents, not with -journal (default: from the "
+           "measured latency and bandwidth of reads)\n");
+    printf(" -blockmapdir dir : keep the allocated blocks of local disks "
+           "and snapshots opened read-only in dir and use them instead of "
+           "querying again\n");
+    printf(" -chunkmap file : with -exportraw, -exportzip or -exportstream, "
+           "split the allocated data into content-defined chunks and "
+           "write their offsets, lengths and SHA-256s to file\n");
+    printf(" -nouring : use pread/pwrite rather than io_uring for local "
+           "files\n");
+    printf(" -directio : write local files and devices with O_DIRECT, "
+           "bypassing the page cache\n");
+    printf(" -journal file : with -exportraw, record the progress in file "
+           "to -resume from after a failure; no other command, -clone and "
+           "-multithread included, keeps a journal\n");
+    printf(" -resume : carry on with the -exportraw of the -journal if the "
+           "disk is unchanged\n");
+    printf(" -journalhash : keep hashes of the data in the -journal and "
+           "check the image against them on -resume\n");
+    printf(" -jobs n : max number of -batch commands or -daemon jobs run in "
+           "parallel (default = 4)\n");
+
+    return 1;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * main --
+ *
+ *      Main routine of the program.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+int
+main(int argc, char* argv[])
+{
+    int retval;
+    bool bVixInit(false);
+
+    memset(&Globals(), 0, sizeof Globals());
+    Globals().command = 0;
+    Globals().adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
+    Globals().startSector = 0;
+    Globals().numSectors = 1;
+    Globals().mbSize = 100;
+    Globals().filler = 0xff;
+    Globals().fillPattern = FILL_BYTE;
+    Globals().fillDepth = 1;
+    Globals().fillThreads = 1;
+    Globals().openFlags = 0;
+    Globals().numThreads = 1;
+    Globals().success = TRUE;
+    Globals().isRemote = FALSE;
+    Globals().cookie = NULL;
+    Globals().chunkSize = VIXDISKLIB_MIN_CHUNK_SIZE;
+    Globals().numJobs = 4;
+    Globals().cacheFileMB = VIX_BLOCK_CACHE_FILE_MB;
+    Globals().readGap = -1;
+
+    retval = ParseArguments(argc, argv);
+    if (retval) {
+        return retval;
+    }
+    if (Globals().startupProfile) {
+       startupTimeline.enable();
+    }
+    blockCache.setBudget((uint64)Globals().cacheMB << 20);
+    if (Globals().cacheFile != NULL) {
+       // Carry on without the file if it can't be used.
+       blockCache.openFile(Globals().cacheFile,
+                           (uint64)Globals().cacheFileMB << 20);
+    }
+
+#ifdef DYNAMIC_LOADING
+    DynLoadDiskLib();
+#endif
+
+    // Initialize random generator
+    struct timeval time;
+    gettimeofday(&time, NULL);
+
+    srand((time.tv_sec * 1000) + (time.tv_usec/1000));
+
+    VixError vixError;
+    try {
+       {
+          StartupPhase phase(Globals().useInitEx ? "VixDiskLib_InitEx" :
+                                                   "VixDiskLib_Init");
+          if (Globals().useInitEx) {
+             vixError = VixDiskLib_InitEx(VIXDISKLIB_VERSION_MAJOR,
+                                          VIXDISKLIB_VERSION_MINOR,
+                                          &LogFunc, &WarnFunc, &PanicFunc,
+                                          Globals().libdir,
+                                          Globals().cfgFile);
+          } else {
+             vixError = VixDiskLib_Init(VIXDISKLIB_VERSION_MAJOR,
+                                        VIXDISKLIB_VERSION_MINOR,
+                                        NULL, NULL, NULL, // Log, warn, panic
+                                        Globals().libdir);
+          }
+       }
+       CHECK_AND_THROW(vixError);
+       bVixInit = true;
+
+       if (Globals().command & COMMAND_BATCH) {
+          DoBatch();
+       } else if (Globals().command & COMMAND_DAEMON) {
+          DoDaemon();
+       } else {
+          RunCommand();
+       }
+
+        retval = 0;
+    } catch (const VixDiskLibErrWrapper& e) {
+       cout << "Error: [" << e.File() << ":" << e.Line() << "]  " <<
+               std::hex << e.ErrorCode() << " " << e.Description() << "\n";
+       retval = 1;
+    }
+
+    if (bVixInit) {
+       if (Globals().startupProfile) {
+          startupTimeline.print();
+       }
+       if (Globals().poolStats) {
+          connPool.printStats();
+       }
+       if (blockCache.enabled()) {
+          blockCache.printStats();
+       }
+       connPool.clear();
+    }
+#ifdef FOR_MNTAPI
+    MntapiExit();
+#endif
+    if (bVixInit) {
+       VixDiskLib_Exit();
+    }
+    return retval;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * RunCommand --
+ *
+ *      Runs the command in Globals() on a connection from the pool.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws VixDiskLibErrWrapper on failure.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+RunCommand(void)
+{
+   auto connLease = connPool.acquire(ConnectSpec::FromGlobals());
+   Globals().connection = connLease.get();
+   try {
+      if (Globals().command & COMMAND_INFO) {
+         DoInfo();
+      } else if (Globals().command & COMMAND_IMPORT_RAW) {
+         DoImportRaw();   // does -create itself
+      } else if (Globals().command & COMMAND_APPLY_DELTA) {
+         DoApplyDelta();
+      } else if (Globals().command & COMMAND_CREATE) {
+         DoCreate();
+      } else if (Globals().command & COMMAND_REDO) {
+         DoRedo();
+      } else if (Globals().command & COMMAND_FILL) {
+         DoFill();
+      } else if (Globals().command & COMMAND_DUMP) {
+         DoDump();
+      } else if (Globals().command & COMMAND_READ_META) {
+         DoReadMetadata();
+      } else if (Globals().command & COMMAND_WRITE_META) {
+         DoWriteMetadata();
+      } else if (Globals().command & COMMAND_DUMP_META) {
+         DoDumpMetadata();
+      } else if (Globals().command & COMMAND_MULTITHREAD) {
+         DoTestMultiThread();
+      } else if (Globals().command & COMMAND_CLONE) {
+         DoClone();
+      } else if (Globals().command & COMMAND_READBENCH) {
+         DoRWBench(true, false);
+      } else if (Globals().command & COMMAND_WRITEBENCH) {
+         DoRWBench(false, false);
+      } else if (Globals().command & COMMAND_READASYNCBENCH) {
+         DoRWBench(true, true);
+      } else if (Globals().command & COMMAND_WRITEASYNCBENCH) {
+         DoRWBench(false, true);
+      } else if (Globals().command & COMMAND_CHECKREPAIR) {
+         DoCheckRepair(Globals().repair);
+      } else if (Globals().command & COMMAND_GET_ALLOCATED_BLOCKS) {
+         DoGetAllocatedBlocks();
+      } else if (Globals().command & COMMAND_MOUNT) {
+         DoMntApi();
+      } else if (Globals().command & COMMAND_NBD) {
+         DoNbd();
+      } else if (Globals().command & COMMAND_FUSE) {
+         DoFuse();
+      } else if (Globals().command & COMMAND_EXPORT_RAW) {
+         DoExportRaw();
+      } else if (Globals().command & COMMAND_EXPORT_ZIP) {
+         DoExportZip();
+      } else if (Globals().command & COMMAND_EXPORT_STREAM) {
+         DoExportStream();
+      } else if (Globals().command & COMMAND_EXPORT_DELTA) {
+         DoExportDelta();
+      } else if (Globals().command & COMMAND_MERKLE) {
+         DoMerkle();
+      } else if (Globals().command & COMMAND_MERKLE_DIFF) {
+         DoMerkleDiff();
+      } else if (Globals().command & COMMAND_DROP_BLOCK_MAP) {
+         DoDropBlockMap();
+      } else if (Globals().command & COMMAND_EXTENT_CHECK) {
+         DoExtentCheck();
+      }
+   } catch (const VixDiskLibErrWrapper& e) {
+      connLease.checkError(e.ErrorCode());
+      Globals().connection = NULL;
+      throw;
+   }
+   if (!Globals().diskPaths.empty()) {
+      connLease.opened(Globals().diskPaths[0]);
+   }
+   Globals().connection = NULL;
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ParseArguments --
+ *
+ *      Parses the arguments passed on the command line.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+ParseArguments(int argc, char* argv[])
+{
+    int i;
+    if (argc < 3 && !(argc == 2 && !strcmp(argv[1], "-extentcheck"))) {
         printf("Error: Too few arguments. See usage below.\n\n");
         return PrintUsage();
     }
-    for (i = 1; i < argc; i++) {
-        if (!strcmp(argv[i], "-info")) {
-            appGlobals.command |= COMMAND_INFO;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-create")) {
-            appGlobals.command |= COMMAND_CREATE;
-        } else if (!strcmp(argv[i], "-dump")) {
-            appGlobals.command |= COMMAND_DUMP;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-fill")) {
-            appGlobals.command |= COMMAND_FILL;
-        } else if (!strcmp(argv[i], "-meta")) {
-            appGlobals.command |= COMMAND_DUMP_META;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-single")) {
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_SINGLE_LINK;
-        } else if (!strcmp(argv[i], "-adapter")) {
-            if (i >= argc - 2) {
-                printf("Error: The -adaptor option requires the adapter type "
-                       "to be specified. The type must be 'ide' or 'scsi'. "
-                       "See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.adapterType = strcmp(argv[i], "scsi") == 0 ?
-                                       VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC :
-                                       VIXDISKLIB_ADAPTER_IDE;
-            ++i;
-        } else if (!strcmp(argv[i], "-rmeta")) {
-            appGlobals.command |= COMMAND_READ_META;
-            if (i >= argc - 2) {
-                printf("Error: The -rmeta command requires a key value to "
-                       "be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.metaKey = argv[++i];
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-wmeta")) {
-            appGlobals.command |= COMMAND_WRITE_META;
-            if (i >= argc - 3) {
-                printf("Error: The -wmeta command requires key and value to "
-                       "be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.metaKey = argv[++i];
-            appGlobals.metaVal = argv[++i];
-        } else if (!strcmp(argv[i], "-getallocatedblocks")) {
-            appGlobals.command |= COMMAND_GET_ALLOCATED_BLOCKS;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-mount")) {
-            appGlobals.command |= COMMAND_MOUNT;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-redo")) {
-            if (i >= argc - 2) {
-                printf("Error: The -redo command requires the parentPath to "
-                       "be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.command |= COMMAND_REDO;
-            appGlobals.parentPath = argv[++i];
-        } else if (!strcmp(argv[i], "-chunksize")) {
-            if (i >= argc - 2) {
-                printf("Error: The -chunksize option requires the number of"
-                       "sectors to be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.chunkSize = strtol(argv[++i], NULL, 0);
-        } else if (!strcmp(argv[i], "-val")) {
-            if (i >= argc - 2) {
-                printf("Error: The -val option requires a byte value to "
-                       "be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.filler = strtol(argv[++i], NULL, 0);
-        } else if (!strcmp(argv[i], "-start")) {
-            if (i >= argc - 2) {
-                printf("Error: The -start option requires a sector number to "
-                       "be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.startSector = strtol(argv[++i], NULL, 0);
-        } else if (!strcmp(argv[i], "-count")) {
-            if (i >= argc - 2) {
-                printf("Error: The -count option requires the number of "
-                       "sectors to be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.numSectors = strtol(argv[++i], NULL, 0);
-        } else if (!strcmp(argv[i], "-cap")) {
-            if (i >= argc - 2) {
-                printf("Error: The -cap option requires the capacity in MB "
-                       "to be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.mbSize = strtol(argv[++i], NULL, 0);
-        } else if (!strcmp(argv[i], "-clone")) {
-            if (i >= argc - 2) {
-                printf("Error: The -clone command requires the path of the "
-                       "source vmdk to be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.srcPath = argv[++i];
-            appGlobals.command |= COMMAND_CLONE;
-        } else if (!strcmp(argv[i], "-compress")) {
-            if (0 && i >= argc - 2) {
-                printf("Error: The -compress command requires a compression type "
-                       "to be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            ++i;
-            if (!strcmp(argv[i], "zlib")) {
-               appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_COMPRESSION_ZLIB;
-            } else if (!strcmp(argv[i], "fastlz")) {
-               appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_COMPRESSION_FASTLZ;
-            } else if (!strcmp(argv[i], "skipz")) {
-               appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_COMPRESSION_SKIPZ;
-            } else {
-                printf("Error: unknown compression type '%s'."
-                       "Only support zlib, fastlz and skipz.\n\n", argv[i]);
-                return PrintUsage();
-            }
-        } else if (!strcmp(argv[i], "-readbench")) {
-            if (0 && i >= argc - 2) {
-                printf("Error: The -readbench command requires a block size "
-                       "(in sectors) to be specified. See usage below.\n\n");
-                return PrintUsage();
-            }
-            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
-            appGlobals.command |= COMMAND_READBENCH;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-writebench")) {
-            if (i >= argc - 2) {
-                printf("Error: The -writebench command requires a block size "
-                       "(in sectors) to be specified. See usage below.\n\n");
-                return PrintUsage();
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-info")) {
+            Globals().command |= COMMAND_INFO;
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-create")) {
+            Globals().command |= COMMAND_CREATE;
+        } else if (!strcmp(argv[i], "-dump")) {
+            Globals().command |= COMMAND_DUMP;
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-fill")) {
+            Globals().command |= COMMAND_FILL;
+        } else if (!strcmp(argv[i], "-meta")) {
+            Globals().command |= COMMAND_DUMP_META;
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-single")) {
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_SINGLE_LINK;
+        } else if (!strcmp(argv[i], "-adapter")) {
+            if (i >= argc - 2) {
+                printf("Error: The -adaptor option requires the adapter type "
+                       "to be specified. The type must be 'ide' or 'scsi'. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().adapterType = strcmp(argv[i], "scsi") == 0 ?
+                                      VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC :
+                                      VIXDISKLIB_ADAPTER_IDE;
+            ++i;
+        } else if (!strcmp(argv[i], "-rmeta")) {
+            Globals().command |= COMMAND_READ_META;
+            if (i >= argc - 2) {
+                printf("Error: The -rmeta command requires a key value to "
+                       "be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().metaKey = argv[++i];
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-wmeta")) {
+            Globals().command |= COMMAND_WRITE_META;
+            if (i >= argc - 3) {
+                printf("Error: The -wmeta command requires key and value to "
+                       "be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().metaKey = argv[++i];
+            Globals().metaVal = argv[++i];
+        } else if (!strcmp(argv[i], "-getallocatedblocks")) {
+            Globals().command |= COMMAND_GET_ALLOCATED_BLOCKS;
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-mount")) {
+            Globals().command |= COMMAND_MOUNT;
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-redo")) {
+            if (i >= argc - 2) {
+                printf("Error: The -redo command requires the parentPath to "
+                       "be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().command |= COMMAND_REDO;
+            Globals().parentPath = argv[++i];
+        } else if (!strcmp(argv[i], "-chunksize")) {
+            if (i >= argc - 2) {
+                printf("Error: The -chunksize option requires the number of"
+                       "sectors to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().chunkSize = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-val")) {
+            if (i >= argc - 2) {
+                printf("Error: The -val option requires a byte value to "
+                       "be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().filler = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-dumpfile")) {
+            if (i >= argc - 2) {
+                printf("Error: The -dumpfile option requires a file path. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().dumpFile = argv[++i];
+        } else if (!strcmp(argv[i], "-fillpattern")) {
+            if (i >= argc - 2) {
+                printf("Error: The -fillpattern option requires a pattern "
+                       "name. See usage below.\n\n");
+                return PrintUsage();
+            }
+            i++;
+            if (!strcmp(argv[i], "byte")) {
+               Globals().fillPattern = FILL_BYTE;
+            } else if (!strcmp(argv[i], "zero")) {
+               Globals().fillPattern = FILL_ZERO;
+            } else if (!strcmp(argv[i], "random")) {
+               Globals().fillPattern = FILL_RANDOM;
+            } else if (!strcmp(argv[i], "lba")) {
+               Globals().fillPattern = FILL_LBA;
+            } else {
+               printf("Error: Unknown fill pattern %s. See usage below.\n\n",
+                      argv[i]);
+               return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-fillsize") ||
+                   !strcmp(argv[i], "-filldepth") ||
+                   !strcmp(argv[i], "-fillthreads")) {
+            if (i >= argc - 2) {
+                printf("Error: The %s option requires a number. "
+                       "See usage below.\n\n", argv[i]);
+                return PrintUsage();
+            }
+            uint32 n = strtoul(argv[i + 1], NULL, 0);
+            if (!strcmp(argv[i], "-fillsize")) {
+               Globals().fillSize = n;
+            } else if (!strcmp(argv[i], "-filldepth")) {
+               Globals().fillDepth = n;
+            } else {
+               Globals().fillThreads = n;
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-start")) {
+            if (i >= argc - 2) {
+                printf("Error: The -start option requires a sector number to "
+                       "be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().startSector = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-count")) {
+            if (i >= argc - 2) {
+                printf("Error: The -count option requires the number of "
+                       "sectors to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().numSectors = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-cap")) {
+            if (i >= argc - 2) {
+                printf("Error: The -cap option requires the capacity in MB "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().mbSize = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-clone")) {
+            if (i >= argc - 2) {
+                printf("Error: The -clone command requires the path of the "
+                       "source vmdk to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().srcPath = argv[++i];
+            Globals().command |= COMMAND_CLONE;
+        } else if (!strcmp(argv[i], "-compress")) {
+            if (0 && i >= argc - 2) {
+                printf("Error: The -compress command requires a compression type "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            ++i;
+            if (!strcmp(argv[i], "zlib")) {
+               Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_COMPRESSION_ZLIB;
+            } else if (!strcmp(argv[i], "fastlz")) {
+               Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_COMPRESSION_FASTLZ;
+            } else if (!strcmp(argv[i], "skipz")) {
+               Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_COMPRESSION_SKIPZ;
+            } else {
+                printf("Error: unknown compression type '%s'."
+                       "Only support zlib, fastlz and skipz.\n\n", argv[i]);
+                return PrintUsage();
+            }
+        } else if (!strcmp(argv[i], "-readbench")) {
+            if (0 && i >= argc - 2) {
+                printf("Error: The -readbench command requires a block size "
+                       "(in sectors) to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().bufSize = strtol(argv[++i], NULL, 0);
+            Globals().command |= COMMAND_READBENCH;
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-writebench")) {
+            if (i >= argc - 2) {
+                printf("Error: The -writebench command requires a block size "
+                       "(in sectors) to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().bufSize = strtol(argv[++i], NULL, 0);
+            Globals().command |= COMMAND_WRITEBENCH;
+        } else if (!strcmp(argv[i], "-readasyncbench")) {
+            if (0 && i >= argc - 2) {
+                printf("Error: The -readasyncbench command requires a block size "
+                       "(in sectors) to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().bufSize = strtol(argv[++i], NULL, 0);
+            Globals().command |= COMMAND_READASYNCBENCH;
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-writeasyncbench")) {
+            if (i >= argc - 2) {
+                printf("Error: The -writeasyncbench command requires a block size "
+                       "(in sectors) to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().bufSize = strtol(argv[++i], NULL, 0);
+            Globals().command |= COMMAND_WRITEASYNCBENCH;
+        } else if (!strcmp(argv[i], "-multithread")) {
+            if (i >= argc - 2) {
+                printf("Error: The -multithread option requires the number "
+                       "of threads to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().command |= COMMAND_MULTITHREAD;
+            Globals().numThreads = strtol(argv[++i], NULL, 0);
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+        } else if (!strcmp(argv[i], "-host")) {
+            if (i >= argc - 2) {
+                printf("Error: The -host option requires the IP address "
+                       "or name of the host to be specified. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().host = argv[++i];
+            Globals().isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-user")) {
+            if (i >= argc - 2) {
+                printf("Error: The -user option requires a username "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().userName = argv[++i];
+            Globals().isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-password")) {
+            if (i >= argc - 2) {
+                printf("Error: The -password option requires a password "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().password = argv[++i];
+            Globals().isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-cookie")) {
+            if (i >= argc - 2) {
+                printf("Error: The -cookie option requires a cookie "
+                       "to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().cookie = argv[++i];
+            Globals().isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-thumb")) {
+            if (i >= argc - 2) {
+                printf("Error: The -thumb option requires an SSL thumbprint "
+                       "to be specified. See usage below.\n\n");
+               return PrintUsage();
+            }
+            Globals().thumbPrint = argv[++i];
+            Globals().isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-port")) {
+            if (i >= argc - 2) {
+                printf("Error: The -port option requires the host's port "
+                       "number to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().port = strtol(argv[++i], NULL, 0);
+            Globals().isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-nfchostport")) {
+           if (i >= argc - 2) {
+              return PrintUsage();
+           }
+           Globals().nfcHostPort = strtol(argv[++i], NULL, 0);
+           Globals().isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-fcdid")) {
+            if (i > argc - 2) {
+                printf("Error: The -fcdid option requires the id of "
+                       "the fcd to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+           Globals().isRemote = TRUE;
+           Globals().fcdid = argv[++i];
+        } else if (!strcmp(argv[i], "-fcdssid")) {
+            if (i > argc - 2) {
+                printf("Error: The -fcdssid option requires the id of "
+                       "the fcd snapshot to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+           Globals().isRemote = TRUE;
+           Globals().fcdssid = argv[++i];
+        } else if (!strcmp(argv[i], "-ds")) {
+            if (i > argc - 2) {
+                printf("Error: The -ds option requires the datastore moref"
+                      " of the fcd to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+           Globals().isRemote = TRUE;
+           Globals().ds = argv[++i];
+        } else if (!strcmp(argv[i], "-vm")) {
+            if (i >= argc - 2) {
+                printf("Error: The -vm option requires the moref id of "
+                       "the vm to be specified. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().vmxSpec = argv[++i];
+            Globals().isRemote = TRUE;
+        } else if (!strcmp(argv[i], "-libdir")) {
+           if (i >= argc - 2) {
+              printf("Error: The -libdir option requires the folder location "
+                     "of the VDDK installation to be specified. "
+                     "See usage below.\n\n");
+              return PrintUsage();
+           }
+           Globals().libdir = argv[++i];
+        } else if (!strcmp(argv[i], "-initex")) {
+           if (i >= argc - 2) {
+              printf("Error: The -initex option requires the path and filename "
+                     "of the VDDK config file to be specified. "
+                     "See usage below.\n\n");
+              return PrintUsage();
+           }
+           Globals().useInitEx = true;
+           Globals().cfgFile = argv[++i];
+           if (Globals().cfgFile[0] == '\0') {
+              Globals().cfgFile = NULL;
+           }
+        } else if (!strcmp(argv[i], "-ssmoref")) {
+           if (i >= argc - 2) {
+              printf("Error: The -ssmoref option requires the moref id "
+                       "of a VM snapshot to be specified. "
+                       "See usage below.\n\n");
+              return PrintUsage();
+           }
+           Globals().ssMoRef = argv[++i];
+        } else if (!strcmp(argv[i], "-mode")) {
+            if (i >= argc - 2) {
+                printf("Error: The -mode option requires a mode string to  "
+                       "connect to VixDiskLib_ConnectEx. Valid modes are "
+                        "'nbd', 'nbdssl', 'san' and 'hotadd'. "
+                        "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().transportModes = argv[++i];
+        } else if (!strcmp(argv[i], "-check")) {
+            if (i >= argc - 2) {
+                printf("Error: The -check command requires a true or false "
+                       "value to indicate if a repair operation should be "
+                       "attempted. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().command |= COMMAND_CHECKREPAIR;
+            Globals().repair = strtol(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-lssize")) {
+            if (i > argc - 2) {
+               printf("Error: The -lssize option requires the number of "
+                      "logical sector size. See usage below.\n\n");
+               return PrintUsage();
+            }
+            Globals().logicalSectorSize = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-pssize")) {
+            if (i > argc - 2) {
+               printf("Error: The -pssize option requires the number of "
+                      "physical sector size. See usage below.\n\n");
+               return PrintUsage();
+            }
+            Globals().physicalSectorSize = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-unbuffered")) {
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_UNBUFFERED;
+        } else if (!strcmp(argv[i], "-poolstats")) {
+            Globals().poolStats = true;
+        } else if (!strcmp(argv[i], "-startupprofile")) {
+            Globals().startupProfile = true;
+        } else if (!strcmp(argv[i], "-nouring")) {
+            Globals().noUring = true;
+        } else if (!strcmp(argv[i], "-directio")) {
+            Globals().directIO = true;
+        } else if (!strcmp(argv[i], "-journal")) {
+            if (i >= argc - 2) {
+                printf("Error: The -journal option requires a file. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().journalPath = argv[++i];
+        } else if (!strcmp(argv[i], "-resume")) {
+            Globals().resume = true;
+        } else if (!strcmp(argv[i], "-journalhash")) {
+            Globals().journalHash = true;
+        } else if (!strcmp(argv[i], "-cache")) {
+            if (i >= argc - 2) {
+               printf("Error: The -cache option requires the cache size in "
+                      "MBytes. See usage below.\n\n");
+               return PrintUsage();
+            }
+            Globals().cacheMB = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-cachefile")) {
+            if (i >= argc - 2) {
+               printf("Error: The -cachefile option requires a file path. "
+                      "See usage below.\n\n");
+               return PrintUsage();
+            }
+            Globals().cacheFile = argv[++i];
+        } else if (!strcmp(argv[i], "-cachefilesize")) {
+            if (i >= argc - 2) {
+               printf("Error: The -cachefilesize option requires the size "
+                      "in MBytes. See usage below.\n\n");
+               return PrintUsage();
+            }
+            Globals().cacheFileMB = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-batch")) {
+            if (i >= argc - 1) {
+                printf("Error: The -batch command requires a file name or "
+                       "'-' for stdin. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().command |= COMMAND_BATCH;
+            Globals().batchFile = argv[++i];
+        } else if (!strcmp(argv[i], "-jobs")) {
+            if (i >= argc - 1) {
+                printf("Error: The -jobs option requires the number of "
+                       "parallel commands. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().numJobs = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-daemon")) {
+            if (i >= argc - 1) {
+                printf("Error: The -daemon command requires the path of "
+                       "the socket to listen on. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().command |= COMMAND_DAEMON;
+            Globals().socketPath = argv[++i];
+        } else if (!strcmp(argv[i], "-nbd") || !strcmp(argv[i], "-nbdrw")) {
+            if (i >= argc - 2) {
+                printf("Error: The %s command requires a port, host:port or "
+                       "socket path to listen on. See usage below.\n\n",
+                       argv[i]);
+                return PrintUsage();
+            }
+            if (!strcmp(argv[i], "-nbd")) {
+               Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            }
+            Globals().command |= COMMAND_NBD;
+            Globals().nbdListen = argv[++i];
+        } else if (!strcmp(argv[i], "-fuse")) {
+            if (i >= argc - 2) {
+                printf("Error: The -fuse command requires a mount point. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            Globals().command |= COMMAND_FUSE;
+            Globals().fuseMountPoint = argv[++i];
+        } else if (!strcmp(argv[i], "-exportraw")) {
+            if (i >= argc - 2) {
+                printf("Error: The -exportraw command requires a file. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            Globals().command |= COMMAND_EXPORT_RAW;
+            Globals().exportPath = argv[++i];
+        } else if (!strcmp(argv[i], "-importraw")) {
+            if (i >= argc - 2) {
+                printf("Error: The -importraw command requires a file or "
+                       "'-' for stdin. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().command |= COMMAND_IMPORT_RAW;
+            Globals().importPath = argv[++i];
+        } else if (!strcmp(argv[i], "-zeroall")) {
+            Globals().zeroAll = true;
+        } else if (!strcmp(argv[i], "-exportzip")) {
+            if (i >= argc - 2) {
+                printf("Error: The -exportzip command requires a file or "
+                       "'-' for stdout. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            Globals().command |= COMMAND_EXPORT_ZIP;
+            Globals().zipPath = argv[++i];
+        } else if (!strcmp(argv[i], "-exportstream")) {
+            if (i >= argc - 2) {
+                printf("Error: The -exportstream command requires a file or "
+                       "'-' for stdout. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            Globals().command |= COMMAND_EXPORT_STREAM;
+            Globals().streamPath = argv[++i];
+        } else if (!strcmp(argv[i], "-exportdelta")) {
+            if (i >= argc - 2) {
+                printf("Error: The -exportdelta command requires a file or "
+                       "'-' for stdout. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            Globals().command |= COMMAND_EXPORT_DELTA;
+            Globals().deltaPath = argv[++i];
+        } else if (!strcmp(argv[i], "-applydelta")) {
+            if (i >= argc - 2) {
+                printf("Error: The -applydelta command requires a file or "
+                       "'-' for stdin. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().command |= COMMAND_APPLY_DELTA;
+            Globals().applyPath = argv[++i];
+        } else if (!strcmp(argv[i], "-basemanifest")) {
+            if (i >= argc - 2) {
+                printf("Error: The -basemanifest option requires a file. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().baseManifestPath = argv[++i];
+        } else if (!strcmp(argv[i], "-manifest")) {
+            if (i >= argc - 2) {
+                printf("Error: The -manifest option requires a file. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().manifestPath = argv[++i];
+        } else if (!strcmp(argv[i], "-merkle")) {
+            if (i >= argc - 2) {
+                printf("Error: The -merkle command requires a file. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            Globals().command |= COMMAND_MERKLE;
+            Globals().merklePath = argv[++i];
+        } else if (!strcmp(argv[i], "-merklediff")) {
+            if (i >= argc - 2) {
+                printf("Error: The -merklediff command requires two files. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().command |= COMMAND_MERKLE_DIFF;
+            Globals().merkleDiff[0] = argv[++i];
+            Globals().merkleDiff[1] = argv[++i];
+        } else if (!strcmp(argv[i], "-extentcheck")) {
+            Globals().command |= COMMAND_EXTENT_CHECK;
+        } else if (!strcmp(argv[i], "-hashthreads")) {
+            if (i >= argc - 2) {
+                printf("Error: The -hashthreads option requires the number "
+                       "of threads. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().hashThreads = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-querythreads")) {
+            if (i >= argc - 2) {
+                printf("Error: The -querythreads option requires the number "
+                       "of handles. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().queryThreads = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-readgap")) {
+            if (i >= argc - 2) {
+                printf("Error: The -readgap option requires the number of "
+                       "sectors. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().readGap = strtoll(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "-blockmapdir")) {
+            if (i >= argc - 2) {
+                printf("Error: The -blockmapdir option requires a "
+                       "directory. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().blockMapDir = argv[++i];
+        } else if (!strcmp(argv[i], "-dropblockmap")) {
+            Globals().openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+            Globals().command |= COMMAND_DROP_BLOCK_MAP;
+        } else if (!strcmp(argv[i], "-codec")) {
+            if (i >= argc - 2) {
+                printf("Error: The -codec option requires a codec name. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().codecSpec = argv[++i];
+        } else if (!strcmp(argv[i], "-peinfo")) {
+            if (i >= argc - 2) {
+                printf("Error: The -peinfo option requires a file. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().peInfoFile = argv[++i];
+        } else if (!strcmp(argv[i], "-chunkmap")) {
+            if (i >= argc - 2) {
+                printf("Error: The -chunkmap option requires a file. "
+                       "See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().chunkMapPath = argv[++i];
+        } else if (!strcmp(argv[i], "-zipthreads")) {
+            if (i >= argc - 2) {
+                printf("Error: The -zipthreads option requires the number "
+                       "of threads. See usage below.\n\n");
+                return PrintUsage();
+            }
+            Globals().zipThreads = strtoul(argv[++i], NULL, 0);
+        }else if (argv[i][0] != '-') {
+          // start of disk path
+          break;
+        }
+    }
+    for (; i < argc; ++i)
+    {
+       string disk = argv[i];
+       if (!disk.empty()) {
+          Globals().diskPaths.push_back(std::move(disk));
+       }
+    }
+
+    if (Globals().fcdid != NULL) {
+       // hack to avoid crash at diskPaths[0]
+       string fcdPath;
+       fcdPath += "[";
+       fcdPath += Globals().ds;
+       fcdPath += "] ";
+       fcdPath += "VStorageObject:";
+       fcdPath += Globals().fcdid;
+
+       Globals().diskPaths.push_back(fcdPath);
+    }
+    if (Globals().diskPaths.size() == 0 &&
+        !(Globals().command & (COMMAND_BATCH | COMMAND_DAEMON |
+                               COMMAND_MERKLE_DIFF |
+                               COMMAND_EXTENT_CHECK))) {
+       printf("Error: Missing diskPath. See usage below.\n");
+       return PrintUsage();
+    }
+
+    // -create may go with -importraw, which creates the disk first.
+    int command = Globals().command;
+    if (command & COMMAND_IMPORT_RAW) {
+       command &= ~COMMAND_CREATE;
+    }
+    if (BitCount(command) != 1) {
+       printf("Error: Missing command. See usage below.\n");
+       return PrintUsage();
+    }
+    if ((Globals().command & COMMAND_DROP_BLOCK_MAP) &&
+        Globals().blockMapDir == NULL) {
+       printf("Error: -dropblockmap requires -blockmapdir. See usage "
+              "below.\n");
+       return PrintUsage();
+    }
+    if (Globals().resume && Globals().journalPath == NULL) {
+       printf("Error: -resume requires -journal. See usage below.\n");
+       return PrintUsage();
+    }
+    if (Globals().journalPath != NULL &&
+        Globals().command != COMMAND_EXPORT_RAW) {
+       printf("Error: -journal only goes with -exportraw. See usage "
+              "below.\n");
+       return PrintUsage();
+    }
+
+    if (Globals().isRemote) {
+       if (Globals().host == NULL ||
+           Globals().userName == NULL ||
+           Globals().password == NULL) {
+           printf("Error: Missing a mandatory option. ");
+           printf("-host, -user and -password must be specified. ");
+           printf("See usage below.\n");
+           return PrintUsage();
+       }
+    }
+
+    /*
+     * TODO: More error checking for params, really
+     */
+    return 0;
+}
+
+template<size_t SIZE, typename TYPE, typename LOCK>
+static std::unique_ptr<BufferPoolInterface<TYPE>>
+getBufferPool(const VixDisk& disk, size_t bufSize, uint32 alignment)
+{
+   typedef AlignedAlloc<TYPE> alignedType;
+   typedef NotAlignedAlloc<TYPE> notAlignedType;
+
+   // alignment is for the other end of the copy, e.g. an O_DIRECT file.
+   if (disk.getTransportMode() == "hotadd") {
+      alignment = std::max<uint32>(alignment,
+                                   disk.getInfo()->logicalSectorSize);
+   }
+   if (alignment > 0) {
+      alignedType alloc(alignment);
+      return std::unique_ptr<BufferPoolInterface<TYPE>>(
+                new BufferPool<SIZE, TYPE, LOCK, alignedType>(
+                   bufSize, std::forward<alignedType>(alloc)));
+   } else {
+      notAlignedType alloc;
+      return std::unique_ptr<BufferPoolInterface<TYPE>>(
+                new BufferPool<SIZE, TYPE, LOCK, notAlignedType>(
+                   bufSize, std::forward<notAlignedType>(alloc)));
+   }
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoInfo --
+ *
+ *      Queries the information of a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoInfo(void)
+{
+    VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(), Globals().openFlags);
+    VixDiskLibInfo *info = NULL;
+    VixError vixError;
+
+    vixError = VixDiskLib_GetInfo(disk.Handle(), &info);
+
+    CHECK_AND_THROW(vixError);
+
+    cout << "capacity             = " << info->capacity << " sectors" << endl;
+    cout << "logical sector size  = " << info->logicalSectorSize << " bytes"
+         << endl;
+    cout << "physical sector size = " << info->physicalSectorSize << " bytes"
+         << endl;
+    cout << "number of links      = " << info->numLinks << endl;
+    cout << "adapter type         = ";
+    switch (info->adapterType) {
+    case VIXDISKLIB_ADAPTER_IDE:
+       cout << "IDE" << endl;
+       break;
+    case VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC:
+       cout << "BusLogic SCSI" << endl;
+       break;
+    case VIXDISKLIB_ADAPTER_SCSI_LSILOGIC:
+       cout << "LsiLogic SCSI" << endl;
+       break;
+    default:
+       cout << "unknown" << endl;
+       break;
+    }
+
+    cout << "BIOS geometry        = " << info->biosGeo.cylinders <<
+       "/" << info->biosGeo.heads << "/" << info->biosGeo.sectors << endl;
+
+    cout << "physical geometry    = " << info->physGeo.cylinders <<
+       "/" << info->physGeo.heads << "/" << info->physGeo.sectors << endl;
+
+    VixDiskLib_FreeInfo(info);
+
+    cout << "Transport modes supported by vixDiskLib: " <<
+       VixDiskLib_ListTransportModes() << endl;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoCreate --
+ *
+ *      Creates a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoCreate(void)
+{
+   VixDiskLibCreateParams createParams;
+   VixError vixError;
+
+   createParams.adapterType = Globals().adapterType;
+
+   createParams.capacity = Globals().mbSize *
+                           ((1U << 20) / VIXDISKLIB_SECTOR_SIZE);
+   createParams.logicalSectorSize = Globals().logicalSectorSize;
+   createParams.physicalSectorSize = Globals().physicalSectorSize;
+   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+   vixError = VixDiskLib_Create(Globals().connection,
+                                Globals().diskPaths[0].c_str(),
+                                &createParams,
+                                NULL,
+                                NULL);
+   CHECK_AND_THROW(vixError);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoRedo --
+ *
+ *      Creates a child disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoRedo(void)
+{
+   VixError vixError;
+   VixDisk parentDisk(Globals().connection, Globals().parentPath, 0);
+   vixError = VixDiskLib_CreateChild(parentDisk.Handle(),
+                                     Globals().diskPaths[0].c_str(),
+                                     VIXDISKLIB_DISK_MONOLITHIC_SPARSE,
+                                     NULL, NULL);
+   CHECK_AND_THROW(vixError);
+}
+
+
+// -fill writes whole grains of sparse disks
+#define FILL_GRAIN 128
+
+// Sectors per -fill write: -fillsize rounded up to whole grains.
+static uint64
+FillWriteSize()
+{
+   uint64 n = Globals().fillSize != 0 ? Globals().fillSize :
+                                        VIX_FILL_WRITE_SIZE;
+   return (n + FILL_GRAIN - 1) / FILL_GRAIN * FILL_GRAIN;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoFill --
+ *
+ *      Writes to a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoFill(void)
+{
+    VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                 Globals().openFlags);
+    auto bufPool =
+       getBufferPool<std::numeric_limits<size_t>::max(), uint8, FakeLock>(
+          disk, FillWriteSize() * VIXDISKLIB_SECTOR_SIZE);
+    DoFillIO(*bufPool, disk);
+}
+
+
+/*
+ * Writes one part of a -fill range. Up to -filldepth writes of
+ * FillWriteSize() sectors are in flight at a time. Writes are synchronous
+ * only with a depth of 1 and a single worker: submissions on the shared
+ * handle are serialized by ioLock, which a synchronous write holds until
+ * it completes. Progress is reported as writes complete.
+ */
+class FillWorker
+{
+   public:
+      FillWorker(const VixDisk& disk, std::mutex& ioLock,
+                 const vector<uint8 *>& bufs, uint64 seed, bool sync)
+         : _disk(disk), _ioLock(ioLock), _free(bufs.begin(), bufs.end()),
+           _depth(bufs.size()), _sync(sync), _globals(curGlobals),
+           _rng(seed | 1), _vixError(VIX_OK), _writes(0)
+      {}
+
+      void run(uint64 start, uint64 end);
+
+      VixError error() const
+      {
+         return _vixError;
+      }
+
+      uint64 writes() const
+      {
+         return _writes;
+      }
+
+   private:
+      struct Write {
+         FillWorker *worker;
+         uint8 *buf;
+         uint64 numSectors;
+      };
+
+      void pattern(uint8 *buf, uint64 sector, uint64 numSectors);
+      uint8 *getBuffer();
+      void setError(VixError vixError);
+      static void WriteDone(void *cbData, VixError result);
+
+      const VixDisk& _disk;
+      std::mutex& _ioLock;
+      std::mutex _lock;
+      std::condition_variable _cond;
+      std::deque<uint8 *> _free;
+      const size_t _depth;
+      const bool _sync;
+      AppGlobals *_globals;   // of the command, for JobAdvance
+      uint64 _rng;
+      VixError _vixError;
+      uint64 _writes;
+};
+
+
+// Fills buf with the -fillpattern data for the given sectors.
+void
+FillWorker::pattern(uint8 *buf, uint64 sector, uint64 numSectors)
+{
+   uint64 *words = (uint64 *)buf;
+   const uint64 wordsPerSector = VIXDISKLIB_SECTOR_SIZE / sizeof(uint64);
+
+   switch (Globals().fillPattern) {
+   case FILL_RANDOM:
+      // xorshift64
+      for (uint64 i = 0; i < numSectors * wordsPerSector; i++) {
+         _rng ^= _rng << 13;
+         _rng ^= _rng >> 7;
+         _rng ^= _rng << 17;
+         words[i] = _rng;
+      }
+      break;
+   case FILL_LBA:
+      for (uint64 i = 0; i < numSectors; i++) {
+         std::fill(words + i * wordsPerSector,
+                   words + (i + 1) * wordsPerSector, sector + i);
+      }
+      break;
+   case FILL_ZERO:
+      memset(buf, 0, numSectors * VIXDISKLIB_SECTOR_SIZE);
+      break;
+   default:
+      memset(buf, Globals().filler, numSectors * VIXDISKLIB_SECTOR_SIZE);
+      break;
+   }
+}
+
+
+void
+FillWorker::setError(VixError vixError)
+{
+   if (VIX_FAILED(vixError) && !VIX_FAILED(_vixError)) {
+      _vixError = vixError;
+   }
+}
+
+
+void
+FillWorker::WriteDone(void *cbData, VixError result)
+{
+   Write *write = (Write *)cbData;
+   FillWorker *worker = write->worker;
+   GlobalsScope gs(worker->_globals);
+
+   {
+      std::lock_guard<std::mutex> lg(worker->_lock);
+      worker->setError(result);
+      if (!VIX_FAILED(result)) {
+         worker->setError(JobAdvance(write->numSectors));
+      }
+      worker->_free.push_back(write->buf);
+   }
+   worker->_cond.notify_all();
+   delete write;
+}
+
+
+// Waits for a buffer whose write completed.
+uint8 *
+FillWorker::getBuffer()
+{
+   std::unique_lock<std::mutex> lk(_lock);
+
+   while (_free.empty()) {
+      if (_cond.wait_for(lk, std::chrono::milliseconds(10)) ==
+          std::cv_status::timeout && _free.empty()) {
+         // Some transports only complete requests from VixDiskLib_Wait.
+         lk.unlock();
+         {
+            std::lock_guard<std::mutex> ioLg(_ioLock);
+            VixDiskLib_Wait(_disk.Handle());
+         }
+         lk.lock();
+      }
+   }
+   uint8 *buf = _free.front();
+   _free.pop_front();
+   return buf;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * FillWorker::run --
+ *
+ *      Fills sectors [start, end). Writes are split at multiples of
+ *      FillWriteSize(), so all but the first and last are aligned to it.
+ *
+ * Results:
+ *      None; see error().
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+FillWorker::run(uint64 start, uint64 end)
+{
+   const uint64 writeSize = FillWriteSize();
+   bool staticPattern = Globals().fillPattern == FILL_BYTE ||
+                        Globals().fillPattern == FILL_ZERO;
+
+   if (staticPattern) {
+      for (auto buf : _free) {
+         pattern(buf, 0, writeSize);
+      }
+   }
+
+   uint64 sector = start;
+   while (sector < end && !VIX_FAILED(error())) {
+      uint64 numSectors = std::min(end, (sector / writeSize + 1) * writeSize) -
+                          sector;
+      uint8 *buf = getBuffer();
+      if (!staticPattern) {
+         pattern(buf, sector, numSectors);
+      }
+
+      if (_sync) {
+         VixError vixError = blockCache.write(_disk, sector, numSectors, buf,
+                                              &_ioLock);
+         std::lock_guard<std::mutex> lg(_lock);
+         setError(vixError);
+         if (!VIX_FAILED(vixError)) {
+            setError(JobAdvance(numSectors));
+         }
+         _free.push_back(buf);
+      } else {
+         Write *write = new Write{this, buf, numSectors};
+         VixError vixError;
+         {
+            std::lock_guard<std::mutex> lg(_ioLock);
+            vixError = blockCache.writeAsync(_disk, sector, numSectors, buf,
+                                             WriteDone, write);
+         }
+         if (vixError != VIX_ASYNC) {
+            WriteDone(write, vixError);
+         }
+      }
+      _writes++;
+      sector += numSectors;
+   }
+
+   // Wait for the writes in flight.
+   for (size_t i = 0; i < _depth; i++) {
+      getBuffer();
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoFillIO --
+ *
+ *      Fills -count sectors from -start with -fillpattern, using
+ *      -fillthreads threads over disjoint parts of the range, each with
+ *      up to -filldepth writes in flight.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws VixDiskLibErrWrapper on failure.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoFillIO(BufferPoolInterface<uint8>& bufPool, const VixDisk& disk)
+{
+    const uint64 writeSize = FillWriteSize();
+    const unsigned numThreads =
+       std::min(std::max(1U, Globals().fillThreads),
+                (unsigned)VIX_FILL_MAX_THREADS);
+    const unsigned depth = std::min(std::max(1U, Globals().fillDepth),
+                                    (unsigned)VIX_FILL_MAX_DEPTH);
+    const uint64 start = Globals().startSector;
+    const uint64 end = start + Globals().numSectors;
+    std::mutex ioLock;
+    vector<std::unique_ptr<FillWorker>> workers;
+    vector<std::thread> threads;
+    vector<uint8 *> allBufs;
+
+    JobAddTotal(Globals().numSectors);
+    auto begin = std::chrono::system_clock::now();
+
+    // Split points of the threads' parts, on write boundaries.
+    uint64 part = (Globals().numSectors / numThreads + writeSize - 1) /
+                  writeSize * writeSize;
+    uint64 partStart = start;
+    for (unsigned t = 0; t < numThreads && partStart < end; t++) {
+       uint64 partEnd = t == numThreads - 1 ? end :
+                        std::min(end, (partStart + part) / writeSize *
+                                      writeSize);
+       if (partEnd <= partStart) {
+          continue;
+       }
+       vector<uint8 *> bufs;
+       for (unsigned i = 0; i < depth; i++) {
+          bufs.push_back(bufPool.getBuffer());
+       }
+       allBufs.insert(allBufs.end(), bufs.begin(), bufs.end());
+       workers.emplace_back(new FillWorker(disk, ioLock, bufs,
+                                           time(NULL) ^ ((uint64)t << 32),
+                                           depth == 1 && numThreads == 1));
+       FillWorker *worker = workers.back().get();
+       AppGlobals *globals = curGlobals;
+       threads.emplace_back([worker, globals, partStart, partEnd] () {
+                               GlobalsScope gs(globals);
+                               worker->run(partStart, partEnd);
+                            });
+       partStart = partEnd;
+    }
+
+    VixError vixError = VIX_OK;
+    uint64 writes = 0;
+    for (size_t t = 0; t < threads.size(); t++) {
+       threads[t].join();
+       if (!VIX_FAILED(vixError)) {
+          vixError = workers[t]->error();
+       }
+       writes += workers[t]->writes();
+    }
+    for (auto buf : allBufs) {
+       bufPool.returnBuffer(buf);
+    }
+    CHECK_AND_THROW(vixError);
+
+    auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now() - begin).count();
+    cout << "Filled " << Globals().numSectors << " sectors with "
+         << writes << " writes in " << msec << " msec";
+    if (msec > 0) {
+       cout << " (" << Globals().numSectors * VIXDISKLIB_SECTOR_SIZE /
+                       1000 / msec << " MBytes/sec)";
+    }
+    cout << endl;
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoReadMetadata --
+ *
+ *      Reads metadata from a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoReadMetadata(void)
+{
+    size_t requiredLen;
+    VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(), Globals().openFlags);
+    VixError vixError = VixDiskLib_ReadMetadata(disk.Handle(),
+                                                Globals().metaKey,
+                                                NULL, 0, &requiredLen);
+    if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
+        THROW_ERROR(vixError);
+    }
+    std::vector <char> val(requiredLen);
+    vixError = VixDiskLib_ReadMetadata(disk.Handle(),
+                                       Globals().metaKey,
+                                       &val[0],
+                                       requiredLen,
+                                       NULL);
+    CHECK_AND_THROW(vixError);
+    cout << Globals().metaKey << " = " << &val[0] << endl;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoWriteMetadata --
+ *
+ *      Writes metadata in a virtual disk.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoWriteMetadata(void)
+{
+    VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(), Globals().openFlags);
+    VixError vixError = VixDiskLib_WriteMetadata(disk.Handle(),
+                                                 Globals().metaKey,
+                                                 Globals().metaVal);
+    CHECK_AND_THROW(vixError);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDumpMetadata --
+ *
+ *      Dumps all the metadata.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDumpMetadata(void)
+{
+    VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(), Globals().openFlags);
+    char *key;
+    size_t requiredLen;
+
+    VixError vixError = VixDiskLib_GetMetadataKeys(disk.Handle(),
+                                                   NULL, 0, &requiredLen);
+    if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
+       THROW_ERROR(vixError);
+    }
+    std::vector<char> buf(requiredLen);
+    vixError = VixDiskLib_GetMetadataKeys(disk.Handle(), &buf[0], requiredLen, NULL);
+    CHECK_AND_THROW(vixError);
+    key = &buf[0];
+
+    while (*key) {
+        vixError = VixDiskLib_ReadMetadata(disk.Handle(), key, NULL, 0,
+                                           &requiredLen);
+        if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
+           THROW_ERROR(vixError);
+        }
+        std::vector <char> val(requiredLen);
+        vixError = VixDiskLib_ReadMetadata(disk.Handle(), key, &val[0],
+                                           requiredLen, NULL);
+        CHECK_AND_THROW(vixError);
+        cout << key << " = " << &val[0] << endl;
+        key += (1 + strlen(key));
+    }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDump --
+ *
+ *      Dumps the content of a virtual disk, in hex or with -dumpfile raw
+ *      to a file. Reads VIX_DUMP_CHUNK sectors at a time through
+ *      ReadAhead.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDump(void)
+{
+    VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(), Globals().openFlags);
+    auto raPool = getBufferPool<VIX_READAHEAD_DEPTH, uint8, ThreadLock>(
+                     disk, VIX_READAHEAD_MAX * VIXDISKLIB_SECTOR_SIZE);
+    ReadAhead readAhead(disk.Handle(), disk.getInfo()->capacity, *raPool);
+    std::unique_ptr<uint8[]> buf(
+       new uint8[VIX_DUMP_CHUNK * VIXDISKLIB_SECTOR_SIZE]);
+    std::unique_ptr<FILE, int (*)(FILE *)> file(NULL, fclose);
+    string out;
+    VixDiskLibSectorType i, n;
+
+    if (Globals().dumpFile != NULL) {
+       file.reset(fopen(Globals().dumpFile, "wb"));
+       if (!file) {
+          cout << "Can't create " << Globals().dumpFile << ": "
+               << strerror(errno) << endl;
+          THROW_ERROR(VIX_E_FILE_ERROR);
+       }
+    }
+
+    JobAddTotal(Globals().numSectors);
+    for (i = 0; i < Globals().numSectors; i += n) {
+       n = std::min<VixDiskLibSectorType>(VIX_DUMP_CHUNK,
+                                          Globals().numSectors - i);
+       VixError vixError = readAhead.read(Globals().startSector + i, n,
+                                          buf.get());
+       CHECK_AND_THROW(vixError);
+       if (file) {
+          if (fwrite(buf.get(), VIXDISKLIB_SECTOR_SIZE, n, file.get()) != n) {
+             cout << "Can't write " << Globals().dumpFile << ": "
+                  << strerror(errno) << endl;
+             THROW_ERROR(VIX_E_FILE_ERROR);
+          }
+       } else {
+          out.clear();
+          for (VixDiskLibSectorType s = 0; s < n; s++) {
+             DumpBytes(buf.get() + s * VIXDISKLIB_SECTOR_SIZE,
+                       VIXDISKLIB_SECTOR_SIZE, 16, out);
+          }
+          fwrite(out.data(), 1, out.size(), stdout);
+       }
+       vixError = JobAdvance(n);
+       CHECK_AND_THROW(vixError);
+    }
+    if (file) {
+       if (fclose(file.release()) != 0) {
+          cout << "Can't write " << Globals().dumpFile << ": "
+               << strerror(errno) << endl;
+          THROW_ERROR(VIX_E_FILE_ERROR);
+       }
+       cout << "Wrote " << Globals().numSectors * VIXDISKLIB_SECTOR_SIZE
+            << " bytes to " << Globals().dumpFile << endl;
+    } else {
+       fflush(stdout);
+    }
+    readAhead.printStats();
+}
+
+
+// Little-endian fields of the -blockmapdir, -journal, -exportdelta
+// manifest and delta files.
+static void
+PutLE(string& s, uint64 v, int bytes)
+{
+   for (int i = 0; i < bytes; i++) {
+      s.push_back((char)(v >> (8 * i)));
+   }
+}
+
+static uint64
+GetLE(const uint8 *p, int bytes)
+{
+   uint64 v = 0;
+
+   for (int i = bytes - 1; i >= 0; i--) {
+      v = (v << 8) | p[i];
+   }
+   return v;
+}
+
+
+/*
+ * A set of sectors as sorted, disjoint extents, stored compactly: each
+ * extent is the gap since the end of the one before it and its length,
+ * as variable length integers counted in units of UNIT sectors when they
+ * are multiples of it. Allocation maps in 64K chunks take about two bytes
+ * per extent this way, where VixDiskLibBlocks take sixteen. An index entry
+ * every INDEX_STRIDE extents lets iterators seek.
+ *
+ * Extents are added in increasing order of offset; adjacent and
+ * overlapping ones are merged. unite(), intersect() and subtract() make a
+ * new map in one pass over both, coalesce() merges extents at most a gap
+ * apart, and aligned() rounds them out to a unit. Iterator::nextPiece()
+ * cuts the extents at multiples of an I/O unit. -extentcheck checks them
+ * against bitmaps (see DoExtentCheck).
+ */
+
+class ExtentMap
+{
+   public:
+      class Iterator
+      {
+         public:
+            explicit Iterator(const ExtentMap& map);
+
+            bool next(VixDiskLibBlock& extent);
+            bool nextPiece(uint64 unit, VixDiskLibBlock& piece);
+            void seek(uint64 sector);
+
+         private:
+            const ExtentMap& _map;
+            size_t _pos;              // in _map._bytes
+            uint64 _end;              // of the extent before _pos
+            bool _lastDone;           // _map._last handed out
+            VixDiskLibBlock _piece;   // left of the extent of nextPiece()
+      };
+
+      ExtentMap();
+
+      void add(uint64 offset, uint64 length);
+
+      ExtentMap coalesce(uint64 maxGap) const;
+      ExtentMap aligned(uint64 unit, uint64 capacity) const;
+
+      static ExtentMap unite(const ExtentMap& a, const ExtentMap& b);
+      static ExtentMap intersect(const ExtentMap& a, const ExtentMap& b);
+      static ExtentMap subtract(const ExtentMap& a, const ExtentMap& b);
+
+      vector<uint8> encoded() const;
+      bool decode(const uint8 *p, size_t len);
+
+      uint64 count() const
+      {
+         return _count;
+      }
+
+      uint64 sectors() const
+      {
+         return _sectors;
+      }
+
+      // Memory taken by the extents.
+      size_t bytes() const
+      {
+         return _bytes.size() + _index.size() * sizeof(IndexEntry);
+      }
+
+   private:
+      static const uint64 UNIT = VIXDISKLIB_MIN_CHUNK_SIZE;
+      static const uint64 INDEX_STRIDE = 256;
+
+      struct IndexEntry {
+         uint64 end;       // of the extents before pos
+         size_t pos;
+      };
+
+      void flush();
+      static void Encode(vector<uint8>& out, uint64 value);
+      static uint64 Decode(const uint8 *&p);
+      static bool Decode(const uint8 *&p, const uint8 *end, uint64& value);
+      template<typename Keep>
+      static ExtentMap Combine(const ExtentMap& a, const ExtentMap& b,
+                               Keep keep);
+
+      vector<uint8> _bytes;
+      vector<IndexEntry> _index;
+      uint64 _encoded;           // extents in _bytes
+      uint64 _end;               // of the last of them
+      bool _haveLast;
+      VixDiskLibBlock _last;     // not encoded yet, as it may still grow
+      uint64 _count;
+      uint64 _sectors;
+};
+
+
+ExtentMap::ExtentMap()
+   : _encoded(0), _end(0), _haveLast(false), _count(0), _sectors(0)
+{
+}
+
+
+void
+ExtentMap::Encode(vector<uint8>& out,     // IN/OUT
+                  uint64 value)           // IN
+{
+   value = value % UNIT == 0 ? value / UNIT << 1 : value << 1 | 1;
+   while (value >= 0x80) {
+      out.push_back((uint8)(value | 0x80));
+      value >>= 7;
+   }
+   out.push_back((uint8)value);
+}
+
+
+uint64
+ExtentMap::Decode(const uint8 *&p)     // IN/OUT
+{
+   uint64 value = 0;
+
+   for (unsigned shift = 0; ; shift += 7) {
+      uint8 b = *p++;
+      value |= (uint64)(b & 0x7f) << shift;
+      if (b < 0x80) {
+         break;
+      }
+   }
+   return value & 1 ? value >> 1 : (value >> 1) * UNIT;
+}
+
+
+// Decodes a value of untrusted data ending at end.
+bool
+ExtentMap::Decode(const uint8 *&p,         // IN/OUT
+                  const uint8 *end,        // IN
+                  uint64& value)           // OUT
+{
+   uint64 v = 0;
+
+   for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+      uint8 b = *p++;
+      v |= (uint64)(b & 0x7f) << shift;
+      if (b < 0x80) {
+         if (!(v & 1) && v >> 1 > std::numeric_limits<uint64>::max() / UNIT) {
+            return false;
+         }
+         value = v & 1 ? v >> 1 : (v >> 1) * UNIT;
+         return true;
+      }
+   }
+   return false;
+}
+
+
+// Encodes the last extent.
+void
+ExtentMap::flush()
+{
+   if (!_haveLast) {
+      return;
+   }
+   if (_encoded % INDEX_STRIDE == 0) {
+      _index.push_back({_end, _bytes.size()});
+   }
+   Encode(_bytes, _last.offset - _end);
+   Encode(_bytes, _last.length);
+   _end = _last.offset + _last.length;
+   _encoded++;
+   _haveLast = false;
+}
+
+
+// Adds [offset, offset + length). offset must not be below the offset of
+// the extent added before.
+void
+ExtentMap::add(uint64 offset,     // IN
+               uint64 length)     // IN
+{
+   if (length == 0) {
+      return;
+   }
+   if (_haveLast && offset <= _last.offset + _last.length) {
+      uint64 end = std::max(_last.offset + _last.length, offset + length);
+      _sectors += end - (_last.offset + _last.length);
+      _last.length = end - _last.offset;
+      return;
+   }
+   flush();
+   _last.offset = offset;
+   _last.length = length;
+   _haveLast = true;
+   _count++;
+   _sectors += length;
+}
+
+
+// The extents as a map stores them, for files.
+vector<uint8>
+ExtentMap::encoded() const
+{
+   vector<uint8> out(_bytes);
+
+   if (_haveLast) {
+      Encode(out, _last.offset - _end);
+      Encode(out, _last.length);
+   }
+   return out;
+}
+
+
+// Replaces the extents with ones of encoded(), which may be damaged.
+bool
+ExtentMap::decode(const uint8 *p,     // IN
+                  size_t len)         // IN
+{
+   const uint8 *end = p + len;
+   const uint64 max = std::numeric_limits<uint64>::max();
+   uint64 pos = 0;
+
+   *this = ExtentMap();
+   while (p < end) {
+      uint64 gap;
+      uint64 length;
+      if (!Decode(p, end, gap) || !Decode(p, end, length) || length == 0 ||
+          gap > max - pos || length > max - pos - gap) {
+         *this = ExtentMap();
+         return false;
+      }
+      add(pos + gap, length);
+      pos += gap + length;
+   }
+   return true;
+}
+
+
+// The extents with the gaps of at most maxGap sectors between them filled.
+ExtentMap
+ExtentMap::coalesce(uint64 maxGap) const     // IN
+{
+   ExtentMap result;
+   Iterator it(*this);
+   VixDiskLibBlock e;
+
+   while (it.next(e)) {
+      if (result._haveLast) {
+         uint64 end = result._last.offset + result._last.length;
+         if (e.offset - end <= maxGap) {
+            result.add(end, e.offset + e.length - end);
+            continue;
+         }
+      }
+      result.add(e.offset, e.length);
+   }
+   return result;
+}
+
+
+// The extents rounded out to multiples of unit, up to capacity.
+ExtentMap
+ExtentMap::aligned(uint64 unit,              // IN
+                   uint64 capacity) const    // IN
+{
+   ExtentMap result;
+   Iterator it(*this);
+   VixDiskLibBlock e;
+
+   while (it.next(e)) {
+      uint64 first = e.offset / unit * unit;
+      uint64 last = std::min(capacity,
+                             (e.offset + e.length + unit - 1) / unit * unit);
+      result.add(first, last - first);
+   }
+   return result;
+}
+
+
+// Walks both maps from boundary to boundary and keeps the ranges for which
+// keep(in a, in b) holds, which it mustn't for neither.
+template<typename Keep>
+ExtentMap
+ExtentMap::Combine(const ExtentMap& a,     // IN
+                   const ExtentMap& b,     // IN
+                   Keep keep)              // IN
+{
+   ExtentMap result;
+   Iterator ia(a);
+   Iterator ib(b);
+   VixDiskLibBlock ea;
+   VixDiskLibBlock eb;
+   bool haveA = ia.next(ea);
+   bool haveB = ib.next(eb);
+   uint64 pos = 0;
+
+   while (haveA || haveB) {
+      bool inA = haveA && ea.offset <= pos;
+      bool inB = haveB && eb.offset <= pos;
+      uint64 to = std::numeric_limits<uint64>::max();
+      if (haveA) {
+         to = std::min(to, inA ? ea.offset + ea.length : ea.offset);
+      }
+      if (haveB) {
+         to = std::min(to, inB ? eb.offset + eb.length : eb.offset);
+      }
+      if (keep(inA, inB)) {
+         result.add(pos, to - pos);
+      }
+      pos = to;
+      if (haveA && ea.offset + ea.length <= pos) {
+         haveA = ia.next(ea);
+      }
+      if (haveB && eb.offset + eb.length <= pos) {
+         haveB = ib.next(eb);
+      }
+   }
+   return result;
+}
+
+
+ExtentMap
+ExtentMap::unite(const ExtentMap& a,     // IN
+                 const ExtentMap& b)     // IN
+{
+   return Combine(a, b, [] (bool inA, bool inB) { return inA || inB; });
+}
+
+
+ExtentMap
+ExtentMap::intersect(const ExtentMap& a,     // IN
+                     const ExtentMap& b)     // IN
+{
+   return Combine(a, b, [] (bool inA, bool inB) { return inA && inB; });
+}
+
+
+ExtentMap
+ExtentMap::subtract(const ExtentMap& a,     // IN
+                    const ExtentMap& b)     // IN
+{
+   return Combine(a, b, [] (bool inA, bool inB) { return inA && !inB; });
+}
+
+
+ExtentMap::Iterator::Iterator(const ExtentMap& map)     // IN
+   : _map(map), _pos(0), _end(0), _lastDone(false)
+{
+   _piece.offset = 0;
+   _piece.length = 0;
+}
+
+
+bool
+ExtentMap::Iterator::next(VixDiskLibBlock& extent)     // OUT
+{
+   if (_pos < _map._bytes.size()) {
+      const uint8 *p = _map._bytes.data() + _pos;
+      extent.offset = _end + Decode(p);
+      extent.length = Decode(p);
+      _pos = p - _map._bytes.data();
+      _end = extent.offset + extent.length;
+      return true;
+   }
+   if (_map._haveLast && !_lastDone) {
+      _lastDone = true;
+      extent = _map._last;
+      _end = extent.offset + extent.length;
+      return true;
+   }
+   return false;
+}
+
+
+// Returns the extents cut at multiples of unit.
+bool
+ExtentMap::Iterator::nextPiece(uint64 unit,                // IN
+                               VixDiskLibBlock& piece)     // OUT
+{
+   if (_piece.length == 0 && !next(_piece)) {
+      return false;
+   }
+   piece.offset = _piece.offset;
+   piece.length = std::min(_piece.offset + _piece.length,
+                           (_piece.offset / unit + 1) * unit) - _piece.offset;
+   _piece.offset += piece.length;
+   _piece.length -= piece.length;
+   return true;
+}
+
+
+// Moves to the first extent that ends after sector.
+void
+ExtentMap::Iterator::seek(uint64 sector)     // IN
+{
+   const auto& index = _map._index;
+   auto i = std::upper_bound(index.begin(), index.end(), sector,
+                             [] (uint64 s, const IndexEntry& e) {
+                                return s < e.end;
+                             });
+   if (i == index.begin()) {
+      _pos = 0;
+      _end = 0;
+   } else {
+      --i;
+      _pos = i->pos;
+      _end = i->end;
+   }
+   _piece.length = 0;
+   _lastDone = false;
+
+   const uint8 *data = _map._bytes.data();
+   while (_pos < _map._bytes.size()) {
+      const uint8 *p = data + _pos;
+      uint64 offset = _end + Decode(p);
+      uint64 end = offset + Decode(p);
+      if (end > sector) {
+         return;
+      }
+      _pos = p - data;
+      _end = end;
+   }
+   _lastDone = _map._haveLast &&
+               _map._last.offset + _map._last.length <= sector;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoExtentCheck --
+ *
+ *      Checks the ExtentMap operations on random maps against the same
+ *      operations on bitmaps of their sectors: unite(), intersect(),
+ *      subtract(), coalesce(), aligned(), Iterator::seek() and decoding
+ *      what encoded() gives.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws VixDiskLibErrWrapper if a result differs.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoExtentCheck(void)
+{
+   static const uint64 capacity = 1 << 16;
+   static const unsigned rounds = 200;
+   const uint64 unit = VIXDISKLIB_MIN_CHUNK_SIZE;
+   uint64 rng = (uint64)time(NULL) | 1;
+   typedef vector<bool> Bits;
+
+   // xorshift64
+   auto random = [&rng] (uint64 n) {
+      rng ^= rng << 13;
+      rng ^= rng >> 7;
+      rng ^= rng << 17;
+      return rng % n;
+   };
+   // Extents of whole units or odd sizes, some touching the one before.
+   auto randomMap = [&random] () {
+      ExtentMap map;
+      uint64 pos = random(2 * unit);
+      while (pos < capacity) {
+         uint64 length = random(2) ? (random(4) + 1) * unit :
+                                     random(3 * unit) + 1;
+         length = std::min(length, capacity - pos);
+         map.add(pos, length);
+         pos += length + (random(4) == 0 ? 0 : random(4 * unit));
+      }
+      return map;
+   };
+   auto bitsOf = [] (const ExtentMap& map) {
+      Bits bits(capacity);
+      ExtentMap::Iterator it(map);
+      VixDiskLibBlock e;
+      while (it.next(e)) {
+         std::fill(bits.begin() + e.offset,
+                   bits.begin() + e.offset + e.length, true);
+      }
+      return bits;
+   };
+   auto check = [&bitsOf] (const char *what, const ExtentMap& map,
+                           const Bits& expected) {
+      if (bitsOf(map) != expected) {
+         cout << "ExtentMap::" << what << " is wrong." << endl;
+         THROW_ERROR(VIX_E_FAIL);
+      }
+   };
+
+   for (unsigned round = 0; round < rounds; round++) {
+      ExtentMap a = randomMap();
+      ExtentMap b = randomMap();
+      Bits bitsA = bitsOf(a);
+      Bits bitsB = bitsOf(b);
+      Bits united(capacity);
+      Bits common(capacity);
+      Bits rest(capacity);
+      for (uint64 s = 0; s < capacity; s++) {
+         united[s] = bitsA[s] || bitsB[s];
+         common[s] = bitsA[s] && bitsB[s];
+         rest[s] = bitsA[s] && !bitsB[s];
+      }
+      check("unite", ExtentMap::unite(a, b), united);
+      check("intersect", ExtentMap::intersect(a, b), common);
+      check("subtract", ExtentMap::subtract(a, b), rest);
+
+      // Gaps of at most maxGap between set sectors are filled.
+      uint64 maxGap = random(2 * unit);
+      Bits coalesced(bitsA);
+      uint64 lastSet = capacity;
+      for (uint64 s = 0; s < capacity; s++) {
+         if (bitsA[s]) {
+            if (lastSet != capacity && s - lastSet - 1 <= maxGap) {
+               std::fill(coalesced.begin() + lastSet, coalesced.begin() + s,
+                         true);
+            }
+            lastSet = s;
+         }
+      }
+      check("coalesce", a.coalesce(maxGap), coalesced);
+
+      // Units with a set sector are set, up to a capacity the extents
+      // lie within.
+      uint64 alignCap = capacity - random(unit);
+      ExtentMap disk;
+      disk.add(0, alignCap);
+      Bits alignedBits(capacity);
+      for (uint64 s = 0; s < alignCap; s++) {
+         if (bitsA[s]) {
+            uint64 first = s / unit * unit;
+            std::fill(alignedBits.begin() + first,
+                      alignedBits.begin() + std::min(alignCap, first + unit),
+                      true);
+         }
+      }
+      check("aligned", ExtentMap::intersect(a, disk).aligned(unit, alignCap),
+            alignedBits);
+
+      ExtentMap decoded;
+      vector<uint8> bytes = a.encoded();
+      if (!decoded.decode(bytes.data(), bytes.size())) {
+         cout << "ExtentMap::decode failed." << endl;
+         THROW_ERROR(VIX_E_FAIL);
+      }
+      check("decode", decoded, bitsA);
+
+      // seek() moves to the first extent ending after the sector.
+      uint64 sector = random(capacity);
+      uint64 s = sector;
+      while (s < capacity && !bitsA[s]) {
+         s++;
+      }
+      ExtentMap::Iterator it(a);
+      VixDiskLibBlock e;
+      it.seek(sector);
+      bool found = it.next(e);
+      if (found != (s < capacity) ||
+          (found && (e.offset > s || e.offset + e.length <= s))) {
+         cout << "ExtentMap::Iterator::seek is wrong." << endl;
+         THROW_ERROR(VIX_E_FAIL);
+      }
+   }
+   cout << "ExtentMap operations match the bitmaps in " << rounds
+        << " rounds." << endl;
+}
+
+
+/*
+ * Allocated-block maps kept across runs in the files of -blockmapdir, one
+ * per disk and chunk size, named <SHA-256 of the SnapshotIdentity>.<chunk
+ * size>.map, so a -single link and its chain get different maps. A file is
+ *
+ *    "VIXBMAP1" chunkSize:8 capacity:8 count:8 sectors:8 identityLen:4
+ *    0:4 bytes:8 identity extents
+ *
+ * with bytes of extents as ExtentMap::encoded() has them, and is mapped to
+ * be read. Only maps of disks whose data can't change under the same
+ * identity are kept: local disks, whose identity has the modification times
+ * of their files, and snapshots (-ssmoref, -fcdssid). Maps are saved only
+ * from read-only handles, as a writer may allocate blocks behind a query.
+ * Nothing drops a map but -dropblockmap.
+ */
+
+#ifndef _WIN32
+
+static const char blockMapMagic[8] = { 'V', 'I', 'X', 'B', 'M', 'A', 'P',
+                                       '1' };
+static const size_t BLOCK_MAP_HEADER = 56;
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BlockMapName --
+ *
+ *      Finds the -blockmapdir files of disk: their path up to the chunk
+ *      size, and the identity they must hold.
+ *
+ * Results:
+ *      false if no maps are kept for disk.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+BlockMapName(const VixDisk& disk,      // IN
+             string& identity,         // OUT
+             string& name)             // OUT
+{
+   if (Globals().blockMapDir == NULL ||
+       !SnapshotIdentity(disk.connection(), disk.path().c_str(), disk.flags(),
+                         disk.getInfo()->capacity, identity)) {
+      return false;
+   }
+
+   uint8 digest[SHA256_DIGEST_LENGTH];
+   char hex[2 * SHA256_DIGEST_LENGTH + 1];
+   SHA256((const uint8 *)identity.data(), identity.size(), digest);
+   for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+      sprintf(hex + 2 * i, "%02x", digest[i]);
+   }
+   name = string(Globals().blockMapDir) + "/" + hex;
+   return true;
+}
+
+
+// Loads the map in file if it is one of identity in chunkSize chunks.
+static bool
+LoadBlockMap(const string& file,          // IN
+             const string& identity,      // IN
+             uint64 chunkSize,            // IN
+             ExtentMap& map)              // OUT
+{
+   int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      return false;
+   }
+   struct stat st;
+   void *mem = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && (uint64)st.st_size >= BLOCK_MAP_HEADER) {
+      mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   }
+   close(fd);
+   if (mem == MAP_FAILED) {
+      return false;
+   }
+
+   const uint8 *p = (const uint8 *)mem;
+   uint64 size = st.st_size;
+   uint64 idLen = GetLE(p + 40, 4);
+   uint64 bytes = GetLE(p + 48, 8);
+   bool ok = memcmp(p, blockMapMagic, sizeof blockMapMagic) == 0 &&
+             GetLE(p + 8, 8) == chunkSize &&
+             idLen == identity.size() &&
+             bytes == size - BLOCK_MAP_HEADER - idLen &&
+             memcmp(p + BLOCK_MAP_HEADER, identity.data(), idLen) == 0;
+   if (ok) {
+      ok = map.decode(p + BLOCK_MAP_HEADER + idLen, bytes) &&
+           map.count() == GetLE(p + 24, 8) &&
+           map.sectors() == GetLE(p + 32, 8);
+      if (!ok) {
+         cout << "Ignoring the damaged block map " << file << "." << endl;
+      }
+   }
+   munmap(mem, size);
+   return ok;
+}
+
+
+// Saves map as file, through a temporary file so readers see all or none.
+static void
+SaveBlockMap(const string& file,          // IN
+             const string& identity,      // IN
+             uint64 chunkSize,            // IN
+             uint64 capacity,             // IN
+             const ExtentMap& map)        // IN
+{
+   vector<char> tmp(file.begin(), file.end());
+   vector<uint8> extents = map.encoded();
+   string header(blockMapMagic, sizeof blockMapMagic);
+
+   PutLE(header, chunkSize, 8);
+   PutLE(header, capacity, 8);
+   PutLE(header, map.count(), 8);
+   PutLE(header, map.sectors(), 8);
+   PutLE(header, identity.size(), 4);
+   PutLE(header, 0, 4);
+   PutLE(header, extents.size(), 8);
+   header += identity;
+
+   mkdir(Globals().blockMapDir, 0755);
+   const char suffix[] = ".XXXXXX";
+   tmp.insert(tmp.end(), suffix, suffix + sizeof suffix);
+   int fd = mkostemp(tmp.data(), O_CLOEXEC);
+   bool ok = fd >= 0 && fchmod(fd, 0644) == 0 &&
+             WriteAll(fd, header.data(), header.size()) &&
+             WriteAll(fd, extents.data(), extents.size()) &&
+             fsync(fd) == 0;
+   if (fd >= 0) {
+      ok = close(fd) == 0 && ok;
+   }
+   if (!ok || rename(tmp.data(), file.c_str()) != 0) {
+      cout << "Can't save the block map " << file << ": " << strerror(errno)
+           << endl;
+      if (fd >= 0) {
+         unlink(tmp.data());
+      }
+   }
+}
+
+#else
+
+static bool
+BlockMapName(const VixDisk& disk, string& identity, string& name)
+{
+   return false;
+}
+
+static bool
+LoadBlockMap(const string& file, const string& identity, uint64 chunkSize,
+             ExtentMap& map)
+{
+   return false;
+}
+
+static void
+SaveBlockMap(const string& file, const string& identity, uint64 chunkSize,
+             uint64 capacity, const ExtentMap& map)
+{
+}
+
+#endif // _WIN32
+
+
+/*
+ * Queries the allocated blocks of a disk in windows of VIX_QUERY_CHUNKS
+ * chunks on several read-only handles of its own at once, and hands the
+ * blocks out in order as soon as the windows up to them are done: merged
+ * with the adjacent ones by next(), as they come by allocated(). The
+ * workers stay at most two windows per handle ahead of the consumer. With
+ * a single handle, or when no other handle can be opened, all windows are
+ * queried on the disk's own handle up front instead: the consumer may
+ * start async I/O on it, and queries can't be mixed with that.
+ *
+ * A window that can't be queried throws, or with allOnError is
+ * reported as allocated, for transports without allocation info. The
+ * unaligned tail of the disk is always reported.
+ *
+ * With -blockmapdir, a map kept for the disk is handed out instead of
+ * querying, and a map queried completely is kept.
+ */
+
+class BlockQuery
+{
+   public:
+      BlockQuery(const VixDisk& disk, uint64 chunkSize, unsigned handles,
+                 bool allOnError = false);
+      ~BlockQuery();
+
+      bool next(VixDiskLibBlock& block);
+      bool allocated(uint64 sector, uint64 numSectors);
+
+   private:
+      struct Window {
+         uint64 offset;
+         uint64 length;
+         bool done;
+         bool failed;
+         VixError vixError;
+         vector<VixDiskLibBlock> blocks;
+      };
+
+      void query(VixDiskLibHandle handle, Window& window);
+      void worker(VixDiskLibHandle handle);
+      bool fetch(VixDiskLibBlock& block);
+
+      uint64 _chunkSize;
+      uint64 _capacity;
+      bool _allOnError;
+      size_t _ahead;
+      string _identity;
+      string _mapFile;               // to keep the map in
+      ExtentMap _map;
+      std::unique_ptr<ExtentMap::Iterator> _mapIt;   // of a kept map
+      vector<Window> _windows;
+      VixDiskLibBlock _tail;
+      size_t _nextQuery;             // next window for a worker
+      size_t _nextOut;               // window next() is at
+      size_t _nextBlock;             // block of it
+      bool _havePending;
+      VixDiskLibBlock _pending;      // merged, not handed out yet
+      bool _haveCurrent;
+      bool _atEnd;
+      VixDiskLibBlock _current;      // for allocated()
+      vector<VixDisk::Ptr> _disks;
+      std::mutex _lock;
+      std::condition_variable _queryCv;
+      std::condition_variable _doneCv;
+      bool _stop;
+      vector<std::thread> _threads;
+};
+
+
+BlockQuery::BlockQuery(const VixDisk& disk,      // IN
+                       uint64 chunkSize,         // IN
+                       unsigned handles,         // IN
+                       bool allOnError)          // IN
+   : _chunkSize(chunkSize), _capacity(disk.getInfo()->capacity),
+     _allOnError(allOnError), _ahead(2 * std::max(1U, handles)),
+     _nextQuery(0), _nextOut(0), _nextBlock(0), _havePending(false),
+     _haveCurrent(false), _atEnd(false), _stop(false)
+{
+   const uint64 capacity = _capacity;
+   const uint64 aligned = capacity / chunkSize * chunkSize;
+   string name;
+
+   _tail.length = 0;
+   if (BlockMapName(disk, _identity, name)) {
+      _mapFile = name + "." + std::to_string(chunkSize) + ".map";
+      if (LoadBlockMap(_mapFile, _identity, chunkSize, _map)) {
+         _mapIt.reset(new ExtentMap::Iterator(_map));
+         _mapFile.clear();
+         return;
+      }
+      if ((disk.flags() & VIXDISKLIB_FLAG_OPEN_READ_ONLY) == 0) {
+         _mapFile.clear();
+      }
+   }
+   const uint64 windowSectors =
+      std::min<uint64>(VIX_QUERY_CHUNKS, VIXDISKLIB_MAX_CHUNK_NUMBER) *
+      chunkSize;
+
+   for (uint64 offset = 0; offset < aligned; offset += windowSectors) {
+      Window w;
+      w.offset = offset;
+      w.length = std::min(windowSectors, aligned - offset);
+      w.done = false;
+      w.failed = false;
+      w.vixError = VIX_OK;
+      _windows.push_back(std::move(w));
+   }
+   _tail.offset = aligned;
+   _tail.length = capacity - aligned;
+   JobAddTotal(aligned);
+
+   if (handles > 1 && _windows.size() > 1) {
+      size_t wanted = std::min<size_t>(handles, _windows.size());
+      try {
+         while (_disks.size() < wanted) {
+            _disks.push_back(disk.reopen());
+         }
+      } catch (const VixDiskLibErrWrapper&) {
+         cout << "Can't open more handles of the disk, querying the "
+              << "allocated blocks on " << std::max<size_t>(1, _disks.size())
+              << "." << endl;
+      }
+   }
+
+   if (_disks.empty()) {
+      for (auto& w : _windows) {
+         query(disk.Handle(), w);
+         w.done = true;
+         if (w.vixError != VIX_OK) {
+            VixError vixError = w.vixError;
+            CHECK_AND_THROW(vixError);
+         }
+      }
+   } else {
+      for (const auto& d : _disks) {
+         VixDiskLibHandle handle = d->Handle();
+         _threads.emplace_back([this, handle] () { worker(handle); });
+      }
+   }
+}
+
+
+BlockQuery::~BlockQuery()
+{
+   {
+      std::lock_guard<std::mutex> lg(_lock);
+      _stop = true;
+   }
+   _queryCv.notify_all();
+   for (auto& t : _threads) {
+      t.join();
+   }
+}
+
+
+void
+BlockQuery::query(VixDiskLibHandle handle,      // IN
+                  Window& w)                    // IN/OUT
+{
+   VixDiskLibBlockList *blockList = NULL;
+   VixError vixError = VixDiskLib_QueryAllocatedBlocks(handle, w.offset,
+                                                       w.length, _chunkSize,
+                                                       &blockList);
+   if (VIX_FAILED(vixError)) {
+      if (_allOnError) {
+         VixDiskLibBlock all;
+         all.offset = w.offset;
+         all.length = w.length;
+         w.blocks.push_back(all);
+         w.failed = true;
+      } else {
+         w.vixError = vixError;
+      }
+      return;
+   }
+   w.blocks.assign(blockList->blocks,
+                   blockList->blocks + blockList->numBlocks);
+   VixDiskLib_FreeBlockList(blockList);
+}
+
+
+void
+BlockQuery::worker(VixDiskLibHandle handle)     // IN
+{
+   std::unique_lock<std::mutex> lk(_lock);
+
+   for (;;) {
+      _queryCv.wait(lk, [this] () {
+         return _stop || _nextQuery == _windows.size() ||
+                _nextQuery < _nextOut + _ahead;
+      });
+      if (_stop || _nextQuery == _windows.size()) {
+         return;
+      }
+      Window& w = _windows[_nextQuery++];
+      lk.unlock();
+      query(handle, w);
+      lk.lock();
+      w.done = true;
+      _doneCv.notify_all();
+   }
+}
+
+
+// Returns the blocks of the windows in order as they are done, then the
+// tail, false after that, or those of a kept map.
+bool
+BlockQuery::fetch(VixDiskLibBlock& block)     // OUT
+{
+   if (_mapIt) {
+      return _mapIt->next(block);
+   }
+   while (_nextOut < _windows.size()) {
+      Window& w = _windows[_nextOut];
+      if (_nextBlock == 0) {
+         std::unique_lock<std::mutex> lk(_lock);
+         _doneCv.wait(lk, [&w] () { return w.done; });
+      }
+      if (w.vixError != VIX_OK) {
+         VixError vixError = w.vixError;
+         CHECK_AND_THROW(vixError);
+      }
+      if (w.failed) {
+         _mapFile.clear();
+      }
+      if (_nextBlock < w.blocks.size()) {
+         block = w.blocks[_nextBlock++];
+         if (!_mapFile.empty()) {
+            _map.add(block.offset, block.length);
+         }
+         return true;
+      }
+      vector<VixDiskLibBlock>().swap(w.blocks);
+      {
+         std::lock_guard<std::mutex> lg(_lock);
+         _nextOut++;
+         _nextBlock = 0;
+      }
+      _queryCv.notify_all();
+      VixError vixError = JobAdvance(w.length);
+      CHECK_AND_THROW(vixError);
+   }
+   if (_tail.length > 0) {
+      block = _tail;
+      _tail.length = 0;
+      if (!_mapFile.empty()) {
+         _map.add(block.offset, block.length);
+      }
+      return true;
+   }
+   if (!_mapFile.empty()) {
+      SaveBlockMap(_mapFile, _identity, _chunkSize, _capacity, _map);
+      _mapFile.clear();
+   }
+   return false;
+}
+
+
+// Returns the next block, adjacent ones merged, false after the last one.
+bool
+BlockQuery::next(VixDiskLibBlock& block)     // OUT
+{
+   VixDiskLibBlock b;
+
+   while (fetch(b)) {
+      if (!_havePending) {
+         _pending = b;
+         _havePending = true;
+      } else if (_pending.offset + _pending.length == b.offset) {
+         _pending.length += b.length;
+      } else {
+         block = _pending;
+         _pending = b;
+         return true;
+      }
+   }
+   if (_havePending) {
+      _havePending = false;
+      block = _pending;
+      return true;
+   }
+   return false;
+}
+
+
+// Whether [sector, sector + numSectors) has allocated blocks, for sectors
+// that don't decrease from call to call. Doesn't wait for the merging of
+// next(), so don't mix the two. Asking up to the end of the disk
+// completes the map.
+bool
+BlockQuery::allocated(uint64 sector,         // IN
+                      uint64 numSectors)     // IN
+{
+   while (!_atEnd &&
+          (!_haveCurrent || _current.offset + _current.length <= sector)) {
+      _haveCurrent = fetch(_current);
+      _atEnd = !_haveCurrent;
+   }
+   bool result = _haveCurrent && _current.offset < sector + numSectors;
+   if (sector + numSectors >= _capacity) {
+      VixDiskLibBlock rest;
+      while (!_atEnd) {
+         _atEnd = !fetch(rest);
+      }
+   }
+   return result;
+}
+
+
+// Handles for the BlockQuerys of a command: -querythreads, or
+// VIX_QUERY_THREADS for remote disks, whose queries are round trips.
+// Commands on several disks split them between the disks.
+static unsigned
+QueryHandles(void)
+{
+   if (Globals().queryThreads != 0) {
+      return std::min<unsigned>(Globals().queryThreads,
+                                VIX_QUERY_MAX_THREADS);
+   }
+   return Globals().isRemote ? VIX_QUERY_THREADS : 1;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * GetAllocatedBlocks --
+ *
+ *      Queries the allocated blocks of disk in units of chunkSize sectors
+ *      on QueryHandles() handles, see BlockQuery. The unaligned tail of
+ *      the disk is always reported.
+ *
+ * Results:
+ *      The blocks are added to blocks.
+ *
+ * Side effects:
+ *      Throws on error.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+GetAllocatedBlocks(const VixDisk& disk,                // IN
+                   uint64 chunkSize,                   // IN
+                   ExtentMap& blocks)                  // OUT
+{
+    BlockQuery query(disk, chunkSize, QueryHandles());
+    VixDiskLibBlock block;
+
+    while (query.next(block)) {
+        blocks.add(block.offset, block.length);
+    }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoGetAllocatedBlocks --
+ *
+ *      Gets the allocated block info of a virtual disk. The blocks are
+ *      printed as they come in, the count after them.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoGetAllocatedBlocks(void)
+{
+    VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                 Globals().openFlags);
+    uint64 capacity = disk.getInfo()->capacity;
+    BlockQuery query(disk, Globals().chunkSize, QueryHandles());
+    VixDiskLibBlock block;
+    ExtentMap blocks;
+
+    printf("\n");
+    while (query.next(block)) {
+        if (blocks.count() == 0) {
+            printf("%-14s\t\t%-14s\n", "Offset", "Length");
+        }
+        printf("0x%012" FMT64 "X\t\t0x%012" FMT64 "X\n",
+               block.offset, block.length);
+        blocks.add(block.offset, block.length);
+    }
+    printf("Number of blocks: %" FMT64 "u (%" FMTSZ "u bytes as an extent "
+           "map)\n", blocks.count(), blocks.bytes());
+    printf("allocated size (%" FMT64 "u) / capacity (%" FMT64 "u) : %u%%\n",
+           blocks.sectors(), capacity,
+           (unsigned int)(blocks.sectors() * 100 / capacity));
+    printf("\n");
+}
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDropBlockMap --
+ *
+ *      Removes the maps of the allocated blocks of the disk, for every
+ *      chunk size, from -blockmapdir, so the next command queries them
+ *      again.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Deletes files in Globals().blockMapDir.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+#ifdef _WIN32
+
+static void
+DoDropBlockMap(void)
+{
+   cout << "-dropblockmap is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+#else
+
+static void
+DoDropBlockMap(void)
+{
+   VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                Globals().openFlags);
+   string identity;
+   string name;
+
+   if (!BlockMapName(disk, identity, name)) {
+      cout << "No block maps are kept for this disk." << endl;
+      return;
+   }
+
+   string prefix = name.substr(name.rfind('/') + 1) + ".";
+   DIR *dir = opendir(Globals().blockMapDir);
+   if (dir == NULL) {
+      cout << "Can't open " << Globals().blockMapDir << ": "
+           << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   unsigned dropped = 0;
+   struct dirent *entry;
+   while ((entry = readdir(dir)) != NULL) {
+      string file(entry->d_name);
+      if (file.compare(0, prefix.size(), prefix) == 0 &&
+          unlinkat(dirfd(dir), entry->d_name, 0) == 0) {
+         dropped++;
+      }
+   }
+   closedir(dir);
+   cout << "Dropped " << dropped << " block maps." << endl;
+}
+
+#endif // _WIN32
+
+
+
+#ifndef _WIN32
+
+static bool
+PWriteAll(int fd, const uint8 *buf, size_t len, uint64 off)
+{
+   while (len > 0) {
+      ssize_t n = pwrite(fd, buf, len, off);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return false;
+      }
+      buf += n;
+      len -= n;
+      off += n;
+   }
+   return true;
+}
+
+
+// Reads len bytes at off; the part past the end of the file reads as zeros.
+static bool
+PReadAll(int fd, uint8 *buf, size_t len, uint64 off)
+{
+   while (len > 0) {
+      ssize_t n = pread(fd, buf, len, off);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n < 0) {
+         return false;
+      }
+      if (n == 0) {
+         memset(buf, 0, len);
+         break;
+      }
+      buf += n;
+      len -= n;
+      off += n;
+   }
+   return true;
+}
+
+
+/*
+ * Asynchronous I/O on a local file, the local side of -exportraw and the
+ * like, so that writing to (or reading from) a staging disk overlaps with
+ * the VixDiskLib reads instead of serialising behind them.
+ *
+ * On Linux this uses an io_uring of VIX_URING_DEPTH entries, set up with
+ * raw system calls. Requests are queued in the submission ring and handed
+ * to the kernel in one io_uring_enter per submit(); completions are picked
+ * up by polling the completion ring, entering the kernel only to wait.
+ * The buffers of a fixed size BufferPool are registered with the ring so
+ * I/O on them skips the per request page pinning. Without io_uring (other
+ * systems, older kernels, seccomp, or -nouring) each request is done at
+ * once with pwrite/pread.
+ *
+ * Callbacks run on the thread calling write/read/poll/wait; they get 0 or
+ * the errno of the failed request. error() is the first such errno.
+ */
+
+class LocalFile
+{
+   public:
+      typedef void (*DoneCB)(void *cbData, int err);
+
+      LocalFile(int fd, BufferPoolInterface<uint8> *pool = NULL);
+      ~LocalFile();
+
+      void write(const uint8 *buf, size_t len, uint64 off, DoneCB cb,
+                 void *cbData);
+      void read(uint8 *buf, size_t len, uint64 off, DoneCB cb,
+                void *cbData);
+      void submit();
+      void poll();
+      void wait(unsigned maxPending = 0);
+      unsigned pending() const { return _pending; }
+      int error() const { return _error; }
+      string backend() const;
+
+   private:
+      struct Request {
+         uint8 *buf;
+         size_t len;
+         uint64 off;
+         size_t done;
+         bool write;
+         int bufIndex;
+         struct iovec iov;
+         DoneCB cb;
+         void *cbData;
+      };
+
+      void start(Request *req);
+      void complete(Request *req, int err);
+
+      int _fd;
+      unsigned _pending;
+      int _error;
+#ifdef VIX_HAVE_URING
+      void closeRing();
+      void queue(Request *req);
+      void enter(unsigned minComplete);
+      void reap();
+
+      int _ring;
+      unsigned _sqEntries;
+      unsigned _cqEntries;
+      unsigned _queued;
+      void *_sqMap;
+      size_t _sqMapSize;
+      void *_cqMap;
+      size_t _cqMapSize;
+      struct io_uring_sqe *_sqes;
+      unsigned *_sqTail;
+      unsigned _sqMask;
+      unsigned *_sqArray;
+      unsigned *_cqHead;
+      unsigned *_cqTail;
+      unsigned _cqMask;
+      struct io_uring_cqe *_cqes;
+      std::map<const uint8 *, int> _fixed;
+      size_t _fixedSize;
+#endif
+};
+
+
+LocalFile::LocalFile(int fd,                              // IN
+                     BufferPoolInterface<uint8> *pool)    // IN
+   : _fd(fd), _pending(0), _error(0)
+{
+#ifdef VIX_HAVE_URING
+   _ring = -1;
+   _queued = 0;
+   _sqMap = _cqMap = MAP_FAILED;
+   _sqes = (struct io_uring_sqe *)MAP_FAILED;
+   _fixedSize = 0;
+   if (Globals().noUring) {
+      return;
+   }
+
+   struct io_uring_params params;
+   memset(&params, 0, sizeof params);
+   _ring = syscall(__NR_io_uring_setup, VIX_URING_DEPTH, &params);
+   if (_ring < 0) {
+      return;
+   }
+   _sqEntries = params.sq_entries;
+   _cqEntries = params.cq_entries;
+   _sqMapSize = params.sq_off.array + _sqEntries * sizeof(unsigned);
+   _cqMapSize = params.cq_off.cqes +
+                _cqEntries * sizeof(struct io_uring_cqe);
+   _sqMap = mmap(NULL, _sqMapSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+   _cqMap = mmap(NULL, _cqMapSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+   _sqes = (struct io_uring_sqe *)
+      mmap(NULL, _sqEntries * sizeof(struct io_uring_sqe),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring,
+           IORING_OFF_SQES);
+   if (_sqMap == MAP_FAILED || _cqMap == MAP_FAILED ||
+       _sqes == MAP_FAILED) {
+      closeRing();
+      return;
+   }
+
+   uint8 *sq = (uint8 *)_sqMap;
+   uint8 *cq = (uint8 *)_cqMap;
+   _sqTail = (unsigned *)(sq + params.sq_off.tail);
+   _sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+   _sqArray = (unsigned *)(sq + params.sq_off.array);
+   _cqHead = (unsigned *)(cq + params.cq_off.head);
+   _cqTail = (unsigned *)(cq + params.cq_off.tail);
+   _cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+   _cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+   // Registration may fail, e.g. on RLIMIT_MEMLOCK; I/O then just isn't
+   // fixed.
+   vector<uint8 *> bufs;
+   if (pool != NULL) {
+      bufs = pool->buffers();
+   }
+   if (!bufs.empty()) {
+      vector<struct iovec> iovs(bufs.size());
+      for (size_t i = 0; i < bufs.size(); i++) {
+         iovs[i].iov_base = bufs[i];
+         iovs[i].iov_len = pool->bufferSize();
+      }
+      if (syscall(__NR_io_uring_register, _ring, IORING_REGISTER_BUFFERS,
+                  iovs.data(), (unsigned)iovs.size()) == 0) {
+         for (size_t i = 0; i < bufs.size(); i++) {
+            _fixed[bufs[i]] = i;
+         }
+         _fixedSize = pool->bufferSize();
+      }
+   }
+#else
+   (void)pool;
+#endif
+}
+
+
+LocalFile::~LocalFile()
+{
+#ifdef VIX_HAVE_URING
+   if (_ring >= 0) {
+      try {
+         wait();
+      } catch (...) {
+         // The kernel may still use the buffers; better leak than corrupt.
+         return;
+      }
+      closeRing();
+   }
+#endif
+}
+
+
+#ifdef VIX_HAVE_URING
+
+void
+LocalFile::closeRing()
+{
+   if (_sqes != MAP_FAILED) {
+      munmap(_sqes, _sqEntries * sizeof(struct io_uring_sqe));
+   }
+   if (_cqMap != MAP_FAILED) {
+      munmap(_cqMap, _cqMapSize);
+   }
+   if (_sqMap != MAP_FAILED) {
+      munmap(_sqMap, _sqMapSize);
+   }
+   close(_ring);
+   _ring = -1;
+}
+
+#endif
+
+
+string
+LocalFile::backend() const
+{
+#ifdef VIX_HAVE_URING
+   if (_ring >= 0) {
+      std::ostringstream s;
+      s << "io_uring";
+      if (!_fixed.empty()) {
+         s << ", " << _fixed.size() << " registered buffers";
+      }
+      return s.str();
+   }
+#endif
+   return "pread/pwrite";
+}
+
+
+void
+LocalFile::write(const uint8 *buf,    // IN
+                 size_t len,          // IN
+                 uint64 off,          // IN
+                 DoneCB cb,           // IN
+                 void *cbData)        // IN
+{
+   Request *req = new Request;
+
+   req->buf = const_cast<uint8 *>(buf);
+   req->len = len;
+   req->off = off;
+   req->done = 0;
+   req->write = true;
+   req->bufIndex = -1;
+   req->cb = cb;
+   req->cbData = cbData;
+   start(req);
+}
+
+
+void
+LocalFile::read(uint8 *buf,           // OUT
+                size_t len,           // IN
+                uint64 off,           // IN
+                DoneCB cb,            // IN
+                void *cbData)         // IN
+{
+   Request *req = new Request;
+
+   req->buf = buf;
+   req->len = len;
+   req->off = off;
+   req->done = 0;
+   req->write = false;
+   req->bufIndex = -1;
+   req->cb = cb;
+   req->cbData = cbData;
+   start(req);
+}
+
+
+void
+LocalFile::start(Request *req)   // IN
+{
+   _pending++;
+#ifdef VIX_HAVE_URING
+   if (_ring >= 0) {
+      // The registered buffer holding all of req->buf, if any.
+      auto it = _fixed.upper_bound(req->buf);
+      req->bufIndex = -1;
+      if (it != _fixed.begin()) {
+         --it;
+         if (req->buf + req->len <= it->first + _fixedSize) {
+            req->bufIndex = it->second;
+         }
+      }
+      // Don't let completions overflow the completion ring.
+      if (_pending > _cqEntries) {
+         wait(_cqEntries);
+      }
+      queue(req);
+      return;
+   }
+#endif
+   bool ok = req->write ? PWriteAll(_fd, req->buf, req->len, req->off)
+                        : PReadAll(_fd, req->buf, req->len, req->off);
+   complete(req, ok ? 0 : (errno != 0 ? errno : EIO));
+}
+
+
+void
+LocalFile::complete(Request *req,     // IN
+                    int err)          // IN
+{
+   _pending--;
+   if (err != 0 && _error == 0) {
+      _error = err;
+   }
+   req->cb(req->cbData, err);
+   delete req;
+}
+
+
+// Hands the queued requests to the kernel.
+void
+LocalFile::submit()
+{
+#ifdef VIX_HAVE_URING
+   if (_ring >= 0 && _queued > 0) {
+      enter(0);
+   }
+#endif
+}
+
+
+// Runs the callbacks of the requests completed so far, without waiting.
+void
+LocalFile::poll()
+{
+#ifdef VIX_HAVE_URING
+   if (_ring >= 0) {
+      reap();
+      // Short transfers are requeued by reap().
+      if (_queued > 0) {
+         enter(0);
+      }
+   }
+#endif
+}
+
+
+// Submits the queued requests and waits until at most maxPending are left.
+void
+LocalFile::wait(unsigned maxPending)   // IN
+{
+#ifdef VIX_HAVE_URING
+   if (_ring < 0) {
+      return;
+   }
+   reap();
+   while (_pending > maxPending) {
+      enter(1);
+      reap();
+   }
+#else
+   (void)maxPending;
+#endif
+}
+
+
+#ifdef VIX_HAVE_URING
+
+void
+LocalFile::queue(Request *req)   // IN
+{
+   if (_queued == _sqEntries) {
+      enter(0);
+   }
+
+   unsigned tail = *_sqTail;
+   unsigned index = tail & _sqMask;
+   struct io_uring_sqe *sqe = &_sqes[index];
+
+   memset(sqe, 0, sizeof *sqe);
+   sqe->fd = _fd;
+   sqe->off = req->off + req->done;
+   sqe->user_data = (uint64)(uintptr_t)req;
+   if (req->bufIndex >= 0) {
+      sqe->opcode = req->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+      sqe->addr = (uint64)(uintptr_t)(req->buf + req->done);
+      sqe->len = req->len - req->done;
+      sqe->buf_index = req->bufIndex;
+   } else {
+      req->iov.iov_base = req->buf + req->done;
+      req->iov.iov_len = req->len - req->done;
+      sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->addr = (uint64)(uintptr_t)&req->iov;
+      sqe->len = 1;
+   }
+   _sqArray[index] = index;
+   __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+   _queued++;
+}
+
+
+void
+LocalFile::enter(unsigned minComplete)   // IN
+{
+   for (;;) {
+      int n = syscall(__NR_io_uring_enter, _ring, _queued, minComplete,
+                      minComplete > 0 ? IORING_ENTER_GETEVENTS : 0,
+                      NULL, 0);
+      if (n >= 0) {
+         _queued -= std::min<unsigned>(n, _queued);
+         return;
+      }
+      if (errno == EINTR) {
+         continue;
+      }
+      if (errno == EAGAIN || errno == EBUSY) {
+         // Out of resources until completions are reaped.
+         reap();
+         if (minComplete > 0) {
+            minComplete = 0;
+         }
+         continue;
+      }
+      cout << "io_uring_enter failed: " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+}
+
+
+void
+LocalFile::reap()
+{
+   unsigned head = *_cqHead;
+
+   while (head != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = &_cqes[head & _cqMask];
+      Request *req = (Request *)(uintptr_t)cqe->user_data;
+      int res = cqe->res;
+
+      __atomic_store_n(_cqHead, ++head, __ATOMIC_RELEASE);
+      // Callbacks and requeueing may run reap() recursively.
+      if (res == -EINTR || res == -EAGAIN) {
+         queue(req);
+      } else if (res < 0) {
+         complete(req, -res);
+      } else if (res == 0) {
+         if (req->write) {
+            complete(req, EIO);
+         } else {
+            memset(req->buf + req->done, 0, req->len - req->done);
+            complete(req, 0);
+         }
+      } else if ((req->done += res) < req->len) {
+         queue(req);
+      } else {
+         complete(req, 0);
+      }
+      head = *_cqHead;
+   }
+}
+
+#endif // VIX_HAVE_URING
+
+#endif // !_WIN32
+
+
+#ifndef _WIN32
+
+/*
+ * Content-defined chunking for -chunkmap: splits each extent of disk data
+ * into chunks whose boundaries depend on the content (FastCDC: a gear
+ * rolling hash with normalized chunking), so that an insertion or a
+ * shifted block moves only nearby boundaries, and fingerprints every
+ * chunk with SHA-256. The boundaries are the same however the data is
+ * split across feed() calls.
+ *
+ * The gear hash is inherently serial, so instead of SIMD it takes two
+ * bytes per step as in FastCDC 2020; the first VIX_CDC_MIN bytes of a
+ * chunk are not hashed at all.
+ */
+
+class ContentChunker
+{
+   public:
+      struct Chunk {
+         uint64 offset;        // bytes
+         uint32 length;
+         uint8 sha256[SHA256_DIGEST_LENGTH];
+      };
+      typedef std::function<void(const Chunk&)> Sink;
+
+      explicit ContentChunker(Sink sink);
+
+      void start(uint64 offset);
+      void feed(const uint8 *buf, size_t len);
+      void finish();
+
+   private:
+      static const uint64 *Gear();
+      static const uint64 *GearShifted();
+      static uint64 SpreadMask(unsigned bits);
+      size_t scan(const uint8 *buf, size_t len, bool& boundary);
+      void cut();
+
+      Sink _sink;
+      uint64 _offset;          // of the current chunk
+      uint64 _length;          // of the current chunk so far
+      uint64 _fp;
+      SHA256_CTX _sha;
+      uint64 _maskS;           // before VIX_CDC_AVG: harder to cut
+      uint64 _maskL;           // after it: easier
+};
+
+
+// 256 fixed pseudo random values (splitmix64), part of the chunk format.
+const uint64 *
+ContentChunker::Gear()
+{
+   static const vector<uint64> gear = [] () {
+      vector<uint64> g(256);
+      uint64 x = 0x6b8b4567327b23c6ULL;
+      for (auto& v : g) {
+         uint64 z = (x += 0x9e3779b97f4a7c15ULL);
+         z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+         z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+         v = z ^ (z >> 31);
+      }
+      return g;
+   }();
+   return gear.data();
+}
+
+
+const uint64 *
+ContentChunker::GearShifted()
+{
+   static const vector<uint64> gear = [] () {
+      vector<uint64> g(Gear(), Gear() + 256);
+      for (auto& v : g) {
+         v <<= 1;
+      }
+      return g;
+   }();
+   return gear.data();
+}
+
+
+// A mask of bits ones spread over the upper 48 bits of the hash, which
+// have seen the most bytes.
+uint64
+ContentChunker::SpreadMask(unsigned bits)   // IN
+{
+   uint64 mask = 0;
+
+   for (unsigned i = 0; i < bits; i++) {
+      mask |= 1ULL << (62 - i * 47 / std::max(bits - 1, 1U));
+   }
+   return mask;
+}
+
+
+ContentChunker::ContentChunker(Sink sink)   // IN
+   : _sink(sink), _offset(0), _length(0), _fp(0)
+{
+   unsigned bits = 0;
+   while ((2ULL << bits) <= VIX_CDC_AVG) {
+      bits++;
+   }
+   _maskS = SpreadMask(bits + 2);
+   _maskL = SpreadMask(bits - 2);
+   SHA256_Init(&_sha);
+}
+
+
+// Starts a new extent at byte offset, ending the current one.
+void
+ContentChunker::start(uint64 offset)   // IN
+{
+   finish();
+   _offset = offset;
+}
+
+
+// Ends the current extent: what is left of it becomes the last chunk.
+void
+ContentChunker::finish()
+{
+   if (_length > 0) {
+      cut();
+   }
+}
+
+
+void
+ContentChunker::cut()
+{
+   Chunk chunk;
+
+   chunk.offset = _offset;
+   chunk.length = _length;
+   SHA256_Final(chunk.sha256, &_sha);
+   _sink(chunk);
+   _offset += _length;
+   _length = 0;
+   _fp = 0;
+   SHA256_Init(&_sha);
+}
+
+
+/*
+ * Hashes buf[0, len) into the current chunk. Returns how many bytes belong
+ * to it, and whether the chunk ends after them.
+ */
+size_t
+ContentChunker::scan(const uint8 *buf,   // IN
+                     size_t len,         // IN
+                     bool& boundary)     // OUT
+{
+   const uint64 *gear = Gear();
+   const uint64 *gearShifted = GearShifted();
+   uint64 fp = _fp;
+   size_t i = 0;
+
+   boundary = true;
+   // Cut points closer than VIX_CDC_MIN aren't looked for.
+   if (_length < VIX_CDC_MIN) {
+      i = std::min<uint64>(len, VIX_CDC_MIN - _length);
+   }
+   size_t limit = std::min<uint64>(len, VIX_CDC_MAX - _length);
+   size_t normal = _length < VIX_CDC_AVG ?
+                   std::min<uint64>(limit, VIX_CDC_AVG - _length) : 0;
+   uint64 mask = _maskS;
+   for (int phase = 0; phase < 2; phase++) {
+      size_t end = phase == 0 ? normal : limit;
+      for (; i + 2 <= end; i += 2) {
+         // fp << 1 after the first byte, and fp after the second.
+         fp = (fp << 2) + gearShifted[buf[i]];
+         if ((fp & (mask << 1)) == 0) {
+            _fp = fp >> 1;
+            return i + 1;
+         }
+         fp += gear[buf[i + 1]];
+         if ((fp & mask) == 0) {
+            _fp = fp;
+            return i + 2;
+         }
+      }
+      if (i < end) {
+         fp = (fp << 1) + gear[buf[i]];
+         i++;
+         if ((fp & mask) == 0) {
+            _fp = fp;
+            return i;
+         }
+      }
+      mask = _maskL;
+   }
+   _fp = fp;
+   boundary = _length + i == VIX_CDC_MAX;
+   return i;
+}
+
+
+void
+ContentChunker::feed(const uint8 *buf,   // IN
+                     size_t len)         // IN
+{
+   while (len > 0) {
+      bool boundary;
+      size_t n = scan(buf, len, boundary);
+
+      SHA256_Update(&_sha, buf, n);
+      _length += n;
+      buf += n;
+      len -= n;
+      if (boundary) {
+         cut();
+      }
+   }
+}
+
+
+/*
+ * The -chunkmap file: a line per chunk with its byte offset on the disk,
+ * its length and its SHA-256, in disk order. Ranges the disk doesn't have
+ * allocated have no chunks.
+ */
+
+class ChunkMap
+{
+   public:
+      ChunkMap()
+         : _chunker([this] (const ContentChunker::Chunk& c) { add(c); }),
+           _file(NULL), _chunks(0), _bytes(0), _nextSector(~0ULL)
+      {}
+
+      ~ChunkMap()
+      {
+         if (_file != NULL) {
+            fclose(_file);
+         }
+      }
+
+      bool open(const char *path);
+      void feed(uint64 sector, const uint8 *buf, uint64 numSectors);
+      void close();
+
+   private:
+      void add(const ContentChunker::Chunk& chunk);
+
+      ContentChunker _chunker;
+      FILE *_file;
+      string _path;
+      uint64 _chunks;
+      uint64 _bytes;
+      uint64 _nextSector;
+      std::unordered_set<uint64> _unique;
+};
+
+
+bool
+ChunkMap::open(const char *path)   // IN
+{
+   _path = path;
+   _file = fopen(path, "w");
+   if (_file == NULL) {
+      cout << "Can't create " << path << ": " << strerror(errno) << endl;
+      return false;
+   }
+   fprintf(_file, "# chunkmap 1 fastcdc %u %u %u sha256\n", VIX_CDC_MIN,
+           VIX_CDC_AVG, VIX_CDC_MAX);
+   return true;
+}
+
+
+// Chunks disk data read at sector; data not following the previous call
+// starts a new extent.
+void
+ChunkMap::feed(uint64 sector,          // IN
+               const uint8 *buf,       // IN
+               uint64 numSectors)      // IN
+{
+   if (sector != _nextSector) {
+      _chunker.start(sector * VIXDISKLIB_SECTOR_SIZE);
+   }
+   _chunker.feed(buf, numSectors * VIXDISKLIB_SECTOR_SIZE);
+   _nextSector = sector + numSectors;
+}
+
+
+void
+ChunkMap::add(const ContentChunker::Chunk& chunk)   // IN
+{
+   char hex[2 * SHA256_DIGEST_LENGTH + 1];
+   uint64 key;
+
+   for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+      sprintf(hex + 2 * i, "%02x", chunk.sha256[i]);
+   }
+   fprintf(_file, "%" FMT64 "u %u %s\n", chunk.offset, chunk.length, hex);
+   memcpy(&key, chunk.sha256, sizeof key);
+   _unique.insert(key);
+   _chunks++;
+   _bytes += chunk.length;
+}
+
+
+void
+ChunkMap::close()
+{
+   _chunker.finish();
+   FILE *file = _file;
+   _file = NULL;
+   bool failed = ferror(file) != 0;
+   if (fclose(file) != 0 || failed) {
+      cout << "Can't write " << _path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   cout << "Chunk map " << _path << ": " << _chunks << " chunks of "
+        << (_chunks > 0 ? _bytes / _chunks : 0) << " bytes on average, "
+        << _unique.size() << " unique" << endl;
+}
+
+#endif // !_WIN32
+
+
+#ifdef _WIN32
+
+static void
+DoExportRaw(void)
+{
+   cout << "-exportraw is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+#else
+
+static bool
+IsAllZero(const uint8 *buf, size_t len)
+{
+   return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ZeroRange --
+ *
+ *      Makes [off, off + len) of fd read back as zeros, by punching a hole
+ *      where the file system or device supports it, else by writing
+ *      zeros.
+ *
+ * Results:
+ *      false on write error.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+ZeroRange(int fd,           // IN
+          uint64 off,       // IN
+          uint64 len)       // IN
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+   if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off,
+                 len) == 0) {
+      return true;
+   }
+#endif
+   vector<uint8> zeros(std::min<uint64>(len, VIX_EXPORT_CHUNK *
+                                             VIXDISKLIB_SECTOR_SIZE));
+   while (len > 0) {
+      uint64 n = std::min<uint64>(len, zeros.size());
+      if (!PWriteAll(fd, zeros.data(), n, off)) {
+         return false;
+      }
+      off += n;
+      len -= n;
+   }
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DirectIOAlignment --
+ *
+ *      Alignment of O_DIRECT buffers, offsets and lengths for fd: the
+ *      logical block size of a block device, else the file system block
+ *      size, capped at 4096 bytes which any file system accepts.
+ *
+ * Results:
+ *      The alignment in bytes.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static uint32
+DirectIOAlignment(int fd)   // IN
+{
+   struct stat st;
+
+   if (fstat(fd, &st) != 0) {
+      return 4096;
+   }
+#ifdef BLKSSZGET
+   int blockSize;
+   if (S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &blockSize) == 0 &&
+       blockSize > 0) {
+      return blockSize;
+   }
+#endif
+   return std::min<uint32>(std::max<uint32>(st.st_blksize,
+                                            VIXDISKLIB_SECTOR_SIZE),
+                           4096);
+}
+
+
+/*
+ * The -journal of -exportraw: the range of the disk durably written to
+ * the image at each checkpoint, so that -resume can carry on from the
+ * last one. The ranges follow each other from sector 0. With -journalhash
+ * each range also has the SHA-256 of the SHA-256s of its VIX_EXPORT_CHUNK
+ * pieces, which -resume checks against the image. A torn last record is
+ * dropped.
+ *
+ *    "VIXJRNL1" pieceSectors:4 flags:4 capacity:8 identityLen:4 0:4
+ *    identity
+ *    start:8 end:8 [digest:32] per checkpoint
+ */
+
+class ExportJournal
+{
+   public:
+      struct Range {
+         uint64 start;
+         uint64 end;
+         uint8 digest[SHA256_DIGEST_LENGTH];
+      };
+
+      ExportJournal() : _fd(-1), _hashes(false), _size(0) {}
+
+      ~ExportJournal()
+      {
+         if (_fd >= 0) {
+            close(_fd);
+         }
+      }
+
+      bool create(const char *path, const string& identity, uint64 capacity,
+                  bool hashes);
+      bool resume(const char *path, const string& identity, uint64 capacity);
+      bool append(uint64 start, uint64 end, const uint8 *digest);
+
+      bool isOpen() const
+      {
+         return _fd >= 0;
+      }
+
+      bool hashes() const
+      {
+         return _hashes;
+      }
+
+      const vector<Range>& ranges() const
+      {
+         return _ranges;
+      }
+
+      // Everything below is in the image.
+      uint64 mark() const
+      {
+         return _ranges.empty() ? 0 : _ranges.back().end;
+      }
+
+   private:
+      static const uint32 FLAG_HASHES = 1;
+      static const size_t HEADER = 32;
+
+      size_t recordSize() const
+      {
+         return 16 + (_hashes ? SHA256_DIGEST_LENGTH : 0);
+      }
+
+      int _fd;
+      bool _hashes;
+      uint64 _size;
+      vector<Range> _ranges;
+};
+
+
+bool
+ExportJournal::create(const char *path,           // IN
+                      const string& identity,     // IN
+                      uint64 capacity,            // IN
+                      bool hashes)                // IN
+{
+   string header("VIXJRNL1");
+
+   _hashes = hashes;
+   PutLE(header, VIX_EXPORT_CHUNK, 4);
+   PutLE(header, hashes ? FLAG_HASHES : 0, 4);
+   PutLE(header, capacity, 8);
+   PutLE(header, identity.size(), 4);
+   PutLE(header, 0, 4);
+   header += identity;
+
+   _fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (_fd < 0 || !PWriteAll(_fd, (const uint8 *)header.data(),
+                             header.size(), 0) ||
+       fsync(_fd) != 0) {
+      cout << "Can't create " << path << ": " << strerror(errno) << endl;
+      return false;
+   }
+   _size = header.size();
+   return true;
+}
+
+
+bool
+ExportJournal::resume(const char *path,           // IN
+                      const string& identity,     // IN
+                      uint64 capacity)            // IN
+{
+   _fd = open(path, O_RDWR | O_CLOEXEC);
+   if (_fd < 0) {
+      cout << "Can't open " << path << ": " << strerror(errno) << endl;
+      return false;
+   }
+   struct stat st;
+   uint8 header[HEADER];
+   if (fstat(_fd, &st) != 0 || !PReadAll(_fd, header, sizeof header, 0) ||
+       memcmp(header, "VIXJRNL1", 8) != 0) {
+      cout << path << " is not a journal." << endl;
+      return false;
+   }
+   _hashes = (GetLE(header + 12, 4) & FLAG_HASHES) != 0;
+   string journaled(GetLE(header + 24, 4), '\0');
+   if (!PReadAll(_fd, (uint8 *)&journaled[0], journaled.size(), HEADER)) {
+      cout << "Can't read " << path << ": " << strerror(errno) << endl;
+      return false;
+   }
+   if (GetLE(header + 8, 4) != VIX_EXPORT_CHUNK ||
+       GetLE(header + 16, 8) != capacity) {
+      cout << path << " is of an export with another chunk size or disk "
+           << "capacity." << endl;
+      return false;
+   }
+   if (journaled != identity) {
+      cout << "The disk changed since " << path << " was started: it was "
+           << journaled << ", it is " << identity << "." << endl;
+      return false;
+   }
+
+   _size = HEADER + journaled.size();
+   vector<uint8> rec(recordSize());
+   while (_size + rec.size() <= (uint64)st.st_size) {
+      if (!PReadAll(_fd, rec.data(), rec.size(), _size)) {
+         cout << "Can't read " << path << ": " << strerror(errno) << endl;
+         return false;
+      }
+      Range r;
+      r.start = GetLE(rec.data(), 8);
+      r.end = GetLE(rec.data() + 8, 8);
+      if (r.start != mark() || r.end < r.start || r.end > capacity) {
+         break;
+      }
+      if (_hashes) {
+         memcpy(r.digest, rec.data() + 16, sizeof r.digest);
+      }
+      _ranges.push_back(r);
+      _size += rec.size();
+   }
+   // Drop a torn record so the next one follows the last good one.
+   if (ftruncate(_fd, _size) != 0) {
+      cout << "Can't write " << path << ": " << strerror(errno) << endl;
+      return false;
+   }
+   return true;
+}
+
+
+// Records that [start, end) is durably in the image.
+bool
+ExportJournal::append(uint64 start,            // IN
+                      uint64 end,              // IN
+                      const uint8 *digest)     // IN
+{
+   string rec;
+
+   PutLE(rec, start, 8);
+   PutLE(rec, end, 8);
+   if (_hashes) {
+      rec.append((const char *)digest, SHA256_DIGEST_LENGTH);
+   }
+   if (!PWriteAll(_fd, (const uint8 *)rec.data(), rec.size(), _size) ||
+       fdatasync(_fd) != 0) {
+      return false;
+   }
+   _size += rec.size();
+   Range r;
+   r.start = start;
+   r.end = end;
+   memcpy(r.digest, rec.data() + 16, _hashes ? SHA256_DIGEST_LENGTH : 0);
+   _ranges.push_back(r);
+   return true;
+}
+
+
+// The pieces of -exportraw written so far, in order, to find the end of
+// those written without a gap.
+struct ExportProgress
+{
+   std::deque<char> done;   // of the pieces from base on
+   size_t base;
+
+   ExportProgress() : base(0) {}
+
+   void add()
+   {
+      done.push_back(0);
+   }
+
+   void complete(size_t piece)
+   {
+      done[piece - base] = 1;
+   }
+
+   // Returns the first piece not written.
+   size_t advance()
+   {
+      while (!done.empty() && done.front()) {
+         done.pop_front();
+         base++;
+      }
+      return base;
+   }
+};
+
+
+// A piece of -exportraw, read and then written, in one write per
+// allocated extent in it
+struct ExportRead
+{
+   uint64 sector;
+   uint64 numSectors;
+   uint8 *buf;
+   BufferPoolInterface<uint8> *pool;
+   ExportProgress *progress;
+   size_t piece;
+   std::atomic<bool> ready;
+   VixError vixError;
+   std::atomic<unsigned> writes;
+   std::atomic<bool> failed;
+
+   static void Done(void *cbData, VixError result)
+   {
+      ExportRead *read = (ExportRead *)cbData;
+
+      read->vixError = result;
+      read->ready = true;
+   }
+
+   // Ends a write; after the last one the piece is done.
+   static void WriteDone(void *cbData, int err)
+   {
+      ExportRead *read = (ExportRead *)cbData;
+
+      if (err != 0) {
+         read->failed = true;
+      }
+      if (--read->writes > 0) {
+         return;
+      }
+      if (!read->failed) {
+         read->progress->complete(read->piece);
+      }
+      read->pool->returnBuffer(read->buf);
+      delete read;
+   }
+};
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * VerifyJournal --
+ *
+ *      Checks the pieces of the -exportraw image fd in the ranges of a
+ *      -journalhash journal against their digests.
+ *
+ * Results:
+ *      false, with the start of the first bad range in badSector, if the
+ *      image doesn't match.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+VerifyJournal(int fd,                                            // IN
+              const vector<std::pair<uint64, uint64>>& pieces,   // IN
+              const ExportJournal& journal,                      // IN
+              uint64& badSector)                                 // OUT
+{
+   vector<uint8> buf(VIX_EXPORT_CHUNK * VIXDISKLIB_SECTOR_SIZE);
+   size_t p = 0;
+
+   for (const auto& r : journal.ranges()) {
+      SHA256_CTX ctx;
+      uint8 digest[SHA256_DIGEST_LENGTH];
+
+      SHA256_Init(&ctx);
+      for (; p < pieces.size() && pieces[p].first < r.end; p++) {
+         size_t len = pieces[p].second * VIXDISKLIB_SECTOR_SIZE;
+         if (!PReadAll(fd, buf.data(), len,
+                       pieces[p].first * VIXDISKLIB_SECTOR_SIZE)) {
+            badSector = pieces[p].first;
+            return false;
+         }
+         SHA256(buf.data(), len, digest);
+         SHA256_Update(&ctx, digest, sizeof digest);
+      }
+      SHA256_Final(digest, &ctx);
+      if (memcmp(digest, r.digest, sizeof digest) != 0) {
+         badSector = r.start;
+         return false;
+      }
+   }
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * PlanReads --
+ *
+ *      Plans the reads of the allocated extents blocks of disk. Reading
+ *      the gap between two extents with them costs bandwidth, reading them
+ *      apart costs another round trip, so extents at most latency *
+ *      bandwidth apart are read as one. The latency is the median of
+ *      VIX_PLAN_PROBES one sector reads across the extents, the bandwidth
+ *      the median of VIX_PLAN_BANDWIDTH_PROBES reads of maxIO sectors
+ *      between them; no read covers sectors an earlier one read, which a
+ *      cache could serve. -readgap sets the gap instead.
+ *
+ * Results:
+ *      The extents to read.
+ *
+ * Side effects:
+ *      Reads the disk and prints the plan.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static ExtentMap
+PlanReads(const VixDisk& disk,           // IN
+          const ExtentMap& blocks,       // IN
+          uint64 maxIO)                  // IN
+{
+   uint64 gap = std::max<int64>(Globals().readGap, 0);
+
+   if (Globals().readGap < 0 && blocks.count() > 1) {
+      const uint64 capacity = disk.getInfo()->capacity;
+      vector<uint8> buf(maxIO * VIXDISKLIB_SECTOR_SIZE);
+      auto timeRead = [&disk, &buf] (uint64 sector, uint64 numSectors) {
+         auto t0 = std::chrono::steady_clock::now();
+         VixError vixError = VixDiskLib_Read(disk.Handle(), sector,
+                                             numSectors, buf.data());
+         CHECK_AND_THROW(vixError);
+         return std::chrono::duration<double>(
+                   std::chrono::steady_clock::now() - t0).count();
+      };
+
+      auto median = [] (vector<double>& v) {
+         std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+         return v[v.size() / 2];
+      };
+
+      // The first allocated sector from sector on from which numSectors
+      // overlap no range read yet, capacity if there is none.
+      vector<std::pair<uint64, uint64>> done;
+      auto unread = [&blocks, &done, capacity] (uint64 sector,
+                                                uint64 numSectors) {
+         ExtentMap::Iterator it(blocks);
+         VixDiskLibBlock e;
+         while (true) {
+            it.seek(sector);
+            if (!it.next(e)) {
+               return capacity;
             }
-            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
-            appGlobals.command |= COMMAND_WRITEBENCH;
-        } else if (!strcmp(argv[i], "-readasyncbench")) {
-            if (0 && i >= argc - 2) {
-                printf("Error: The -readasyncbench command requires a block size "
-                       "(in sectors) to be specified. See usage below.\n\n");
-                return PrintUsage();
+            sector = std::max(sector, e.offset);
+            uint64 end = std::min(sector + numSectors, capacity);
+            auto r = std::find_if(done.begin(), done.end(),
+                                  [sector, end] (const std::pair<uint64,
+                                                                 uint64>& d) {
+                                     return d.first < end && sector < d.second;
+                                  });
+            if (r == done.end()) {
+               return sector;
             }
-            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
-            appGlobals.command |= COMMAND_READASYNCBENCH;
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-writeasyncbench")) {
-            if (i >= argc - 2) {
-                printf("Error: The -writeasyncbench command requires a block size "
-                       "(in sectors) to be specified. See usage below.\n\n");
-                return PrintUsage();
+            sector = r->second;
+         }
+      };
+
+      vector<double> times;
+      for (unsigned i = 0; i < VIX_PLAN_PROBES; i++) {
+         uint64 sector = unread(capacity / VIX_PLAN_PROBES * i, 1);
+         if (sector < capacity) {
+            times.push_back(timeRead(sector, 1));
+            done.push_back({sector, sector + 1});
+         }
+      }
+      double latency = median(times);
+
+      // Between the latency probes, as caches are bound to hold those.
+      vector<double> bandwidths;
+      const uint64 step = capacity / VIX_PLAN_PROBES;
+      for (unsigned i = 0; i < VIX_PLAN_BANDWIDTH_PROBES; i++) {
+         uint64 sector = unread(step * (i * VIX_PLAN_PROBES /
+                                        VIX_PLAN_BANDWIDTH_PROBES) +
+                                step / 2, maxIO);
+         if (sector < capacity) {
+            uint64 n = std::min(maxIO, capacity - sector);
+            double t = timeRead(sector, n);
+            bandwidths.push_back(n * VIXDISKLIB_SECTOR_SIZE /
+                                 std::max(t - latency, 1e-6));
+            done.push_back({sector, sector + n});
+         }
+      }
+      if (bandwidths.empty()) {
+         cout << "No unread data to time reads of. ";
+      } else {
+         double bandwidth = median(bandwidths);
+         gap = std::min<uint64>(maxIO, latency * bandwidth /
+                                       VIXDISKLIB_SECTOR_SIZE);
+         cout << "Read latency " << (uint64)(latency * 1e6) << " usec, "
+              << (uint64)(bandwidth / 1e6) << " MBytes/sec. ";
+      }
+   }
+
+   ExtentMap reads = blocks.coalesce(gap);
+   cout << "Reading " << blocks.count() << " allocated extents as "
+        << reads.count() << ", up to " << gap << " sectors apart, in reads "
+        << "of at most " << maxIO << " sectors." << endl;
+   return reads;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoExportRaw --
+ *
+ *      Exports the disk to the raw image Globals().exportPath. Only the
+ *      allocated extents are read, VIX_EXPORT_DEPTH chunks at a time with
+ *      async reads, and written in order with large aligned writes,
+ *      asynchronously through LocalFile so they overlap the reads.
+ *      Extents close to each other are read as one, see PlanReads, but
+ *      only the extents are written and chunked, the gaps in such a read
+ *      left alone like any unallocated range.
+ *      Unallocated ranges and chunks that read back as zeros are left as
+ *      holes: a regular file is truncated to the disk size first, so they
+ *      are holes already; on a block device they are punched or zeroed.
+ *      With -directio the chunks are written with O_DIRECT from buffers
+ *      aligned to the destination's block size; pieces that aren't
+ *      aligned, like an odd sized tail of the disk, go through the page
+ *      cache. With -journal the image is synced and the end of the data
+ *      written without a gap recorded every VIX_JOURNAL_MB or
+ *      VIX_JOURNAL_SECONDS, and on failure; -resume checks that the disk
+ *      is the one the journal was started for and carries on from there.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates or overwrites Globals().exportPath.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoExportRaw(void)
+{
+   VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                Globals().openFlags);
+   const uint64 capacity = disk.getInfo()->capacity;
+   const char *path = Globals().exportPath;
+   ExtentMap blocks;
+   auto start = std::chrono::system_clock::now();
+
+   GetAllocatedBlocks(disk,
+                      std::max<uint64>(Globals().chunkSize,
+                                       VIXDISKLIB_MIN_CHUNK_SIZE),
+                      blocks);
+
+   // Cut the extents into chunk aligned reads. Without a -journal, which
+   // needs the same pieces on -resume, extents close to each other are
+   // read together, in larger reads; see PlanReads.
+   vector<std::pair<uint64, uint64>> pieces;
+   const uint64 allocated = blocks.sectors();
+   uint64 maxIO = VIX_EXPORT_CHUNK;
+   ExtentMap reads;
+   if (Globals().journalPath == NULL) {
+      string mode = disk.getTransportMode();
+      maxIO = mode == "nbd" || mode == "nbdssl" ? VIX_MAX_IO_NBD :
+                                                  VIX_MAX_IO;
+      reads = PlanReads(disk, blocks, maxIO);
+   }
+   const ExtentMap& toRead = Globals().journalPath == NULL ? reads :
+                                                             blocks;
+   {
+      ExtentMap::Iterator it(toRead);
+      VixDiskLibBlock piece;
+      while (it.nextPiece(maxIO, piece)) {
+         pieces.push_back({piece.offset, piece.length});
+      }
+   }
+
+   ExportJournal journal;
+   bool resume = Globals().resume;
+   if (Globals().journalPath != NULL) {
+      string identity;
+      if (!DiskIdentity(Globals().connection,
+                        Globals().diskPaths[0].c_str(), capacity,
+                        identity)) {
+         cout << "Can't identify the disk for the journal." << endl;
+         THROW_ERROR(VIX_E_FAIL);
+      }
+      if (resume ? !journal.resume(Globals().journalPath, identity,
+                                   capacity) :
+                   !journal.create(Globals().journalPath, identity,
+                                   capacity, Globals().journalHash)) {
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+   }
+   const uint64 mark = journal.mark();
+
+   int fd = open(path, (resume ? O_RDWR : O_WRONLY | O_CREAT) | O_CLOEXEC,
+                 0644);
+   if (fd < 0) {
+      cout << "Can't create " << path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   std::unique_ptr<int, void (*)(int *)> fdGuard(&fd, [] (int *f) {
+                                                     close(*f);
+                                                  });
+   int directFd = -1;
+   uint32 alignment = 0;
+#ifdef O_DIRECT
+   if (Globals().directIO) {
+      directFd = open(path, O_WRONLY | O_DIRECT | O_CLOEXEC);
+      if (directFd >= 0) {
+         alignment = DirectIOAlignment(directFd);
+      } else {
+         cout << "Can't open " << path << " with O_DIRECT ("
+              << strerror(errno) << "), using the page cache." << endl;
+      }
+   }
+#endif
+   std::unique_ptr<int, void (*)(int *)> directFdGuard(&directFd,
+                                                       [] (int *f) {
+                                                          if (*f >= 0) {
+                                                             close(*f);
+                                                          }
+                                                       });
+   struct stat st;
+   bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+   const uint64 size = capacity * VIXDISKLIB_SECTOR_SIZE;
+   if (resume) {
+      if (regular && (uint64)st.st_size != size) {
+         cout << path << " is " << st.st_size << " bytes, not " << size
+              << ": it isn't the image the journal is of." << endl;
+         THROW_ERROR(VIX_E_INVALID_ARG);
+      }
+      uint64 badSector;
+      if (journal.hashes() &&
+          !VerifyJournal(fd, pieces, journal, badSector)) {
+         cout << path << " doesn't match the journal at sector " << badSector
+              << "; export again without -resume." << endl;
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+      cout << "Resuming " << path << " at sector " << mark << " of "
+           << capacity << endl;
+   } else if (regular) {
+      if (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0) {
+         cout << "Can't size " << path << ": " << strerror(errno) << endl;
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+   }
+   if (!regular) {
+      // Zeroes the gap [from, to) unless it is below the journal's mark.
+      auto zeroGap = [fd, mark] (uint64 from, uint64 to) {
+         from = std::max(from, mark);
+         return from >= to ||
+                ZeroRange(fd, from * VIXDISKLIB_SECTOR_SIZE,
+                          (to - from) * VIXDISKLIB_SECTOR_SIZE);
+      };
+      ExtentMap::Iterator it(blocks);
+      VixDiskLibBlock e;
+      uint64 pos = 0;
+      while (it.next(e)) {
+         if (!zeroGap(pos, e.offset)) {
+            THROW_ERROR(VIX_E_FILE_ERROR);
+         }
+         pos = e.offset + e.length;
+      }
+      if (!zeroGap(pos, capacity)) {
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+   }
+
+   // Buffers are held by reads and then by writes.
+   static const size_t numBufs = 2 * VIX_EXPORT_DEPTH;
+   auto bufPool = getBufferPool<numBufs, uint8, ThreadLock>(
+                     disk, maxIO * VIXDISKLIB_SECTOR_SIZE, alignment);
+   LocalFile file(directFd >= 0 ? directFd : fd, bufPool.get());
+   std::unique_ptr<ChunkMap> chunkMap;
+   if (Globals().chunkMapPath != NULL) {
+      chunkMap.reset(new ChunkMap);
+      if (!chunkMap->open(Globals().chunkMapPath)) {
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+   }
+   std::deque<std::unique_ptr<ExportRead>> inFlight;
+   ExtentMap::Iterator allocIt(blocks);
+   size_t next = 0;
+   uint64 written = 0;
+   uint64 zero = 0;
+   uint64 skipped = 0;
+
+   while (next < pieces.size() &&
+          pieces[next].first + pieces[next].second <= mark) {
+      skipped += pieces[next].second;
+      next++;
+   }
+
+   ExportProgress progress;
+   progress.base = next;
+   vector<uint8> digests;   // of the pieces since the last checkpoint
+   size_t cpPiece = next;
+   uint64 cpMark = mark;
+   uint64 cpBytes = 0;
+   auto cpTime = std::chrono::steady_clock::now();
+
+   // Records the pieces written without a gap since the last checkpoint
+   // in the journal, once they are durable.
+   auto checkpoint = [&] (bool force) {
+      if (!journal.isOpen()) {
+         return true;
+      }
+      size_t k = progress.advance();
+      uint64 to = k < pieces.size() ? pieces[k].first : capacity;
+      auto now = std::chrono::steady_clock::now();
+      if (to == cpMark ||
+          (!force && written + zero - cpBytes < (uint64)VIX_JOURNAL_MB << 20 &&
+           now - cpTime < std::chrono::seconds(VIX_JOURNAL_SECONDS))) {
+         return true;
+      }
+      // EINVAL: the output, e.g. a character device, can't be synced.
+      if (fsync(fd) != 0 && errno != EINVAL) {
+         return false;
+      }
+      uint8 digest[SHA256_DIGEST_LENGTH] = { 0 };
+      if (journal.hashes()) {
+         size_t n = (k - cpPiece) * SHA256_DIGEST_LENGTH;
+         SHA256(digests.data(), n, digest);
+         digests.erase(digests.begin(), digests.begin() + n);
+      }
+      if (!journal.append(cpMark, to, digest)) {
+         return false;
+      }
+      cpPiece = k;
+      cpMark = to;
+      cpBytes = written + zero;
+      cpTime = now;
+      return true;
+   };
+
+   // Reads still in flight must complete before their buffers go away.
+   // What was written is recorded so that -resume can carry on from it.
+   auto drain = [&] () {
+      VixDiskLib_Wait(disk.Handle());
+      for (auto& r : inFlight) {
+         bufPool->returnBuffer(r->buf);
+      }
+      inFlight.clear();
+      file.wait();
+      checkpoint(true);
+   };
+
+   JobAddTotal(toRead.sectors() - skipped);
+   while (next < pieces.size() || !inFlight.empty()) {
+      file.poll();
+      while (inFlight.size() < VIX_EXPORT_DEPTH && next < pieces.size() &&
+             inFlight.size() + file.pending() < numBufs) {
+         std::unique_ptr<ExportRead> read(new ExportRead);
+         read->sector = pieces[next].first;
+         read->numSectors = pieces[next].second;
+         read->buf = bufPool->getBuffer();
+         read->pool = bufPool.get();
+         read->progress = &progress;
+         read->piece = next;
+         read->ready = false;
+         read->vixError = VIX_OK;
+         VixError vixError = blockCache.readAsync(disk, read->sector,
+                                                  read->numSectors, read->buf,
+                                                  ExportRead::Done,
+                                                  read.get());
+         if (vixError != VIX_ASYNC) {
+            read->vixError = vixError;
+            read->ready = true;
+         }
+         inFlight.push_back(std::move(read));
+         progress.add();
+         next++;
+      }
+      if (inFlight.empty()) {
+         // Every buffer is waiting to be written.
+         file.wait(file.pending() - 1);
+         continue;
+      }
+
+      if (!inFlight.front()->ready) {
+         VixDiskLib_Wait(disk.Handle());
+      }
+      // Queue the writes of all reads done so far, in order, and submit
+      // them together.
+      while (!inFlight.empty() && inFlight.front()->ready) {
+         std::unique_ptr<ExportRead>& read = inFlight.front();
+         VixError vixError = read->vixError;
+         if (VIX_FAILED(vixError)) {
+            drain();
+            THROW_ERROR(vixError);
+         }
+
+         uint64 len = read->numSectors * VIXDISKLIB_SECTOR_SIZE;
+         if (journal.hashes()) {
+            digests.resize(digests.size() + SHA256_DIGEST_LENGTH);
+            SHA256(read->buf, len, &digests[digests.size() -
+                                            SHA256_DIGEST_LENGTH]);
+         }
+
+         // Write the allocated extents the read holds; one that is all
+         // zeros stays a hole. The gaps between them are holes of the
+         // regular file, or zeroed on a device, already. The read is done
+         // once its last write is, and the loop holds one write of it.
+         ExportRead *r = read.release();
+         inFlight.pop_front();
+         r->writes = 1;
+         r->failed = false;
+         const uint64 end = r->sector + r->numSectors;
+         bool ok = true;
+         VixDiskLibBlock e;
+         allocIt.seek(r->sector);
+         while (ok && allocIt.next(e) && e.offset < end) {
+            uint64 first = std::max(e.offset, r->sector);
+            uint64 numSectors = std::min(e.offset + e.length, end) - first;
+            uint64 pos = (first - r->sector) * VIXDISKLIB_SECTOR_SIZE;
+            uint64 off = first * VIXDISKLIB_SECTOR_SIZE;
+            uint64 n = numSectors * VIXDISKLIB_SECTOR_SIZE;
+            uint8 *buf = r->buf + pos;
+            if (chunkMap) {
+               chunkMap->feed(first, buf, numSectors);
             }
-            appGlobals.bufSize = strtol(argv[++i], NULL, 0);
-            appGlobals.command |= COMMAND_WRITEASYNCBENCH;
-        } else if (!strcmp(argv[i], "-multithread")) {
-            if (i >= argc - 2) {
-                printf("Error: The -multithread option requires the number "
-                       "of threads to be specified. See usage below.\n\n");
-                return PrintUsage();
+            if (IsAllZero(buf, n)) {
+               zero += n;
+               ok = regular || ZeroRange(fd, off, n);
+            } else if (directFd >= 0 &&
+                       (off % alignment != 0 || n % alignment != 0 ||
+                        pos % alignment != 0)) {
+               ok = PWriteAll(fd, buf, n, off);
+               if (!ok) {
+                  cout << "Can't write " << path << ": " << strerror(errno)
+                       << endl;
+               }
+               written += ok ? n : 0;
+            } else {
+               written += n;
+               r->writes++;
+               file.write(buf, n, off, ExportRead::WriteDone, r);
             }
-            appGlobals.command |= COMMAND_MULTITHREAD;
-            appGlobals.numThreads = strtol(argv[++i], NULL, 0);
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_READ_ONLY;
-        } else if (!strcmp(argv[i], "-host")) {
-            if (i >= argc - 2) {
-                printf("Error: The -host option requires the IP address "
-                       "or name of the host to be specified. "
-                       "See usage below.\n\n");
-                return PrintUsage();
+         }
+         ExportRead::WriteDone(r, ok ? 0 : EIO);
+         if (!ok) {
+            drain();
+            THROW_ERROR(VIX_E_FILE_ERROR);
+         }
+
+         vixError = JobAdvance(len / VIXDISKLIB_SECTOR_SIZE);
+         if (VIX_FAILED(vixError)) {
+            drain();
+            THROW_ERROR(vixError);
+         }
+      }
+      file.submit();
+      if (file.error() != 0) {
+         break;
+      }
+      if (!checkpoint(false)) {
+         cout << "Can't write " << Globals().journalPath << ": "
+              << strerror(errno) << endl;
+         drain();
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+   }
+   file.wait();
+   if (file.error() != 0) {
+      drain();
+      cout << "Can't write " << path << ": " << strerror(file.error())
+           << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+
+   // EINVAL: the output, e.g. a pipe or character device, can't be synced.
+   if (fsync(fd) != 0 && errno != EINVAL) {
+      cout << "Can't write " << path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   if (!checkpoint(true)) {
+      cout << "Can't write " << Globals().journalPath << ": "
+           << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   if (chunkMap) {
+      chunkMap->close();
+   }
+
+   auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now() - start).count();
+   cout << "Exported " << size << " bytes to " << path << ": "
+        << allocated * VIXDISKLIB_SECTOR_SIZE << " allocated, " << written
+        << " written, " << zero << " zero, in " << msec << " msec";
+   if (msec > 0) {
+      cout << " (" << written / 1000 / msec << " MBytes/sec)";
+   }
+   cout << " via " << file.backend()
+        << (directFd >= 0 ? ", O_DIRECT" : "") << endl;
+}
+
+#endif // _WIN32
+
+#ifdef _WIN32
+
+static void
+DoImportRaw(void)
+{
+   cout << "-importraw is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+#else
+
+// A VIX_IMPORT_CHUNK sized piece of the -importraw image
+struct ImportChunk
+{
+   uint64 sector;
+   uint64 numSectors;
+   uint8 *buf;
+   bool ready;                    // read from the image
+   std::atomic<int> writes;       // disk writes in flight
+   std::atomic<VixError> vixError;
+   int readError;
+
+   static void ReadDone(void *cbData, int err)
+   {
+      ImportChunk *chunk = (ImportChunk *)cbData;
+
+      chunk->readError = err;
+      chunk->ready = true;
+   }
+
+   static void WriteDone(void *cbData, VixError result)
+   {
+      ImportChunk *chunk = (ImportChunk *)cbData;
+
+      if (VIX_FAILED(result)) {
+         chunk->vixError = result;
+      }
+      chunk->writes--;
+   }
+};
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ImportDataRegions --
+ *
+ *      Finds the data regions of the image file fd of size bytes with
+ *      SEEK_DATA/SEEK_HOLE. Without file system support the whole file is
+ *      one region.
+ *
+ * Results:
+ *      The data regions in sectors.
+ *
+ * Side effects:
+ *      Moves the file offset.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static ExtentMap
+ImportDataRegions(int fd,        // IN
+                  uint64 size)   // IN
+{
+   ExtentMap regions;
+   uint64 end = (size + VIXDISKLIB_SECTOR_SIZE - 1) / VIXDISKLIB_SECTOR_SIZE;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+   off_t pos = 0;
+   while ((uint64)pos < size) {
+      off_t data = lseek(fd, pos, SEEK_DATA);
+      if (data < 0) {
+         if (errno == ENXIO) {
+            return regions;   // only a hole is left
+         }
+         break;
+      }
+      off_t hole = lseek(fd, data, SEEK_HOLE);
+      if (hole < 0) {
+         break;
+      }
+      uint64 first = data / VIXDISKLIB_SECTOR_SIZE;
+      uint64 last = std::min<uint64>((hole + VIXDISKLIB_SECTOR_SIZE - 1) /
+                                     VIXDISKLIB_SECTOR_SIZE, end);
+      regions.add(first, last - first);
+      pos = hole;
+   }
+   if ((uint64)pos >= size) {
+      return regions;
+   }
+#endif
+   regions = ExtentMap();
+   regions.add(0, end);
+   return regions;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoImportRaw --
+ *
+ *      Writes the raw image Globals().importPath, or stdin for "-", to
+ *      the disk. Holes of an image file are found with SEEK_DATA/
+ *      SEEK_HOLE and skipped; the data is read in VIX_IMPORT_CHUNK sector
+ *      pieces through LocalFile, and of each piece only the grains that
+ *      aren't all zeros are written, with async writes and
+ *      VIX_IMPORT_DEPTH pieces in flight. So the time taken follows the
+ *      data in the image, not its size.
+ *
+ *      With -create the disk is created first, as large as the image
+ *      file rounded up to MBytes (-cap for stdin). An existing disk is
+ *      assumed to have stale data: its allocated blocks that are holes or
+ *      zeros in the image are zeroed, with VIX_IMPORT_DEPTH writes of
+ *      zeros in flight. A disk without allocation info is only zeroed
+ *      all over with -zeroall.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes the disk.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoImportRaw(void)
+{
+   const char *path = Globals().importPath;
+   int fd = strcmp(path, "-") == 0 ? STDIN_FILENO :
+                                     open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      cout << "Can't open " << path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   std::unique_ptr<int, void (*)(int *)> fdGuard(&fd, [] (int *f) {
+                                                     if (*f != STDIN_FILENO) {
+                                                        close(*f);
+                                                     }
+                                                  });
+   struct stat st;
+   if (fstat(fd, &st) != 0) {
+      cout << "Can't stat " << path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   // A regular file is read at offsets, anything else as a stream.
+   bool stream = !S_ISREG(st.st_mode);
+   uint64 size = stream ? 0 : st.st_size;
+
+   bool created = (Globals().command & COMMAND_CREATE) != 0;
+   if (created) {
+      if (!stream) {
+         Globals().mbSize = std::max<uint64>((size + (1 << 20) - 1) >> 20,
+                                             1);
+      }
+      DoCreate();
+   }
+
+   VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                Globals().openFlags);
+   const uint64 capacity = disk.getInfo()->capacity;
+   if (size > capacity * VIXDISKLIB_SECTOR_SIZE) {
+      cout << path << " is " << size << " bytes, larger than the disk."
+           << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   auto start = std::chrono::system_clock::now();
+
+   // Blocks of an existing disk that must be zeroed unless written.
+   ExtentMap stale;
+   if (!created) {
+      try {
+         GetAllocatedBlocks(disk,
+                            std::max<uint64>(Globals().chunkSize,
+                                             VIXDISKLIB_MIN_CHUNK_SIZE),
+                            stale);
+      } catch (const VixDiskLibErrWrapper&) {
+         // No allocation info, e.g. from the transport.
+         if (!Globals().zeroAll) {
+            cout << "Can't find the allocated blocks of the disk; use "
+                    "-zeroall to zero all of it the image doesn't write."
+                 << endl;
+            throw;
+         }
+         stale = ExtentMap();
+         stale.add(0, capacity);
+      }
+   }
+   const size_t chunkBytes = VIX_IMPORT_CHUNK * VIXDISKLIB_SECTOR_SIZE;
+   vector<uint8> zeros;
+   uint64 zeroed = 0;
+   ExtentMap::Iterator staleIt(stale);
+   VixDiskLibBlock staleBlock;
+   bool staleLeft = staleIt.next(staleBlock);
+   // Counts the async writes of zeros; VixDiskLib doesn't allow sync I/O
+   // on a handle doing async I/O.
+   ImportChunk zeroWrites;
+   zeroWrites.writes = 0;
+   zeroWrites.vixError = VIX_OK;
+
+   // Zeroes the stale blocks in [first, last), which the image doesn't
+   // write. Calls come in increasing order.
+   auto zeroStale = [&] (uint64 first, uint64 last) {
+      const VixDiskLibBlock& b = staleBlock;
+      for (; staleLeft && b.offset < last;
+           staleLeft = staleIt.next(staleBlock)) {
+         uint64 s = std::max(b.offset, first);
+         uint64 e = std::min(b.offset + b.length, last);
+         if (s < e && zeros.empty()) {
+            zeros.resize(chunkBytes);
+         }
+         while (s < e) {
+            uint64 n = std::min<uint64>(e - s, VIX_IMPORT_CHUNK);
+            while (zeroWrites.writes >= VIX_IMPORT_DEPTH) {
+               VixDiskLib_Wait(disk.Handle());
             }
-            appGlobals.host = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-user")) {
-            if (i >= argc - 2) {
-                printf("Error: The -user option requires a username "
-                       "to be specified. See usage below.\n\n");
-                return PrintUsage();
+            zeroWrites.writes++;
+            VixError vixError =
+               blockCache.writeAsync(disk, s, n, zeros.data(),
+                                     ImportChunk::WriteDone, &zeroWrites);
+            if (vixError != VIX_ASYNC) {
+               ImportChunk::WriteDone(&zeroWrites, vixError);
             }
-            appGlobals.userName = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-password")) {
-            if (i >= argc - 2) {
-                printf("Error: The -password option requires a password "
-                       "to be specified. See usage below.\n\n");
-                return PrintUsage();
+            vixError = zeroWrites.vixError;
+            CHECK_AND_THROW(vixError);
+            zeroed += n * VIXDISKLIB_SECTOR_SIZE;
+            s += n;
+         }
+         if (b.offset + b.length > last) {
+            break;   // the rest comes with the next call
+         }
+      }
+   };
+
+   // Image pieces: chunk aligned pieces of the data regions of a file.
+   // A stream is cut into pieces as it is read.
+   vector<std::pair<uint64, uint64>> pieces;
+   uint64 data = 0;
+   if (!stream) {
+      ExtentMap regions = ImportDataRegions(fd, size);
+      ExtentMap::Iterator it(regions);
+      VixDiskLibBlock piece;
+      while (it.nextPiece(VIX_IMPORT_CHUNK, piece)) {
+         pieces.push_back({piece.offset, piece.length});
+      }
+      data = regions.sectors() * VIXDISKLIB_SECTOR_SIZE;
+      JobAddTotal(regions.sectors());
+   }
+
+   static const size_t numBufs = 2 * VIX_IMPORT_DEPTH;
+   auto bufPool = getBufferPool<numBufs, uint8, ThreadLock>(disk,
+                                                            chunkBytes);
+   LocalFile file(fd, bufPool.get());
+   std::deque<std::unique_ptr<ImportChunk>> reading;
+   std::deque<std::unique_ptr<ImportChunk>> writing;
+   size_t next = 0;
+   uint64 streamSector = 0;
+   bool streamEnd = false;
+   uint64 written = 0;
+   uint64 zero = 0;
+   uint64 covered = 0;     // sectors up to which stale blocks are handled
+
+   // On errors: disk writes still in flight must complete before their
+   // buffers go.
+   auto drain = [&] () {
+      VixDiskLib_Wait(disk.Handle());
+      file.wait();
+      for (auto& c : reading) {
+         bufPool->returnBuffer(c->buf);
+      }
+      for (auto& c : writing) {
+         bufPool->returnBuffer(c->buf);
+      }
+      reading.clear();
+      writing.clear();
+   };
+
+   // Returns the buffers of pieces written completely.
+   auto reapWrites = [&] () {
+      while (!writing.empty() && writing.front()->writes == 0) {
+         VixError vixError = writing.front()->vixError;
+         CHECK_AND_THROW(vixError);
+         bufPool->returnBuffer(writing.front()->buf);
+         writing.pop_front();
+      }
+   };
+
+   auto newChunk = [&] (uint64 sector, uint64 numSectors) {
+      std::unique_ptr<ImportChunk> chunk(new ImportChunk);
+      chunk->sector = sector;
+      chunk->numSectors = numSectors;
+      chunk->buf = bufPool->getBuffer();
+      chunk->ready = false;
+      chunk->writes = 0;
+      chunk->vixError = VIX_OK;
+      chunk->readError = 0;
+      return chunk;
+   };
+
+   try {
+      for (;;) {
+         reapWrites();
+         if (stream) {
+            // Read the next piece of a stream synchronously.
+            if (!streamEnd && reading.empty() &&
+                writing.size() < numBufs) {
+               std::unique_ptr<ImportChunk> chunk =
+                  newChunk(streamSector, VIX_IMPORT_CHUNK);
+               size_t got = 0;
+               while (got < chunkBytes) {
+                  ssize_t n = ::read(fd, chunk->buf + got, chunkBytes - got);
+                  if (n < 0 && errno == EINTR) {
+                     continue;
+                  }
+                  if (n < 0) {
+                     chunk->readError = errno;
+                  }
+                  if (n <= 0) {
+                     streamEnd = true;
+                     break;
+                  }
+                  got += n;
+               }
+               chunk->numSectors = (got + VIXDISKLIB_SECTOR_SIZE - 1) /
+                                   VIXDISKLIB_SECTOR_SIZE;
+               memset(chunk->buf + got, 0,
+                      chunk->numSectors * VIXDISKLIB_SECTOR_SIZE - got);
+               chunk->ready = true;
+               if (chunk->readError == 0 &&
+                   streamSector + chunk->numSectors > capacity) {
+                  cout << path << " is larger than the disk." << endl;
+                  bufPool->returnBuffer(chunk->buf);
+                  THROW_ERROR(VIX_E_INVALID_ARG);
+               }
+               streamSector += chunk->numSectors;
+               data += got;
+               if (chunk->numSectors > 0 || chunk->readError != 0) {
+                  reading.push_back(std::move(chunk));
+               } else {
+                  bufPool->returnBuffer(chunk->buf);
+               }
             }
-            appGlobals.password = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-cookie")) {
-            if (i >= argc - 2) {
-                printf("Error: The -cookie option requires a cookie "
-                       "to be specified. See usage below.\n\n");
-                return PrintUsage();
+         } else {
+            while (next < pieces.size() &&
+                   reading.size() + writing.size() < numBufs) {
+               std::unique_ptr<ImportChunk> chunk =
+                  newChunk(pieces[next].first, pieces[next].second);
+               file.read(chunk->buf, chunk->numSectors * VIXDISKLIB_SECTOR_SIZE,
+                         chunk->sector * VIXDISKLIB_SECTOR_SIZE,
+                         ImportChunk::ReadDone, chunk.get());
+               reading.push_back(std::move(chunk));
+               next++;
             }
-            appGlobals.cookie = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-thumb")) {
-            if (i >= argc - 2) {
-                printf("Error: The -thumb option requires an SSL thumbprint "
-                       "to be specified. See usage below.\n\n");
-               return PrintUsage();
+            file.submit();
+         }
+
+         if (reading.empty()) {
+            bool allRead = stream ? streamEnd : next == pieces.size();
+            if (allRead && writing.empty()) {
+               break;
             }
-            appGlobals.thumbPrint = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-port")) {
-            if (i >= argc - 2) {
-                printf("Error: The -port option requires the host's port "
-                       "number to be specified. See usage below.\n\n");
-                return PrintUsage();
+            // Every buffer is waiting for its disk writes.
+            VixDiskLib_Wait(disk.Handle());
+            continue;
+         }
+         while (!reading.front()->ready) {
+            file.wait(file.pending() - 1);
+         }
+
+         writing.push_back(std::move(reading.front()));
+         reading.pop_front();
+         ImportChunk *chunk = writing.back().get();
+         if (chunk->readError != 0) {
+            cout << "Can't read " << path << ": " << strerror(chunk->readError)
+                 << endl;
+            THROW_ERROR(VIX_E_FILE_ERROR);
+         }
+
+         // Write the runs of grains that aren't all zeros.
+         zeroStale(covered, chunk->sector);
+         uint64 end = chunk->sector + chunk->numSectors;
+         uint64 run = chunk->sector;
+         for (uint64 s = chunk->sector; s < end; ) {
+            uint64 n = std::min(end, (s / FILL_GRAIN + 1) * FILL_GRAIN) - s;
+            const uint8 *grain = chunk->buf +
+                                 (s - chunk->sector) * VIXDISKLIB_SECTOR_SIZE;
+            bool isZero = IsAllZero(grain, n * VIXDISKLIB_SECTOR_SIZE);
+            if (isZero || s + n == end) {
+               uint64 runEnd = isZero ? s : end;
+               if (runEnd > run) {
+                  chunk->writes++;
+                  VixError vixError =
+                     blockCache.writeAsync(disk, run, runEnd - run,
+                                           chunk->buf + (run - chunk->sector) *
+                                                        VIXDISKLIB_SECTOR_SIZE,
+                                           ImportChunk::WriteDone, chunk);
+                  if (vixError != VIX_ASYNC) {
+                     ImportChunk::WriteDone(chunk, vixError);
+                  }
+                  written += (runEnd - run) * VIXDISKLIB_SECTOR_SIZE;
+               }
+               if (isZero) {
+                  zeroStale(s, s + n);
+                  zero += n * VIXDISKLIB_SECTOR_SIZE;
+               }
+               run = s + n;
             }
-            appGlobals.port = strtol(argv[++i], NULL, 0);
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-nfchostport")) {
-           if (i >= argc - 2) {
-              return PrintUsage();
-           }
-           appGlobals.nfcHostPort = strtol(argv[++i], NULL, 0);
-           appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-fcdid")) {
-            if (i > argc - 2) {
-                printf("Error: The -fcdid option requires the id of "
-                       "the fcd to be specified. See usage below.\n\n");
-                return PrintUsage();
+            s += n;
+         }
+         covered = end;
+
+         VixError vixError = JobAdvance(chunk->numSectors);
+         CHECK_AND_THROW(vixError);
+      }
+      zeroStale(covered, capacity);
+      VixDiskLib_Wait(disk.Handle());
+      reapWrites();
+      VixError vixError = zeroWrites.vixError;
+      CHECK_AND_THROW(vixError);
+   } catch (...) {
+      drain();
+      throw;
+   }
+
+   auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now() - start).count();
+   cout << "Imported " << (stream ? data : size) << " bytes from " << path
+        << ": " << data << " data, " << written << " written, " << zero
+        << " zero";
+   if (!created) {
+      cout << ", " << zeroed << " zeroed";
+   }
+   cout << ", in " << msec << " msec";
+   if (msec > 0) {
+      cout << " (" << written / 1000 / msec << " MBytes/sec)";
+   }
+   cout << " via " << (stream ? "read" : file.backend()) << endl;
+}
+
+#endif // _WIN32
+
+#ifdef _WIN32
+
+static void
+DoExportZip(void)
+{
+   cout << "-exportzip is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+static void
+DoExportStream(void)
+{
+   cout << "-exportstream is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+#else
+
+static bool
+WriteAll(int fd, const void *buf, size_t len)
+{
+   const uint8 *p = (const uint8 *)buf;
+
+   while (len > 0) {
+      ssize_t n = ::write(fd, p, len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return false;
+      }
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DeflateChunk --
+ *
+ *      Raw deflates in[0, len) on its own. Unless last, the output ends
+ *      with a sync flush instead of a final block, so the output of
+ *      consecutive chunks concatenates to one deflate stream.
+ *
+ * Results:
+ *      false if zlib fails. The output is in out.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+DeflateChunk(const uint8 *in,          // IN
+             size_t len,               // IN
+             bool last,                // IN
+             int level,                // IN
+             vector<uint8>& out)       // OUT
+{
+   z_stream zs;
+
+   memset(&zs, 0, sizeof zs);
+   if (deflateInit2(&zs, level, Z_DEFLATED, -MAX_WBITS, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+      return false;
+   }
+   out.resize(deflateBound(&zs, len) + 16);
+   zs.next_in = const_cast<uint8 *>(in);
+   zs.avail_in = len;
+   zs.next_out = out.data();
+   zs.avail_out = out.size();
+   int ret;
+   while ((ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH)) == Z_OK &&
+          zs.avail_out == 0) {
+      size_t used = out.size();
+      out.resize(used * 2);
+      zs.next_out = out.data() + used;
+      zs.avail_out = out.size() - used;
+   }
+   out.resize(zs.total_out);
+   deflateEnd(&zs);
+   return last ? ret == Z_STREAM_END : ret == Z_OK || ret == Z_BUF_ERROR;
+}
+
+
+/*
+ * A zip archive written as a stream, the way Go's archive/zip writes one:
+ * deflated entries with the CRC and sizes in a data descriptor after the
+ * data, and Zip64 records once sizes or offsets pass 4 GBytes. The output
+ * never seeks, so it can be a pipe.
+ */
+
+class ZipStream
+{
+   public:
+      explicit ZipStream(int fd)
+         : _fd(fd), _offset(0), _failed(false)
+      {
+         time_t now = time(NULL);
+         struct tm tm;
+
+         localtime_r(&now, &tm);
+         _dosTime = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+         _dosDate = (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 |
+                    tm.tm_mday;
+      }
+
+      void begin(const string& name);
+      void data(const uint8 *buf, size_t len);
+      void end(uint32 crc, uint64 size);
+      void finish();
+
+      bool failed() const
+      {
+         return _failed;
+      }
+
+      uint64 offset() const
+      {
+         return _offset;
+      }
+
+   private:
+      struct Entry {
+         string name;
+         uint64 offset;
+         uint32 crc;
+         uint64 compressed;
+         uint64 size;
+      };
+
+      static void Put16(string& s, uint16 v)
+      {
+         s.push_back(v & 0xff);
+         s.push_back(v >> 8);
+      }
+
+      static void Put32(string& s, uint32 v)
+      {
+         Put16(s, v & 0xffff);
+         Put16(s, v >> 16);
+      }
+
+      static void Put64(string& s, uint64 v)
+      {
+         Put32(s, v & 0xffffffff);
+         Put32(s, v >> 32);
+      }
+
+      void emit(const string& s)
+      {
+         data((const uint8 *)s.data(), s.size());
+      }
+
+      int _fd;
+      uint64 _offset;
+      bool _failed;
+      uint16 _dosTime;
+      uint16 _dosDate;
+      vector<Entry> _entries;
+};
+
+static const uint32 ZIP_MAX32 = 0xffffffff;
+static const uint16 ZIP_FLAG_DESCRIPTOR = 0x8;
+static const uint16 ZIP_DEFLATE = 8;
+static const uint16 ZIP_VERSION_20 = 20;
+static const uint16 ZIP_VERSION_45 = 45;   // Zip64
+
+
+void
+ZipStream::begin(const string& name)   // IN
+{
+   Entry entry = { name, _offset, 0, 0, 0 };
+   string h;
+
+   _entries.push_back(entry);
+   Put32(h, 0x04034b50);
+   Put16(h, ZIP_VERSION_20);
+   Put16(h, ZIP_FLAG_DESCRIPTOR);
+   Put16(h, ZIP_DEFLATE);
+   Put16(h, _dosTime);
+   Put16(h, _dosDate);
+   Put32(h, 0);                  // crc, sizes: in the data descriptor
+   Put32(h, 0);
+   Put32(h, 0);
+   Put16(h, name.size());
+   Put16(h, 0);
+   h += name;
+   emit(h);
+}
+
+
+void
+ZipStream::data(const uint8 *buf,   // IN
+                size_t len)         // IN
+{
+   if (!_failed && !WriteAll(_fd, buf, len)) {
+      _failed = true;
+   }
+   _offset += len;
+}
+
+
+void
+ZipStream::end(uint32 crc,      // IN
+               uint64 size)     // IN
+{
+   Entry& entry = _entries.back();
+   string h;
+
+   entry.crc = crc;
+   entry.size = size;
+   entry.compressed = _offset - entry.offset - 30 - entry.name.size();
+   Put32(h, 0x08074b50);
+   Put32(h, crc);
+   if (entry.size >= ZIP_MAX32 || entry.compressed >= ZIP_MAX32) {
+      Put64(h, entry.compressed);
+      Put64(h, entry.size);
+   } else {
+      Put32(h, entry.compressed);
+      Put32(h, entry.size);
+   }
+   emit(h);
+}
+
+
+void
+ZipStream::finish()
+{
+   uint64 dirOffset = _offset;
+
+   for (const auto& entry : _entries) {
+      bool zip64 = entry.size >= ZIP_MAX32 ||
+                   entry.compressed >= ZIP_MAX32 ||
+                   entry.offset >= ZIP_MAX32;
+      string h;
+
+      Put32(h, 0x02014b50);
+      Put16(h, ZIP_VERSION_20);
+      Put16(h, zip64 ? ZIP_VERSION_45 : ZIP_VERSION_20);
+      Put16(h, ZIP_FLAG_DESCRIPTOR);
+      Put16(h, ZIP_DEFLATE);
+      Put16(h, _dosTime);
+      Put16(h, _dosDate);
+      Put32(h, entry.crc);
+      Put32(h, zip64 ? ZIP_MAX32 : entry.compressed);
+      Put32(h, zip64 ? ZIP_MAX32 : entry.size);
+      Put16(h, entry.name.size());
+      Put16(h, zip64 ? 28 : 0);
+      Put16(h, 0);               // comment
+      Put16(h, 0);               // disk
+      Put16(h, 0);               // internal attributes
+      Put32(h, 0);               // external attributes
+      Put32(h, zip64 ? ZIP_MAX32 : entry.offset);
+      h += entry.name;
+      if (zip64) {
+         Put16(h, 0x0001);
+         Put16(h, 24);
+         Put64(h, entry.size);
+         Put64(h, entry.compressed);
+         Put64(h, entry.offset);
+      }
+      emit(h);
+   }
+
+   uint64 dirSize = _offset - dirOffset;
+   uint64 records = _entries.size();
+   string h;
+   if (records >= 0xffff || dirSize >= ZIP_MAX32 || dirOffset >= ZIP_MAX32) {
+      uint64 end64 = _offset;
+
+      Put32(h, 0x06064b50);      // Zip64 end of central directory
+      Put64(h, 44);
+      Put16(h, ZIP_VERSION_45);
+      Put16(h, ZIP_VERSION_45);
+      Put32(h, 0);
+      Put32(h, 0);
+      Put64(h, records);
+      Put64(h, records);
+      Put64(h, dirSize);
+      Put64(h, dirOffset);
+      Put32(h, 0x07064b50);      // and its locator
+      Put32(h, 0);
+      Put64(h, end64);
+      Put32(h, 1);
+      records = 0xffff;
+      dirSize = ZIP_MAX32;
+      dirOffset = ZIP_MAX32;
+   }
+   Put32(h, 0x06054b50);
+   Put16(h, 0);
+   Put16(h, 0);
+   Put16(h, records);
+   Put16(h, records);
+   Put32(h, dirSize);
+   Put32(h, dirOffset);
+   Put16(h, 0);
+   emit(h);
+}
+
+
+/*
+ * Compressors of independent chunks for CompressPipeline. A deflate chunk
+ * is a piece of one deflate stream (see DeflateChunk); an lz4 or zstd
+ * chunk is a whole frame, and concatenated frames are a valid .lz4 or .zst
+ * file. liblz4 and libzstd are loaded with dlopen when asked for, so the
+ * sample neither needs their headers nor depends on them otherwise.
+ */
+
+class Codec
+{
+   public:
+      virtual ~Codec() {}
+      virtual bool compress(const uint8 *in, size_t len, bool last,
+                            vector<uint8>& out) const = 0;
+      virtual string name() const = 0;
+};
+
+
+class DeflateCodec : public Codec
+{
+   public:
+      explicit DeflateCodec(int level) : _level(level) {}
+
+      bool compress(const uint8 *in, size_t len, bool last,
+                    vector<uint8>& out) const
+      {
+         return DeflateChunk(in, len, last, _level, out);
+      }
+
+      string name() const
+      {
+         return "deflate level " + std::to_string(_level);
+      }
+
+   private:
+      int _level;
+};
+
+
+class StoreCodec : public Codec
+{
+   public:
+      bool compress(const uint8 *in, size_t len, bool /* last */,
+                    vector<uint8>& out) const
+      {
+         out.assign(in, in + len);
+         return true;
+      }
+
+      string name() const
+      {
+         return "uncompressed";
+      }
+};
+
+
+// The parts of lz4frame.h (1.8 and later) used here.
+struct Lz4FrameInfo {
+   int blockSizeID;
+   int blockMode;
+   int contentChecksumFlag;
+   int frameType;
+   unsigned long long contentSize;
+   unsigned dictID;
+   int blockChecksumFlag;
+};
+
+struct Lz4Preferences {
+   Lz4FrameInfo frameInfo;
+   int compressionLevel;
+   unsigned autoFlush;
+   unsigned favorDecSpeed;
+   unsigned reserved[3];
+};
+
+class Lz4Codec : public Codec
+{
+   public:
+      explicit Lz4Codec(int level) : _level(level) {}
+
+      bool load();
+
+      bool compress(const uint8 *in, size_t len, bool /* last */,
+                    vector<uint8>& out) const
+      {
+         Lz4Preferences prefs;
+
+         memset(&prefs, 0, sizeof prefs);
+         prefs.frameInfo.contentChecksumFlag = 1;
+         prefs.frameInfo.contentSize = len;
+         prefs.compressionLevel = _level;
+         out.resize(_bound(len, &prefs));
+         size_t n = _compressFrame(out.data(), out.size(), in, len, &prefs);
+         if (_isError(n)) {
+            return false;
+         }
+         out.resize(n);
+         return true;
+      }
+
+      string name() const
+      {
+         return "lz4 level " + std::to_string(_level);
+      }
+
+   private:
+      int _level;
+      size_t (*_bound)(size_t, const Lz4Preferences *);
+      size_t (*_compressFrame)(void *, size_t, const void *, size_t,
+                               const Lz4Preferences *);
+      unsigned (*_isError)(size_t);
+};
+
+
+class ZstdCodec : public Codec
+{
+   public:
+      explicit ZstdCodec(int level) : _level(level) {}
+
+      bool load();
+
+      bool compress(const uint8 *in, size_t len, bool /* last */,
+                    vector<uint8>& out) const
+      {
+         // A context per thread, kept for the thread's next chunks.
+         struct Context {
+            void *cctx;
+            void (*free)(void *);
+            ~Context() { if (cctx != NULL) free(cctx); }
+         };
+         thread_local Context ctx = { NULL, NULL };
+
+         if (ctx.cctx == NULL) {
+            ctx.cctx = _createCCtx();
+            ctx.free = _freeCCtx;
+            if (ctx.cctx == NULL) {
+               return false;
             }
-           appGlobals.isRemote = TRUE;
-           appGlobals.fcdid = argv[++i];
-        } else if (!strcmp(argv[i], "-fcdssid")) {
-            if (i > argc - 2) {
-                printf("Error: The -fcdssid option requires the id of "
-                       "the fcd snapshot to be specified. See usage below.\n\n");
-                return PrintUsage();
+         }
+         out.resize(_bound(len));
+         size_t n = _compressCCtx(ctx.cctx, out.data(), out.size(), in, len,
+                                  _level);
+         if (_isError(n)) {
+            return false;
+         }
+         out.resize(n);
+         return true;
+      }
+
+      string name() const
+      {
+         return "zstd level " + std::to_string(_level);
+      }
+
+   private:
+      int _level;
+      size_t (*_bound)(size_t);
+      void *(*_createCCtx)(void);
+      void (*_freeCCtx)(void *);
+      size_t (*_compressCCtx)(void *, void *, size_t, const void *, size_t,
+                              int);
+      unsigned (*_isError)(size_t);
+};
+
+
+template <typename FUNC>
+static bool
+LoadSymbol(void *lib, const char *name, FUNC& func)
+{
+   func = (FUNC)dlsym(lib, name);
+   return func != NULL;
+}
+
+
+bool
+Lz4Codec::load()
+{
+   void *lib = dlopen("liblz4.so.1", RTLD_NOW);
+
+   return lib != NULL &&
+          LoadSymbol(lib, "LZ4F_compressFrameBound", _bound) &&
+          LoadSymbol(lib, "LZ4F_compressFrame", _compressFrame) &&
+          LoadSymbol(lib, "LZ4F_isError", _isError);
+}
+
+
+bool
+ZstdCodec::load()
+{
+   void *lib = dlopen("libzstd.so.1", RTLD_NOW);
+
+   return lib != NULL &&
+          LoadSymbol(lib, "ZSTD_compressBound", _bound) &&
+          LoadSymbol(lib, "ZSTD_createCCtx", _createCCtx) &&
+          LoadSymbol(lib, "ZSTD_freeCCtx", _freeCCtx) &&
+          LoadSymbol(lib, "ZSTD_compressCCtx", _compressCCtx) &&
+          LoadSymbol(lib, "ZSTD_isError", _isError);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * MakeCodec --
+ *
+ *      Makes the codec for -codec spec: "lz4", "zstd" or "deflate",
+ *      optionally followed by ":level", or "none". Levels are 0-9 for
+ *      deflate, 0-12 for lz4 and 1-22 for zstd.
+ *
+ * Results:
+ *      The codec.
+ *
+ * Side effects:
+ *      Loads liblz4 or libzstd. Throws if spec is unknown, the level is
+ *      out of range or the library isn't there.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static std::unique_ptr<Codec>
+MakeCodec(const char *spec)   // IN
+{
+   string name = spec;
+   string::size_type colon = name.find(':');
+   bool hasLevel = colon != string::npos;
+   long level = 0;
+
+   name = name.substr(0, colon);
+   if (hasLevel) {
+      const char *text = spec + colon + 1;
+      char *end;
+      errno = 0;
+      level = strtol(text, &end, 10);
+      long maxLevel = name == "deflate" ? 9 : name == "lz4" ? 12 : 22;
+      long minLevel = name == "zstd" ? 1 : 0;
+      if (name == "none" || *text == '\0' || *end != '\0' || errno != 0 ||
+          level < minLevel || level > maxLevel) {
+         cout << "Bad codec level in " << spec << endl;
+         THROW_ERROR(VIX_E_INVALID_ARG);
+      }
+   }
+   if (name == "none") {
+      return std::unique_ptr<Codec>(new StoreCodec);
+   } else if (name == "deflate") {
+      return std::unique_ptr<Codec>(
+                new DeflateCodec(hasLevel ? level : VIX_ZIP_LEVEL));
+   } else if (name == "lz4") {
+      std::unique_ptr<Lz4Codec> codec(new Lz4Codec(hasLevel ? level : 0));
+      if (!codec->load()) {
+         cout << "Can't load liblz4.so.1: " << dlerror() << endl;
+         THROW_ERROR(VIX_E_NOT_SUPPORTED);
+      }
+      return codec;
+   } else if (name == "zstd") {
+      std::unique_ptr<ZstdCodec> codec(new ZstdCodec(hasLevel ? level : 3));
+      if (!codec->load()) {
+         cout << "Can't load libzstd.so.1: " << dlerror() << endl;
+         THROW_ERROR(VIX_E_NOT_SUPPORTED);
+      }
+      return codec;
+   }
+   cout << "Unknown codec " << spec << endl;
+   THROW_ERROR(VIX_E_INVALID_ARG);
+}
+
+
+/*
+ * Compresses a stream in chunks on a pool of threads and hands the output
+ * to a sink in order. The chunks are compressed independently by a Codec,
+ * so the threads share nothing; for zip entries the CRC-32s of the chunks
+ * are combined with crc32_combine. Up to twice as many chunks as threads
+ * are in flight, which bounds the memory used.
+ */
+
+class CompressPipeline
+{
+   public:
+      struct Job {
+         vector<uint8> in;
+         size_t len;
+         bool last;
+         vector<uint8> out;
+         uLong crc;
+         bool done;
+         bool ok;
+      };
+      // Returns false if the output can't be written.
+      typedef std::function<bool(const uint8 *, size_t)> Sink;
+
+      CompressPipeline(Sink sink, const Codec& codec, unsigned threads,
+                       size_t chunkBytes, bool withCrc = false);
+      ~CompressPipeline();
+
+      Job *get();
+      void put(Job *job, size_t len, bool last);
+      void putZeros();
+      void finish();
+
+      uLong crc() const
+      {
+         return _crc;
+      }
+
+      uint64 size() const
+      {
+         return _size;
+      }
+
+      uint64 compressedSize() const
+      {
+         return _compressedSize;
+      }
+
+   private:
+      void worker();
+      void retire();
+
+      Sink _sink;
+      const Codec& _codec;
+      size_t _chunkBytes;
+      bool _withCrc;
+      vector<std::unique_ptr<Job>> _jobs;
+      vector<Job *> _free;
+      std::deque<Job *> _order;      // put, in order
+      std::deque<Job *> _work;       // put, not taken by a worker yet
+      std::mutex _lock;
+      std::condition_variable _workCv;
+      std::condition_variable _doneCv;
+      bool _stop;
+      vector<std::thread> _threads;
+      std::unique_ptr<Job> _zeros;   // a compressed chunk of zeros
+      uLong _crc;
+      uint64 _size;
+      uint64 _compressedSize;
+};
+
+
+CompressPipeline::CompressPipeline(Sink sink,              // IN
+                                   const Codec& codec,     // IN
+                                   unsigned threads,       // IN
+                                   size_t chunkBytes,      // IN
+                                   bool withCrc)           // IN
+   : _sink(sink), _codec(codec), _chunkBytes(chunkBytes), _withCrc(withCrc),
+     _stop(false), _crc(crc32(0, NULL, 0)), _size(0), _compressedSize(0)
+{
+   for (unsigned i = 0; i < 2 * threads; i++) {
+      _jobs.emplace_back(new Job);
+      _jobs.back()->in.resize(chunkBytes);
+      _free.push_back(_jobs.back().get());
+   }
+   for (unsigned i = 0; i < threads; i++) {
+      _threads.emplace_back([this] () { worker(); });
+   }
+}
+
+
+CompressPipeline::~CompressPipeline()
+{
+   {
+      std::lock_guard<std::mutex> lg(_lock);
+      _stop = true;
+   }
+   _workCv.notify_all();
+   for (auto& t : _threads) {
+      t.join();
+   }
+}
+
+
+void
+CompressPipeline::worker()
+{
+   std::unique_lock<std::mutex> lk(_lock);
+
+   for (;;) {
+      _workCv.wait(lk, [this] () { return _stop || !_work.empty(); });
+      if (_stop) {
+         return;
+      }
+      Job *job = _work.front();
+      _work.pop_front();
+      lk.unlock();
+      if (_withCrc) {
+         job->crc = crc32(0, job->in.data(), job->len);
+      }
+      job->ok = _codec.compress(job->in.data(), job->len, job->last,
+                                job->out);
+      lk.lock();
+      job->done = true;
+      _doneCv.notify_all();
+   }
+}
+
+
+// Waits for the oldest chunk and writes it out.
+void
+CompressPipeline::retire()
+{
+   Job *job = _order.front();
+   {
+      std::unique_lock<std::mutex> lk(_lock);
+      _doneCv.wait(lk, [job] () { return job->done; });
+   }
+   _order.pop_front();
+   if (!job->ok) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+   bool written = _sink(job->out.data(), job->out.size());
+   if (_withCrc) {
+      _crc = crc32_combine(_crc, job->crc, job->len);
+   }
+   _size += job->len;
+   _compressedSize += job->out.size();
+   if (job != _zeros.get()) {
+      _free.push_back(job);
+   }
+   if (!written) {
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+}
+
+
+// Returns the buffer for the next chunk, job->in.
+CompressPipeline::Job *
+CompressPipeline::get()
+{
+   while (_free.empty()) {
+      retire();
+   }
+   Job *job = _free.back();
+   _free.pop_back();
+   return job;
+}
+
+
+void
+CompressPipeline::put(Job *job,       // IN
+                      size_t len,     // IN
+                      bool last)      // IN
+{
+   job->len = len;
+   job->last = last;
+   job->done = false;
+   _order.push_back(job);
+   {
+      std::lock_guard<std::mutex> lg(_lock);
+      _work.push_back(job);
+   }
+   _workCv.notify_one();
+}
+
+
+// Queues a whole chunk of zeros, not the last one, without compressing it
+// again: the output for it is always the same.
+void
+CompressPipeline::putZeros()
+{
+   if (!_zeros) {
+      _zeros.reset(new Job);
+      _zeros->in.assign(_chunkBytes, 0);
+      _zeros->len = _chunkBytes;
+      _zeros->last = false;
+      _zeros->crc = crc32(0, _zeros->in.data(), _chunkBytes);
+      _zeros->ok = _codec.compress(_zeros->in.data(), _chunkBytes, false,
+                                   _zeros->out);
+      _zeros->done = true;
+      vector<uint8>().swap(_zeros->in);
+   }
+   _order.push_back(_zeros.get());
+}
+
+
+// Writes out all chunks put.
+void
+CompressPipeline::finish()
+{
+   while (!_order.empty()) {
+      retire();
+   }
+}
+
+
+/*
+ * The stdout of the process for data. On first use it gets a private
+ * descriptor and fd 1 is pointed at stderr for the rest of the process,
+ * so nothing printed, by this or any concurrent command, lands in the
+ * data. Only one command at a time may write it.
+ */
+
+static std::atomic<bool> stdoutDataBusy(false);
+
+static int
+StdoutData(void)
+{
+   static std::once_flag once;
+   static int fd = -1;
+
+   std::call_once(once, [] () {
+      cout.flush();
+      fflush(stdout);
+      fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+      if (fd >= 0 && dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+         close(fd);
+         fd = -1;
+      }
+   });
+   return fd;
+}
+
+
+/*
+ * The output of -exportzip, -exportstream and -exportdelta: a new file,
+ * or stdout for "-" (see StdoutData).
+ */
+
+class ExportOutput
+{
+   public:
+      explicit ExportOutput(const char *path)
+         : _toStdout(strcmp(path, "-") == 0)
+      {
+         if (_toStdout) {
+            if (stdoutDataBusy.exchange(true)) {
+               cout << "Another command is writing to stdout." << endl;
+               THROW_ERROR(VIX_E_FILE_ERROR);
             }
-           appGlobals.isRemote = TRUE;
-           appGlobals.fcdssid = argv[++i];
-        } else if (!strcmp(argv[i], "-ds")) {
-            if (i > argc - 2) {
-                printf("Error: The -ds option requires the datastore moref"
-                      " of the fcd to be specified. See usage below.\n\n");
-                return PrintUsage();
+            _fd = StdoutData();
+            if (_fd < 0) {
+               stdoutDataBusy = false;
+               THROW_ERROR(VIX_E_FILE_ERROR);
             }
-           appGlobals.isRemote = TRUE;
-           appGlobals.ds = argv[++i];
-        } else if (!strcmp(argv[i], "-vm")) {
-            if (i >= argc - 2) {
-                printf("Error: The -vm option requires the moref id of "
-                       "the vm to be specified. See usage below.\n\n");
-                return PrintUsage();
+         } else {
+            _fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (_fd < 0) {
+               cout << "Can't create " << path << ": " << strerror(errno)
+                    << endl;
+               THROW_ERROR(VIX_E_FILE_ERROR);
             }
-            appGlobals.vmxSpec = argv[++i];
-            appGlobals.isRemote = TRUE;
-        } else if (!strcmp(argv[i], "-libdir")) {
-           if (i >= argc - 2) {
-              printf("Error: The -libdir option requires the folder location "
-                     "of the VDDK installation to be specified. "
-                     "See usage below.\n\n");
-              return PrintUsage();
-           }
-           appGlobals.libdir = argv[++i];
-        } else if (!strcmp(argv[i], "-initex")) {
-           if (i >= argc - 2) {
-              printf("Error: The -initex option requires the path and filename "
-                     "of the VDDK config file to be specified. "
-                     "See usage below.\n\n");
-              return PrintUsage();
-           }
-           appGlobals.useInitEx = true;
-           appGlobals.cfgFile = argv[++i];
-           if (appGlobals.cfgFile[0] == '\0') {
-              appGlobals.cfgFile = NULL;
-           }
-        } else if (!strcmp(argv[i], "-ssmoref")) {
-           if (i >= argc - 2) {
-              printf("Error: The -ssmoref option requires the moref id "
-                       "of a VM snapshot to be specified. "
-                       "See usage below.\n\n");
-              return PrintUsage();
-           }
-           appGlobals.ssMoRef = argv[++i];
-        } else if (!strcmp(argv[i], "-mode")) {
-            if (i >= argc - 2) {
-                printf("Error: The -mode option requires a mode string to  "
-                       "connect to VixDiskLib_ConnectEx. Valid modes are "
-                        "'nbd', 'nbdssl', 'san' and 'hotadd'. "
-                        "See usage below.\n\n");
-                return PrintUsage();
+         }
+      }
+
+      ~ExportOutput()
+      {
+         if (_toStdout) {
+            stdoutDataBusy = false;
+         } else {
+            close(_fd);
+         }
+      }
+
+      int fd() const
+      {
+         return _fd;
+      }
+
+      // Syncs a file; a pipe needs nothing.
+      bool sync() const
+      {
+         return _toStdout || fsync(_fd) == 0 || errno == EINVAL;
+      }
+
+   private:
+      bool _toStdout;
+      int _fd;
+};
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * CompressDisk --
+ *
+ *      Puts the whole disk through pipeline in chunkSectors sector chunks,
+ *      reading only the chunks with allocated blocks and feeding them to
+ *      chunkMap if there is one.
+ *
+ * Results:
+ *      The number of bytes read.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static uint64
+CompressDisk(const VixDisk& disk,                // IN
+             uint64 chunkSectors,                // IN
+             CompressPipeline& pipeline,         // IN
+             ChunkMap *chunkMap)                 // IN
+{
+   const uint64 capacity = disk.getInfo()->capacity;
+   uint64 read = 0;
+
+   BlockQuery blocks(disk,
+                     std::max<uint64>(Globals().chunkSize,
+                                      VIXDISKLIB_MIN_CHUNK_SIZE),
+                     QueryHandles());
+   JobAddTotal(capacity);
+
+   auto raPool = getBufferPool<VIX_READAHEAD_DEPTH, uint8, ThreadLock>(
+                    disk, VIX_READAHEAD_MAX * VIXDISKLIB_SECTOR_SIZE);
+   ReadAhead readAhead(disk.Handle(), capacity, *raPool);
+   for (uint64 sector = 0; sector < capacity; ) {
+      uint64 n = std::min<uint64>(chunkSectors, capacity - sector);
+      bool last = sector + n == capacity;
+
+      bool allocated = blocks.allocated(sector, n);
+      if (!allocated && !last) {
+         pipeline.putZeros();
+      } else {
+         CompressPipeline::Job *job = pipeline.get();
+         if (allocated) {
+            VixError vixError = readAhead.read(sector, n, job->in.data());
+            CHECK_AND_THROW(vixError);
+            read += n * VIXDISKLIB_SECTOR_SIZE;
+            if (chunkMap != NULL) {
+               chunkMap->feed(sector, job->in.data(), n);
+            }
+         } else {
+            memset(job->in.data(), 0, n * VIXDISKLIB_SECTOR_SIZE);
+         }
+         pipeline.put(job, n * VIXDISKLIB_SECTOR_SIZE, last);
+      }
+      sector += n;
+
+      VixError vixError = JobAdvance(n);
+      CHECK_AND_THROW(vixError);
+   }
+   if (capacity == 0) {
+      // Still end the stream, e.g. the final deflate block.
+      pipeline.put(pipeline.get(), 0, true);
+   }
+   pipeline.finish();
+   return read;
+}
+
+
+static unsigned
+CompressThreads()
+{
+   return Globals().zipThreads != 0 ?
+          Globals().zipThreads :
+          std::max(1U, std::thread::hardware_concurrency());
+}
+
+
+static std::unique_ptr<ChunkMap>
+OpenChunkMap()
+{
+   std::unique_ptr<ChunkMap> chunkMap;
+
+   if (Globals().chunkMapPath != NULL) {
+      chunkMap.reset(new ChunkMap);
+      if (!chunkMap->open(Globals().chunkMapPath)) {
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+   }
+   return chunkMap;
+}
+
+
+static string
+JsonString(const string& s)
+{
+   std::ostringstream out;
+
+   out << '"';
+   for (unsigned char c : s) {
+      if (c == '"' || c == '\\') {
+         out << '\\' << c;
+      } else if (c < 0x20) {
+         out << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+             << (int)c << std::dec;
+      } else {
+         out << c;
+      }
+   }
+   out << '"';
+   return out.str();
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * ExportZipPEInfo --
+ *
+ *      The "peinfo" entry of -exportzip: the file given with -peinfo, else
+ *      a ProtectedEntityInfo for an ivd entity named after the disk, with
+ *      the FCD id (and snapshot id) if given, else the disk file name.
+ *
+ * Results:
+ *      The JSON.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static string
+ExportZipPEInfo(uint64 capacity)   // IN
+{
+   if (Globals().peInfoFile != NULL) {
+      std::ifstream in(Globals().peInfoFile, std::ios::binary);
+      std::ostringstream json;
+      if (!in || !(json << in.rdbuf())) {
+         cout << "Can't read " << Globals().peInfoFile << endl;
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+      return json.str();
+   }
+
+   string name = Globals().diskPaths[0];
+   string::size_type slash = name.find_last_of("/]");
+   if (slash != string::npos) {
+      name = name.substr(slash + 1);
+   }
+   name = name.substr(0, name.rfind(".vmdk"));
+   string id = Globals().fcdid != NULL ? Globals().fcdid : name;
+   // ':' separates the parts of a protected entity id.
+   std::replace(id.begin(), id.end(), ':', '_');
+   id = "ivd:" + id;
+   if (Globals().fcdid != NULL && Globals().fcdssid != NULL) {
+      id += string(":") + Globals().fcdssid;
+   }
+
+   std::ostringstream json;
+   json << "{\"id\":" << JsonString(id) << ",\"name\":" << JsonString(name)
+        << ",\"size\":" << capacity * VIXDISKLIB_SECTOR_SIZE
+        << ",\"dataTransports\":[],\"metadataTransports\":[],"
+        << "\"combinedTransports\":[],\"componentIDs\":[]}";
+   return json.str();
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoExportZip --
+ *
+ *      Writes the disk as a zip stream in the layout astrolabe's
+ *      ZipProtectedEntity uses and GetPEFromZipStream reads: a "peinfo"
+ *      entry with the ProtectedEntityInfo JSON and a "data" entry with
+ *      the raw disk. The data is deflated in VIX_ZIP_CHUNK sector chunks
+ *      on -zipthreads threads. Only allocated chunks are read; the others
+ *      are zeros whose deflated form is reused. The output is
+ *      Globals().zipPath, or stdout for "-", in which case messages go
+ *      to stderr.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates or overwrites Globals().zipPath.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoExportZip(void)
+{
+   const char *path = Globals().zipPath;
+   ExportOutput output(path);
+   VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                Globals().openFlags);
+   const uint64 capacity = disk.getInfo()->capacity;
+   auto start = std::chrono::system_clock::now();
+   ZipStream zip(output.fd());
+
+   string peInfo = ExportZipPEInfo(capacity);
+   vector<uint8> out;
+   if (!DeflateChunk((const uint8 *)peInfo.data(), peInfo.size(), true,
+                     VIX_ZIP_LEVEL, out)) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+   zip.begin("peinfo");
+   zip.data(out.data(), out.size());
+   zip.end(crc32(0, (const Bytef *)peInfo.data(), peInfo.size()),
+           peInfo.size());
+
+   unsigned threads = CompressThreads();
+   std::unique_ptr<ChunkMap> chunkMap = OpenChunkMap();
+   DeflateCodec codec(VIX_ZIP_LEVEL);
+   uint64 read;
+   {
+      CompressPipeline pipeline(
+         [&zip] (const uint8 *buf, size_t len) {
+            zip.data(buf, len);
+            return !zip.failed();
+         },
+         codec, threads, VIX_ZIP_CHUNK * VIXDISKLIB_SECTOR_SIZE, true);
+
+      zip.begin("data");
+      read = CompressDisk(disk, VIX_ZIP_CHUNK, pipeline, chunkMap.get());
+      zip.end(pipeline.crc(), pipeline.size());
+   }
+   zip.finish();
+   if (chunkMap) {
+      chunkMap->close();
+   }
+   if (zip.failed() || !output.sync()) {
+      cout << "Can't write " << path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+
+   auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now() - start).count();
+   cout << "Exported " << capacity * VIXDISKLIB_SECTOR_SIZE << " bytes to "
+        << path << ": " << read << " read, " << zip.offset()
+        << " zip bytes, " << threads << " deflate threads, in " << msec
+        << " msec";
+   if (msec > 0) {
+      cout << " (" << capacity * VIXDISKLIB_SECTOR_SIZE / 1000 / msec
+           << " MBytes/sec)";
+   }
+   cout << endl;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoExportStream --
+ *
+ *      Writes the raw disk compressed with the -codec codec, zstd by
+ *      default, as one frame per VIX_COMPRESS_CHUNK sectors. The frames
+ *      are compressed on -zipthreads threads and written in order, so
+ *      "lz4 -d" or "zstd -d" of the output gives the raw disk; deflate
+ *      gives a raw deflate stream.
+ *      Unallocated chunks aren't read and reuse one compressed frame of
+ *      zeros. The output is Globals().streamPath, or stdout for "-", in
+ *      which case messages go to stderr.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates or overwrites Globals().streamPath.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoExportStream(void)
+{
+   const char *path = Globals().streamPath;
+   std::unique_ptr<Codec> codec = MakeCodec(
+      Globals().codecSpec != NULL ? Globals().codecSpec : "zstd");
+   ExportOutput output(path);
+   VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                Globals().openFlags);
+   const uint64 capacity = disk.getInfo()->capacity;
+   auto start = std::chrono::system_clock::now();
+   unsigned threads = CompressThreads();
+   std::unique_ptr<ChunkMap> chunkMap = OpenChunkMap();
+   int fd = output.fd();
+   uint64 read;
+   uint64 written;
+   {
+      CompressPipeline pipeline(
+         [fd] (const uint8 *buf, size_t len) {
+            return WriteAll(fd, buf, len);
+         },
+         *codec, threads, VIX_COMPRESS_CHUNK * VIXDISKLIB_SECTOR_SIZE);
+
+      read = CompressDisk(disk, VIX_COMPRESS_CHUNK, pipeline, chunkMap.get());
+      written = pipeline.compressedSize();
+   }
+   if (chunkMap) {
+      chunkMap->close();
+   }
+   if (!output.sync()) {
+      cout << "Can't write " << path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+
+   const uint64 bytes = capacity * VIXDISKLIB_SECTOR_SIZE;
+   auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now() - start).count();
+   cout << "Exported " << bytes << " bytes to " << path << " with "
+        << codec->name() << ": " << read << " read, " << written
+        << " written, ratio " << std::fixed << std::setprecision(2)
+        << (written > 0 ? (double)bytes / written : 0.0)
+        << std::defaultfloat << ", " << threads << " threads, in " << msec
+        << " msec";
+   if (msec > 0) {
+      cout << " (" << bytes / 1000 / msec << " MBytes/sec)";
+   }
+   cout << endl;
+}
+#endif // _WIN32
+
+#ifdef _WIN32
+
+static void
+DoExportDelta(void)
+{
+   cout << "-exportdelta is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+static void
+DoApplyDelta(void)
+{
+   cout << "-applydelta is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+#else
+
+static bool
+ReadFull(int fd, void *buf, size_t len)
+{
+   uint8 *p = (uint8 *)buf;
+
+   while (len > 0) {
+      ssize_t n = ::read(fd, p, len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return false;
+      }
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+
+/*
+ * The manifest of -exportdelta: the SHA-256 of every block of a disk, all
+ * zero bits for a block that reads as zeros, after a header with the
+ * block size, the capacity and the DiskIdentity of the disk. The next
+ * -exportdelta compares the disk against it to find the changed blocks.
+ *
+ *    "VIXMANI1" blockSectors:4 identityLen:4 capacity:8 identity
+ *    digest:32 per block
+ */
+
+class BlockManifest
+{
+   public:
+      static const size_t DIGEST = SHA256_DIGEST_LENGTH;
+
+      BlockManifest() : _blockSectors(0), _capacity(0) {}
+
+      void reset(uint64 capacity, uint32 blockSectors,
+                 const string& identity)
+      {
+         _capacity = capacity;
+         _blockSectors = blockSectors;
+         _identity = identity;
+         _digests.assign((capacity + blockSectors - 1) / blockSectors *
+                         DIGEST, 0);
+      }
+
+      bool load(const char *path);
+      bool save(const char *path) const;
+
+      uint64 numBlocks() const
+      {
+         return _digests.size() / DIGEST;
+      }
+
+      uint32 blockSectors() const
+      {
+         return _blockSectors;
+      }
+
+      uint64 capacity() const
+      {
+         return _capacity;
+      }
+
+      const string& identity() const
+      {
+         return _identity;
+      }
+
+      void set(uint64 block, const uint8 *digest)
+      {
+         memcpy(&_digests[block * DIGEST], digest, DIGEST);
+      }
+
+      // Blocks past the end of the manifest read as zeros.
+      void get(uint64 block, uint8 *digest) const
+      {
+         if (block < numBlocks()) {
+            memcpy(digest, &_digests[block * DIGEST], DIGEST);
+         } else {
+            memset(digest, 0, DIGEST);
+         }
+      }
+
+      // Blocks past the end of the manifest read as zeros.
+      bool same(uint64 block, const uint8 *digest) const
+      {
+         return block < numBlocks() ?
+                memcmp(&_digests[block * DIGEST], digest, DIGEST) == 0 :
+                IsAllZero(digest, DIGEST);
+      }
+
+   private:
+      uint32 _blockSectors;
+      uint64 _capacity;
+      string _identity;
+      vector<uint8> _digests;
+};
+
+
+bool
+BlockManifest::load(const char *path)   // IN
+{
+   std::ifstream in(path, std::ios::binary);
+   uint8 header[24];
+
+   if (!in.read((char *)header, sizeof header) ||
+       memcmp(header, "VIXMANI1", 8) != 0) {
+      return false;
+   }
+   uint32 blockSectors = GetLE(header + 8, 4);
+   uint32 identityLen = GetLE(header + 12, 4);
+   uint64 capacity = GetLE(header + 16, 8);
+   if (blockSectors == 0) {
+      return false;
+   }
+   string identity(identityLen, '\0');
+   if (!in.read(&identity[0], identityLen)) {
+      return false;
+   }
+   reset(capacity, blockSectors, identity);
+   return (bool)in.read((char *)_digests.data(), _digests.size());
+}
+
+
+// Writes the manifest to a temporary file renamed over path, so a failed
+// run leaves the previous manifest in place.
+bool
+BlockManifest::save(const char *path) const   // IN
+{
+   string tmp = string(path) + ".tmp";
+   string header("VIXMANI1");
+
+   PutLE(header, _blockSectors, 4);
+   PutLE(header, _identity.size(), 4);
+   PutLE(header, _capacity, 8);
+   header += _identity;
+
+   int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0644);
+   if (fd < 0) {
+      return false;
+   }
+   bool ok = WriteAll(fd, header.data(), header.size()) &&
+             WriteAll(fd, _digests.data(), _digests.size()) &&
+             fsync(fd) == 0;
+   ok = close(fd) == 0 && ok;
+   if (!ok || rename(tmp.c_str(), path) != 0) {
+      unlink(tmp.c_str());
+      return false;
+   }
+   return true;
+}
+
+
+/*
+ * The records of a delta file, after its header
+ *
+ *    "VIXDELT1" blockSectors:4 flags:4 capacity:8 baseIdLen:4 idLen:4
+ *    baseIdentity identity
+ *
+ * Each record is sector:8 numSectors:8 type:4 reserved:4, followed by the
+ * data for DELTA_DATA. DELTA_END closes the file.
+ */
+
+enum DeltaRecordType {
+   DELTA_END = 0,
+   DELTA_DATA = 1,
+   DELTA_ZERO = 2,
+};
+
+#define DELTA_FLAG_BASE 1   // relative to a -basemanifest, else to zeros
+
+static string
+DeltaRecord(uint64 sector, uint64 numSectors, DeltaRecordType type)
+{
+   string r;
+
+   PutLE(r, sector, 8);
+   PutLE(r, numSectors, 8);
+   PutLE(r, type, 4);
+   PutLE(r, 0, 4);
+   return r;
+}
+
+
+/*
+ * The DELTA_META_KEY value of a disk holding the data of the export with
+ * identity: the hex SHA-256 of the identity. While -applydelta writes,
+ * the disk has "applying " and the stamp of the delta's identity.
+ */
+
+static string
+DeltaStamp(const string& identity)   // IN
+{
+   uint8 digest[SHA256_DIGEST_LENGTH];
+   char hex[2 * SHA256_DIGEST_LENGTH + 1];
+
+   SHA256((const uint8 *)identity.data(), identity.size(), digest);
+   for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+      sprintf(hex + 2 * i, "%02x", digest[i]);
+   }
+   return hex;
+}
+
+
+// The DELTA_META_KEY value of disk, empty if it has none.
+static string
+ReadDeltaStamp(const VixDisk& disk)   // IN
+{
+   size_t requiredLen = 0;
+   VixError vixError = VixDiskLib_ReadMetadata(disk.Handle(), DELTA_META_KEY,
+                                               NULL, 0, &requiredLen);
+   if (vixError == VIX_E_DISK_KEY_NOTFOUND) {
+      return "";
+   }
+   if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
+      THROW_ERROR(vixError);
+   }
+   vector<char> val(requiredLen + 1);
+   vixError = VixDiskLib_ReadMetadata(disk.Handle(), DELTA_META_KEY,
+                                      &val[0], val.size(), NULL);
+   CHECK_AND_THROW(vixError);
+   return &val[0];
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoExportDelta --
+ *
+ *      Writes the blocks of the disk that differ from the -basemanifest
+ *      of an earlier export, e.g. of the previous snapshot, as a delta
+ *      file that -applydelta writes to a copy of that earlier disk.
+ *      Without -basemanifest the delta has all nonzero blocks. -manifest
+ *      saves the manifest of the disk for the next run. The output is
+ *      Globals().deltaPath, or stdout for "-". Deltas are chained by the
+ *      SnapshotIdentity of their disks, so a live remote disk, whose
+ *      identity stays when its data changes, is refused.
+ *
+ *      Of the whole chain, blocks unallocated now are zeros and need no
+ *      read: they are skipped if they were zeros before and become zero
+ *      records if not. Every allocated block is read and its SHA-256
+ *      compared with the manifest.
+ *
+ *      With -single the disk is a snapshot's link, and -basemanifest must
+ *      be of its parent. Blocks unallocated in the link are inherited, so
+ *      unchanged, and keep their digests of the base. Only the blocks the
+ *      link allocates are read, through the whole chain, since sectors
+ *      of them the link doesn't have come from the parent.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates or overwrites Globals().deltaPath and the -manifest file.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoExportDelta(void)
+{
+   const char *path = Globals().deltaPath;
+   const bool singleLink =
+      (Globals().openFlags & VIXDISKLIB_FLAG_OPEN_SINGLE_LINK) != 0;
+   BlockManifest base;
+
+   if (singleLink && Globals().baseManifestPath == NULL) {
+      cout << "-exportdelta -single needs the -basemanifest of the "
+              "parent." << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   if (Globals().baseManifestPath != NULL) {
+      if (!base.load(Globals().baseManifestPath)) {
+         cout << "Can't read manifest " << Globals().baseManifestPath
+              << endl;
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+      if (base.blockSectors() != VIX_DELTA_BLOCK) {
+         cout << Globals().baseManifestPath << " has blocks of "
+              << base.blockSectors() << " sectors, not " << VIX_DELTA_BLOCK
+              << endl;
+         THROW_ERROR(VIX_E_INVALID_ARG);
+      }
+   }
+
+   ExportOutput output(path);
+   VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                Globals().openFlags);
+   const uint64 capacity = disk.getInfo()->capacity;
+   auto start = std::chrono::system_clock::now();
+   string identity;
+   if (!SnapshotIdentity(Globals().connection,
+                         Globals().diskPaths[0].c_str(), Globals().openFlags,
+                         capacity, identity)) {
+      cout << "Can't identify the data of the disk; -exportdelta needs a "
+              "local disk or a snapshot (-ssmoref, -fcdssid)." << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   BlockManifest manifest;
+   manifest.reset(capacity, VIX_DELTA_BLOCK, identity);
+
+   // The data of a single link is read through the whole chain.
+   std::unique_ptr<VixDisk> chain;
+   if (singleLink) {
+      chain.reset(new VixDisk(Globals().connection,
+                              Globals().diskPaths[0].c_str(),
+                              Globals().openFlags &
+                              ~VIXDISKLIB_FLAG_OPEN_SINGLE_LINK, 1));
+   }
+   const VixDisk& source = singleLink ? *chain : disk;
+
+   // Without allocation info, e.g. from the transport, read everything;
+   // of a single link that would take inherited blocks for changed ones.
+   BlockQuery blocks(disk,
+                     std::max<uint64>(Globals().chunkSize,
+                                      VIXDISKLIB_MIN_CHUNK_SIZE),
+                     QueryHandles(), !singleLink);
+   JobAddTotal(capacity);
+
+   string header("VIXDELT1");
+   PutLE(header, VIX_DELTA_BLOCK, 4);
+   PutLE(header, Globals().baseManifestPath != NULL ? DELTA_FLAG_BASE : 0,
+         4);
+   PutLE(header, capacity, 8);
+   PutLE(header, base.identity().size(), 4);
+   PutLE(header, identity.size(), 4);
+   header += base.identity();
+   header += identity;
+   bool ok = WriteAll(output.fd(), header.data(), header.size());
+
+   auto raPool = getBufferPool<VIX_READAHEAD_DEPTH, uint8, ThreadLock>(
+                    source, VIX_READAHEAD_MAX * VIXDISKLIB_SECTOR_SIZE);
+   vector<uint8> buf(VIX_DELTA_BLOCK * VIXDISKLIB_SECTOR_SIZE);
+   uint64 read = 0;
+   uint64 changed = 0;
+   uint64 zeroed = 0;
+   uint64 written = header.size();
+   uint64 zeroStart = 0;
+   uint64 zeroEnd = 0;
+   auto flushZeros = [&] () {
+      if (zeroEnd > zeroStart) {
+         string r = DeltaRecord(zeroStart, zeroEnd - zeroStart, DELTA_ZERO);
+         ok = ok && WriteAll(output.fd(), r.data(), r.size());
+         written += r.size();
+         zeroed += zeroEnd - zeroStart;
+      }
+      zeroStart = zeroEnd = 0;
+   };
+   {
+      ReadAhead readAhead(source.Handle(), capacity, *raPool);
+      uint64 block = 0;
+
+      for (uint64 sector = 0; sector < capacity && ok; block++) {
+         uint64 n = std::min<uint64>(VIX_DELTA_BLOCK, capacity - sector);
+         size_t bytes = n * VIXDISKLIB_SECTOR_SIZE;
+         uint8 digest[BlockManifest::DIGEST] = { 0 };
+
+         if (blocks.allocated(sector, n)) {
+            VixError vixError = readAhead.read(sector, n, buf.data());
+            CHECK_AND_THROW(vixError);
+            read += bytes;
+            if (!IsAllZero(buf.data(), bytes)) {
+               SHA256(buf.data(), bytes, digest);
             }
-            appGlobals.transportModes = argv[++i];
-        } else if (!strcmp(argv[i], "-check")) {
-            if (i >= argc - 2) {
-                printf("Error: The -check command requires a true or false "
-                       "value to indicate if a repair operation should be "
-                       "attempted. See usage below.\n\n");
-                return PrintUsage();
+         } else if (singleLink) {
+            base.get(block, digest);
+         }
+         manifest.set(block, digest);
+
+         if (base.same(block, digest)) {
+            // unchanged
+         } else if (IsAllZero(digest, sizeof digest)) {
+            if (zeroEnd != sector) {
+               flushZeros();
+               zeroStart = sector;
             }
-            appGlobals.command |= COMMAND_CHECKREPAIR;
-            appGlobals.repair = strtol(argv[++i], NULL, 0);
-        } else if (!strcmp(argv[i], "-lssize")) {
-            if (i > argc - 2) {
-               printf("Error: The -lssize option requires the number of "
-                      "logical sector size. See usage below.\n\n");
-               return PrintUsage();
+            zeroEnd = sector + n;
+         } else {
+            flushZeros();
+            string r = DeltaRecord(sector, n, DELTA_DATA);
+            ok = WriteAll(output.fd(), r.data(), r.size()) &&
+                 WriteAll(output.fd(), buf.data(), bytes);
+            written += r.size() + bytes;
+            changed++;
+         }
+         sector += n;
+
+         VixError vixError = JobAdvance(n);
+         CHECK_AND_THROW(vixError);
+      }
+   }
+   flushZeros();
+   string end = DeltaRecord(0, 0, DELTA_END);
+   ok = ok && WriteAll(output.fd(), end.data(), end.size());
+   written += end.size();
+   if (!ok || !output.sync()) {
+      cout << "Can't write " << path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   if (Globals().manifestPath != NULL &&
+       !manifest.save(Globals().manifestPath)) {
+      cout << "Can't write manifest " << Globals().manifestPath << ": "
+           << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+
+   auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now() - start).count();
+   cout << "Exported delta of " << capacity * VIXDISKLIB_SECTOR_SIZE
+        << " bytes to " << path << ": " << read << " read, " << changed
+        << " of " << manifest.numBlocks() << " blocks changed, "
+        << zeroed * VIXDISKLIB_SECTOR_SIZE << " bytes zeroed, " << written
+        << " delta bytes, in " << msec << " msec";
+   if (msec > 0) {
+      cout << " (" << read / 1000 / msec << " MBytes/sec read)";
+   }
+   cout << endl;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoApplyDelta --
+ *
+ *      Writes a delta of -exportdelta, from Globals().applyPath or stdin
+ *      for "-", to the disk, which must hold the data the delta's base
+ *      manifest was taken of, or zeros for a delta without one. Which
+ *      data a disk holds is told by its DELTA_META_KEY metadata, which
+ *      must be the DeltaStamp of the delta's base identity, or none for
+ *      a delta without base. A delta whose apply was cut short may be
+ *      applied again.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Writes the disk and its DELTA_META_KEY metadata.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoApplyDelta(void)
+{
+   const char *path = Globals().applyPath;
+   int fd = strcmp(path, "-") == 0 ? STDIN_FILENO :
+                                     open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0) {
+      cout << "Can't open " << path << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   std::unique_ptr<int, void (*)(int *)> fdGuard(&fd, [] (int *f) {
+                                                     if (*f != STDIN_FILENO) {
+                                                        close(*f);
+                                                     }
+                                                  });
+
+   uint8 header[32];
+   if (!ReadFull(fd, header, sizeof header) ||
+       memcmp(header, "VIXDELT1", 8) != 0) {
+      cout << path << " is not a delta file." << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   // The header sizes the buffers: take only what -exportdelta writes.
+   static const uint32 maxIdentity = 65536;
+   uint32 blockSectors = GetLE(header + 8, 4);
+   uint32 flags = GetLE(header + 12, 4);
+   if (blockSectors != VIX_DELTA_BLOCK) {
+      cout << path << " has blocks of " << blockSectors << " sectors, not "
+           << VIX_DELTA_BLOCK << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   uint64 deltaCapacity = GetLE(header + 16, 8);
+   if (GetLE(header + 24, 4) > maxIdentity ||
+       GetLE(header + 28, 4) > maxIdentity) {
+      cout << path << " is damaged: its identities are too long." << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   string baseIdentity(GetLE(header + 24, 4), '\0');
+   string identity(GetLE(header + 28, 4), '\0');
+   if (!ReadFull(fd, &baseIdentity[0], baseIdentity.size()) ||
+       !ReadFull(fd, &identity[0], identity.size())) {
+      cout << "Can't read " << path << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+
+   VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                Globals().openFlags);
+   const uint64 capacity = disk.getInfo()->capacity;
+   if (deltaCapacity > capacity) {
+      cout << "The delta is of " << deltaCapacity << " sectors, the disk "
+           << "has " << capacity << "." << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   string stamp = ReadDeltaStamp(disk);
+   string baseStamp = flags & DELTA_FLAG_BASE ? DeltaStamp(baseIdentity) :
+                                                "";
+   string applying = "applying " + DeltaStamp(identity);
+   if (stamp != baseStamp && stamp != applying) {
+      if (flags & DELTA_FLAG_BASE) {
+         cout << "The disk doesn't hold the base " << baseIdentity
+              << " of the delta. If it does, set its " DELTA_META_KEY
+                 " metadata to " << baseStamp << " with -writemeta." << endl;
+      } else {
+         cout << "The disk holds " << DELTA_META_KEY << " " << stamp
+              << ", not zeros for a delta without base." << endl;
+      }
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   VixError vixError = VixDiskLib_WriteMetadata(disk.Handle(),
+                                                DELTA_META_KEY,
+                                                applying.c_str());
+   CHECK_AND_THROW(vixError);
+   cout << "Applying delta " << (flags & DELTA_FLAG_BASE ? "from " : "")
+        << baseIdentity << (flags & DELTA_FLAG_BASE ? " " : "") << "to "
+        << identity << endl;
+   auto start = std::chrono::system_clock::now();
+   JobAddTotal(deltaCapacity);
+
+   vector<uint8> buf(blockSectors * VIXDISKLIB_SECTOR_SIZE);
+   vector<uint8> zeros(buf.size());
+   uint64 dataSectors = 0;
+   uint64 zeroSectors = 0;
+   for (;;) {
+      uint8 rec[24];
+      if (!ReadFull(fd, rec, sizeof rec)) {
+         cout << path << " is truncated." << endl;
+         THROW_ERROR(VIX_E_FILE_ERROR);
+      }
+      uint64 sector = GetLE(rec, 8);
+      uint64 numSectors = GetLE(rec + 8, 8);
+      uint32 type = GetLE(rec + 16, 4);
+      if (type == DELTA_END) {
+         break;
+      }
+      if (sector > deltaCapacity || numSectors > deltaCapacity - sector ||
+          (type == DELTA_DATA && numSectors > blockSectors) ||
+          (type != DELTA_DATA && type != DELTA_ZERO)) {
+         cout << path << " has a bad record at sector " << sector << endl;
+         THROW_ERROR(VIX_E_INVALID_ARG);
+      }
+
+      if (type == DELTA_DATA) {
+         if (!ReadFull(fd, buf.data(), numSectors * VIXDISKLIB_SECTOR_SIZE)) {
+            cout << path << " is truncated." << endl;
+            THROW_ERROR(VIX_E_FILE_ERROR);
+         }
+         vixError = VixDiskLib_Write(disk.Handle(), sector, numSectors,
+                                     buf.data());
+         CHECK_AND_THROW(vixError);
+         dataSectors += numSectors;
+      } else {
+         for (uint64 done = 0; done < numSectors; ) {
+            uint64 n = std::min<uint64>(blockSectors, numSectors - done);
+            vixError = VixDiskLib_Write(disk.Handle(), sector + done, n,
+                                        zeros.data());
+            CHECK_AND_THROW(vixError);
+            done += n;
+         }
+         zeroSectors += numSectors;
+      }
+      vixError = JobAdvance(numSectors);
+      CHECK_AND_THROW(vixError);
+   }
+   vixError = VixDiskLib_WriteMetadata(disk.Handle(), DELTA_META_KEY,
+                                       DeltaStamp(identity).c_str());
+   CHECK_AND_THROW(vixError);
+
+   auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now() - start).count();
+   cout << "Applied " << path << ": " << dataSectors * VIXDISKLIB_SECTOR_SIZE
+        << " bytes written, " << zeroSectors * VIXDISKLIB_SECTOR_SIZE
+        << " bytes zeroed, in " << msec << " msec" << endl;
+}
+#endif // _WIN32
+
+#ifdef _WIN32
+
+static void
+DoMerkle(void)
+{
+   cout << "-merkle is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+static void
+DoMerkleDiff(void)
+{
+   cout << "-merklediff is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+#else
+
+/*
+ * A Merkle tree over the VIX_MERKLE_LEAF sector blocks of a disk, in a
+ * file that is used through mmap. A leaf is the SHA-256 of its block, or
+ * all zero bits for a block of zeros; a node is all zero bits if both its
+ * children are, else the SHA-256 of a 1 byte and its two children, a
+ * missing right one counting as zeros. Comparing two trees from the root
+ * down only visits the nodes above the blocks that differ.
+ *
+ *    "VIXMRKL1" leafSectors:4 levels:4 capacity:8 leaves:8 identityLen:4
+ *    0:28  identity, padded to 32 bytes
+ *    digest:32 per node, the root first, level by level down to the leaves
+ */
+
+class MerkleTree
+{
+   public:
+      static const size_t DIGEST = SHA256_DIGEST_LENGTH;
+
+      MerkleTree() : _fd(-1), _map(NULL), _mapSize(0), _leafSectors(0),
+                     _capacity(0), _nodes(NULL) {}
+
+      ~MerkleTree()
+      {
+         if (_map != NULL) {
+            munmap(_map, _mapSize);
+         }
+         if (_fd >= 0) {
+            close(_fd);
+         }
+      }
+
+      bool create(const char *path, uint64 capacity, uint32 leafSectors,
+                  const string& identity);
+      bool open(const char *path);
+      void build();
+      bool sync();
+
+      unsigned levels() const
+      {
+         return _count.size();
+      }
+
+      uint64 count(unsigned level) const
+      {
+         return _count[level];
+      }
+
+      uint8 *node(unsigned level, uint64 i) const
+      {
+         return _nodes + (_offset[level] + i) * DIGEST;
+      }
+
+      uint8 *leaf(uint64 i) const
+      {
+         return node(levels() - 1, i);
+      }
+
+      uint32 leafSectors() const
+      {
+         return _leafSectors;
+      }
+
+      uint64 capacity() const
+      {
+         return _capacity;
+      }
+
+      const string& identity() const
+      {
+         return _identity;
+      }
+
+   private:
+      static const size_t HEADER = 64;
+
+      size_t layout(uint64 leaves);
+      bool map(const char *path, int prot);
+
+      int _fd;
+      uint8 *_map;
+      size_t _mapSize;
+      uint32 _leafSectors;
+      uint64 _capacity;
+      string _identity;
+      vector<uint64> _count;    // nodes per level, the root's first
+      vector<uint64> _offset;   // in nodes from the root
+      uint8 *_nodes;
+};
+
+
+// Lays out the levels over leaves; returns the size of the file.
+size_t
+MerkleTree::layout(uint64 leaves)   // IN
+{
+   vector<uint64> counts;
+   for (uint64 n = std::max<uint64>(leaves, 1); ; n = (n + 1) / 2) {
+      counts.push_back(n);
+      if (n == 1) {
+         break;
+      }
+   }
+   _count.assign(counts.rbegin(), counts.rend());
+   _offset.clear();
+   uint64 total = 0;
+   for (uint64 n : _count) {
+      _offset.push_back(total);
+      total += n;
+   }
+   return HEADER + (_identity.size() + DIGEST - 1) / DIGEST * DIGEST +
+          total * DIGEST;
+}
+
+
+bool
+MerkleTree::map(const char *path,   // IN
+                int prot)           // IN
+{
+   _map = (uint8 *)mmap(NULL, _mapSize, prot, MAP_SHARED, _fd, 0);
+   if (_map == MAP_FAILED) {
+      _map = NULL;
+      cout << "Can't map " << path << ": " << strerror(errno) << endl;
+      return false;
+   }
+   _nodes = _map + HEADER +
+            (_identity.size() + DIGEST - 1) / DIGEST * DIGEST;
+   return true;
+}
+
+
+// Creates the file with all nodes zero, for the leaves to be filled in.
+bool
+MerkleTree::create(const char *path,          // IN
+                   uint64 capacity,           // IN
+                   uint32 leafSectors,        // IN
+                   const string& identity)    // IN
+{
+   _capacity = capacity;
+   _leafSectors = leafSectors;
+   _identity = identity;
+   _mapSize = layout((capacity + leafSectors - 1) / leafSectors);
+
+   string header("VIXMRKL1");
+   PutLE(header, leafSectors, 4);
+   PutLE(header, levels(), 4);
+   PutLE(header, capacity, 8);
+   PutLE(header, count(levels() - 1), 8);
+   PutLE(header, identity.size(), 4);
+   header.resize(HEADER, '\0');
+   header += identity;
+
+   _fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (_fd < 0 || ftruncate(_fd, _mapSize) != 0 ||
+       !PWriteAll(_fd, (const uint8 *)header.data(), header.size(), 0)) {
+      cout << "Can't create " << path << ": " << strerror(errno) << endl;
+      return false;
+   }
+   return map(path, PROT_READ | PROT_WRITE);
+}
+
+
+bool
+MerkleTree::open(const char *path)   // IN
+{
+   struct stat st;
+   uint8 header[HEADER];
+
+   _fd = ::open(path, O_RDONLY | O_CLOEXEC);
+   if (_fd < 0 || fstat(_fd, &st) != 0) {
+      cout << "Can't open " << path << ": " << strerror(errno) << endl;
+      return false;
+   }
+   if (!PReadAll(_fd, header, sizeof header, 0) ||
+       memcmp(header, "VIXMRKL1", 8) != 0) {
+      cout << path << " is not a Merkle tree." << endl;
+      return false;
+   }
+   _leafSectors = GetLE(header + 8, 4);
+   _capacity = GetLE(header + 16, 8);
+   uint64 leaves = GetLE(header + 24, 8);
+   _identity.assign(GetLE(header + 32, 4), '\0');
+   if (_identity.size() > (uint64)st.st_size ||
+       !PReadAll(_fd, (uint8 *)&_identity[0], _identity.size(), HEADER)) {
+      cout << path << " is truncated." << endl;
+      return false;
+   }
+   // The leaves must cover the capacity, as create() lays them out.
+   if (_leafSectors == 0 ||
+       leaves != (_capacity + _leafSectors - 1) / _leafSectors) {
+      cout << path << " is damaged." << endl;
+      return false;
+   }
+   _mapSize = layout(leaves);
+   if (levels() != GetLE(header + 12, 4) ||
+       _mapSize != (uint64)st.st_size) {
+      cout << path << " is truncated or damaged." << endl;
+      return false;
+   }
+   return map(path, PROT_READ);
+}
+
+
+// Computes the nodes above the leaves.
+void
+MerkleTree::build()
+{
+   static const uint8 zero[DIGEST] = { 0 };
+
+   for (unsigned level = levels() - 1; level > 0; level--) {
+      for (uint64 i = 0; i < count(level - 1); i++) {
+         const uint8 *left = node(level, 2 * i);
+         const uint8 *right = 2 * i + 1 < count(level) ?
+                              node(level, 2 * i + 1) : zero;
+         uint8 *parent = node(level - 1, i);
+
+         if (IsAllZero(left, DIGEST) && IsAllZero(right, DIGEST)) {
+            memset(parent, 0, DIGEST);
+         } else {
+            SHA256_CTX ctx;
+            static const uint8 one = 1;
+            SHA256_Init(&ctx);
+            SHA256_Update(&ctx, &one, 1);
+            SHA256_Update(&ctx, left, DIGEST);
+            SHA256_Update(&ctx, right, DIGEST);
+            SHA256_Final(parent, &ctx);
+         }
+      }
+   }
+}
+
+
+bool
+MerkleTree::sync()
+{
+   return msync(_map, _mapSize, MS_SYNC) == 0 && fsync(_fd) == 0;
+}
+
+
+/*
+ * Hashes blocks into the leaves of a MerkleTree on a pool of threads.
+ * The leaves are independent, so the blocks can be hashed in any order;
+ * twice as many buffers as threads bound the memory used. OpenSSL picks
+ * the SHA extensions or AVX2 code for the CPU it runs on.
+ */
+
+class LeafHasher
+{
+   public:
+      LeafHasher(MerkleTree& tree, unsigned threads, size_t bufBytes);
+      ~LeafHasher();
+
+      uint8 *get();
+      void put(uint64 leaf, uint8 *buf, size_t len);
+      void finish();
+
+   private:
+      struct Job {
+         uint64 leaf;
+         uint8 *buf;
+         size_t len;
+      };
+
+      void worker();
+
+      MerkleTree& _tree;
+      vector<vector<uint8>> _bufs;
+      vector<uint8 *> _free;
+      std::deque<Job> _work;
+      unsigned _busy;
+      std::mutex _lock;
+      std::condition_variable _workCv;
+      std::condition_variable _freeCv;
+      bool _stop;
+      vector<std::thread> _threads;
+};
+
+
+LeafHasher::LeafHasher(MerkleTree& tree,      // IN
+                       unsigned threads,      // IN
+                       size_t bufBytes)       // IN
+   : _tree(tree), _bufs(2 * threads, vector<uint8>(bufBytes)), _busy(0),
+     _stop(false)
+{
+   for (auto& b : _bufs) {
+      _free.push_back(b.data());
+   }
+   for (unsigned i = 0; i < threads; i++) {
+      _threads.emplace_back([this] () { worker(); });
+   }
+}
+
+
+LeafHasher::~LeafHasher()
+{
+   {
+      std::lock_guard<std::mutex> lg(_lock);
+      _stop = true;
+   }
+   _workCv.notify_all();
+   for (auto& t : _threads) {
+      t.join();
+   }
+}
+
+
+void
+LeafHasher::worker()
+{
+   std::unique_lock<std::mutex> lk(_lock);
+
+   for (;;) {
+      _workCv.wait(lk, [this] () { return _stop || !_work.empty(); });
+      if (_stop) {
+         return;
+      }
+      Job job = _work.front();
+      _work.pop_front();
+      _busy++;
+      lk.unlock();
+      uint8 *leaf = _tree.leaf(job.leaf);
+      if (IsAllZero(job.buf, job.len)) {
+         memset(leaf, 0, MerkleTree::DIGEST);
+      } else {
+         SHA256(job.buf, job.len, leaf);
+      }
+      lk.lock();
+      _busy--;
+      _free.push_back(job.buf);
+      _freeCv.notify_all();
+   }
+}
+
+
+// Returns a buffer for the next block, waiting for one if all are busy.
+// Blocks put and not hashed yet when the hasher goes away are dropped.
+uint8 *
+LeafHasher::get()
+{
+   std::unique_lock<std::mutex> lk(_lock);
+
+   _freeCv.wait(lk, [this] () { return !_free.empty(); });
+   uint8 *buf = _free.back();
+   _free.pop_back();
+   return buf;
+}
+
+
+void
+LeafHasher::put(uint64 leaf,       // IN
+                uint8 *buf,        // IN
+                size_t len)        // IN
+{
+   {
+      std::lock_guard<std::mutex> lg(_lock);
+      _work.push_back(Job{leaf, buf, len});
+   }
+   _workCv.notify_one();
+}
+
+
+// Waits for all blocks put to be hashed.
+void
+LeafHasher::finish()
+{
+   std::unique_lock<std::mutex> lk(_lock);
+
+   _freeCv.wait(lk, [this] () {
+                       return _free.size() == _bufs.size();
+                    });
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BuildMerkle --
+ *
+ *      Builds the MerkleTree of a disk in file out. Only the allocated
+ *      blocks are read; the leaves of the others stay zero.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates or overwrites out. Throws on error.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+BuildMerkle(VixDiskLibConnection connection,   // IN
+            const char *diskPath,              // IN
+            uint32 flags,                      // IN
+            unsigned queryHandles,             // IN
+            const string& out)                 // IN
+{
+   VixDisk disk(connection, diskPath, flags);
+   const uint64 capacity = disk.getInfo()->capacity;
+   auto start = std::chrono::system_clock::now();
+   string identity;
+   if (!DiskIdentity(connection, diskPath, capacity, identity)) {
+      cout << "Can't identify " << diskPath << " for the Merkle tree."
+           << endl;
+      THROW_ERROR(VIX_E_FAIL);
+   }
+
+   MerkleTree tree;
+   if (!tree.create(out.c_str(), capacity, VIX_MERKLE_LEAF, identity)) {
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+
+   // Without allocation info, e.g. from the transport, read everything.
+   BlockQuery blocks(disk,
+                     std::max<uint64>(Globals().chunkSize,
+                                      VIXDISKLIB_MIN_CHUNK_SIZE),
+                     queryHandles, true);
+   JobAddTotal(capacity);
+
+   unsigned threads = Globals().hashThreads != 0 ?
+                      Globals().hashThreads :
+                      std::max(1U, std::thread::hardware_concurrency());
+   auto raPool = getBufferPool<VIX_READAHEAD_DEPTH, uint8, ThreadLock>(
+                    disk, VIX_READAHEAD_MAX * VIXDISKLIB_SECTOR_SIZE);
+   uint64 read = 0;
+   {
+      ReadAhead readAhead(disk.Handle(), capacity, *raPool);
+      LeafHasher hasher(tree, threads,
+                        VIX_MERKLE_LEAF * VIXDISKLIB_SECTOR_SIZE);
+      uint64 leaf = 0;
+
+      for (uint64 sector = 0; sector < capacity; leaf++) {
+         uint64 n = std::min<uint64>(VIX_MERKLE_LEAF, capacity - sector);
+
+         if (blocks.allocated(sector, n)) {
+            uint8 *buf = hasher.get();
+            VixError vixError = readAhead.read(sector, n, buf);
+            CHECK_AND_THROW(vixError);
+            hasher.put(leaf, buf, n * VIXDISKLIB_SECTOR_SIZE);
+            read += n * VIXDISKLIB_SECTOR_SIZE;
+         }
+         sector += n;
+
+         VixError vixError = JobAdvance(n);
+         CHECK_AND_THROW(vixError);
+      }
+      hasher.finish();
+   }
+   tree.build();
+   if (!tree.sync()) {
+      cout << "Can't write " << out << ": " << strerror(errno) << endl;
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+
+   auto msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now() - start).count();
+   std::ostringstream line;
+   line << "Merkle tree of " << diskPath << " in " << out << ": "
+        << tree.count(tree.levels() - 1) << " leaves, " << tree.levels()
+        << " levels, " << read << " bytes read and hashed on " << threads
+        << " threads in " << msec << " msec";
+   if (msec > 0) {
+      line << " (" << read / 1000 / msec << " MBytes/sec)";
+   }
+   cout << line.str() << endl;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoMerkle --
+ *
+ *      Builds the MerkleTree of each disk given, all disks at the same
+ *      time, in Globals().merklePath, or with several disks in
+ *      Globals().merklePath.<n> for the nth one. The disks share the
+ *      QueryHandles(), so the command opens no more of them than a
+ *      single disk would.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates or overwrites the tree files.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoMerkle(void)
+{
+   const vector<string>& paths = Globals().diskPaths;
+   vector<std::future<void>> builds;
+   const unsigned queryHandles =
+      std::max<size_t>(1, QueryHandles() / std::max<size_t>(1, paths.size()));
+
+   for (size_t i = 0; i < paths.size(); i++) {
+      string out = Globals().merklePath;
+      if (paths.size() > 1) {
+         out += "." + std::to_string(i);
+      }
+      AppGlobals *globals = curGlobals;
+      builds.push_back(std::async(std::launch::async,
+                                  [globals, &paths, i, queryHandles,
+                                   out] () {
+                                     GlobalsScope gs(globals);
+                                     BuildMerkle(Globals().connection,
+                                                 paths[i].c_str(),
+                                                 Globals().openFlags,
+                                                 queryHandles, out);
+                                  }));
+   }
+   // Wait for all, then report the first failure.
+   std::exception_ptr error;
+   for (auto& b : builds) {
+      try {
+         b.get();
+      } catch (...) {
+         if (!error) {
+            error = std::current_exception();
+         }
+      }
+   }
+   if (error) {
+      std::rethrow_exception(error);
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoMerkleDiff --
+ *
+ *      Compares the MerkleTrees in Globals().merkleDiff, from the roots
+ *      down, and prints the byte ranges whose blocks differ. Only the
+ *      subtrees with differing roots are visited.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoMerkleDiff(void)
+{
+   MerkleTree a;
+   MerkleTree b;
+
+   if (!a.open(Globals().merkleDiff[0]) ||
+       !b.open(Globals().merkleDiff[1])) {
+      THROW_ERROR(VIX_E_FILE_ERROR);
+   }
+   if (a.leafSectors() != b.leafSectors() || a.capacity() != b.capacity() ||
+       a.levels() != b.levels()) {
+      cout << "The trees are of disks of " << a.capacity() << " and "
+           << b.capacity() << " sectors in blocks of " << a.leafSectors()
+           << " and " << b.leafSectors() << ", " << a.levels() << " and "
+           << b.levels() << " levels; they can't be compared." << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   cout << "Comparing " << a.identity() << " with " << b.identity() << endl;
+
+   const unsigned leafLevel = a.levels() - 1;
+   uint64 nodes = 0;
+   for (unsigned level = 0; level < a.levels(); level++) {
+      nodes += a.count(level);
+   }
+   vector<std::pair<unsigned, uint64>> stack(1, std::make_pair(0U, 0ULL));
+   uint64 visited = 0;
+   uint64 diffStart = 0;
+   uint64 diffEnd = 0;
+   uint64 ranges = 0;
+   uint64 differ = 0;
+   auto flush = [&] () {
+      if (diffEnd > diffStart) {
+         uint64 end = std::min(diffEnd, a.capacity());
+         cout << diffStart * VIXDISKLIB_SECTOR_SIZE << " "
+              << (end - diffStart) * VIXDISKLIB_SECTOR_SIZE << endl;
+         ranges++;
+         differ += end - diffStart;
+      }
+   };
+
+   // Depth first, left to right, so the ranges come in order.
+   while (!stack.empty()) {
+      unsigned level = stack.back().first;
+      uint64 i = stack.back().second;
+      stack.pop_back();
+      visited++;
+      if (memcmp(a.node(level, i), b.node(level, i),
+                 MerkleTree::DIGEST) == 0) {
+         continue;
+      }
+      if (level == leafLevel) {
+         uint64 sector = i * a.leafSectors();
+         if (sector != diffEnd) {
+            flush();
+            diffStart = sector;
+         }
+         diffEnd = sector + a.leafSectors();
+         continue;
+      }
+      if (2 * i + 1 < a.count(level + 1)) {
+         stack.push_back(std::make_pair(level + 1, 2 * i + 1));
+      }
+      stack.push_back(std::make_pair(level + 1, 2 * i));
+   }
+   flush();
+   cout << ranges << " ranges, " << differ * VIXDISKLIB_SECTOR_SIZE
+        << " bytes differ; " << visited << " of " << nodes
+        << " nodes compared" << endl;
+}
+#endif // _WIN32
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * BitCount --
+ *
+ *      Counts all the bits set in an int.
+ *
+ * Results:
+ *      Number of bits set to 1.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+BitCount(int number)    // IN
+{
+    int bits = 0;
+    while (number) {
+        number = number & (number - 1);
+        bits++;
+    }
+    return bits;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DumpBytes --
+ *
+ *      Formats an array of n bytes as lines of step bytes in hex and
+ *      as text, appending to out. Table driven, as dumps of whole disk
+ *      ranges are bound by formatting otherwise.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+// Hex and printable forms of every byte value, for DumpBytes
+struct DumpTables
+{
+   DumpTables()
+   {
+      static const char digits[] = "0123456789abcdef";
+
+      for (int c = 0; c < 256; c++) {
+         hex[c][0] = digits[c >> 4];
+         hex[c][1] = digits[c & 0xf];
+         hex[c][2] = ' ';
+         ascii[c] = c < ' ' || c >= 127 ? '.' : (char)c;
+      }
+   }
+
+   char hex[256][3];
+   char ascii[256];
+};
+
+static const DumpTables dumpTables;
+
+static void
+DumpBytes(const unsigned char *buf,     // IN
+          size_t n,                     // IN
+          int step,                     // IN
+          string& out)                  // IN/OUT
+{
+   size_t lines = n / step;
+   size_t pos = out.size();
+   size_t i;
+
+   // Offset of up to 16 digits, " : ", hex, "  ", text and newline
+   out.resize(pos + lines * (22 + 4 * step) + 1);
+   char *p = &out[pos];
+
+   for (i = 0; i < lines; i++) {
+      const unsigned char *line = buf + i * step;
+      char offset[16];
+      size_t off = i * step;
+      int digits = 0;
+      int k;
+
+      do {
+         offset[digits++] = "0123456789abcdef"[off & 0xf];
+         off >>= 4;
+      } while (off != 0 || digits < 4);
+      while (digits > 0) {
+         *p++ = offset[--digits];
+      }
+      memcpy(p, " : ", 3);
+      p += 3;
+      for (k = 0; k < step; k++) {
+         memcpy(p, dumpTables.hex[line[k]], 3);
+         p += 3;
+      }
+      *p++ = ' ';
+      *p++ = ' ';
+      for (k = 0; k < step; k++) {
+         *p++ = dumpTables.ascii[line[k]];
+      }
+      *p++ = '\n';
+   }
+   *p++ = '\n';
+   out.resize(p - out.data());
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CopyThread --
+ *
+ *       Copies a source disk to the given file.
+ *
+ * Results:
+ *       0 if succeeded, 1 if not.
+ *
+ * Side effects:
+ *      Creates a new disk; sets Globals().success to false if fails
+ *
+ *----------------------------------------------------------------------
+ */
+
+#ifdef _WIN32
+#define TASK_OK 0
+#define TASK_FAIL 1
+
+static unsigned __stdcall
+#else
+#define TASK_OK ((void*)0)
+#define TASK_FAIL ((void*)1)
+
+static void *
+#endif
+CopyThread(void *arg)
+{
+   ThreadData *td = (ThreadData *)arg;
+   GlobalsScope gs(td->globals);
+
+    try {
+      VixDiskLibSectorType i;
+      VixError vixError;
+      uint8 *buf = new uint8[VIXDISKLIB_SECTOR_SIZE];
+      BufferPool<VIX_READAHEAD_DEPTH, uint8, ThreadLock> raPool(
+         VIX_READAHEAD_MAX * VIXDISKLIB_SECTOR_SIZE);
+      ReadAhead readAhead(td->srcHandle, td->numSectors, raPool);
+
+      JobAddTotal(td->numSectors);
+      for (i = 0; i < td->numSectors ; i += 1) {
+         vixError = readAhead.read(i, 1, buf);
+         CHECK_AND_THROW_2(vixError, buf);
+         vixError = VixDiskLib_Write(td->dstHandle, i, 1, buf);
+         CHECK_AND_THROW_2(vixError, buf);
+         vixError = JobAdvance(1);
+         CHECK_AND_THROW_2(vixError, buf);
+      }
+
+      delete[] buf;
+      readAhead.printStats();
+    } catch (const VixDiskLibErrWrapper& e) {
+       cout << "CopyThread (" << td->dstDisk << ")Error: " << e.ErrorCode()
+            <<" " << e.Description();
+        Globals().success = FALSE;
+        return TASK_FAIL;
+    }
+
+    cout << "CopyThread to " << td->dstDisk << " succeeded.\n";
+    return TASK_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrepareThreadData --
+ *
+ *      Open the source and destination disk for multi threaded copy.
+ *
+ * Results:
+ *      Fills in ThreadData in td.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrepareThreadData(VixDiskLibConnection &dstConnection,
+                  ThreadData &td)
+{
+   VixError vixError;
+   VixDiskLibCreateParams createParams;
+   VixDiskLibInfo *info = NULL;
+   string prefixName,randomFilename;
+
+#ifdef _WIN32
+   prefixName = "c:\\test";
+#else
+   prefixName = "/tmp/test";
+#endif
+   GenerateRandomFilename(prefixName, randomFilename);
+   td.dstDisk = randomFilename;
+   td.globals = curGlobals;
+
+   std::lock_guard<std::mutex> lg(openCloseLock);
+   vixError = VixDiskLib_Open(Globals().connection,
+                              Globals().diskPaths[0].c_str(),
+                              Globals().openFlags,
+                              &td.srcHandle);
+   CHECK_AND_THROW(vixError);
+
+   vixError = VixDiskLib_GetInfo(td.srcHandle, &info);
+   CHECK_AND_THROW(vixError);
+   td.numSectors = info->capacity;
+   VixDiskLib_FreeInfo(info);
+
+   createParams.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
+   createParams.capacity = td.numSectors;
+   createParams.logicalSectorSize = Globals().logicalSectorSize;
+   createParams.physicalSectorSize = Globals().physicalSectorSize;
+   createParams.diskType = VIXDISKLIB_DISK_SPLIT_SPARSE;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+   vixError = VixDiskLib_Create(dstConnection, td.dstDisk.c_str(),
+                                &createParams, NULL, NULL);
+   CHECK_AND_THROW(vixError);
+
+   vixError = VixDiskLib_Open(dstConnection, td.dstDisk.c_str(), 0,
+                              &td.dstHandle);
+   CHECK_AND_THROW(vixError);
+
+   vixError = VixDiskLib_GetInfo(td.dstHandle, &info);
+   CHECK_AND_THROW(vixError);
+   VixDiskLib_FreeInfo(info);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoTestMultiThread --
+ *
+ *      Starts a given number of threads, each of which will copy the
+ *      source disk to a temp. file.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoTestMultiThread(void)
+{
+   auto dstLease = connPool.acquire(ConnectSpec::Local());
+   VixDiskLibConnection dstConnection = dstLease.get();
+   vector<ThreadData> threadData(Globals().numThreads);
+   unsigned int i;
+
+#ifdef _WIN32
+   vector<HANDLE> threads(Globals().numThreads);
+
+   for (i = 0; i < Globals().numThreads; i++) {
+      unsigned int threadId;
+
+      PrepareThreadData(dstConnection, threadData[i]);
+      threads[i] = (HANDLE)_beginthreadex(NULL, 0, &CopyThread,
+                                          (void*)&threadData[i], 0, &threadId);
+   }
+   WaitForMultipleObjects(Globals().numThreads, &threads[0], TRUE, INFINITE);
+#else
+   vector<pthread_t> threads(Globals().numThreads);
+
+   for (i = 0; i < Globals().numThreads; i++) {
+      PrepareThreadData(dstConnection, threadData[i]);
+      pthread_create(&threads[i], NULL, &CopyThread, (void*)&threadData[i]);
+   }
+   for (i = 0; i < Globals().numThreads; i++) {
+      void *hlp;
+      pthread_join(threads[i], &hlp);
+   }
+#endif
+
+   std::lock_guard<std::mutex> lg(openCloseLock);
+   for (i = 0; i < Globals().numThreads; i++) {
+      blockCache.invalidate(threadData[i].srcHandle);
+      VixDiskLib_Close(threadData[i].srcHandle);
+      VixDiskLib_Close(threadData[i].dstHandle);
+      VixDiskLib_Unlink(dstConnection, threadData[i].dstDisk.c_str());
+   }
+   if (!Globals().success) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CloneProgress --
+ *
+ *      Callback for the clone function. progressData is the JobControl
+ *      of a daemon job, or NULL.
+ *
+ * Results:
+ *      FALSE to abort the clone when the job was cancelled.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+CloneProgressFunc(void *progressData,           // IN
+                  int percentCompleted)         // IN
+{
+   JobControl *job = (JobControl *)progressData;
+
+   cout << "Cloning : " << percentCompleted << "% Done" << "\r";
+   if (job != NULL) {
+      job->total = 100;
+      job->done = percentCompleted;
+      return !job->cancelled;
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoClone --
+ *
+ *      Clones a local disk (possibly to an ESX host).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoClone(void)
+{
+   auto srcLease = connPool.acquire(ConnectSpec::Local());
+   VixDiskLibConnection srcConnection = srcLease.get();
+   VixError vixError;
+
+   /*
+    *  Note : These createParams are ignored for remote case except
+    *  for diskType when it's set to VIXDISKLIB_DISK_VMFS_THIN.
+    */
+
+   VixDiskLibCreateParams createParams;
+   createParams.adapterType = Globals().adapterType;
+   createParams.capacity = Globals().mbSize *
+                           ((1U << 20) / VIXDISKLIB_SECTOR_SIZE);
+   createParams.logicalSectorSize = Globals().logicalSectorSize;
+   createParams.physicalSectorSize = Globals().physicalSectorSize;
+   // If createParams.diskType is set VIXDISKLIB_DISK_VMFS_THIN, the disk
+   // provision type will be thin. Otherwise, it will be thick.
+   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
+   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+
+   vixError = VixDiskLib_Clone(Globals().connection,
+                               Globals().diskPaths[0].c_str(),
+                               srcConnection,
+                               Globals().srcPath,
+                               &createParams,
+                               CloneProgressFunc,
+                               Globals().job,   // clientData
+                               TRUE);  // doOverWrite
+   srcLease.release();
+   CHECK_AND_THROW(vixError);
+   cout << "\n Done" << "\n";
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * PrintStat --
+ *
+ *      Print performance statistics for read/write benchmarks.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+PrintStat(bool read,                                     // IN
+          std::chrono::system_clock::time_point start,   // IN
+          std::chrono::system_clock::time_point end,     // IN
+          uint32 numSectors,                             // IN
+          uint32 sectorSize,                             // IN
+          const std::string& prefix)                     // IN
+{
+   auto dur = std::chrono::duration_cast<std::chrono::milliseconds>(end-start);
+   auto elapsed = dur.count();
+   if (elapsed == 0) {
+      elapsed = 1;
+   }
+   auto speed = (1000 * sectorSize * (uint64)numSectors) /
+                      (1024 * 1024 * elapsed);
+   cout << prefix << (read ? "Read" : "Wrote")
+        << numSectors / 2048 << " MBytes in " << elapsed << " msec ("
+        << speed << " MBytes/sec)" << endl;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitBuffer --
+ *
+ *      Fill an array of uint32 with random values, to defeat any
+ *      attempts to compress it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitBuffer(uint32 *buf,     // OUT
+           uint32 numElems) // IN
+{
+   unsigned int i;
+
+   srand(time(NULL));
+
+   for (i = 0; i < numElems; i++) {
+      buf[i] = (uint32)rand();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoRWBench --
+ *
+ *      Perform read/write benchmarks according to settings in
+ *      Globals(). Note that a write benchmark will destroy the data
+ *      in the target disk.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoRWBench(bool read, bool async) // IN
+{
+   DiskIOPipeline diskIO(Globals().diskPaths.size());
+   for (unsigned int i = 0 ; i < Globals().diskPaths.size() ; ++i) {
+      if (read) {
+         diskIO.read(Globals().connection,
+                     Globals().diskPaths[i].c_str(),
+                     Globals().openFlags, i, async);
+      } else {
+         diskIO.write(Globals().connection,
+                      Globals().diskPaths[i].c_str(),
+                      Globals().openFlags, i, async);
+      }
+   }
+}
+
+
+// One command line of a -batch file.
+struct BatchOp
+{
+   enum State { PENDING, RUNNING, OK, FAILED, SKIPPED };
+
+   size_t index;
+   unsigned lineNo;
+   string text;
+   vector<string> args;
+   AppGlobals globals;
+   vector<size_t> deps;
+   State state;
+   VixError error;
+   string errorDesc;
+   uint64 msec;
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SplitArgs --
+ *
+ *      Splits a command line into arguments. Single or double quotes
+ *      group words, e.g. for datastore paths like "[ds1] vm/vm.vmdk".
+ *
+ * Results:
+ *      Arguments in args.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SplitArgs(const string& line,          // IN
+          vector<string>& args)        // OUT
+{
+   string cur;
+   bool inArg = false;
+   char quote = 0;
+
+   for (char c : line) {
+      if (quote != 0) {
+         if (c == quote) {
+            quote = 0;
+         } else {
+            cur += c;
+         }
+      } else if (c == '"' || c == '\'') {
+         quote = c;
+         inArg = true;
+      } else if (isspace((unsigned char)c)) {
+         if (inArg) {
+            args.push_back(cur);
+            cur.clear();
+            inArg = false;
+         }
+      } else {
+         cur += c;
+         inArg = true;
+      }
+   }
+   if (inArg) {
+      args.push_back(cur);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ParseCommandLine --
+ *
+ *      Parses one command line of -batch or -daemon into globals, using
+ *      base for the defaults. Commands that take over the process
+ *      (-batch, -daemon) are refused.
+ *
+ * Results:
+ *      true if the line is a valid command. args holds the strings that
+ *      globals points into and must live as long as globals.
+ *
+ * Side effects:
+ *      Prints the usage on an invalid command line.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+ParseCommandLine(const AppGlobals& base,     // IN
+                 const string& text,         // IN
+                 vector<string>& args,       // OUT
+                 AppGlobals& globals)        // OUT
+{
+   static char arg0[] = "vixdisklibsample";
+
+   SplitArgs(text, args);
+
+   globals = base;
+   globals.command = 0;
+   globals.diskPaths.clear();
+   globals.batchFile = NULL;
+   globals.socketPath = NULL;
+   globals.connection = NULL;
+   globals.job = NULL;
+   globals.success = TRUE;
+
+   vector<char *> argv;
+   argv.push_back(arg0);
+   for (auto& arg : args) {
+      argv.push_back(&arg[0]);
+   }
+   GlobalsScope gs(&globals);
+   return ParseArguments((int)argv.size(), &argv[0]) == 0 &&
+          !(globals.command & (COMMAND_BATCH | COMMAND_DAEMON));
+}
+
+
+// Whether a command writes its output to stdout ("-").
+static bool
+WritesStdout(const AppGlobals& globals)
+{
+   auto isStdout = [] (const char *path) {
+      return path != NULL && strcmp(path, "-") == 0;
+   };
+
+   return ((globals.command & COMMAND_EXPORT_ZIP) &&
+           isStdout(globals.zipPath)) ||
+          ((globals.command & COMMAND_EXPORT_STREAM) &&
+           isStdout(globals.streamPath)) ||
+          ((globals.command & COMMAND_EXPORT_DELTA) &&
+           isStdout(globals.deltaPath));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * BatchOpsConflict --
+ *
+ *      Two batch commands conflict if one of them writes to a disk the
+ *      other uses. Whether a command writes depends on the command, not
+ *      on how it opens the disk: -clone writes its target but only reads
+ *      its source, -check writes only when repairing and -nbd only as
+ *      -nbdrw. Commands writing to stdout conflict too. Conflicting
+ *      commands run in the order they are listed.
+ *
+ * Results:
+ *      true if a and b must not run concurrently.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+BatchOpWrites(const BatchOp& op)       // IN
+{
+   const AppGlobals& g = op.globals;
+
+   return (g.command & COMMAND_WRITES) != 0 ||
+          ((g.command & COMMAND_CHECKREPAIR) && g.repair) ||
+          ((g.command & COMMAND_NBD) &&
+           !(g.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY));
+}
+
+static bool
+BatchOpsConflict(const BatchOp& a,     // IN
+                 const BatchOp& b)     // IN
+{
+   // The disks an op uses, or without all, the ones it may write.
+   auto paths = [] (const BatchOp& op, bool all) {
+      vector<string> p(op.globals.diskPaths);
+      if (op.globals.parentPath != NULL) {
+         p.push_back(op.globals.parentPath);
+      }
+      if (all && op.globals.srcPath != NULL) {
+         p.push_back(op.globals.srcPath);
+      }
+      return p;
+   };
+   auto overlap = [] (const vector<string>& x, const vector<string>& y) {
+      for (const auto& p : x) {
+         if (std::find(y.begin(), y.end(), p) != y.end()) {
+            return true;
+         }
+      }
+      return false;
+   };
+
+   return (BatchOpWrites(a) && overlap(paths(a, false), paths(b, true))) ||
+          (BatchOpWrites(b) && overlap(paths(b, false), paths(a, true))) ||
+          (WritesStdout(a.globals) && WritesStdout(b.globals));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DoBatch --
+ *
+ *      Runs the commands listed in Globals().batchFile in this process,
+ *      so VixDiskLib init is paid once and connections come from the
+ *      pool. Up to Globals().numJobs independent commands run in
+ *      parallel; commands following a failed write to the same disk are
+ *      skipped.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Throws VixDiskLibErrWrapper if any command did not succeed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+DoBatch(void)
+{
+   AppGlobals *base = curGlobals;
+   std::ifstream file;
+   std::istream *in = &cin;
+
+   if (strcmp(Globals().batchFile, "-") != 0) {
+      file.open(Globals().batchFile);
+      if (!file) {
+         THROW_ERROR(VIX_E_FILE_NOT_FOUND);
+      }
+      in = &file;
+   }
+
+   std::deque<BatchOp> ops;
+   string line;
+   unsigned lineNo = 0;
+   while (std::getline(*in, line)) {
+      ++lineNo;
+      size_t first = line.find_first_not_of(" \t\r");
+      if (first == string::npos || line[first] == '#') {
+         continue;
+      }
+      size_t last = line.find_last_not_of(" \t\r");
+
+      ops.emplace_back();
+      BatchOp& op = ops.back();
+      op.index = ops.size() - 1;
+      op.lineNo = lineNo;
+      op.text = line.substr(first, last - first + 1);
+      op.state = BatchOp::PENDING;
+      op.error = VIX_OK;
+      op.msec = 0;
+      if (!ParseCommandLine(*base, op.text, op.args, op.globals)) {
+         op.state = BatchOp::FAILED;
+         op.error = VIX_E_INVALID_ARG;
+         op.errorDesc = "Invalid command line";
+      }
+   }
+
+   for (size_t i = 0; i < ops.size(); ++i) {
+      for (size_t j = 0; j < i; ++j) {
+         if (BatchOpsConflict(ops[i], ops[j])) {
+            ops[i].deps.push_back(j);
+         }
+      }
+   }
+
+   std::mutex lock;
+   std::condition_variable cond;
+   auto report = [&ops] (size_t i) {
+      const BatchOp& op = ops[i];
+      static const char *states[] = {
+         "pending", "running", "OK", "FAILED", "SKIPPED"
+      };
+      cout << "Batch[" << i << "] line " << op.lineNo << " "
+           << states[op.state] << " (" << op.msec << " msec): "
+           << op.text << endl;
+   };
+
+   /*
+    * Pick the first pending command whose dependencies are finished.
+    * Called with lock held.
+    */
+   auto next = [&ops, &report] (bool& anyPending) -> BatchOp * {
+      anyPending = false;
+      for (size_t i = 0; i < ops.size(); ++i) {
+         BatchOp& op = ops[i];
+         if (op.state != BatchOp::PENDING) {
+            continue;
+         }
+         bool ready = true;
+         bool skip = false;
+         for (size_t d : op.deps) {
+            BatchOp::State st = ops[d].state;
+            if (st == BatchOp::PENDING || st == BatchOp::RUNNING) {
+               ready = false;
+            } else if (st != BatchOp::OK && BatchOpWrites(ops[d])) {
+               skip = true;
             }
-            appGlobals.logicalSectorSize = strtoul(argv[++i], NULL, 0);
-        } else if (!strcmp(argv[i], "-pssize")) {
-            if (i > argc - 2) {
-               printf("Error: The -pssize option requires the number of "
-                      "physical sector size. See usage below.\n\n");
-               return PrintUsage();
+         }
+         if (skip) {
+            op.state = BatchOp::SKIPPED;
+            report(i);
+            continue;
+         }
+         anyPending = true;
+         if (ready) {
+            op.state = BatchOp::RUNNING;
+            return &op;
+         }
+      }
+      return NULL;
+   };
+
+   auto worker = [&] () {
+      while (true) {
+         BatchOp *op;
+         {
+            std::unique_lock<std::mutex> lk(lock);
+            bool anyPending;
+            while ((op = next(anyPending)) == NULL) {
+               if (!anyPending) {
+                  cond.notify_all();
+                  return;
+               }
+               cond.wait(lk);
             }
-            appGlobals.physicalSectorSize = strtoul(argv[++i], NULL, 0);
-        } else if (!strcmp(argv[i], "-unbuffered")) {
-            appGlobals.openFlags |= VIXDISKLIB_FLAG_OPEN_UNBUFFERED;
-        }else if (argv[i][0] != '-') {
-          // start of disk path
-          break;
-        }
-    }
-    for (; i < argc; ++i)
-    {
-       string disk = argv[i];
-       if (!disk.empty()) {
-          appGlobals.diskPaths.push_back(std::move(disk));
-       }
-    }
+         }
+
+         BatchOp::State state = BatchOp::OK;
+         auto start = std::chrono::steady_clock::now();
+         try {
+            GlobalsScope gs(&op->globals);
+            RunCommand();
+         } catch (const VixDiskLibErrWrapper& e) {
+            state = BatchOp::FAILED;
+            op->error = e.ErrorCode();
+            op->errorDesc = e.Description();
+         } catch (const std::exception& e) {
+            state = BatchOp::FAILED;
+            op->error = VIX_E_FAIL;
+            op->errorDesc = e.what();
+         }
+         auto end = std::chrono::steady_clock::now();
+
+         {
+            std::lock_guard<std::mutex> lg(lock);
+            op->state = state;
+            op->msec = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          end - start).count();
+            report(op->index);
+         }
+         cond.notify_all();
+      }
+   };
+
+   auto start = std::chrono::steady_clock::now();
+   if (!ops.empty()) {
+      unsigned jobs = std::max(1U, std::min<unsigned>(Globals().numJobs,
+                                                      ops.size()));
+      TaskExecutor exec(jobs, worker);
+   }
+   auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start).count();
+
+   unsigned numOk = 0, numFailed = 0, numSkipped = 0;
+   cout << "\nBatch results:" << endl;
+   for (size_t i = 0; i < ops.size(); ++i) {
+      const BatchOp& op = ops[i];
+      switch (op.state) {
+      case BatchOp::OK:
+         ++numOk;
+         cout << "  [" << i << "] line " << op.lineNo << ": OK, "
+              << op.msec << " msec" << endl;
+         break;
+      case BatchOp::FAILED:
+         ++numFailed;
+         cout << "  [" << i << "] line " << op.lineNo << ": FAILED, "
+              << op.msec << " msec, error " << std::hex << op.error
+              << std::dec << " " << op.errorDesc << endl;
+         break;
+      default:
+         ++numSkipped;
+         cout << "  [" << i << "] line " << op.lineNo << ": SKIPPED" << endl;
+         break;
+      }
+   }
+   cout << "Batch: " << ops.size() << " commands, " << numOk << " OK, "
+        << numFailed << " failed, " << numSkipped << " skipped in "
+        << elapsed << " msec" << endl;
+
+   if (numFailed + numSkipped > 0) {
+      throw VixDiskLibErrWrapper("Some batch commands did not succeed",
+                                 __FILE__, __LINE__);
+   }
+}
+
+#ifdef _WIN32
+
+static void
+DoDaemon(void)
+{
+   cout << "-daemon needs Unix domain sockets and is not supported "
+           "on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+#else
+
+// How often a running job reports its progress to the client
+#ifndef VIX_DAEMON_PROGRESS_MSEC
+#define VIX_DAEMON_PROGRESS_MSEC 250
+#endif
+
+// Longest request line a daemon client may send
+#define DAEMON_MAX_LINE 4096
+
+// Set by SIGINT / SIGTERM or a request to stop -daemon or -nbd.
+static volatile sig_atomic_t serverStop;
+
+static void
+ServerSignalHandler(int /*sig*/)
+{
+   serverStop = 1;
+}
+
+// Routes SIGINT and SIGTERM to serverStop while in scope.
+class StopSignals
+{
+   public:
+      StopSignals()
+      {
+         struct sigaction sa;
+         memset(&sa, 0, sizeof sa);
+         sa.sa_handler = ServerSignalHandler;
+         sigemptyset(&sa.sa_mask);
+         sigaction(SIGINT, &sa, &_oldInt);
+         sigaction(SIGTERM, &sa, &_oldTerm);
+      }
+
+      ~StopSignals()
+      {
+         sigaction(SIGINT, &_oldInt, NULL);
+         sigaction(SIGTERM, &_oldTerm, NULL);
+      }
+
+   private:
+      struct sigaction _oldInt;
+      struct sigaction _oldTerm;
+};
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * SendAll / RecvAll --
+ *
+ *      Sends / receives exactly len bytes on a socket.
+ *
+ * Results:
+ *      false if the peer went away.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+SendAll(int fd,                     // IN
+        const void *buf,            // IN
+        size_t len)                 // IN
+{
+   const char *p = (const char *)buf;
+
+   while (len > 0) {
+      ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return false;
+      }
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+static bool
+RecvAll(int fd,                     // IN
+        void *buf,                  // OUT
+        size_t len)                 // IN
+{
+   char *p = (char *)buf;
+
+   while (len > 0) {
+      ssize_t n = recv(fd, p, len, 0);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return false;
+      }
+      p += n;
+      len -= n;
+   }
+   return true;
+}
+
+// A command submitted to the daemon.
+struct DaemonJob
+{
+   enum State { QUEUED, RUNNING, OK, FAILED, CANCELLED };
+
+   uint64 id;
+   string text;
+   vector<string> args;
+   AppGlobals globals;
+   JobControl control;
+   State state;
+   VixError error;
+   string errorDesc;
+};
+
+
+/*
+ * Registry of daemon jobs. At most maxRunning jobs run at a time, the
+ * others wait in QUEUED state; a job cancelled while queued never runs.
+ */
+class JobServer
+{
+   public:
+      using JobPtr = std::shared_ptr<DaemonJob>;
+
+      JobServer(const AppGlobals& base, unsigned maxRunning)
+         : _base(base), _maxRunning(std::max(1U, maxRunning)), _running(0),
+           _nextId(1)
+      {}
+
+      JobPtr submit(const string& text);
+      void run(JobPtr job);
+      bool wait(const JobPtr& job, unsigned msec);
+      bool cancel(uint64 id);
+      void cancelAll();
+      void remove(uint64 id);
+      void list(std::ostream& out);
+
+   private:
+      const AppGlobals& _base;
+      const unsigned _maxRunning;
+      unsigned _running;
+      uint64 _nextId;
+      std::map<uint64, JobPtr> _jobs;
+      std::mutex _lock;
+      std::condition_variable _cond;
+};
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * JobServer::submit --
+ *
+ *      Parses a command line into a new job.
+ *
+ * Results:
+ *      The job, or NULL if the command line is invalid.
+ *
+ * Side effects:
+ *      Registers the job.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+JobServer::JobPtr
+JobServer::submit(const string& text)
+{
+   JobPtr job = std::make_shared<DaemonJob>();
+
+   job->text = text;
+   if (!ParseCommandLine(_base, text, job->args, job->globals)) {
+      return NULL;
+   }
+   if (WritesStdout(job->globals)) {
+      cout << "Daemon jobs can't write to stdout: " << text << endl;
+      return NULL;
+   }
+   job->globals.job = &job->control;
+   job->state = DaemonJob::QUEUED;
+   job->error = VIX_OK;
+
+   std::lock_guard<std::mutex> lg(_lock);
+   job->id = _nextId++;
+   _jobs[job->id] = job;
+   return job;
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * JobServer::run --
+ *
+ *      Waits for a free slot and runs the job on the calling thread.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The job ends up OK, FAILED or CANCELLED.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+JobServer::run(JobPtr job)
+{
+   {
+      std::unique_lock<std::mutex> lk(_lock);
+      _cond.wait(lk, [this, &job] () {
+         return _running < _maxRunning || job->control.cancelled;
+      });
+      if (job->control.cancelled) {
+         job->state = DaemonJob::CANCELLED;
+         _cond.notify_all();
+         return;
+      }
+      ++_running;
+      job->state = DaemonJob::RUNNING;
+   }
+
+   DaemonJob::State state = DaemonJob::OK;
+   VixError error = VIX_OK;
+   string errorDesc;
+   try {
+      GlobalsScope gs(&job->globals);
+      RunCommand();
+      if (!Globals().success) {
+         THROW_ERROR(VIX_E_FAIL);
+      }
+   } catch (const VixDiskLibErrWrapper& e) {
+      state = DaemonJob::FAILED;
+      error = e.ErrorCode();
+      errorDesc = e.Description();
+   } catch (const std::exception& e) {
+      state = DaemonJob::FAILED;
+      error = VIX_E_FAIL;
+      errorDesc = e.what();
+   }
+
+   /*
+    * The benchmarks swallow I/O errors, so a cancelled job may come back
+    * without one.
+    */
+   if (job->control.cancelled) {
+      state = DaemonJob::CANCELLED;
+   }
 
-    if (appGlobals.fcdid != NULL) {
-       // hack to avoid crash at diskPaths[0]
-       string fcdPath;
-       fcdPath += "[";
-       fcdPath += appGlobals.ds;
-       fcdPath += "] ";
-       fcdPath += "VStorageObject:";
-       fcdPath += appGlobals.fcdid;
+   std::lock_guard<std::mutex> lg(_lock);
+   --_running;
+   job->state = state;
+   job->error = error;
+   job->errorDesc = errorDesc;
+   _cond.notify_all();
+}
 
-       appGlobals.diskPaths.push_back(fcdPath);
-    }
-    if (appGlobals.diskPaths.size() == 0) {
-       printf("Error: Missing diskPath. See usage below.\n");
-       return PrintUsage();
-    }
 
-    if (BitCount(appGlobals.command) != 1) {
-       printf("Error: Missing command. See usage below.\n");
-       return PrintUsage();
-    }
+/*
+ *--------------------------------------------------------------------------
+ *
+ * JobServer::wait --
+ *
+ *      Waits up to msec milliseconds for the job to finish.
+ *
+ * Results:
+ *      true if the job has finished.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
 
-    if (appGlobals.isRemote) {
-       if (appGlobals.host == NULL ||
-           appGlobals.userName == NULL ||
-           appGlobals.password == NULL) {
-           printf("Error: Missing a mandatory option. ");
-           printf("-host, -user and -password must be specified. ");
-           printf("See usage below.\n");
-           return PrintUsage();
-       }
-    }
+bool
+JobServer::wait(const JobPtr& job, unsigned msec)
+{
+   auto finished = [&job] () {
+      return job->state != DaemonJob::QUEUED &&
+             job->state != DaemonJob::RUNNING;
+   };
 
-    /*
-     * TODO: More error checking for params, really
-     */
-    return 0;
+   std::unique_lock<std::mutex> lk(_lock);
+   return _cond.wait_for(lk, std::chrono::milliseconds(msec), finished);
 }
 
-template<size_t SIZE, typename TYPE, typename LOCK>
-static std::unique_ptr<BufferPoolInterface<TYPE>>
-getBufferPool(const VixDisk& disk, size_t bufSize)
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * JobServer::cancel --
+ *
+ *      Asks a job to stop. A queued job is woken to end without running,
+ *      a running one notices at its next progress update. Cancelling goes
+ *      through here, under _lock, so run() doesn't miss it.
+ *
+ * Results:
+ *      false if there is no such job.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+bool
+JobServer::cancel(uint64 id)
 {
-   typedef AlignedAlloc<TYPE> alignedType;
-   typedef NotAlignedAlloc<TYPE> notAlignedType;
+   std::lock_guard<std::mutex> lg(_lock);
+   auto it = _jobs.find(id);
+   if (it == _jobs.end()) {
+      return false;
+   }
+   it->second->control.cancelled = true;
+   _cond.notify_all();
+   return true;
+}
 
-   if (disk.getTransportMode() == "hotadd") {
-      uint32 alignment = disk.getInfo()->logicalSectorSize;
-      alignedType alloc(alignment);
-      return std::unique_ptr<BufferPoolInterface<TYPE>>(
-                new BufferPool<SIZE, TYPE, LOCK, alignedType>(
-                   bufSize, std::forward<alignedType>(alloc)));
-   } else {
-      notAlignedType alloc;
-      return std::unique_ptr<BufferPoolInterface<TYPE>>(
-                new BufferPool<SIZE, TYPE, LOCK, notAlignedType>(
-                   bufSize, std::forward<notAlignedType>(alloc)));
+void
+JobServer::cancelAll()
+{
+   std::lock_guard<std::mutex> lg(_lock);
+   for (auto& it : _jobs) {
+      it.second->control.cancelled = true;
+   }
+   _cond.notify_all();
+}
+
+void
+JobServer::remove(uint64 id)
+{
+   std::lock_guard<std::mutex> lg(_lock);
+   _jobs.erase(id);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * JobServer::list --
+ *
+ *      Writes one 'JOB id state done total command' line per job.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+void
+JobServer::list(std::ostream& out)
+{
+   static const char *states[] = {
+      "QUEUED", "RUNNING", "OK", "FAILED", "CANCELLED"
+   };
+
+   std::lock_guard<std::mutex> lg(_lock);
+   for (const auto& it : _jobs) {
+      const DaemonJob& job = *it.second;
+      out << "JOB " << job.id << " " << states[job.state] << " "
+          << job.control.done << " " << job.control.total << " "
+          << job.text << "\n";
+   }
+}
+
+
+// Sends text to a daemon client; false if the client went away.
+static bool
+DaemonSend(int fd,                  // IN
+           const string& text)      // IN
+{
+   return SendAll(fd, text.data(), text.size());
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DaemonReadLine --
+ *
+ *      Reads one request line from a daemon client, waiting at most msec
+ *      milliseconds. buf keeps what was read past the line.
+ *
+ * Results:
+ *      1 with the line in line, 0 on timeout, -1 on end of file or error.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static int
+DaemonReadLine(int fd,              // IN
+               string& buf,         // IN/OUT
+               string& line,        // OUT
+               int msec)            // IN
+{
+   while (true) {
+      size_t eol = buf.find('\n');
+      if (eol != string::npos) {
+         line = buf.substr(0, eol);
+         buf.erase(0, eol + 1);
+         if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+         }
+         return 1;
+      }
+      if (buf.size() > DAEMON_MAX_LINE) {
+         return -1;
+      }
+
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      int rc = poll(&pfd, 1, msec);
+      if (rc < 0 && errno == EINTR) {
+         return 0;
+      }
+      if (rc <= 0) {
+         return rc;
+      }
+
+      char data[1024];
+      ssize_t n = recv(fd, data, sizeof data, 0);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return -1;
+      }
+      buf.append(data, n);
+      msec = 0;
+   }
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DaemonRunJob --
+ *
+ *      Runs one job for a client, streaming its progress until it is
+ *      done. While the job runs, the client may send CANCEL; closing the
+ *      connection cancels the job too.
+ *
+ * Results:
+ *      false if the client went away.
+ *
+ * Side effects:
+ *      None.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static bool
+DaemonRunJob(JobServer& server,     // IN
+             int fd,                // IN
+             string& buf,           // IN/OUT
+             const string& text)    // IN
+{
+   JobServer::JobPtr job = server.submit(text);
+   if (job == NULL) {
+      return DaemonSend(fd, "ERROR invalid command line\n");
+   }
+
+   std::ostringstream id;
+   id << job->id;
+   bool connected = DaemonSend(fd, "JOB " + id.str() + "\n");
+
+   std::thread runner(&JobServer::run, &server, job);
+   uint64 lastDone = ~0ULL;
+   while (!server.wait(job, connected ? 0 : VIX_DAEMON_PROGRESS_MSEC)) {
+      if (serverStop) {
+         server.cancel(job->id);
+      }
+      if (!connected) {
+         continue;
+      }
+
+      string line;
+      int rc = DaemonReadLine(fd, buf, line, VIX_DAEMON_PROGRESS_MSEC);
+      if (rc < 0) {
+         connected = false;
+         server.cancel(job->id);
+         continue;
+      }
+      if (rc > 0) {
+         vector<string> words;
+         SplitArgs(line, words);
+         if (!words.empty() && words[0] == "CANCEL" &&
+             (words.size() == 1 || words[1] == id.str())) {
+            server.cancel(job->id);
+            connected = DaemonSend(fd, "OK\n");
+         } else {
+            connected = DaemonSend(fd, "ERROR job " + id.str() +
+                                       " is running\n");
+         }
+      }
+
+      uint64 done = job->control.done;
+      if (connected && done != lastDone) {
+         std::ostringstream progress;
+         progress << "PROGRESS " << job->id << " " << done << " "
+                  << job->control.total << "\n";
+         connected = DaemonSend(fd, progress.str());
+         lastDone = done;
+      }
+   }
+   runner.join();
+   server.remove(job->id);
+
+   std::ostringstream result;
+   result << "DONE " << job->id << " ";
+   switch (job->state) {
+   case DaemonJob::OK:
+      result << "OK";
+      break;
+   case DaemonJob::FAILED:
+      result << "FAILED " << job->error << " " << job->errorDesc;
+      break;
+   default:
+      result << "CANCELLED";
+      break;
+   }
+   result << "\n";
+   return connected && DaemonSend(fd, result.str());
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DaemonClient --
+ *
+ *      Serves the requests of one daemon client until it disconnects.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Closes fd.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DaemonClient(JobServer& server,     // IN
+             int fd)                // IN
+{
+   string buf;
+   bool connected = true;
+
+   while (connected && !serverStop) {
+      string line;
+      int rc = DaemonReadLine(fd, buf, line, 500);
+      if (rc < 0) {
+         break;
+      }
+      if (rc == 0) {
+         continue;
+      }
+
+      size_t sp = line.find(' ');
+      string verb = line.substr(0, sp);
+      string rest = sp == string::npos ? "" : line.substr(sp + 1);
+
+      if (verb == "RUN") {
+         connected = DaemonRunJob(server, fd, buf, rest);
+      } else if (verb == "CANCEL") {
+         uint64 id = strtoull(rest.c_str(), NULL, 0);
+         connected = DaemonSend(fd, server.cancel(id) ?
+                                    "OK\n" : "ERROR no such job\n");
+      } else if (verb == "LIST") {
+         std::ostringstream out;
+         server.list(out);
+         connected = DaemonSend(fd, out.str() + "OK\n");
+      } else if (verb == "STATS") {
+         std::ostringstream out;
+         connPool.printStats(out);
+         if (blockCache.enabled()) {
+            blockCache.printStats(out);
+         }
+         connected = DaemonSend(fd, out.str() + "OK\n");
+      } else if (verb == "SHUTDOWN") {
+         serverStop = 1;
+         connected = DaemonSend(fd, "OK\n");
+      } else if (!verb.empty()) {
+         connected = DaemonSend(fd, "ERROR unknown request " + verb + "\n");
+      }
+   }
+   close(fd);
+}
+
+
+/*
+ *--------------------------------------------------------------------------
+ *
+ * DoDaemon --
+ *
+ *      Listens on the Unix domain socket Globals().socketPath and runs
+ *      the commands clients send, so VixDiskLib init and connection setup
+ *      are paid once for all of them. Up to Globals().numJobs jobs run
+ *      in parallel. Stops on SIGINT, SIGTERM or a SHUTDOWN request.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Creates and finally removes the socket file.
+ *
+ *--------------------------------------------------------------------------
+ */
+
+static void
+DoDaemon(void)
+{
+   struct sockaddr_un addr;
+
+   memset(&addr, 0, sizeof addr);
+   addr.sun_family = AF_UNIX;
+   if (strlen(Globals().socketPath) >= sizeof addr.sun_path) {
+      cout << "Socket path " << Globals().socketPath << " is too long."
+           << endl;
+      THROW_ERROR(VIX_E_INVALID_ARG);
+   }
+   strcpy(addr.sun_path, Globals().socketPath);
+
+   // Only a socket left behind by an earlier daemon is replaced.
+   struct stat st;
+   if (lstat(Globals().socketPath, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+         cout << Globals().socketPath << " exists and is not a socket."
+              << endl;
+         THROW_ERROR(VIX_E_FILE_ALREADY_EXISTS);
+      }
+      unlink(Globals().socketPath);
+   }
+
+   int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listenFd < 0) {
+      THROW_ERROR(VIX_E_FAIL);
+   }
+   // The socket is created owner-only, not chmod'ed after the fact.
+   mode_t oldMask = umask(077);
+   int err = bind(listenFd, (struct sockaddr *)&addr, sizeof addr);
+   umask(oldMask);
+   if (err != 0 || listen(listenFd, SOMAXCONN) != 0) {
+      cout << "Cannot listen on " << Globals().socketPath << ": "
+           << strerror(errno) << endl;
+      close(listenFd);
+      THROW_ERROR(VIX_E_FAIL);
+   }
+
+   StopSignals stopSignals;
+   serverStop = 0;
+
+   cout << "Listening on " << Globals().socketPath << ", up to "
+        << Globals().numJobs << " parallel jobs." << endl;
+
+   JobServer server(Globals(), Globals().numJobs);
+   struct Client {
+      std::thread thread;
+      std::shared_ptr<std::atomic<bool>> done;
+   };
+   std::list<Client> clients;
+
+   while (!serverStop) {
+      struct pollfd pfd;
+      pfd.fd = listenFd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 500) <= 0) {
+         continue;
+      }
+      int fd = accept(listenFd, NULL, NULL);
+      if (fd < 0) {
+         continue;
+      }
+
+      clients.remove_if([] (Client& c) {
+         if (*c.done) {
+            c.thread.join();
+            return true;
+         }
+         return false;
+      });
+
+      auto done = std::make_shared<std::atomic<bool>>(false);
+      clients.push_back({std::thread([&server, fd, done] () {
+                                        DaemonClient(server, fd);
+                                        *done = true;
+                                     }),
+                         done});
+   }
+
+   cout << "Shutting down." << endl;
+   close(listenFd);
+   unlink(Globals().socketPath);
+   server.cancelAll();
+   for (auto& c : clients) {
+      c.thread.join();
    }
 }
 
+#endif // _WIN32
+
+#ifdef _WIN32
+
+static void
+DoNbd(void)
+{
+   cout << "-nbd is not supported on Windows." << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
+}
+
+#else
+
+// Max number of requests of one NBD client in flight at a time
+#ifndef VIX_NBD_MAX_INFLIGHT
+#define VIX_NBD_MAX_INFLIGHT 64
+#endif
+
+// Largest read / write request served (and advertised), in bytes
+#define NBD_MAX_REQUEST (32 * 1024 * 1024)
+
+// Longest option payload accepted during negotiation
+#define NBD_MAX_OPTION 4096
+
+/*
+ * NBD protocol constants, see doc/proto.md in the nbd project. Only the
+ * fixed newstyle handshake is spoken.
+ */
+#define NBD_MAGIC                  0x4e42444d41474943ULL  // "NBDMAGIC"
+#define NBD_IHAVEOPT               0x49484156454f5054ULL  // "IHAVEOPT"
+#define NBD_REP_MAGIC              0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC          0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC     0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+#define NBD_FLAG_FIXED_NEWSTYLE    (1 << 0)
+#define NBD_FLAG_NO_ZEROES         (1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS         (1 << 0)
+#define NBD_FLAG_READ_ONLY         (1 << 1)
+#define NBD_FLAG_SEND_FLUSH        (1 << 2)
+#define NBD_FLAG_CAN_MULTI_CONN    (1 << 8)
+
+#define NBD_OPT_EXPORT_NAME        1
+#define NBD_OPT_ABORT              2
+#define NBD_OPT_LIST               3
+#define NBD_OPT_INFO               6
+#define NBD_OPT_GO                 7
+#define NBD_OPT_STRUCTURED_REPLY   8
+#define NBD_OPT_LIST_META_CONTEXT  9
+#define NBD_OPT_SET_META_CONTEXT   10
+
+#define NBD_REP_ACK                1
+#define NBD_REP_SERVER             2
+#define NBD_REP_INFO               3
+#define NBD_REP_META_CONTEXT       4
+#define NBD_REP_ERR_UNSUP          0x80000001
+#define NBD_REP_ERR_INVALID        0x80000003
+
+#define NBD_INFO_EXPORT            0
+#define NBD_INFO_BLOCK_SIZE        3
+
+#define NBD_CMD_READ               0
+#define NBD_CMD_WRITE              1
+#define NBD_CMD_DISC               2
+#define NBD_CMD_FLUSH              3
+#define NBD_CMD_BLOCK_STATUS       7
+
+#define NBD_CMD_FLAG_REQ_ONE       (1 << 3)
+
+#define NBD_REPLY_FLAG_DONE        (1 << 0)
+#define NBD_REPLY_TYPE_NONE        0
+#define NBD_REPLY_TYPE_OFFSET_DATA 1
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR       32769
+
+#define NBD_STATE_HOLE             (1 << 0)
+#define NBD_STATE_ZERO             (1 << 1)
+
+#define NBD_EPERM                  1
+#define NBD_EIO                    5
+#define NBD_ENOMEM                 12
+#define NBD_EINVAL                 22
+#define NBD_ENOSPC                 28
+
+// Context id of "base:allocation", the only metadata context offered
+#define NBD_META_BASE_ALLOCATION   1
+
+
+// Big endian encoding used on the wire.
+static void
+NbdPut16(string& buf, uint16 v)
+{
+   buf.push_back((char)(v >> 8));
+   buf.push_back((char)v);
+}
+
+static void
+NbdPut32(string& buf, uint32 v)
+{
+   NbdPut16(buf, (uint16)(v >> 16));
+   NbdPut16(buf, (uint16)v);
+}
+
+static void
+NbdPut64(string& buf, uint64 v)
+{
+   NbdPut32(buf, (uint32)(v >> 32));
+   NbdPut32(buf, (uint32)v);
+}
+
+static uint16
+NbdGet16(const uint8 *p)
+{
+   return (uint16)((p[0] << 8) | p[1]);
+}
+
+static uint32
+NbdGet32(const uint8 *p)
+{
+   return ((uint32)NbdGet16(p) << 16) | NbdGet16(p + 2);
+}
+
+static uint64
+NbdGet64(const uint8 *p)
+{
+   return ((uint64)NbdGet32(p) << 32) | NbdGet32(p + 4);
+}
+
+
 /*
- *--------------------------------------------------------------------------
- *
- * DoInfo --
- *
- *      Queries the information of a virtual disk.
- *
- * Results:
- *      None.
- *
- * Side effects:
- *      None.
- *
- *--------------------------------------------------------------------------
+ * The disk exported by -nbd. All connections share the disk handle;
+ * submissions are serialized since VixDiskLib handles are not thread safe.
+ * VixDiskLib doesn't allow sync calls on a handle doing async I/O, so
+ * flush() and blockStatus() wait for the I/O in flight first, holding
+ * _ioLock so no more is started.
  */
-
-static void
-DoInfo(void)
+class NbdExport
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPaths[0].c_str(), appGlobals.openFlags);
-    VixDiskLibInfo *info = NULL;
-    VixError vixError;
+   public:
+      NbdExport(VixDisk& disk, bool readOnly)
+         : _disk(disk), _readOnly(readOnly),
+           _size(disk.getInfo()->capacity * VIXDISKLIB_SECTOR_SIZE),
+           _chunkSize(std::max<uint64>(Globals().chunkSize,
+                                       VIXDISKLIB_MIN_CHUNK_SIZE)),
+           _reads(0), _writes(0), _bytesRead(0), _bytesWritten(0),
+           _blockStatus(0)
+      {}
 
-    vixError = VixDiskLib_GetInfo(disk.Handle(), &info);
+      uint64 size() const
+      {
+         return _size;
+      }
 
-    CHECK_AND_THROW(vixError);
+      bool readOnly() const
+      {
+         return _readOnly;
+      }
 
-    cout << "capacity             = " << info->capacity << " sectors" << endl;
-    cout << "logical sector size  = " << info->logicalSectorSize << " bytes"
-         << endl;
-    cout << "physical sector size = " << info->physicalSectorSize << " bytes"
-         << endl;
-    cout << "number of links      = " << info->numLinks << endl;
-    cout << "adapter type         = ";
-    switch (info->adapterType) {
-    case VIXDISKLIB_ADAPTER_IDE:
-       cout << "IDE" << endl;
-       break;
-    case VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC:
-       cout << "BusLogic SCSI" << endl;
-       break;
-    case VIXDISKLIB_ADAPTER_SCSI_LSILOGIC:
-       cout << "LsiLogic SCSI" << endl;
-       break;
-    default:
-       cout << "unknown" << endl;
-       break;
-    }
+      uint32 chunkBytes() const
+      {
+         return (uint32)(_chunkSize * VIXDISKLIB_SECTOR_SIZE);
+      }
 
-    cout << "BIOS geometry        = " << info->biosGeo.cylinders <<
-       "/" << info->biosGeo.heads << "/" << info->biosGeo.sectors << endl;
+      VixError read(uint64 sector, uint64 numSectors, uint8 *buf,
+                    VixDiskLibCompletionCB cb, void *cbData)
+      {
+         std::lock_guard<std::mutex> lg(_ioLock);
+         ++_reads;
+         _bytesRead += numSectors * VIXDISKLIB_SECTOR_SIZE;
+         startupTimeline.firstIO();
+         return blockCache.readAsync(_disk, sector, numSectors, buf, cb,
+                                     cbData);
+      }
 
-    cout << "physical geometry    = " << info->physGeo.cylinders <<
-       "/" << info->physGeo.heads << "/" << info->physGeo.sectors << endl;
+      VixError write(uint64 sector, uint64 numSectors, const uint8 *buf,
+                     VixDiskLibCompletionCB cb, void *cbData)
+      {
+         std::lock_guard<std::mutex> lg(_ioLock);
+         ++_writes;
+         _bytesWritten += numSectors * VIXDISKLIB_SECTOR_SIZE;
+         startupTimeline.firstIO();
+         return blockCache.writeAsync(_disk, sector, numSectors, buf, cb,
+                                      cbData);
+      }
 
-    VixDiskLib_FreeInfo(info);
+      VixError flush()
+      {
+         std::lock_guard<std::mutex> lg(_ioLock);
+         VixDiskLib_Wait(_disk.Handle());
+         return VixDiskLib_Flush(_disk.Handle());
+      }
 
-    cout << "Transport modes supported by vixDiskLib: " <<
-       VixDiskLib_ListTransportModes() << endl;
-}
+      // Some transports only complete requests from VixDiskLib_Wait.
+      void wait()
+      {
+         std::lock_guard<std::mutex> lg(_ioLock);
+         VixDiskLib_Wait(_disk.Handle());
+      }
+
+      void blockStatus(uint64 offset, uint32 length, bool one,
+                       vector<std::pair<uint32, uint32>>& extents);
+      void printStats();
+
+   private:
+      VixDisk& _disk;
+      const bool _readOnly;
+      const uint64 _size;
+      const uint64 _chunkSize;
+      std::mutex _ioLock;
+      uint64 _reads;
+      uint64 _writes;
+      uint64 _bytesRead;
+      uint64 _bytesWritten;
+      uint64 _blockStatus;
+};
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * DoCreate --
+ * NbdExport::blockStatus --
  *
- *      Creates a virtual disk.
+ *      Describes [offset, offset + length) as allocated / hole extents
+ *      using VixDiskLib_QueryAllocatedBlocks, once the I/O in flight is
+ *      done. Parts the query can't cover (unaligned tail, errors) are
+ *      reported as allocated.
  *
  * Results:
- *      None.
+ *      (length, NBD_STATE_* flags) pairs in extents.
  *
  * Side effects:
  *      None.
@@ -2087,68 +13785,185 @@ DoInfo(void)
  *--------------------------------------------------------------------------
  */
 
-static void
-DoCreate(void)
+void
+NbdExport::blockStatus(uint64 offset,      // IN
+                       uint32 length,      // IN
+                       bool one,           // IN: just the first extent
+                       vector<std::pair<uint32, uint32>>& extents) // OUT
 {
-   VixDiskLibCreateParams createParams;
-   VixError vixError;
+   uint64 end = offset + length;
+   uint64 chunkBytes = _chunkSize * VIXDISKLIB_SECTOR_SIZE;
+   uint64 qStart = offset / chunkBytes * chunkBytes;
+   uint64 qEnd = std::min((end + chunkBytes - 1) / chunkBytes * chunkBytes,
+                          _size / chunkBytes * chunkBytes);
+   vector<std::pair<uint64, uint64>> allocated;
+
+   if (qStart < qEnd) {
+      VixDiskLibBlockList *blockList = NULL;
+      VixError vixError;
+      {
+         std::lock_guard<std::mutex> lg(_ioLock);
+         ++_blockStatus;
+         VixDiskLib_Wait(_disk.Handle());
+         vixError = VixDiskLib_QueryAllocatedBlocks(
+                       _disk.Handle(), qStart / VIXDISKLIB_SECTOR_SIZE,
+                       (qEnd - qStart) / VIXDISKLIB_SECTOR_SIZE, _chunkSize,
+                       &blockList);
+      }
+      if (VIX_FAILED(vixError)) {
+         qEnd = qStart;
+      } else {
+         for (uint32 i = 0; i < blockList->numBlocks; i++) {
+            allocated.push_back(
+               {blockList->blocks[i].offset * VIXDISKLIB_SECTOR_SIZE,
+                (blockList->blocks[i].offset + blockList->blocks[i].length) *
+                   VIXDISKLIB_SECTOR_SIZE});
+         }
+         VixDiskLib_FreeBlockList(blockList);
+      }
+   }
+   if (qEnd < end) {
+      allocated.push_back({std::max(qStart, qEnd), end});
+   }
+
+   auto add = [&extents] (uint64 len, uint32 flags) {
+      if (len == 0) {
+         return;
+      }
+      if (!extents.empty() && extents.back().second == flags) {
+         extents.back().first += (uint32)len;
+      } else {
+         extents.push_back({(uint32)len, flags});
+      }
+   };
 
-   createParams.adapterType = appGlobals.adapterType;
+   uint64 pos = offset;
+   for (const auto& a : allocated) {
+      uint64 s = std::max(a.first, pos);
+      uint64 e = std::min(a.second, end);
+      if (s >= e) {
+         continue;
+      }
+      add(s - pos, NBD_STATE_HOLE | NBD_STATE_ZERO);
+      add(e - s, 0);
+      pos = e;
+   }
+   add(end - pos, NBD_STATE_HOLE | NBD_STATE_ZERO);
 
-   createParams.capacity = appGlobals.mbSize *
-                           ((1U << 20) / VIXDISKLIB_SECTOR_SIZE);
-   createParams.logicalSectorSize = appGlobals.logicalSectorSize;
-   createParams.physicalSectorSize = appGlobals.physicalSectorSize;
-   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
-   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+   if (one && extents.size() > 1) {
+      extents.resize(1);
+   }
+}
 
-   vixError = VixDiskLib_Create(appGlobals.connection,
-                                appGlobals.diskPaths[0].c_str(),
-                                &createParams,
-                                NULL,
-                                NULL);
-   CHECK_AND_THROW(vixError);
+void
+NbdExport::printStats()
+{
+   std::lock_guard<std::mutex> lg(_ioLock);
+   cout << "NBD: " << _reads << " reads (" << _bytesRead << " bytes), "
+        << _writes << " writes (" << _bytesWritten << " bytes), "
+        << _blockStatus << " allocation queries" << endl;
 }
 
 
 /*
- *--------------------------------------------------------------------------
- *
- * DoRedo --
- *
- *      Creates a child disk.
- *
- * Results:
- *      None.
- *
- * Side effects:
- *      None.
- *
- *--------------------------------------------------------------------------
+ * One NBD client. The calling thread negotiates and then reads requests,
+ * submitting them as async VixDiskLib I/O; a writer thread sends the
+ * replies in completion order. At most VIX_NBD_MAX_INFLIGHT requests are
+ * outstanding.
  */
+class NbdConnection
+{
+   public:
+      NbdConnection(NbdExport& exp, int fd)
+         : _export(exp), _fd(fd), _structured(false), _metaContext(false),
+           _inFlight(0), _done(false)
+      {}
 
-static void
-DoRedo(void)
+      void serve();
+
+   private:
+      struct Request {
+         NbdConnection *conn;
+         uint16 type;
+         uint16 flags;
+         uint64 handle;
+         uint64 offset;
+         uint32 length;
+         uint32 skip;            // bytes of buf before offset
+         std::unique_ptr<uint8[]> buf;
+         VixError vixError;
+         uint32 error;           // NBD errno, set when vixError is not used
+         string payload;         // ready made structured reply payload
+      };
+
+      bool negotiate();
+      bool sendOptionReply(uint32 option, uint32 type,
+                           const string& data = "");
+      bool handleInfo(uint32 option, const string& data, bool& acked);
+      bool handleMetaContext(uint32 option, const string& data);
+      bool sendExportInfo(bool zeroes);
+      void transmit();
+      void waitInFlight(std::unique_lock<std::mutex>& lk, unsigned max);
+      void submit(Request *req);
+      void complete(Request *req);
+      void writer();
+      bool sendReply(Request *req);
+      static void IoDone(void *cbData, VixError result);
+
+      NbdExport& _export;
+      int _fd;
+      bool _structured;
+      bool _metaContext;
+      unsigned _inFlight;
+      bool _done;
+      std::deque<Request *> _replies;
+      std::mutex _lock;
+      std::condition_variable _cond;
+};
+
+
+bool
+NbdConnection::sendOptionReply(uint32 option, uint32 type,
+                               const string& data)
 {
-   VixError vixError;
-   VixDisk parentDisk(appGlobals.connection, appGlobals.parentPath, 0);
-   vixError = VixDiskLib_CreateChild(parentDisk.Handle(),
-                                     appGlobals.diskPaths[0].c_str(),
-                                     VIXDISKLIB_DISK_MONOLITHIC_SPARSE,
-                                     NULL, NULL);
-   CHECK_AND_THROW(vixError);
+   string msg;
+
+   NbdPut64(msg, NBD_REP_MAGIC);
+   NbdPut32(msg, option);
+   NbdPut32(msg, type);
+   NbdPut32(msg, (uint32)data.size());
+   msg += data;
+   return SendAll(_fd, msg.data(), msg.size());
+}
+
+
+bool
+NbdConnection::sendExportInfo(bool zeroes)
+{
+   string msg;
+   uint16 flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN;
+
+   flags |= _export.readOnly() ? NBD_FLAG_READ_ONLY : NBD_FLAG_SEND_FLUSH;
+   NbdPut64(msg, _export.size());
+   NbdPut16(msg, flags);
+   if (zeroes) {
+      msg.append(124, '\0');
+   }
+   return SendAll(_fd, msg.data(), msg.size());
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * DoFill --
+ * NbdConnection::handleInfo --
  *
- *      Writes to a virtual disk.
+ *      Answers NBD_OPT_INFO / NBD_OPT_GO. Any export name refers to the
+ *      one disk. acked is set only if the option was answered with
+ *      NBD_REP_ACK rather than an error.
  *
  * Results:
- *      None.
+ *      false if the connection must be dropped.
  *
  * Side effects:
  *      None.
@@ -2156,82 +13971,124 @@ DoRedo(void)
  *--------------------------------------------------------------------------
  */
 
-static void
-DoFill(void)
-{
-    VixDisk disk(appGlobals.connection, appGlobals.diskPaths[0].c_str(),
-                 appGlobals.openFlags);
-    auto bufPool =
-       getBufferPool<std::numeric_limits<size_t>::max(), uint8, FakeLock>(
-          disk, VIXDISKLIB_SECTOR_SIZE);
-    DoFillIO(*bufPool, disk);
-}
-
-static void
-DoFillIO(BufferPoolInterface<uint8>& bufPool, const VixDisk& disk)
+bool
+NbdConnection::handleInfo(uint32 option,        // IN
+                          const string& data,   // IN
+                          bool& acked)          // OUT
 {
-    VixDiskLibSectorType startSector;
-    auto buf = bufPool.getBuffer();
-    memset(buf, appGlobals.filler, sizeof(uint8) * VIXDISKLIB_SECTOR_SIZE);
+   const uint8 *p = (const uint8 *)data.data();
+   bool blockSize = false;
 
-    for (startSector = 0; startSector < appGlobals.numSectors; ++startSector) {
-       VixError vixError;
-       vixError = VixDiskLib_Write(disk.Handle(),
-                                   appGlobals.startSector + startSector,
-                                   1, buf);
-       CHECK_AND_THROW(vixError);
-    }
+   acked = false;
+   if (data.size() < 6 || data.size() < 6 + (size_t)NbdGet32(p)) {
+      return sendOptionReply(option, NBD_REP_ERR_INVALID);
+   }
+   size_t pos = 4 + NbdGet32(p);
+   uint16 numInfos = NbdGet16(p + pos);
+   pos += 2;
+   if (data.size() != pos + 2 * (size_t)numInfos) {
+      return sendOptionReply(option, NBD_REP_ERR_INVALID);
+   }
+   for (uint16 i = 0; i < numInfos; i++) {
+      if (NbdGet16(p + pos + 2 * i) == NBD_INFO_BLOCK_SIZE) {
+         blockSize = true;
+      }
+   }
 
-    bufPool.returnBuffer(buf);
+   string info;
+   uint16 flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN;
+   flags |= _export.readOnly() ? NBD_FLAG_READ_ONLY : NBD_FLAG_SEND_FLUSH;
+   NbdPut16(info, NBD_INFO_EXPORT);
+   NbdPut64(info, _export.size());
+   NbdPut16(info, flags);
+   if (!sendOptionReply(option, NBD_REP_INFO, info)) {
+      return false;
+   }
+   if (blockSize) {
+      info.clear();
+      NbdPut16(info, NBD_INFO_BLOCK_SIZE);
+      NbdPut32(info, VIXDISKLIB_SECTOR_SIZE);
+      NbdPut32(info, _export.chunkBytes());
+      NbdPut32(info, NBD_MAX_REQUEST);
+      if (!sendOptionReply(option, NBD_REP_INFO, info)) {
+         return false;
+      }
+   }
+   acked = true;
+   return sendOptionReply(option, NBD_REP_ACK);
 }
 
+
 /*
  *--------------------------------------------------------------------------
  *
- * DoReadMetadata --
+ * NbdConnection::handleMetaContext --
  *
- *      Reads metadata from a virtual disk.
+ *      Answers NBD_OPT_LIST_META_CONTEXT / NBD_OPT_SET_META_CONTEXT.
+ *      Only "base:allocation" is known.
  *
  * Results:
- *      None.
+ *      false if the connection must be dropped.
  *
  * Side effects:
- *      None.
+ *      SET selects or deselects base:allocation for BLOCK_STATUS.
  *
  *--------------------------------------------------------------------------
  */
 
-static void
-DoReadMetadata(void)
+bool
+NbdConnection::handleMetaContext(uint32 option, const string& data)
 {
-    size_t requiredLen;
-    VixDisk disk(appGlobals.connection, appGlobals.diskPaths[0].c_str(), appGlobals.openFlags);
-    VixError vixError = VixDiskLib_ReadMetadata(disk.Handle(),
-                                                appGlobals.metaKey,
-                                                NULL, 0, &requiredLen);
-    if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
-        THROW_ERROR(vixError);
-    }
-    std::vector <char> val(requiredLen);
-    vixError = VixDiskLib_ReadMetadata(disk.Handle(),
-                                       appGlobals.metaKey,
-                                       &val[0],
-                                       requiredLen,
-                                       NULL);
-    CHECK_AND_THROW(vixError);
-    cout << appGlobals.metaKey << " = " << &val[0] << endl;
+   static const string baseAllocation = "base:allocation";
+   const uint8 *p = (const uint8 *)data.data();
+   bool set = option == NBD_OPT_SET_META_CONTEXT;
+
+   if (set && !_structured) {
+      return sendOptionReply(option, NBD_REP_ERR_INVALID);
+   }
+   if (data.size() < 8 || data.size() < 8 + (size_t)NbdGet32(p)) {
+      return sendOptionReply(option, NBD_REP_ERR_INVALID);
+   }
+   size_t pos = 4 + NbdGet32(p);
+   uint32 numQueries = NbdGet32(p + pos);
+   pos += 4;
+
+   bool match = !set && numQueries == 0;
+   for (uint32 i = 0; i < numQueries; i++) {
+      if (pos + 4 > data.size() || pos + 4 + NbdGet32(p + pos) > data.size()) {
+         return sendOptionReply(option, NBD_REP_ERR_INVALID);
+      }
+      string query = data.substr(pos + 4, NbdGet32(p + pos));
+      pos += 4 + query.size();
+      if (query == baseAllocation || (!set && query == "base:")) {
+         match = true;
+      }
+   }
+
+   if (set) {
+      _metaContext = match;
+   }
+   if (match) {
+      string reply;
+      NbdPut32(reply, NBD_META_BASE_ALLOCATION);
+      reply += baseAllocation;
+      if (!sendOptionReply(option, NBD_REP_META_CONTEXT, reply)) {
+         return false;
+      }
+   }
+   return sendOptionReply(option, NBD_REP_ACK);
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * DoWriteMetadata --
+ * NbdConnection::negotiate --
  *
- *      Writes metadata in a virtual disk.
+ *      Runs the fixed newstyle handshake and option haggling.
  *
  * Results:
- *      None.
+ *      true when the client entered the transmission phase.
  *
  * Side effects:
  *      None.
@@ -2239,72 +14096,124 @@ DoReadMetadata(void)
  *--------------------------------------------------------------------------
  */
 
-static void
-DoWriteMetadata(void)
+bool
+NbdConnection::negotiate()
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPaths[0].c_str(), appGlobals.openFlags);
-    VixError vixError = VixDiskLib_WriteMetadata(disk.Handle(),
-                                                 appGlobals.metaKey,
-                                                 appGlobals.metaVal);
-    CHECK_AND_THROW(vixError);
+   string hello;
+   uint8 clientFlags[4];
+
+   NbdPut64(hello, NBD_MAGIC);
+   NbdPut64(hello, NBD_IHAVEOPT);
+   NbdPut16(hello, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+   if (!SendAll(_fd, hello.data(), hello.size()) ||
+       !RecvAll(_fd, clientFlags, sizeof clientFlags)) {
+      return false;
+   }
+   bool zeroes = !(NbdGet32(clientFlags) & NBD_FLAG_NO_ZEROES);
+
+   while (!serverStop) {
+      uint8 hdr[16];
+      if (!RecvAll(_fd, hdr, sizeof hdr) || NbdGet64(hdr) != NBD_IHAVEOPT) {
+         return false;
+      }
+      uint32 option = NbdGet32(hdr + 8);
+      uint32 length = NbdGet32(hdr + 12);
+      if (length > NBD_MAX_OPTION) {
+         return false;
+      }
+      string data(length, '\0');
+      if (length > 0 && !RecvAll(_fd, &data[0], length)) {
+         return false;
+      }
+
+      bool ok;
+      switch (option) {
+      case NBD_OPT_EXPORT_NAME:
+         return sendExportInfo(zeroes);
+      case NBD_OPT_ABORT:
+         sendOptionReply(option, NBD_REP_ACK);
+         return false;
+      case NBD_OPT_LIST: {
+         string name;
+         NbdPut32(name, 0);
+         ok = sendOptionReply(option, NBD_REP_SERVER, name) &&
+              sendOptionReply(option, NBD_REP_ACK);
+         break;
+      }
+      case NBD_OPT_INFO:
+      case NBD_OPT_GO: {
+         bool acked;
+         ok = handleInfo(option, data, acked);
+         if (ok && acked && option == NBD_OPT_GO) {
+            return true;
+         }
+         break;
+      }
+      case NBD_OPT_STRUCTURED_REPLY:
+         if (length != 0) {
+            ok = sendOptionReply(option, NBD_REP_ERR_INVALID);
+            break;
+         }
+         _structured = true;
+         ok = sendOptionReply(option, NBD_REP_ACK);
+         break;
+      case NBD_OPT_LIST_META_CONTEXT:
+      case NBD_OPT_SET_META_CONTEXT:
+         ok = handleMetaContext(option, data);
+         break;
+      default:
+         ok = sendOptionReply(option, NBD_REP_ERR_UNSUP);
+         break;
+      }
+      if (!ok) {
+         return false;
+      }
+   }
+   return false;
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * DoDumpMetadata --
+ * NbdConnection::IoDone --
  *
- *      Dumps all the metadata.
+ *      Completion callback of VixDiskLib_ReadAsync / WriteAsync.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Queues the reply for the writer thread.
  *
  *--------------------------------------------------------------------------
- */
-
-static void
-DoDumpMetadata(void)
-{
-    VixDisk disk(appGlobals.connection, appGlobals.diskPaths[0].c_str(), appGlobals.openFlags);
-    char *key;
-    size_t requiredLen;
-
-    VixError vixError = VixDiskLib_GetMetadataKeys(disk.Handle(),
-                                                   NULL, 0, &requiredLen);
-    if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
-       THROW_ERROR(vixError);
-    }
-    std::vector<char> buf(requiredLen);
-    vixError = VixDiskLib_GetMetadataKeys(disk.Handle(), &buf[0], requiredLen, NULL);
-    CHECK_AND_THROW(vixError);
-    key = &buf[0];
-
-    while (*key) {
-        vixError = VixDiskLib_ReadMetadata(disk.Handle(), key, NULL, 0,
-                                           &requiredLen);
-        if (vixError != VIX_OK && vixError != VIX_E_BUFFER_TOOSMALL) {
-           THROW_ERROR(vixError);
-        }
-        std::vector <char> val(requiredLen);
-        vixError = VixDiskLib_ReadMetadata(disk.Handle(), key, &val[0],
-                                           requiredLen, NULL);
-        CHECK_AND_THROW(vixError);
-        cout << key << " = " << &val[0] << endl;
-        key += (1 + strlen(key));
-    }
+ */
+
+void
+NbdConnection::IoDone(void *cbData, VixError result)
+{
+   Request *req = (Request *)cbData;
+
+   req->vixError = result;
+   req->conn->complete(req);
+}
+
+void
+NbdConnection::complete(Request *req)
+{
+   std::lock_guard<std::mutex> lg(_lock);
+   _replies.push_back(req);
+   _cond.notify_all();
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * DoDump --
+ * NbdConnection::submit --
  *
- *      Dumps the content of a virtual disk.
+ *      Starts one request. I/O goes to VixDiskLib asynchronously, the
+ *      rest completes right away.
  *
  * Results:
  *      None.
@@ -2315,33 +14224,68 @@ DoDumpMetadata(void)
  *--------------------------------------------------------------------------
  */
 
-static void
-DoDump(void)
+void
+NbdConnection::submit(Request *req)
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPaths[0].c_str(), appGlobals.openFlags);
-    uint8 *buf = new uint8[VIXDISKLIB_SECTOR_SIZE];
-    VixDiskLibSectorType i;
+   uint64 end = req->offset + req->length;
+   uint64 sector = req->offset / VIXDISKLIB_SECTOR_SIZE;
+   uint64 numSectors = (end + VIXDISKLIB_SECTOR_SIZE - 1) /
+                       VIXDISKLIB_SECTOR_SIZE - sector;
+   VixError vixError;
 
-    for (i = 0; i < appGlobals.numSectors; i++) {
-       VixError vixError = VixDiskLib_Read(disk.Handle(),
-                                           appGlobals.startSector + i,
-                                           1, buf);
-       CHECK_AND_THROW_2(vixError, buf);
-       DumpBytes(buf, sizeof(buf[0]) * VIXDISKLIB_SECTOR_SIZE, 16);
-    }
-    delete[] buf;
+   if ((req->type == NBD_CMD_READ || req->type == NBD_CMD_WRITE) &&
+       req->length == 0) {
+      // Nothing to transfer; VixDiskLib doesn't take 0 sectors.
+      complete(req);
+      return;
+   }
+
+   switch (req->type) {
+   case NBD_CMD_READ:
+      vixError = _export.read(sector, numSectors, req->buf.get(), IoDone,
+                              req);
+      break;
+   case NBD_CMD_WRITE:
+      vixError = _export.write(sector, numSectors, req->buf.get(), IoDone,
+                               req);
+      break;
+   case NBD_CMD_FLUSH:
+      req->vixError = _export.flush();
+      complete(req);
+      return;
+   case NBD_CMD_BLOCK_STATUS: {
+      vector<std::pair<uint32, uint32>> extents;
+      _export.blockStatus(req->offset, req->length,
+                          (req->flags & NBD_CMD_FLAG_REQ_ONE) != 0, extents);
+      NbdPut32(req->payload, NBD_META_BASE_ALLOCATION);
+      for (const auto& e : extents) {
+         NbdPut32(req->payload, e.first);
+         NbdPut32(req->payload, e.second);
+      }
+      complete(req);
+      return;
+   }
+   default:
+      complete(req);
+      return;
+   }
+
+   if (vixError != VIX_ASYNC) {
+      req->vixError = vixError;
+      complete(req);
+   }
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * DoGetAllocatedBlocks --
+ * NbdConnection::sendReply --
  *
- *      Gets the allocated block info of a virtual disk.
+ *      Sends the reply of a finished request, simple or structured.
  *
  * Results:
- *      None.
+ *      false if the client went away.
  *
  * Side effects:
  *      None.
@@ -2349,86 +14293,116 @@ DoDump(void)
  *--------------------------------------------------------------------------
  */
 
-static void
-DoGetAllocatedBlocks(void)
+bool
+NbdConnection::sendReply(Request *req)
 {
-    VixDisk disk(appGlobals.connection, appGlobals.diskPaths[0].c_str(),
-                 appGlobals.openFlags);
-    uint64 capacity;
-    VixError vixError;
-    uint64 offset;
-    uint64 chunkSize = appGlobals.chunkSize;
-    uint64 numChunk;
-    vector<VixDiskLibBlock> vixBlocks;
-
-    offset = 0;
-    capacity = disk.getInfo()->capacity;
-    numChunk = capacity / chunkSize;
-    while (numChunk > 0) {
-        VixDiskLibBlockList *blockList;
-        uint64 numChunkToQuery;
-
-        if (numChunk > VIXDISKLIB_MAX_CHUNK_NUMBER) {
-           numChunkToQuery = VIXDISKLIB_MAX_CHUNK_NUMBER;
-        } else {
-           numChunkToQuery = numChunk;
-        }
-        blockList = NULL;
-        vixError = VixDiskLib_QueryAllocatedBlocks(disk.Handle(),
-                                                   offset,
-                                                   numChunkToQuery * chunkSize,
-                                                   chunkSize,
-                                                   &blockList);
-        CHECK_AND_THROW(vixError);
+   uint32 error = req->error;
+   string hdr;
+
+   if (error == 0 && VIX_FAILED(req->vixError)) {
+      switch (req->vixError & 0xFFFF) {
+      case VIX_E_OUT_OF_MEMORY:
+         error = NBD_ENOMEM;
+         break;
+      case VIX_E_DISK_FULL:
+         error = NBD_ENOSPC;
+         break;
+      case VIX_E_INVALID_ARG:
+         error = NBD_EINVAL;
+         break;
+      default:
+         error = NBD_EIO;
+         break;
+      }
+   }
 
-        for (uint32 i = 0; i < blockList->numBlocks; i++) {
-            vixBlocks.push_back(blockList->blocks[i]);
-        }
+   if (!_structured) {
+      NbdPut32(hdr, NBD_SIMPLE_REPLY_MAGIC);
+      NbdPut32(hdr, error);
+      NbdPut64(hdr, req->handle);
+      if (!SendAll(_fd, hdr.data(), hdr.size())) {
+         return false;
+      }
+      if (error == 0 && req->type == NBD_CMD_READ) {
+         return SendAll(_fd, req->buf.get() + req->skip, req->length);
+      }
+      return true;
+   }
 
-        numChunk -= numChunkToQuery;
-        offset += numChunkToQuery * chunkSize;
+   uint16 type = NBD_REPLY_TYPE_NONE;
+   uint32 length = 0;
+   string payload;
+   if (error != 0) {
+      type = NBD_REPLY_TYPE_ERROR;
+      NbdPut32(payload, error);
+      NbdPut16(payload, 0);
+      length = payload.size();
+   } else if (req->type == NBD_CMD_READ && req->length > 0) {
+      // An OFFSET_DATA chunk must carry at least one byte.
+      type = NBD_REPLY_TYPE_OFFSET_DATA;
+      NbdPut64(payload, req->offset);
+      length = payload.size() + req->length;
+   } else if (req->type == NBD_CMD_BLOCK_STATUS) {
+      type = NBD_REPLY_TYPE_BLOCK_STATUS;
+      payload = req->payload;
+      length = payload.size();
+   }
+   NbdPut32(hdr, NBD_STRUCTURED_REPLY_MAGIC);
+   NbdPut16(hdr, NBD_REPLY_FLAG_DONE);
+   NbdPut16(hdr, type);
+   NbdPut64(hdr, req->handle);
+   NbdPut32(hdr, length);
+   hdr += payload;
+   if (!SendAll(_fd, hdr.data(), hdr.size())) {
+      return false;
+   }
+   if (type == NBD_REPLY_TYPE_OFFSET_DATA) {
+      return SendAll(_fd, req->buf.get() + req->skip, req->length);
+   }
+   return true;
+}
 
-        VixDiskLib_FreeBlockList(blockList);
-    }
 
-    /*
-     * Just add unaligned part even though it may not be allocated.
-     */
-    uint64 unalignedPart = capacity % chunkSize;
-    if (unalignedPart > 0) {
-        VixDiskLibBlock block;
-        block.offset = offset;
-        block.length = unalignedPart;
-        vixBlocks.push_back(block);
-    }
+void
+NbdConnection::writer()
+{
+   bool connected = true;
 
-    printf("\n");
-    printf("Number of blocks: %" FMTSZ "u\n", vixBlocks.size());
-    if (vixBlocks.size() > 0) {
-        printf("%-14s\t\t%-14s\n", "Offset", "Length");
-    }
-    uint64 allocatedSize = 0;
-    for (uint32 i = 0; i < vixBlocks.size(); i++) {
-        printf("0x%012" FMT64 "X\t\t0x%012" FMT64 "X\n",
-               vixBlocks[i].offset, vixBlocks[i].length);
-        allocatedSize += vixBlocks[i].length;
-    }
-    printf("allocated size (%" FMT64 "u) / capacity (%" FMT64 "u) : %u%%\n",
-           allocatedSize, capacity,
-           (unsigned int)(allocatedSize * 100 / capacity));
-    printf("\n");
+   while (true) {
+      Request *req;
+      {
+         std::unique_lock<std::mutex> lk(_lock);
+         _cond.wait(lk, [this] () { return !_replies.empty() || _done; });
+         if (_replies.empty()) {
+            return;
+         }
+         req = _replies.front();
+         _replies.pop_front();
+      }
+
+      if (connected && !sendReply(req)) {
+         // Keep draining so the reader does not wait forever.
+         connected = false;
+         shutdown(_fd, SHUT_RDWR);
+      }
+      delete req;
+
+      std::lock_guard<std::mutex> lg(_lock);
+      --_inFlight;
+      _cond.notify_all();
+   }
 }
 
 
 /*
  *--------------------------------------------------------------------------
  *
- * BitCount --
+ * NbdConnection::transmit --
  *
- *      Counts all the bits set in an int.
+ *      Reads requests until the client disconnects or the server stops.
  *
  * Results:
- *      Number of bits set to 1.
+ *      None.
  *
  * Side effects:
  *      None.
@@ -2436,24 +14410,129 @@ DoGetAllocatedBlocks(void)
  *--------------------------------------------------------------------------
  */
 
-static int
-BitCount(int number)    // IN
+void
+NbdConnection::transmit()
 {
-    int bits = 0;
-    while (number) {
-        number = number & (number - 1);
-        bits++;
-    }
-    return bits;
+   while (!serverStop) {
+      uint8 hdr[28];
+
+      struct pollfd pfd;
+      pfd.fd = _fd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 500) == 0) {
+         continue;
+      }
+      if (!RecvAll(_fd, hdr, sizeof hdr) ||
+          NbdGet32(hdr) != NBD_REQUEST_MAGIC) {
+         break;
+      }
+
+      std::unique_ptr<Request> req(new Request);
+      req->conn = this;
+      req->flags = NbdGet16(hdr + 4);
+      req->type = NbdGet16(hdr + 6);
+      req->handle = NbdGet64(hdr + 8);
+      req->offset = NbdGet64(hdr + 16);
+      req->length = NbdGet32(hdr + 24);
+      req->skip = req->offset % VIXDISKLIB_SECTOR_SIZE;
+      req->vixError = VIX_OK;
+      req->error = 0;
+
+      if (req->type == NBD_CMD_DISC) {
+         break;
+      }
+
+      bool io = req->type == NBD_CMD_READ || req->type == NBD_CMD_WRITE;
+      if (req->type == NBD_CMD_WRITE && req->length > NBD_MAX_REQUEST) {
+         // Can't skip the payload safely.
+         break;
+      }
+      if (io || req->type == NBD_CMD_BLOCK_STATUS) {
+         if (req->offset > _export.size() ||
+             req->length > _export.size() - req->offset ||
+             (io && req->length > NBD_MAX_REQUEST)) {
+            req->error = NBD_EINVAL;
+         }
+      }
+      if (io && req->error == 0) {
+         size_t bufLen = (req->skip + req->length + VIXDISKLIB_SECTOR_SIZE - 1) /
+                         VIXDISKLIB_SECTOR_SIZE * VIXDISKLIB_SECTOR_SIZE;
+         req->buf.reset(new uint8[std::max<size_t>(bufLen, 1)]);
+      }
+      if (req->type == NBD_CMD_WRITE) {
+         std::unique_ptr<uint8[]> sink;
+         uint8 *dst = req->buf.get();
+         if (dst == NULL) {
+            sink.reset(new uint8[std::max<uint32>(req->length, 1)]);
+            dst = sink.get();
+         }
+         if (!RecvAll(_fd, dst, req->length)) {
+            break;
+         }
+         if (req->error == 0 && _export.readOnly()) {
+            req->error = NBD_EPERM;
+         } else if (req->error == 0 &&
+                    (req->skip != 0 ||
+                     req->length % VIXDISKLIB_SECTOR_SIZE != 0)) {
+            req->error = NBD_EINVAL;
+         }
+      }
+      switch (req->type) {
+      case NBD_CMD_READ:
+      case NBD_CMD_WRITE:
+         break;
+      case NBD_CMD_FLUSH:
+         if (_export.readOnly()) {
+            req->error = NBD_EINVAL;
+         }
+         break;
+      case NBD_CMD_BLOCK_STATUS:
+         if (!_metaContext || req->length == 0) {
+            req->error = NBD_EINVAL;
+         }
+         break;
+      default:
+         req->error = NBD_EINVAL;
+         break;
+      }
+
+      {
+         std::unique_lock<std::mutex> lk(_lock);
+         waitInFlight(lk, VIX_NBD_MAX_INFLIGHT);
+         ++_inFlight;
+      }
+      if (req->error != 0) {
+         complete(req.release());
+      } else {
+         submit(req.release());
+      }
+   }
+}
+
+
+// Waits, holding lk on _lock, until fewer than max requests are in flight.
+void
+NbdConnection::waitInFlight(std::unique_lock<std::mutex>& lk,   // IN
+                            unsigned max)                       // IN
+{
+   while (_inFlight >= max) {
+      if (_cond.wait_for(lk, std::chrono::milliseconds(10)) ==
+          std::cv_status::timeout && _inFlight >= max) {
+         // Some transports only complete requests from VixDiskLib_Wait.
+         lk.unlock();
+         _export.wait();
+         lk.lock();
+      }
+   }
 }
 
 
 /*
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  *
- * DumpBytes --
+ * NbdConnection::serve --
  *
- *      Displays an array of n bytes.
+ *      Serves the client until it disconnects.
  *
  * Results:
  *      None.
@@ -2461,406 +14540,767 @@ BitCount(int number)    // IN
  * Side effects:
  *      None.
  *
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  */
 
-static void
-DumpBytes(const unsigned char *buf,     // IN
-          size_t n,                     // IN
-          int step)                     // IN
+void
+NbdConnection::serve()
 {
-   size_t lines = n / step;
-   size_t i;
-
-   for (i = 0; i < lines; i++) {
-      int k, last;
-      printf("%04" FMTSZ "x : ", i * step);
-      for (k = 0; n != 0 && k < step; k++, n--) {
-         printf("%02x ", buf[i * step + k]);
-      }
-      printf("  ");
-      last = k;
-      while (k --) {
-         unsigned char c = buf[i * step + last - k - 1];
-         if (c < ' ' || c >= 127) {
-            c = '.';
-         }
-         printf("%c", c);
-      }
-      printf("\n");
+   if (negotiate()) {
+      std::thread replies([this] () { writer(); });
+      transmit();
+
+      std::unique_lock<std::mutex> lk(_lock);
+      waitInFlight(lk, 1);
+      _done = true;
+      _cond.notify_all();
+      lk.unlock();
+      replies.join();
    }
-   printf("\n");
 }
 
 
 /*
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  *
- * CopyThread --
+ * NbdListen --
  *
- *       Copies a source disk to the given file.
+ *      Creates the listening socket for -nbd: a Unix domain socket if the
+ *      address contains a '/', else a TCP port, optionally preceded by
+ *      'host:' (default host 127.0.0.1).
  *
  * Results:
- *       0 if succeeded, 1 if not.
+ *      The socket.
  *
  * Side effects:
- *      Creates a new disk; sets appGlobals.success to false if fails
+ *      Throws VixDiskLibErrWrapper on failure.
  *
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  */
 
-#ifdef _WIN32
-#define TASK_OK 0
-#define TASK_FAIL 1
-
-static unsigned __stdcall
-#else
-#define TASK_OK ((void*)0)
-#define TASK_FAIL ((void*)1)
-
-static void *
-#endif
-CopyThread(void *arg)
+static int
+NbdListen(const string& address)    // IN
 {
-   ThreadData *td = (ThreadData *)arg;
-
-    try {
-      VixDiskLibSectorType i;
-      VixError vixError;
-      uint8 *buf = new uint8[VIXDISKLIB_SECTOR_SIZE];
-
-      for (i = 0; i < td->numSectors ; i += 1) {
-         vixError = VixDiskLib_Read(td->srcHandle, i, 1, buf);
-         CHECK_AND_THROW_2(vixError, buf);
-         vixError = VixDiskLib_Write(td->dstHandle, i, 1, buf);
-         CHECK_AND_THROW_2(vixError, buf);
+   int fd = -1;
+
+   if (address.find('/') != string::npos) {
+      struct sockaddr_un addr;
+      memset(&addr, 0, sizeof addr);
+      addr.sun_family = AF_UNIX;
+      if (address.size() >= sizeof addr.sun_path) {
+         cout << "Socket path " << address << " is too long." << endl;
+         THROW_ERROR(VIX_E_INVALID_ARG);
       }
+      strcpy(addr.sun_path, address.c_str());
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      unlink(address.c_str());
+      if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof addr) != 0) {
+         close(fd);
+         fd = -1;
+      }
+   } else {
+      size_t colon = address.rfind(':');
+      string host = colon == string::npos ? "127.0.0.1" :
+                                            address.substr(0, colon);
+      string port = colon == string::npos ? address :
+                                            address.substr(colon + 1);
+      struct addrinfo hints, *res = NULL;
+      memset(&hints, 0, sizeof hints);
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      hints.ai_flags = AI_PASSIVE;
+      if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                      &hints, &res) != 0) {
+         cout << "Can't resolve " << address << endl;
+         THROW_ERROR(VIX_E_INVALID_ARG);
+      }
+      for (struct addrinfo *ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+         int one = 1;
+         fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+         if (fd < 0) {
+            continue;
+         }
+         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+         if (bind(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+         }
+      }
+      freeaddrinfo(res);
+   }
 
-      delete[] buf;
-    } catch (const VixDiskLibErrWrapper& e) {
-       cout << "CopyThread (" << td->dstDisk << ")Error: " << e.ErrorCode()
-            <<" " << e.Description();
-        appGlobals.success = FALSE;
-        return TASK_FAIL;
-    }
-
-    cout << "CopyThread to " << td->dstDisk << " succeeded.\n";
-    return TASK_OK;
+   if (fd < 0 || listen(fd, SOMAXCONN) != 0) {
+      cout << "Cannot listen on " << address << ": " << strerror(errno)
+           << endl;
+      if (fd >= 0) {
+         close(fd);
+      }
+      THROW_ERROR(VIX_E_FAIL);
+   }
+   return fd;
 }
 
 
 /*
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  *
- * PrepareThreadData --
+ * DoNbd --
  *
- *      Open the source and destination disk for multi threaded copy.
+ *      Exports the disk as an NBD server on Globals().nbdListen, e.g. for
+ *      qemu-img, nbd-client or nbdcopy. Each client connection keeps up to
+ *      VIX_NBD_MAX_INFLIGHT requests in flight. Stops on SIGINT, SIGTERM
+ *      or when the daemon job is cancelled.
  *
  * Results:
- *      Fills in ThreadData in td.
+ *      None.
  *
  * Side effects:
- *      None.
+ *      Writes to the disk if exported with -nbdrw.
  *
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  */
 
 static void
-PrepareThreadData(VixDiskLibConnection &dstConnection,
-                  ThreadData &td)
+DoNbd(void)
 {
-   VixError vixError;
-   VixDiskLibCreateParams createParams;
-   VixDiskLibInfo *info = NULL;
-   string prefixName,randomFilename;
+   VixDisk disk(Globals().connection, Globals().diskPaths[0].c_str(),
+                Globals().openFlags);
+   NbdExport exp(disk, (Globals().openFlags &
+                        VIXDISKLIB_FLAG_OPEN_READ_ONLY) != 0);
+   int listenFd = NbdListen(Globals().nbdListen);
+   StopSignals stopSignals;
+
+   cout << "Exporting " << Globals().diskPaths[0] << " ("
+        << exp.size() << " bytes, "
+        << (exp.readOnly() ? "read-only" : "read-write") << ") over NBD on "
+        << Globals().nbdListen << endl;
+
+   struct Client {
+      std::thread thread;
+      int fd;
+      std::shared_ptr<std::atomic<bool>> done;
+   };
+   std::list<Client> clients;
+
+   while (!serverStop &&
+          !(Globals().job != NULL && Globals().job->cancelled)) {
+      struct pollfd pfd;
+      pfd.fd = listenFd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 500) <= 0) {
+         continue;
+      }
+      int fd = accept(listenFd, NULL, NULL);
+      if (fd < 0) {
+         continue;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+      clients.remove_if([] (Client& c) {
+         if (*c.done) {
+            c.thread.join();
+            close(c.fd);
+            return true;
+         }
+         return false;
+      });
+
+      auto done = std::make_shared<std::atomic<bool>>(false);
+      clients.push_back({std::thread([&exp, fd, done] () {
+                                        NbdConnection conn(exp, fd);
+                                        conn.serve();
+                                        *done = true;
+                                     }),
+                         fd, done});
+   }
 
-#ifdef _WIN32
-   prefixName = "c:\\test";
-#else
-   prefixName = "/tmp/test";
+   close(listenFd);
+   if (strchr(Globals().nbdListen, '/') != NULL) {
+      unlink(Globals().nbdListen);
+   }
+   // Wake up clients blocked on the socket.
+   for (auto& c : clients) {
+      shutdown(c.fd, SHUT_RDWR);
+   }
+   for (auto& c : clients) {
+      c.thread.join();
+      close(c.fd);
+   }
+   exp.printStats();
+}
+
+#endif // _WIN32
+
+#if defined(FOR_MNTAPI) && !defined(_WIN32)
+
+// Readahead window in sectors once -fuse sees sequential reads
+#ifndef VIX_FUSE_READAHEAD
+#define VIX_FUSE_READAHEAD 2048
 #endif
-   GenerateRandomFilename(prefixName, randomFilename);
-   td.dstDisk = randomFilename;
 
-   vixError = VixDiskLib_Open(appGlobals.connection,
-                              appGlobals.diskPaths[0].c_str(),
-                              appGlobals.openFlags,
-                              &td.srcHandle);
-   CHECK_AND_THROW(vixError);
+// Sequential reads in a row on one open file before readahead starts
+#define FUSE_READAHEAD_TRIGGER 2
 
-   vixError = VixDiskLib_GetInfo(td.srcHandle, &info);
-   CHECK_AND_THROW(vixError);
-   td.numSectors = info->capacity;
-   VixDiskLib_FreeInfo(info);
+// Inode numbers of the -fuse file system
+#define FUSE_ROOT_INO  1
+#define FUSE_FIRST_INO 2
+
+// A flat view of the whole chain or of one link, exported by -fuse.
+struct FuseFile
+{
+   string name;
+   VixDisk::Ptr disk;
+   uint64 size;
+   std::mutex ioLock;    // VixDiskLib handles are not thread safe
+};
+
+struct FuseExport
+{
+   vector<std::unique_ptr<FuseFile>> files;
+   std::atomic<uint64> reads;
+   std::atomic<uint64> bytesRead;
+   std::atomic<uint64> readaheadHits;
+   std::atomic<uint64> readaheadWindows;
+};
+
+
+/*
+ * Reads of one open -fuse file. Once FUSE_READAHEAD_TRIGGER reads in a
+ * row were sequential, the next VIX_FUSE_READAHEAD sectors are fetched
+ * with VixDiskLib_ReadAsync, keeping one window ahead of the reader.
+ */
+class FuseReader
+{
+   public:
+      FuseReader(FuseExport& exp, FuseFile& file)
+         : _export(exp), _file(file), _nextOff(0), _streak(0)
+      {}
+
+      ~FuseReader()
+      {
+         dropWindows();
+      }
+
+      void read(fuse_req_t req, size_t size, uint64 off);
+
+   private:
+      struct Window {
+         uint64 off;
+         uint64 len;
+         std::unique_ptr<uint8[]> buf;
+         std::mutex lock;
+         std::condition_variable cond;
+         bool ready;
+         VixError vixError;
+      };
+
+      void startWindow(uint64 off);
+      bool waitWindow(Window& win);
+      void dropWindows();
+      void reply(fuse_req_t req, const uint8 *buf, size_t size);
+      static void WindowDone(void *cbData, VixError result);
+
+      FuseExport& _export;
+      FuseFile& _file;
+      std::mutex _lock;
+      uint64 _nextOff;
+      unsigned _streak;
+      std::deque<std::unique_ptr<Window>> _windows;
+};
+
+
+void
+FuseReader::WindowDone(void *cbData, VixError result)
+{
+   Window *win = (Window *)cbData;
+
+   {
+      std::lock_guard<std::mutex> lg(win->lock);
+      win->vixError = result;
+      win->ready = true;
+   }
+   win->cond.notify_all();
+}
+
+
+void
+FuseReader::startWindow(uint64 off)
+{
+   uint64 len = std::min<uint64>((uint64)VIX_FUSE_READAHEAD *
+                                    VIXDISKLIB_SECTOR_SIZE,
+                                 _file.size - off);
+   if (len == 0 || off % VIXDISKLIB_SECTOR_SIZE != 0) {
+      return;
+   }
+
+   std::unique_ptr<Window> win(new Window);
+   win->off = off;
+   win->len = len;
+   win->buf.reset(new uint8[len]);
+   win->ready = false;
+   win->vixError = VIX_OK;
+
+   VixError vixError;
+   {
+      std::lock_guard<std::mutex> lg(_file.ioLock);
+      vixError = blockCache.readAsync(*_file.disk,
+                                      off / VIXDISKLIB_SECTOR_SIZE,
+                                      len / VIXDISKLIB_SECTOR_SIZE,
+                                      win->buf.get(), WindowDone, win.get());
+   }
+   if (vixError != VIX_ASYNC) {
+      win->vixError = vixError;
+      win->ready = true;
+   }
+   ++_export.readaheadWindows;
+   _windows.push_back(std::move(win));
+}
+
+
+// Waits for a readahead window; false if it failed.
+bool
+FuseReader::waitWindow(Window& win)
+{
+   std::unique_lock<std::mutex> lk(win.lock);
+
+   while (!win.ready) {
+      if (win.cond.wait_for(lk, std::chrono::milliseconds(10)) ==
+          std::cv_status::timeout && !win.ready) {
+         // Some transports only complete requests from VixDiskLib_Wait.
+         lk.unlock();
+         {
+            std::lock_guard<std::mutex> ioLg(_file.ioLock);
+            VixDiskLib_Wait(_file.disk->Handle());
+         }
+         lk.lock();
+      }
+   }
+   return !VIX_FAILED(win.vixError);
+}
 
-   createParams.adapterType = VIXDISKLIB_ADAPTER_SCSI_BUSLOGIC;
-   createParams.capacity = td.numSectors;
-   createParams.logicalSectorSize = appGlobals.logicalSectorSize;
-   createParams.physicalSectorSize = appGlobals.physicalSectorSize;
-   createParams.diskType = VIXDISKLIB_DISK_SPLIT_SPARSE;
-   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
 
-   vixError = VixDiskLib_Create(dstConnection, td.dstDisk.c_str(),
-                                &createParams, NULL, NULL);
-   CHECK_AND_THROW(vixError);
+void
+FuseReader::dropWindows()
+{
+   for (auto& win : _windows) {
+      waitWindow(*win);
+   }
+   _windows.clear();
+}
 
-   vixError = VixDiskLib_Open(dstConnection, td.dstDisk.c_str(), 0,
-                              &td.dstHandle);
-   CHECK_AND_THROW(vixError);
 
-   vixError = VixDiskLib_GetInfo(td.dstHandle, &info);
-   CHECK_AND_THROW(vixError);
-   VixDiskLib_FreeInfo(info);
+// Replies with data from buf.
+void
+FuseReader::reply(fuse_req_t req, const uint8 *buf, size_t size)
+{
+   fuse_reply_buf(req, (const char *)buf, size);
+   ++_export.reads;
+   _export.bytesRead += size;
+   startupTimeline.firstIO();
 }
 
 
 /*
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  *
- * DoTestMultiThread --
+ * FuseReader::read --
  *
- *      Starts a given number of threads, each of which will copy the
- *      source disk to a temp. file.
+ *      Serves a FUSE read, from a readahead window if one covers it,
+ *      else with a synchronous VixDiskLib_Read.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      None.
+ *      Replies to req. May start the next readahead window.
  *
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  */
 
-static void
-DoTestMultiThread(void)
+void
+FuseReader::read(fuse_req_t req, size_t size, uint64 off)
 {
-   VixDiskLibConnectParams cnxParams = { 0 };
-   VixDiskLibConnection dstConnection;
-   VixError vixError;
-   vector<ThreadData> threadData(appGlobals.numThreads);
-   unsigned int i;
+   std::lock_guard<std::mutex> lg(_lock);
 
-   vixError = VixDiskLib_Connect(&cnxParams, &dstConnection);
-   CHECK_AND_THROW(vixError);
+   if (off >= _file.size) {
+      fuse_reply_buf(req, NULL, 0);
+      return;
+   }
+   size = (size_t)std::min<uint64>(size, _file.size - off);
+   uint64 end = off + size;
 
-#ifdef _WIN32
-   vector<HANDLE> threads(appGlobals.numThreads);
+   _streak = off == _nextOff ? _streak + 1 : 0;
+   _nextOff = end;
+   if (_streak == 0) {
+      dropWindows();
+   }
 
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      unsigned int threadId;
+   // Windows behind the reader are done with.
+   while (!_windows.empty() &&
+          _windows.front()->off + _windows.front()->len <= off) {
+      waitWindow(*_windows.front());
+      _windows.pop_front();
+   }
 
-      PrepareThreadData(dstConnection, threadData[i]);
-      threads[i] = (HANDLE)_beginthreadex(NULL, 0, &CopyThread,
-                                          (void*)&threadData[i], 0, &threadId);
+   if (!_windows.empty() && _windows.front()->off <= off &&
+       end <= _windows.front()->off + _windows.front()->len) {
+      Window& win = *_windows.front();
+      if (waitWindow(win)) {
+         if (_windows.size() == 1) {
+            startWindow(win.off + win.len);
+         }
+         ++_export.readaheadHits;
+         reply(req, win.buf.get() + (off - win.off), size);
+         return;
+      }
+      dropWindows();
    }
-   WaitForMultipleObjects(appGlobals.numThreads, &threads[0], TRUE, INFINITE);
-#else
-   vector<pthread_t> threads(appGlobals.numThreads);
 
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      PrepareThreadData(dstConnection, threadData[i]);
-      pthread_create(&threads[i], NULL, &CopyThread, (void*)&threadData[i]);
+   uint64 sector = off / VIXDISKLIB_SECTOR_SIZE;
+   uint64 numSectors = (end + VIXDISKLIB_SECTOR_SIZE - 1) /
+                       VIXDISKLIB_SECTOR_SIZE - sector;
+   std::unique_ptr<uint8[]> buf(new uint8[numSectors *
+                                          VIXDISKLIB_SECTOR_SIZE]);
+   VixError vixError = blockCache.read(*_file.disk, sector, numSectors,
+                                       buf.get(), &_file.ioLock);
+   if (VIX_FAILED(vixError)) {
+      fuse_reply_err(req, EIO);
+      return;
    }
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      void *hlp;
-      pthread_join(threads[i], &hlp);
+   if (_streak >= FUSE_READAHEAD_TRIGGER && _windows.empty()) {
+      startWindow((end + VIXDISKLIB_SECTOR_SIZE - 1) /
+                  VIXDISKLIB_SECTOR_SIZE * VIXDISKLIB_SECTOR_SIZE);
    }
-#endif
+   reply(req, buf.get() + (off - sector * VIXDISKLIB_SECTOR_SIZE), size);
+}
 
-   for (i = 0; i < appGlobals.numThreads; i++) {
-      VixDiskLib_Close(threadData[i].srcHandle);
-      VixDiskLib_Close(threadData[i].dstHandle);
-      VixDiskLib_Unlink(dstConnection, threadData[i].dstDisk.c_str());
+
+static FuseExport *
+FuseGetExport(fuse_req_t req)
+{
+   return (FuseExport *)fuse_req_userdata(req);
+}
+
+static FuseFile *
+FuseGetFile(FuseExport *exp, fuse_ino_t ino)
+{
+   if (ino < FUSE_FIRST_INO || ino - FUSE_FIRST_INO >= exp->files.size()) {
+      return NULL;
    }
-   VixDiskLib_Disconnect(dstConnection);
-   if (!appGlobals.success) {
-      THROW_ERROR(VIX_E_FAIL);
+   return exp->files[ino - FUSE_FIRST_INO].get();
+}
+
+static void
+FuseStat(FuseExport *exp, fuse_ino_t ino, struct stat *st)
+{
+   memset(st, 0, sizeof *st);
+   st->st_ino = ino;
+   st->st_uid = getuid();
+   st->st_gid = getgid();
+   if (ino == FUSE_ROOT_INO) {
+      st->st_mode = S_IFDIR | 0555;
+      st->st_nlink = 2;
+   } else {
+      FuseFile *file = FuseGetFile(exp, ino);
+      st->st_mode = S_IFREG | 0444;
+      st->st_nlink = 1;
+      st->st_size = file->size;
+      st->st_blocks = file->size / 512;
+      st->st_blksize = VIX_FUSE_READAHEAD * VIXDISKLIB_SECTOR_SIZE;
    }
 }
 
 
-/*
- *----------------------------------------------------------------------
- *
- * CloneProgress --
- *
- *      Callback for the clone function.
- *
- * Results:
- *      None
- *
- * Side effects:
- *      None.
- *
- *----------------------------------------------------------------------
- */
+static void
+FuseInit(void * /*userdata*/, struct fuse_conn_info *conn)
+{
+   conn->max_readahead = VIX_FUSE_READAHEAD * VIXDISKLIB_SECTOR_SIZE;
+}
 
-static Bool
-CloneProgressFunc(void * /*progressData*/,      // IN
-                  int percentCompleted)         // IN
+static void
+FuseLookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-   cout << "Cloning : " << percentCompleted << "% Done" << "\r";
-   return TRUE;
+   FuseExport *exp = FuseGetExport(req);
+
+   if (parent == FUSE_ROOT_INO) {
+      for (size_t i = 0; i < exp->files.size(); i++) {
+         if (exp->files[i]->name == name) {
+            struct fuse_entry_param e;
+            memset(&e, 0, sizeof e);
+            e.ino = FUSE_FIRST_INO + i;
+            e.attr_timeout = 3600.0;
+            e.entry_timeout = 3600.0;
+            FuseStat(exp, e.ino, &e.attr);
+            fuse_reply_entry(req, &e);
+            return;
+         }
+      }
+   }
+   fuse_reply_err(req, ENOENT);
 }
 
+static void
+FuseGetAttr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info * /*fi*/)
+{
+   FuseExport *exp = FuseGetExport(req);
+   struct stat st;
 
-/*
- *----------------------------------------------------------------------
- *
- * DoClone --
- *
- *      Clones a local disk (possibly to an ESX host).
- *
- * Results:
- *      None.
- *
- * Side effects:
- *      None.
- *
- *----------------------------------------------------------------------
- */
+   if (ino != FUSE_ROOT_INO && FuseGetFile(exp, ino) == NULL) {
+      fuse_reply_err(req, ENOENT);
+      return;
+   }
+   FuseStat(exp, ino, &st);
+   fuse_reply_attr(req, &st, 3600.0);
+}
 
 static void
-DoClone(void)
+FuseReadDir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+            struct fuse_file_info * /*fi*/)
 {
-   VixDiskLibConnection srcConnection;
-   VixDiskLibConnectParams cnxParams = { 0 };
-   VixError vixError = VixDiskLib_Connect(&cnxParams, &srcConnection);
-   CHECK_AND_THROW(vixError);
+   FuseExport *exp = FuseGetExport(req);
 
-   /*
-    *  Note : These createParams are ignored for remote case except
-    *  for diskType when it's set to VIXDISKLIB_DISK_VMFS_THIN.
-    */
+   if (ino != FUSE_ROOT_INO) {
+      fuse_reply_err(req, ENOTDIR);
+      return;
+   }
 
-   VixDiskLibCreateParams createParams;
-   createParams.adapterType = appGlobals.adapterType;
-   createParams.capacity = appGlobals.mbSize *
-                           ((1U << 20) / VIXDISKLIB_SECTOR_SIZE);
-   createParams.logicalSectorSize = appGlobals.logicalSectorSize;
-   createParams.physicalSectorSize = appGlobals.physicalSectorSize;
-   // If createParams.diskType is set VIXDISKLIB_DISK_VMFS_THIN, the disk
-   // provision type will be thin. Otherwise, it will be thick.
-   createParams.diskType = VIXDISKLIB_DISK_MONOLITHIC_SPARSE;
-   createParams.hwVersion = VIXDISKLIB_HWVERSION_WORKSTATION_5;
+   vector<std::pair<string, fuse_ino_t>> names;
+   names.push_back({".", FUSE_ROOT_INO});
+   names.push_back({"..", FUSE_ROOT_INO});
+   for (size_t i = 0; i < exp->files.size(); i++) {
+      names.push_back({exp->files[i]->name, FUSE_FIRST_INO + i});
+   }
 
-   vixError = VixDiskLib_Clone(appGlobals.connection,
-                               appGlobals.diskPaths[0].c_str(),
-                               srcConnection,
-                               appGlobals.srcPath,
-                               &createParams,
-                               CloneProgressFunc,
-                               NULL,   // clientData
-                               TRUE);  // doOverWrite
-   VixDiskLib_Disconnect(srcConnection);
-   CHECK_AND_THROW(vixError);
-   cout << "\n Done" << "\n";
+   string buf;
+   for (size_t i = off; i < names.size(); i++) {
+      struct stat st;
+      memset(&st, 0, sizeof st);
+      st.st_ino = names[i].second;
+      st.st_mode = names[i].second == FUSE_ROOT_INO ? S_IFDIR : S_IFREG;
+      size_t len = fuse_add_direntry(req, NULL, 0, names[i].first.c_str(),
+                                     NULL, 0);
+      if (buf.size() + len > size) {
+         break;
+      }
+      buf.resize(buf.size() + len);
+      fuse_add_direntry(req, &buf[buf.size() - len], len,
+                        names[i].first.c_str(), &st, i + 1);
+   }
+   fuse_reply_buf(req, buf.data(), buf.size());
 }
 
+static void
+FuseOpen(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+   FuseExport *exp = FuseGetExport(req);
+   FuseFile *file = FuseGetFile(exp, ino);
 
-/*
- *----------------------------------------------------------------------
- *
- * PrintStat --
- *
- *      Print performance statistics for read/write benchmarks.
- *
- * Results:
- *      None
- *
- * Side effects:
- *      None.
- *
- *----------------------------------------------------------------------
- */
+   if (file == NULL) {
+      fuse_reply_err(req, ino == FUSE_ROOT_INO ? EISDIR : ENOENT);
+      return;
+   }
+   if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+      fuse_reply_err(req, EROFS);
+      return;
+   }
+   fi->fh = (uint64_t)(uintptr_t)new FuseReader(*exp, *file);
+   fi->keep_cache = 1;
+   fuse_reply_open(req, fi);
+}
 
 static void
-PrintStat(bool read,                                     // IN
-          std::chrono::system_clock::time_point start,   // IN
-          std::chrono::system_clock::time_point end,     // IN
-          uint32 numSectors,                             // IN
-          uint32 sectorSize,                             // IN
-          const std::string& prefix)                     // IN
+FuseRead(fuse_req_t req, fuse_ino_t /*ino*/, size_t size, off_t off,
+         struct fuse_file_info *fi)
 {
-   auto dur = std::chrono::duration_cast<std::chrono::milliseconds>(end-start);
-   auto elapsed = dur.count();
-   if (elapsed == 0) {
-      elapsed = 1;
-   }
-   auto speed = (1000 * sectorSize * (uint64)numSectors) /
-                      (1024 * 1024 * elapsed);
-   cout << prefix << (read ? "Read" : "Wrote")
-        << numSectors / 2048 << " MBytes in " << elapsed << " msec ("
-        << speed << " MBytes/sec)" << endl;
+   FuseReader *reader = (FuseReader *)(uintptr_t)fi->fh;
+
+   reader->read(req, size, (uint64)off);
+}
+
+static void
+FuseRelease(fuse_req_t req, fuse_ino_t /*ino*/, struct fuse_file_info *fi)
+{
+   delete (FuseReader *)(uintptr_t)fi->fh;
+   fuse_reply_err(req, 0);
 }
 
 
 /*
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  *
- * InitBuffer --
+ * FuseParentPath --
  *
- *      Fill an array of uint32 with random values, to defeat any
- *      attempts to compress it.
+ *      Turns the parentFileNameHint of a link into a path VixDiskLib_Open
+ *      takes. Local hints are relative to the directory of the child.
  *
  * Results:
- *      None
+ *      The parent's path.
  *
  * Side effects:
  *      None.
  *
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  */
 
-static void
-InitBuffer(uint32 *buf,     // OUT
-           uint32 numElems) // IN
+static string
+FuseParentPath(const string& child,     // IN
+               const string& hint)      // IN
 {
-   unsigned int i;
-
-   srand(time(NULL));
-
-   for (i = 0; i < numElems; i++) {
-      buf[i] = (uint32)rand();
+   if (hint.empty() || hint[0] == '/' || hint[0] == '[') {
+      return hint;
+   }
+   size_t slash = child.rfind('/');
+   if (slash == string::npos) {
+      return hint;
    }
+   size_t bracket = child.find("] ");
+   if (bracket != string::npos && hint.find('/') != string::npos) {
+      // Datastore path hints are relative to the datastore root.
+      return child.substr(0, bracket + 2) + hint;
+   }
+   return child.substr(0, slash + 1) + hint;
 }
 
 
 /*
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  *
- * DoRWBench --
+ * DoFuse --
  *
- *      Perform read/write benchmarks according to settings in
- *      appGlobals. Note that a write benchmark will destroy the data
- *      in the target disk.
+ *      Mounts a FUSE file system at Globals().fuseMountPoint with
+ *      disk.raw, the whole disk as a flat file, and linkN.raw for each
+ *      link of the chain (link0 is the disk given, higher numbers its
+ *      parents), read-only. Serves with the multithreaded FUSE loop
+ *      until unmounted, interrupted or the daemon job is cancelled.
  *
  * Results:
- *      None
+ *      None.
  *
  * Side effects:
  *      None.
  *
- *----------------------------------------------------------------------
+ *--------------------------------------------------------------------------
  */
 
 static void
-DoRWBench(bool read, bool async) // IN
+DoFuse(void)
 {
-   DiskIOPipeline diskIO(appGlobals.diskPaths.size());
-   for (unsigned int i = 0 ; i < appGlobals.diskPaths.size() ; ++i) {
-      if (read) {
-         diskIO.read(appGlobals.connection,
-                     appGlobals.diskPaths[i].c_str(),
-                     appGlobals.openFlags, i, async);
-      } else {
-         diskIO.write(appGlobals.connection,
-                      appGlobals.diskPaths[i].c_str(),
-                      appGlobals.openFlags, i, async);
+   FuseExport exp;
+   const uint32 flags = Globals().openFlags | VIXDISKLIB_FLAG_OPEN_READ_ONLY;
+   string path = Globals().diskPaths[0];
+
+   exp.reads = 0;
+   exp.bytesRead = 0;
+   exp.readaheadHits = 0;
+   exp.readaheadWindows = 0;
+
+   auto addFile = [&exp] (const string& name, VixDisk::Ptr disk) {
+      std::unique_ptr<FuseFile> file(new FuseFile);
+      file->name = name;
+      file->disk = disk;
+      file->size = disk->getInfo()->capacity * VIXDISKLIB_SECTOR_SIZE;
+      exp.files.push_back(std::move(file));
+   };
+
+   auto top = std::make_shared<VixDisk>(Globals().connection, path.c_str(),
+                                        flags, 0);
+   addFile("disk.raw", top);
+   int numLinks = std::max(1, top->getInfo()->numLinks);
+   for (int i = 0; i < numLinks; i++) {
+      auto link = std::make_shared<VixDisk>(
+                     Globals().connection, path.c_str(),
+                     flags | VIXDISKLIB_FLAG_OPEN_SINGLE_LINK, i + 1);
+      std::ostringstream name;
+      name << "link" << i << ".raw";
+      addFile(name.str(), link);
+      cout << name.str() << " : " << path << endl;
+
+      const char *hint = link->getInfo()->parentFileNameHint;
+      if (hint == NULL || *hint == '\0') {
+         break;
       }
+      path = FuseParentPath(path, hint);
+   }
+
+   struct fuse_lowlevel_ops ops;
+   memset(&ops, 0, sizeof ops);
+   ops.init = FuseInit;
+   ops.lookup = FuseLookup;
+   ops.getattr = FuseGetAttr;
+   ops.readdir = FuseReadDir;
+   ops.open = FuseOpen;
+   ops.read = FuseRead;
+   ops.release = FuseRelease;
+
+   static char arg0[] = "vixdisklibsample";
+   static char argO[] = "-o";
+   static char argOpts[] = "ro,fsname=vixdisklib,subtype=vixdisk";
+   char *argv[] = { arg0, argO, argOpts };
+   struct fuse_args args = FUSE_ARGS_INIT(3, argv);
+
+   const char *mountPoint = Globals().fuseMountPoint;
+   struct fuse_chan *ch = fuse_mount(mountPoint, &args);
+   if (ch == NULL) {
+      cout << "Can't mount FUSE file system on " << mountPoint << endl;
+      THROW_ERROR(VIX_E_FAIL);
    }
+   struct fuse_session *se = fuse_lowlevel_new(&args, &ops, sizeof ops,
+                                               &exp);
+   if (se == NULL) {
+      fuse_unmount(mountPoint, ch);
+      THROW_ERROR(VIX_E_FAIL);
+   }
+   fuse_session_add_chan(se, ch);
+
+   /*
+    * SIGINT / SIGTERM or a cancelled daemon job end the loop. libfuse's
+    * own signal handlers would replace the process's, so they are not
+    * used. Looking up a name that doesn't exist sends a request, which
+    * wakes up a worker so the loop notices.
+    */
+   StopSignals stopSignals;
+   std::atomic<bool> loopDone(false);
+   JobControl *job = Globals().job;
+   string wakeup = string(mountPoint) + "/.stop";
+   std::thread watcher([&loopDone, &wakeup, job, se] () {
+      while (!loopDone) {
+         if (serverStop || (job != NULL && job->cancelled)) {
+            struct stat st;
+            fuse_session_exit(se);
+            stat(wakeup.c_str(), &st);
+            return;
+         }
+         std::this_thread::sleep_for(std::chrono::milliseconds(250));
+      }
+   });
+
+   cout << "Serving " << exp.files.size() << " files on " << mountPoint
+        << " until unmounted." << endl;
+   fuse_session_loop_mt(se);
+   loopDone = true;
+   watcher.join();
+
+   fuse_session_remove_chan(ch);
+   fuse_session_destroy(se);
+   fuse_unmount(mountPoint, ch);
+
+   cout << "FUSE: " << exp.reads << " reads (" << exp.bytesRead
+        << " bytes), " << exp.readaheadHits << " from "
+        << exp.readaheadWindows << " readahead windows" << endl;
+}
+
+#else
+
+static void
+DoFuse(void)
+{
+   cout << "-fuse needs libfuse; use the vix-mntapi-sample build on Linux."
+        << endl;
+   THROW_ERROR(VIX_E_NOT_SUPPORTED);
 }
 
+#endif // FOR_MNTAPI && !_WIN32
 
 /*
  *----------------------------------------------------------------------
@@ -2883,7 +15323,7 @@ DoCheckRepair(Bool repair)
 {
    VixError err;
 
-   err = VixDiskLib_CheckRepair(appGlobals.connection, appGlobals.diskPaths[0].c_str(),
+   err = VixDiskLib_CheckRepair(Globals().connection, Globals().diskPaths[0].c_str(),
                                 repair);
    if (VIX_FAILED(err)) {
       throw VixDiskLibErrWrapper(err, __FILE__, __LINE__);
@@ -2906,6 +15346,58 @@ using VolumeHdl = std::unique_ptr<VixVolumeHandleStruct,
 using VolumeInfo = std::unique_ptr<VixVolumeInfo,
                                    std::function<void(VixVolumeInfo*)>>;
 
+static std::once_flag mntapiInitOnce;
+static bool mntapiInitialized;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MntapiInit --
+ *
+ *      Initializes VixMntapi the first time a command needs it, so the
+ *      other commands don't pay for it.
+ *
+ * Results:
+ *      None
+ *
+ * Side effects:
+ *      Throws VixDiskLibErrWrapper if VixMntapi_Init fails.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MntapiInit(void)
+{
+   std::call_once(mntapiInitOnce, [] () {
+      StartupPhase phase("VixMntapi_Init");
+      VixError vixError;
+      if (processGlobals.useInitEx) {
+         vixError = VixMntapi_Init(VIXMNTAPI_MAJOR_VERSION,
+                                   VIXMNTAPI_MINOR_VERSION,
+                                   &LogFunc, &WarnFunc, &PanicFunc,
+                                   processGlobals.libdir,
+                                   processGlobals.cfgFile);
+      } else {
+         vixError = VixMntapi_Init(VIXMNTAPI_MAJOR_VERSION,
+                                   VIXMNTAPI_MINOR_VERSION,
+                                   NULL, NULL, NULL,
+                                   processGlobals.libdir, NULL);
+      }
+      CHECK_AND_THROW(vixError);
+      mntapiInitialized = true;
+   });
+}
+
+static void
+MntapiExit(void)
+{
+   if (mntapiInitialized) {
+      VixMntapi_Exit();
+   }
+}
+
 
 /*
  *----------------------------------------------------------------------
@@ -2926,14 +15418,15 @@ using VolumeInfo = std::unique_ptr<VixVolumeInfo,
 static void
 DoMntApi()
 {
+   MntapiInit();
    cout << "\nCalling VixMntapi_OpenDisks..." << endl;
    const char* diskNames[1];
-   diskNames[0] = appGlobals.diskPaths[0].c_str();
+   diskNames[0] = Globals().diskPaths[0].c_str();
    VixDiskSetHandle diskSetHandle = NULL;
-   VixError err = VixMntapi_OpenDisks(appGlobals.connection,
+   VixError err = VixMntapi_OpenDisks(Globals().connection,
                               diskNames,
                               1,
-                              appGlobals.openFlags,
+                              Globals().openFlags,
                               &diskSetHandle);
    if (VIX_FAILED(err)) {
       throw VixDiskLibErrWrapper(err, __FILE__, __LINE__);
@@ -2950,7 +15443,7 @@ DoMntApi()
    DiskSetInfo dsi(diskSetInfo, VixMntapi_FreeDiskSetInfo);
 
    cout << "DiskSet Info - flags " << diskSetInfo->openFlags
-        << " (passed - " << appGlobals.openFlags << "), mountPoint "
+        << " (passed - " << Globals().openFlags << "), mountPoint "
         << diskSetInfo->mountPath << "." << endl;
 
    cout << "\nCalling VixMntapi_GetVolumeHandles..." << endl;
@@ -2972,7 +15465,7 @@ DoMntApi()
 
    vector<VolumeHdl> vhset;
    vector<VolumeInfo> viset;
-   auto ro = (appGlobals.openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY);
+   auto ro = (Globals().openFlags & VIXDISKLIB_FLAG_OPEN_READ_ONLY);
    for (auto i = j-1; i < (int)numVolumes; ++i) {
       cout << "\nCalling VixMntapi_MountVolume on volume " << i+1 << endl;
       err = VixMntapi_MountVolume(volumeHandles[i], ro);